@@ -0,0 +1,81 @@
+/**
+ * @file   guide_clustering.h
+ * @brief  Parallel scoring of a demonstration against the guides, used by ClusterVm.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GUIDE_CLUSTERING_H
+#define GUIDE_CLUSTERING_H
+
+///////// MECHANISM_MANAGER
+#include "mechanism_manager/guide_registry.h"
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <string>
+#include <vector>
+
+namespace mechanism_manager
+{
+
+struct ClusterScore
+{
+  std::string name;
+  int idx;                    // In the scored snapshot
+  bool rejected;              // By the bounding volumes test, not scored
+  double likelihood;          // ComputeResponsability() of the demonstration, 0 if rejected
+  double relative_likelihood; // Over the likelihood of the demonstration for its own guide
+};
+
+typedef std::vector<ClusterScore> cluster_scores_t;
+
+/// Not for rt. Likelihood of a demonstration for each guide of a snapshot, the guides are scored concurrently
+/// by n_threads threads (0 uses all the cores). The snapshot is a copy, the registry is not locked meanwhile, and
+/// each guide is scored on a Clone() of it, so the guides shared with the rt thread are never written.
+/// A guide is rejected without being scored if it can not match the demonstration, the margin being reject_margin
+/// times the diagonal of the bounding box of the demonstration:
+///  - the bounding boxes of the guide and of the demonstration are farther than the margin,
+///  - an end point of the guide is farther than the margin from the corresponding end point of the demonstration,
+///  - a point of the demonstration is farther than the margin from the capsules around the guide.
+/// So only the guides near the demonstration are scored.
+class GuideClustering
+{
+  public:
+    GuideClustering(const int n_threads = 0, const double reject_margin = 0.5);
+
+    /// Scores sorted by decreasing relative likelihood, the rejected guides last
+    void Score(const guides_t& guides, const Eigen::MatrixXd& data, const double reference_likelihood, cluster_scores_t& scores) const;
+
+    inline int GetNbThreads() const {return n_threads_;}
+    inline double GetRejectMargin() const {return reject_margin_;}
+
+  private:
+    bool IsNear(const vm_t& guide, const Eigen::MatrixXd& data, const Eigen::VectorXd& start, const Eigen::VectorXd& end,
+                const Eigen::VectorXd& box_min, const Eigen::VectorXd& box_max, const double margin) const;
+
+    int n_threads_;
+    double reject_margin_;
+};
+
+}
+
+#endif
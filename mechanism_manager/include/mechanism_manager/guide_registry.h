@@ -0,0 +1,136 @@
+/**
+ * @file   guide_registry.h
+ * @brief  Lock-free (rt side) registry of the guides, based on immutable snapshots.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GUIDE_REGISTRY_H
+#define GUIDE_REGISTRY_H
+
+////////// Toolbox
+#include <toolbox/filters/filters.h>
+
+////////// VIRTUAL_MECHANISM
+#include <virtual_mechanism/virtual_mechanism_interface.h>
+
+////////// BOOST
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+
+////////// STD
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace mechanism_manager
+{
+
+typedef virtual_mechanism::VirtualMechanismInterface vm_t;
+
+/// Per tick state of a guide, written only by the rt thread. It is shared by the snapshots instead of copied,
+/// so the writers never read it and the values written after a copy are not lost.
+struct GuideTickState
+{
+  GuideTickState():scale(0.0),scale_hard(0.0),scale_t(0.0),dormant(false),sleep_ticks(0)
+  {
+  }
+
+  double scale;
+  double scale_hard;
+  double scale_t;
+  bool dormant;    // Not updated, see MechanismManager::Update()
+  int sleep_ticks; // Consecutive ticks with a scale below the sleep threshold
+};
+
+struct GuideStruct
+{
+  std::string name;
+  boost::shared_ptr<GuideTickState> tick;
+  boost::shared_ptr<vm_t> guide;
+  boost::shared_ptr<tool_box::DynSystemFirstOrder> fade;
+};
+
+typedef std::vector<GuideStruct> guides_t;
+
+/// RCU-like registry:
+///  - The rt thread (only one) pins the current snapshot with Pin(), a pointer load plus a hazard pointer store.
+///    The snapshot stays valid until the next Pin(). A published snapshot is never written, the rt thread only
+///    writes the objects it points to (GuideTickState, fade, guide). There is a single hazard pointer, so Pin()
+///    must always be called by the same thread, asserted in debug.
+///  - The writers copy the current snapshot, edit the copy and publish it. They are serialized by a mutex
+///    never taken by the rt thread.
+///  - The replaced snapshots are retired to a background thread, which deletes them once the rt thread does not
+///    pin them anymore. The guides (and their models, buffers and publishers) are therefore never released by the
+///    rt thread, and the writers do not pay for the destruction either.
+class GuideRegistry
+{
+  public:
+    GuideRegistry();
+    ~GuideRegistry();
+
+    /// Rt side, only one thread (the first one calling it)
+    guides_t& Pin();
+
+    /// Non rt side, edit(guides_t&) returns false to discard the changes
+    template <typename Edit>
+    bool Modify(Edit edit)
+    {
+        boost::mutex::scoped_lock guard(writers_mtx_);
+        guides_t* snapshot = new guides_t(*current_.load());
+        if(!edit(*snapshot))
+        {
+            delete snapshot;
+            return false;
+        }
+        Publish(snapshot);
+        return true;
+    }
+
+    /// Non rt side, the snapshot can not be retired while visit(const guides_t&) runs
+    template <typename Visit>
+    void Read(Visit visit)
+    {
+        boost::mutex::scoped_lock guard(writers_mtx_);
+        visit(*current_.load());
+    }
+
+  private:
+
+    bool IsRtThread();
+    void Publish(guides_t* snapshot);
+    void Reclaim();
+    void ReclaimLoop();
+
+    std::atomic<guides_t*> current_;
+    std::atomic<guides_t*> hazard_; // Snapshot used by the rt thread
+    std::atomic<std::thread::id> rt_thread_; // Owner of hazard_
+    boost::mutex writers_mtx_;
+
+    /// Reclamation queue, consumed by reclaimer_
+    std::vector<guides_t*> retired_;
+    boost::mutex retired_mtx_;
+    boost::condition_variable retired_cond_;
+    bool stop_;
+    boost::thread reclaimer_;
+};
+
+}
+
+#endif
@@ -27,6 +27,7 @@
 ////////// Toolbox
 #include <toolbox/toolbox.h>
 #include <toolbox/filters/filters.h>
+#include <toolbox/profiler.h>
 
 ////////// ROS
 #include <ros/ros.h>
@@ -39,23 +40,13 @@
 
 ///////// MECHANISM_MANAGER
 #include "mechanism_manager/mechanism_manager_interface.h"
+#include "mechanism_manager/guide_registry.h"
+#include "mechanism_manager/update_pool.h"
+#include "mechanism_manager/guide_clustering.h"
 
 namespace mechanism_manager
 {
 
-typedef boost::recursive_mutex mutex_t;
-typedef virtual_mechanism::VirtualMechanismInterface vm_t;
-
-struct GuideStruct
-{
-  std::string name;
-  double scale;
-  double scale_hard;
-  double scale_t;
-  boost::shared_ptr<vm_t> guide;
-  boost::shared_ptr<tool_box::DynSystemFirstOrder> fade;
-};
-
 class MechanismManager
 {
 
@@ -77,8 +68,10 @@ class MechanismManager
     void InsertVm(double* data, const int n_rows);
     void DeleteVm(const int idx);
     void UpdateVm(Eigen::MatrixXd& data, const int idx);
+    void StreamVm(Eigen::MatrixXd& data, const int idx); // Chunk of a demonstration, UpdateVm() ends it
     void ClusterVm(Eigen::MatrixXd& data);
     void ClusterVm(double* data, const int n_rows);
+    void GetClusterScores(cluster_scores_t& scores); // Ranked likelihoods of the guides for the last ClusterVm()
     void SaveVm(const int idx);
     void GetVmName(const int idx, std::string& name);
     void SetVmName(const int idx, std::string& name);
@@ -87,15 +80,22 @@ class MechanismManager
     scale_mode_t& GetVmMode();
     void SetMergeThreshold(double merge_th);
     void GetMergeThreshold(double& merge_th);
+    void SetVmPreferences(const std::string order, const std::string model_type); // Used for the next insertions
+    /// Timings of the update stages, empty unless compiled with USE_PROFILER
+    void GetTimings(std::string& report);
+    bool DumpTimings(const std::string& file_path); // Csv, an empty path writes timings.csv in the package
+    void ResetTimings();
 
 
-    /// Real time methods, they can be called in a real time loop
+    /// Real time methods, they can be called in a real time loop. They pin the guides like Update(),
+    /// so they must be called by the thread calling Update() (asserted in debug)
     inline int GetPositionDim() const {return position_dim_;}
     int GetNbVms();
     void GetVmPosition(const int idx, Eigen::VectorXd& position);
     void GetVmVelocity(const int idx, Eigen::VectorXd& velocity);
     double GetPhase(const int idx);
     double GetScale(const int idx);
+    bool IsVmDormant(const int idx);
     void SetMode(const scale_mode_t mode);
     void Stop();
     bool OnVm();
@@ -104,8 +104,20 @@ class MechanismManager
   protected:
 
     bool ReadConfig();
+    void UpdateGuide(const int idx);
     void AddNewVm(vm_t* const vm_tmp_ptr, std::string& name);
-    bool CheckForNamesCollision(const std::string& name);
+
+    /// Edit a snapshot of the registry, they return false if the snapshot has not been changed
+    bool AddNewVm(guides_t& guides, vm_t* const vm_tmp_ptr, std::string& name);
+
+    /// Update out of the registry lock: a copy of the guide is trained, then swapped if the guide did not change.
+    /// If ReplaceVm() fails, selected is the guide now called name, empty if it is gone or in HARD mode.
+    boost::shared_ptr<vm_t> TrainCopy(const boost::shared_ptr<vm_t>& selected, Eigen::MatrixXd& data);
+    bool ReplaceVm(const std::string& name, boost::shared_ptr<vm_t>& selected, const boost::shared_ptr<vm_t>& updated);
+
+    bool CheckForNamesCollision(const guides_t& guides, const std::string& name);
+    bool OnVm(const guides_t& guides);
+    std::string GetModelsPath() const; // Folder of the models of the default model type
 
     scale_mode_t scale_mode_;
 
@@ -123,6 +135,8 @@ class MechanismManager
     Eigen::VectorXd f_vm_;
     Eigen::VectorXd err_pos_;
     Eigen::VectorXd err_vel_;
+    Eigen::VectorXd f_sum_; // Weighted sum of the guides forces
+    Eigen::MatrixXd projector_; // Weighted sum of the tangent projectors
     Eigen::VectorXd robot_position_;
     Eigen::VectorXd robot_velocity_;
 
@@ -130,15 +144,47 @@ class MechanismManager
 
     double escape_factor_;
 
+    /// Level of detail of the update (lod_period > 0). A guide whose scale stays below lod_sleep_ratio times the
+    /// largest scale for lod_period ticks becomes dormant: its scale is 0 and it is not updated anymore. Every
+    /// lod_period ticks the distance lower bound of its bounding volumes is checked, it wakes up (projection on
+    /// the guide, then normal update) once the scale it can reach is above lod_wake_ratio times the largest one.
+    /// The lower bound is decreased by lod_wake_margin plus the distance the robot travels until the next check.
+    int lod_period_;
+    double lod_sleep_ratio_;
+    double lod_wake_ratio_;
+    double lod_wake_margin_;
+    double lod_max_scale_; // Largest scale of the previous tick
+
+    int profiler_export_period_; // [ms] Collection of the timings (USE_PROFILER)
+
+    /// Parallel update of the guides (opt-in, n_update_threads > 0)
+    int n_update_threads_;
+    int update_threads_first_cpu_;
+    boost::shared_ptr<UpdatePool> update_pool_;
+    guides_t* update_buffer_; // Inputs of UpdateGuide for the current tick
+    const Eigen::VectorXd* update_position_;
+    const Eigen::VectorXd* update_velocity_;
+    double update_dt_;
+
     std::string pkg_path_;
-    int guide_unique_id_; // Incremental id
-
-    /// Double buffer http://gameprogrammingpatterns.com/double-buffer.html
-    /// Mechanism used: Page-flipping
-    std::vector<GuideStruct> vm_buffers_[2];
-    std::atomic<int> rt_idx_; // atom
-    std::atomic<int> no_rt_idx_; // atom
-    mutex_t mtx_;
+    std::atomic<int> guide_unique_id_; // Incremental id
+
+    /// Guides, the rt thread pins a snapshot, the non rt methods publish new ones
+    GuideRegistry guides_;
+
+    /// Protects merge_th_ and the factory preferences, never used by the rt thread
+    boost::mutex config_mtx_;
+
+    /// Streamed demonstration, on a private copy of the guide until UpdateVm() publishes it
+    boost::shared_ptr<vm_t> stream_guide_;
+    std::string stream_name_;
+    int stream_idx_;
+    boost::mutex stream_mtx_;
+
+    /// Scoring of the demonstrations for ClusterVm(), and the table of the last one
+    GuideClustering clustering_;
+    cluster_scores_t cluster_scores_;
+    boost::mutex cluster_scores_mtx_;
 };
 
 }
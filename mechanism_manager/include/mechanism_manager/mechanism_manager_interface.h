@@ -37,6 +37,9 @@
 ////////// BOOST
 #include <boost/thread.hpp>
 
+///////// MECHANISM_MANAGER
+#include "mechanism_manager/guide_clustering.h"
+
 
 namespace mechanism_manager
 {
@@ -64,6 +67,7 @@ class MechanismManagerInterface
     void InsertVm(double* data, const int n_rows, bool threading = default_threading_on);
     void DeleteVm(const int idx, bool threading = default_threading_on);
     void UpdateVm(Eigen::MatrixXd& data, const int idx, bool threading = default_threading_on);
+    void StreamVm(Eigen::MatrixXd& data, const int idx, bool threading = default_threading_on);
     void ClusterVm(Eigen::MatrixXd& data, bool threading = default_threading_on);
     void ClusterVm(double* data, const int n_rows, bool threading = default_threading_on);
     void SaveVm(const int idx, bool threading = default_threading_on);
@@ -73,6 +77,11 @@ class MechanismManagerInterface
     void SetVmName(const int idx, std::string& name);
     void GetVmNames(std::vector<std::string>& names);
     void SetVmMode(const std::string mode);
+    void GetTimings(std::string& report); // Update stages, empty unless compiled with USE_PROFILER
+    bool DumpTimings(const std::string& file_path);
+    void ResetTimings();
+
+    /// NOTE The methods below use the guides like Update(), call them from the thread calling Update()
 
     /// Stop the mechanisms
     void Stop();
@@ -89,8 +98,10 @@ class MechanismManagerInterface
     void GetVmVelocity(const int idx, double* const velocity_ptr);
     double GetPhase(const int idx);
     double GetScale(const int idx);
+    bool IsVmDormant(const int idx); // Not updated, far from the robot
     void GetVmMode(std::string& mode);
     void GetMergeThreshold(double& merge_th);
+    void GetClusterScores(cluster_scores_t& scores); // Ranked likelihoods of the guides for the last ClusterVm()
 
     /// Sets
     void SetVmMode(const scale_mode_t mode);
@@ -0,0 +1,76 @@
+/**
+ * @file   update_pool.h
+ * @brief  Pool of pinned spinning threads used to update the guides in parallel.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPDATE_POOL_H
+#define UPDATE_POOL_H
+
+////////// BOOST
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+////////// STD
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace mechanism_manager
+{
+
+/// The workers are spawned once, pinned to consecutive cpus and spin waiting for a new round.
+/// Run() publishes a round of n jobs, takes part in it and returns when all the jobs are done (barrier).
+/// The jobs are distributed dynamically, so the calling thread never waits for a job that nobody took.
+class UpdatePool
+{
+  public:
+    typedef boost::function<void (const int)> job_t;
+
+    /// Not for rt
+    UpdatePool(const int n_workers, const int first_cpu, job_t job);
+    ~UpdatePool();
+
+    /// Rt safe, call job(0)...job(n_jobs-1) and wait for all of them
+    void Run(const int n_jobs);
+
+    inline int GetNbWorkers() const {return workers_.size();}
+
+  private:
+
+    static const int MAX_JOBS = 0xFFFF;
+
+    void Loop(const int cpu);
+    void RunJobs(const uint32_t round);
+
+    job_t job_;
+    std::vector<boost::shared_ptr<boost::thread> > workers_;
+
+    /// Round (32 bits) | n_jobs (16 bits) | next job (16 bits), a job is claimed with a CAS on the whole word,
+    /// so a worker late from a previous round can not take a job of the current one
+    std::atomic<uint64_t> claim_;
+    std::atomic<int> pending_jobs_;
+    std::atomic<bool> stop_;
+};
+
+}
+
+#endif
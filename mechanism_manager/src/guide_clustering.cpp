@@ -0,0 +1,132 @@
+/**
+ * @file   guide_clustering.cpp
+ * @brief  Parallel scoring of a demonstration against the guides, used by ClusterVm.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mechanism_manager/guide_clustering.h"
+
+////////// BOOST
+#include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+
+////////// STD
+#include <algorithm>
+#include <atomic>
+
+using namespace Eigen;
+
+namespace mechanism_manager
+{
+
+static bool CompareScores(const ClusterScore& a, const ClusterScore& b)
+{
+    if(a.rejected != b.rejected)
+        return b.rejected;
+    return a.relative_likelihood > b.relative_likelihood;
+}
+
+GuideClustering::GuideClustering(const int n_threads, const double reject_margin)
+{
+    assert(n_threads >= 0);
+    assert(reject_margin >= 0.0);
+    n_threads_ = n_threads > 0 ? n_threads : std::max(1u,boost::thread::hardware_concurrency());
+    reject_margin_ = reject_margin;
+}
+
+void GuideClustering::Score(const guides_t& guides, const MatrixXd& data, const double reference_likelihood, cluster_scores_t& scores) const
+{
+    scores.resize(guides.size());
+    if(guides.empty() || data.rows() == 0)
+        return;
+
+    // End points and bounding box of the demonstration, pos only
+    const int dim = guides[0].guide->getStateDim();
+    assert(data.cols() == dim || data.cols() == dim + 1);
+    const VectorXd start = data.row(0).tail(dim).transpose();
+    const VectorXd end = data.row(data.rows()-1).tail(dim).transpose();
+    const VectorXd box_min = data.rightCols(dim).colwise().minCoeff().transpose();
+    const VectorXd box_max = data.rightCols(dim).colwise().maxCoeff().transpose();
+    const double margin = reject_margin_ * (box_max - box_min).norm();
+
+    // Cheap tests first, only the guides left are scored
+    std::vector<int> to_score;
+    for(size_t i=0;i<guides.size();i++)
+    {
+        ClusterScore& score = scores[i];
+        score.name = guides[i].name;
+        score.idx = i;
+        score.likelihood = 0.0;
+        score.relative_likelihood = 0.0;
+        score.rejected = !IsNear(*guides[i].guide,data,start,end,box_min,box_max,margin);
+        if(!score.rejected)
+            to_score.push_back(i);
+    }
+
+    // Dynamic distribution of the guides, their models have different costs
+    std::atomic<int> next_guide(0);
+    auto score_guides = [&]()
+    {
+        int k;
+        while((k = next_guide.fetch_add(1)) < static_cast<int>(to_score.size()))
+        {
+            // On a copy, ComputeResponsability() can cache its result in the model (gmr) while the rt thread uses the guide
+            ClusterScore& score = scores[to_score[k]];
+            boost::scoped_ptr<vm_t> guide(guides[to_score[k]].guide->Clone());
+            score.likelihood = guide->ComputeResponsability(data);
+            score.relative_likelihood = reference_likelihood > 0.0 ? score.likelihood/reference_likelihood : score.likelihood;
+        }
+    };
+    boost::thread_group workers;
+    const int n_workers = std::min<int>(n_threads_,to_score.size());
+    for(int i=1;i<n_workers;i++)
+        workers.create_thread(score_guides);
+    score_guides();
+    workers.join_all();
+
+    std::stable_sort(scores.begin(),scores.end(),CompareScores);
+}
+
+bool GuideClustering::IsNear(const vm_t& guide, const MatrixXd& data, const VectorXd& start, const VectorXd& end,
+                             const VectorXd& box_min, const VectorXd& box_max, const double margin) const
+{
+    // Bounding boxes, O(1)
+    const VectorXd guide_min = guide.getBoundingBoxMin();
+    const VectorXd guide_max = guide.getBoundingBoxMax();
+    if((box_max.array() < guide_min.array() - margin).any() || (box_min.array() > guide_max.array() + margin).any())
+        return false;
+
+    // End points, O(1)
+    if((guide.getInitialPos() - start).norm() > margin || (guide.getFinalPos() - end).norm() > margin)
+        return false;
+
+    // Every point of the demonstration must be close to the capsules, stops at the first one too far
+    const int dim = guide.getStateDim();
+    VectorXd pos(dim);
+    for(int i=0;i<data.rows();i++)
+    {
+        pos = data.row(i).tail(dim).transpose();
+        if(!guide.IsNear(pos,margin))
+            return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,134 @@
+/**
+ * @file   guide_registry.cpp
+ * @brief  Lock-free (rt side) registry of the guides, based on immutable snapshots.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mechanism_manager/guide_registry.h"
+
+////////// BOOST
+#include <boost/bind.hpp>
+
+////////// STD
+#include <cassert>
+
+namespace mechanism_manager
+{
+
+GuideRegistry::GuideRegistry()
+{
+    current_ = new guides_t();
+    hazard_ = NULL;
+    rt_thread_ = std::thread::id();
+    stop_ = false;
+    reclaimer_ = boost::thread(boost::bind(&GuideRegistry::ReclaimLoop,this));
+}
+
+GuideRegistry::~GuideRegistry()
+{
+    {
+        boost::mutex::scoped_lock guard(retired_mtx_);
+        stop_ = true;
+    }
+    retired_cond_.notify_one();
+    reclaimer_.join();
+
+    // No rt thread at this point
+    for(size_t i=0;i<retired_.size();i++)
+        delete retired_[i];
+    delete current_.load();
+}
+
+bool GuideRegistry::IsRtThread()
+{
+    // The first thread pinning a snapshot owns the hazard pointer
+    const std::thread::id self = std::this_thread::get_id();
+    std::thread::id owner;
+    return rt_thread_.compare_exchange_strong(owner,self) || owner == self;
+}
+
+guides_t& GuideRegistry::Pin()
+{
+    assert(IsRtThread()); // A second thread would overwrite the hazard of the rt thread
+    guides_t* snapshot;
+    // Announce the snapshot, then check that it was not replaced in the meantime:
+    // a snapshot retired after this point is seen as pinned by the reclaimer
+    do
+    {
+        snapshot = current_.load();
+        hazard_.store(snapshot);
+    }
+    while(snapshot != current_.load());
+    return *snapshot;
+}
+
+void GuideRegistry::Publish(guides_t* snapshot)
+{
+    guides_t* old_snapshot = current_.exchange(snapshot);
+    {
+        boost::mutex::scoped_lock guard(retired_mtx_);
+        retired_.push_back(old_snapshot);
+    }
+    retired_cond_.notify_one();
+}
+
+void GuideRegistry::Reclaim()
+{
+    std::vector<guides_t*> to_delete;
+    {
+        boost::mutex::scoped_lock guard(retired_mtx_);
+        // A retired snapshot can not be pinned again, so once it is not
+        // the hazard it is safe to delete it
+        const guides_t* pinned = hazard_.load();
+        size_t n_kept = 0;
+        for(size_t i=0;i<retired_.size();i++)
+        {
+            if(retired_[i] == pinned)
+                retired_[n_kept++] = retired_[i];
+            else
+                to_delete.push_back(retired_[i]);
+        }
+        retired_.resize(n_kept);
+    }
+    // Releases the guides not used by the current snapshot, out of the lock
+    for(size_t i=0;i<to_delete.size();i++)
+        delete to_delete[i];
+}
+
+void GuideRegistry::ReclaimLoop()
+{
+    boost::mutex::scoped_lock guard(retired_mtx_);
+    while(!stop_)
+    {
+        if(retired_.empty())
+            retired_cond_.wait(guard);
+        else // The rt thread still pins a retired snapshot, poll until it moves on
+            retired_cond_.timed_wait(guard,boost::posix_time::milliseconds(10));
+
+        if(stop_)
+            break;
+
+        guard.unlock();
+        Reclaim();
+        guard.lock();
+    }
+}
+
+} // namespace
@@ -30,6 +30,9 @@ namespace mechanism_manager
   using namespace tool_box;
   using namespace Eigen;
 
+/// Fade of the dormant guides below which they are left out of the projector
+static const double LOD_FADE_FLOOR = 1e-9;
+
 MechanismManager::MechanismManager(int position_dim)
 {
       if(!ReadConfig())
@@ -46,6 +49,8 @@ MechanismManager::MechanismManager(int position_dim)
       f_vm_.resize(position_dim_);
       err_pos_.resize(position_dim_);
       err_vel_.resize(position_dim_);
+      f_sum_.resize(position_dim_);
+      projector_.resize(position_dim_,position_dim_);
 
       // Clear
       f_K_.fill(0.0);
@@ -53,80 +58,123 @@ MechanismManager::MechanismManager(int position_dim)
       f_vm_.fill(0.0);
       err_pos_.fill(0.0);
       err_vel_.fill(0.0);
+      f_sum_.fill(0.0);
+      projector_.fill(0.0);
 
       loopCnt = 0;
+      lod_max_scale_ = 0.0;
 
       pkg_path_ = ros::package::getPath(ROS_PKG_NAME);
 
       guide_unique_id_ = 0;
 
-      rt_idx_ = 0;
-      no_rt_idx_ = 1;
-
       scale_mode_ = SOFT; // By default use soft guides
 
       merge_th_ = 0.3;
+
+      stream_idx_ = -1;
+
+      update_buffer_ = NULL;
+      update_position_ = NULL;
+      update_velocity_ = NULL;
+      update_dt_ = 0.0;
+      // Spinning workers must not share the cpu with the rt thread
+      const int max_update_threads = static_cast<int>(boost::thread::hardware_concurrency()) - 1;
+      if(n_update_threads_ > max_update_threads)
+      {
+          PRINT_WARNING("MechanismManager: Only "<< (max_update_threads > 0 ? max_update_threads : 0) <<" update threads available");
+          n_update_threads_ = max_update_threads > 0 ? max_update_threads : 0;
+      }
+      if(n_update_threads_ > 0)
+          update_pool_.reset(new UpdatePool(n_update_threads_,update_threads_first_cpu_,boost::bind(&MechanismManager::UpdateGuide,this,_1)));
+
+#ifdef USE_PROFILER
+      Profiler::Instance().StartExporter(profiler_export_period_);
+#endif
 }
 
 MechanismManager::~MechanismManager()
 {
-    for(size_t i=0;i<2;i++)
-        vm_buffers_[i].clear();
+    update_pool_.reset(); // Stop the workers before releasing the guides
+#ifdef USE_PROFILER
+    Profiler::Instance().StopExporter();
+#endif
 }
 
 void MechanismManager::AddNewVm(vm_t* const vm_tmp_ptr, std::string& name)
 {
-    if(!CheckForNamesCollision(name))
+    guides_.Modify([&](guides_t& guides) -> bool
     {
-        boost::recursive_mutex::scoped_lock guard(mtx_);
-        //guard.lock(); // Lock
+        return AddNewVm(guides,vm_tmp_ptr,name);
+    });
+}
 
-        if(scale_mode_ == HARD)
-        {
-            PRINT_WARNING("Impossible to insert the guide while in HARD mode.");
-            return;
-        }
+bool MechanismManager::AddNewVm(guides_t& guides, vm_t* const vm_tmp_ptr, std::string& name)
+{
+    boost::shared_ptr<vm_t> guide(vm_tmp_ptr); // Released if not inserted
 
-        std::vector<GuideStruct>& no_rt_buffer = vm_buffers_[no_rt_idx_];
-        std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-        no_rt_buffer.clear();
+    if(CheckForNamesCollision(guides,name))
+    {
+        PRINT_WARNING("Impossible to insert the guide, guide already existing.");
+        return false;
+    }
 
-        // Copy
-        for (size_t i = 0; i < rt_buffer.size(); i++)
-          no_rt_buffer.push_back(rt_buffer[i]); // FIXME possible problems in the copy!!! (fade)
+    if(scale_mode_ == HARD)
+    {
+        PRINT_WARNING("Impossible to insert the guide while in HARD mode.");
+        return false;
+    }
 
-        GuideStruct new_guide;
-        new_guide.name = name;
-        new_guide.scale = 0.0;
-        new_guide.scale_t = 0.0;
-        new_guide.guide = boost::shared_ptr<vm_t>(vm_tmp_ptr);
-        new_guide.fade = boost::shared_ptr<DynSystemFirstOrder>(new DynSystemFirstOrder(10.0)); // FIXME since it's a dynamic system, it should be a pointer or in the vm
+    GuideStruct new_guide;
+    new_guide.name = name;
+    new_guide.tick = boost::shared_ptr<GuideTickState>(new GuideTickState());
+    new_guide.guide = guide;
+    new_guide.fade = boost::shared_ptr<DynSystemFirstOrder>(new DynSystemFirstOrder(10.0)); // FIXME since it's a dynamic system, it should be a pointer or in the vm
 
-        // Define a new ros node with the same name as the guide
+    // Define a new ros node with the same name as the guide
 #ifdef USE_ROS_RT_PUBLISHER
-        new_guide.guide->InitRtPublishers(name);
+    new_guide.guide->InitRtPublishers(name);
 #endif
-        // Add the new guide to the buffer
-        no_rt_buffer.push_back(new_guide);
+    // Add the new guide to the snapshot
+    guides.push_back(new_guide);
 
-        // Circular swap
-        rt_idx_ = (rt_idx_ + 1) % 2;
-        no_rt_idx_ = (no_rt_idx_ + 1) % 2;
-    }
-    else
-        PRINT_WARNING("Impossible to insert the guide, guide already existing.");
+    return true;
 }
 
 bool MechanismManager::ReadConfig()
 {
-    YAML::Node main_node = CreateYamlNodeFromPkgName(ROS_PKG_NAME);
-    if (const YAML::Node& curr_node = main_node["mechanism_manager"])
+    Config::ptr_t cfg = Config::Load(ROS_PKG_NAME);
+    if (cfg->Has("mechanism_manager"))
     {
+        bool ok = true;
         std::string vm_order, vm_model_type;
-        curr_node["vm_order"] >> vm_order;
-        curr_node["vm_model_type"] >> vm_model_type;
-        curr_node["escape_factor"] >> escape_factor_;
+        ok &= cfg->Get("mechanism_manager/vm_order",vm_order);
+        ok &= cfg->Get("mechanism_manager/vm_model_type",vm_model_type);
+        ok &= cfg->Get("mechanism_manager/escape_factor",escape_factor_);
+        ok &= cfg->Get("mechanism_manager/n_update_threads",n_update_threads_);
+        ok &= cfg->Get("mechanism_manager/update_threads_first_cpu",update_threads_first_cpu_);
+        int n_cluster_threads;
+        double cluster_reject_margin;
+        ok &= cfg->Get("mechanism_manager/n_cluster_threads",n_cluster_threads);
+        ok &= cfg->Get("mechanism_manager/cluster_reject_margin",cluster_reject_margin);
+        ok &= cfg->Get("mechanism_manager/lod_period",lod_period_);
+        ok &= cfg->Get("mechanism_manager/lod_sleep_ratio",lod_sleep_ratio_);
+        ok &= cfg->Get("mechanism_manager/lod_wake_ratio",lod_wake_ratio_);
+        ok &= cfg->Get("mechanism_manager/lod_wake_margin",lod_wake_margin_);
+        ok &= cfg->Get("mechanism_manager/profiler_export_period",profiler_export_period_);
+        if(!ok)
+            return false;
         assert(escape_factor_ > 0.0);
+        assert(n_update_threads_ >= 0);
+        assert(update_threads_first_cpu_ >= 0);
+        assert(n_cluster_threads >= 0);
+        assert(cluster_reject_margin >= 0.0);
+        assert(lod_period_ >= 0);
+        assert(lod_sleep_ratio_ >= 0.0 && lod_sleep_ratio_ < lod_wake_ratio_ && lod_wake_ratio_ <= 1.0); // Hysteresis
+        assert(lod_wake_margin_ >= 0.0);
+        assert(profiler_export_period_ > 0);
+
+        clustering_ = GuideClustering(n_cluster_threads,cluster_reject_margin);
 
         vm_factory_.SetDefaultPreferences(vm_order,vm_model_type);
 
@@ -136,6 +184,14 @@ bool MechanismManager::ReadConfig()
         return false;
 }
 
+std::string MechanismManager::GetModelsPath() const
+{
+    if(vm_factory_.GetDefaultModelType() == virtual_mechanism::SPLINE)
+        return pkg_path_+"/models/spline/";
+    else
+        return pkg_path_+"/models/gmm/";
+}
+
 void MechanismManager::InsertVm(std::string& model_name)
 {
     if(model_name.empty())
@@ -144,7 +200,7 @@ void MechanismManager::InsertVm(std::string& model_name)
         return;
     }
 
-    std::string model_complete_path(pkg_path_+"/models/gmm/"+model_name); // FIXME change the folder for splines
+    std::string model_complete_path(GetModelsPath()+model_name);
     PRINT_INFO("Creating the guide from file... " << model_complete_path);
     vm_t* vm_tmp_ptr = NULL;
     try
@@ -188,55 +244,165 @@ void MechanismManager::InsertVm(double* data, const int n_rows)
 
 void MechanismManager::UpdateVm(MatrixXd& data, const int idx)
 {
-    boost::recursive_mutex::scoped_lock guard(mtx_);
-    //guard.lock(); // Lock
+    boost::shared_ptr<vm_t> streamed;
+    std::string streamed_name;
+    {
+        boost::mutex::scoped_lock guard(stream_mtx_);
+        if(stream_guide_ && stream_idx_ == idx)
+        {
+            streamed.swap(stream_guide_);
+            streamed_name = stream_name_;
+        }
+    }
 
-    if(scale_mode_ == HARD)
+    if(!streamed)
+    {
+        if(scale_mode_ == HARD)
+        {
+            PRINT_WARNING("Impossible to update the guide while in HARD mode.");
+            return;
+        }
+
+        // Clone and train out of the registry lock, the snapshot is only edited to swap the guide
+        boost::shared_ptr<vm_t> selected;
+        std::string name;
+        guides_.Read([&](const guides_t& guides)
+        {
+            if(idx >= 0 && idx < guides.size())
+            {
+                selected = guides[idx].guide;
+                name = guides[idx].name;
+            }
+        });
+        if(!selected)
+        {
+            PRINT_WARNING("Impossible to update the guide.");
+            return;
+        }
+
+        PRINT_INFO("Update guide: " << name);
+        boost::shared_ptr<vm_t> updated = TrainCopy(selected,data);
+        if(updated && !ReplaceVm(name,selected,updated) && selected)
+            PRINT_WARNING("Impossible to update the guide, it changed while training.");
+        return;
+    }
+
+    // End of a streamed demonstration: last chunk and a few EM iterations, out of the registry lock
+    try
     {
-        PRINT_WARNING("Impossible to update the guide while in HARD mode.");
+        if(data.rows() > 0)
+            streamed->AddDataChunk(data);
+        if(!streamed->CreateModelFromStream())
+        {
+            PRINT_WARNING("Impossible to update the guide from the streamed data.");
+            return;
+        }
+    }
+    catch(...)
+    {
+        PRINT_WARNING("Impossible to update the guide from the streamed data.");
         return;
     }
 
-    std::vector<GuideStruct>& no_rt_buffer = vm_buffers_[no_rt_idx_];
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    no_rt_buffer.clear();
+    guides_.Modify([&](guides_t& guides) -> bool
+    {
+        if(scale_mode_ == HARD)
+        {
+            PRINT_WARNING("Impossible to update the guide while in HARD mode.");
+            return false;
+        }
+        if(idx < 0 || idx >= guides.size() || guides[idx].name != streamed_name)
+        {
+            PRINT_WARNING("Impossible to update the guide, it changed while streaming.");
+            return false;
+        }
+        PRINT_INFO("Update guide: " << guides[idx].name << " (streamed)");
+        guides[idx].guide = streamed; // Name, scales and fade are kept
+        return true;
+    });
+}
 
-    PRINT_INFO("Update guide: " << rt_buffer[idx].name);
+void MechanismManager::StreamVm(MatrixXd& data, const int idx)
+{
+    if(data.rows() == 0)
+        return;
 
-    if(idx<rt_buffer.size())
+    boost::mutex::scoped_lock guard(stream_mtx_);
+    if(!stream_guide_ || stream_idx_ != idx) // New demonstration
     {
-        // Clone the vm to update
         vm_t* vm_tmp_ptr = NULL;
-        vm_tmp_ptr = rt_buffer[idx].guide->Clone();
-
-        // Update
-        // Behavior:
-        //  - Spline: substitute the model
-        //  - GMR: incremental training
-        vm_tmp_ptr->CreateModelFromData(data);
-        //vm_tmp_ptr->AlignAndUpateGuide(data);
-
-        GuideStruct updated_guide;
-        updated_guide.name = rt_buffer[idx].name;
-        updated_guide.scale = rt_buffer[idx].scale;
-        updated_guide.scale_t = rt_buffer[idx].scale_t;
-        updated_guide.guide = boost::shared_ptr<vm_t>(vm_tmp_ptr);
-        updated_guide.fade = rt_buffer[idx].fade; // Copy the shared pointer
-
-        for (size_t i = 0; i < rt_buffer.size(); i++)
+        guides_.Read([&](const guides_t& guides)
         {
-            if(i != idx)
-                 no_rt_buffer.push_back(rt_buffer[i]); // Copy all the vms except the one to update
-            else
-                 no_rt_buffer.push_back(updated_guide);
+            if(idx >= 0 && idx < guides.size())
+            {
+                vm_tmp_ptr = guides[idx].guide->Clone();
+                stream_name_ = guides[idx].name;
+            }
+        });
+        if(vm_tmp_ptr == NULL)
+        {
+            PRINT_WARNING("Impossible to stream on the guide.");
+            return;
         }
+        stream_guide_.reset(vm_tmp_ptr);
+        stream_idx_ = idx;
+    }
 
-        // Circular swap
-        rt_idx_ = (rt_idx_ + 1) % 2;
-        no_rt_idx_ = (no_rt_idx_ + 1) % 2;
+    try
+    {
+        if(!stream_guide_->AddDataChunk(data))
+            PRINT_WARNING("Chunk discarded by guide: " << stream_name_);
     }
-    else
-        PRINT_WARNING("Impossible to update the guide.");
+    catch(...)
+    {
+        PRINT_WARNING("Impossible to stream on guide: " << stream_name_);
+        stream_guide_.reset();
+    }
+}
+
+boost::shared_ptr<vm_t> MechanismManager::TrainCopy(const boost::shared_ptr<vm_t>& selected, MatrixXd& data)
+{
+    // Behavior:
+    //  - Spline: substitute the model
+    //  - GMR: incremental training
+    boost::shared_ptr<vm_t> updated;
+    try
+    {
+        updated.reset(selected->Clone());
+        updated->CreateModelFromData(data);
+    }
+    catch(...)
+    {
+        PRINT_WARNING("Impossible to update the guide from data...");
+        updated.reset();
+    }
+    return updated;
+}
+
+bool MechanismManager::ReplaceVm(const std::string& name, boost::shared_ptr<vm_t>& selected, const boost::shared_ptr<vm_t>& updated)
+{
+    boost::shared_ptr<vm_t> current;
+    const bool replaced = guides_.Modify([&](guides_t& guides) -> bool
+    {
+        if(scale_mode_ == HARD)
+        {
+            PRINT_WARNING("Impossible to update the guide while in HARD mode.");
+            return false;
+        }
+        for(size_t i=0;i<guides.size();i++)
+            if(guides[i].guide == selected)
+            {
+                guides[i].guide = updated; // Name, scales and fade are kept
+                return true;
+            }
+        for(size_t i=0;i<guides.size();i++) // Changed in the meantime
+            if(guides[i].name == name)
+                current = guides[i].guide;
+        return false;
+    });
+    if(!replaced)
+        selected = current;
+    return replaced;
 }
 
 void MechanismManager::ClusterVm(MatrixXd& data)
@@ -246,9 +412,6 @@ void MechanismManager::ClusterVm(MatrixXd& data)
 
     if(CropData(data))
     {
-        boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-        guard.lock(); // Lock
-
         // Create a temporary gmm model
         vm_t* vm_tmp_ptr = NULL;
         try
@@ -262,44 +425,45 @@ void MechanismManager::ClusterVm(MatrixXd& data)
         }
         std::string default_name = "guide_"+std::to_string(++guide_unique_id_);
 
-        std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-        if(rt_buffer.size()>0 && merge_th_ != 1.0)
+        double merge_th;
+        GetMergeThreshold(merge_th);
+
+        // Score the demonstration on a copy of the current snapshot, the registry is not locked meanwhile
+        guides_t guides_copy;
+        guides_.Read([&](const guides_t& guides)
         {
-            int max_idx = 0;
-            double max_lik, lik;
-            double max_rel_lik = -std::numeric_limits<double>::min();
-            double rel_lik = 0.0;
-            //max_lik = std::exp(vm_tmp_ptr->GetResponsability());
-            max_lik = vm_tmp_ptr->GetResponsability();
-            for(int i=0;i<rt_buffer.size();i++)
-            {
-                //lik = std::exp(rt_buffer[i].guide->ComputeResponsability(data));
-                lik = rt_buffer[i].guide->ComputeResponsability(data);
-                rel_lik = lik/max_lik;
-                //assert(rel_lik>=0 && rel_lik<=1); // This should never happen
-                assert(rel_lik<=1); // This should never happen
-                if(rel_lik>max_rel_lik) // Search the maximum relative likelihood
-                {
-                    max_rel_lik = rel_lik;
-                    max_idx = i;
-                }
-            }
-            if(max_rel_lik<merge_th_)
-            {
-                PRINT_INFO("Creating a new guide.");
-                AddNewVm(vm_tmp_ptr,default_name);
-            }
-            else
-            {
-                UpdateVm(data,max_idx);
-            }
+            guides_copy = guides;
+        });
+        cluster_scores_t scores;
+        if(guides_copy.size()>0 && merge_th != 1.0)
+            clustering_.Score(guides_copy,data,vm_tmp_ptr->GetResponsability(),scores);
+        {
+            boost::mutex::scoped_lock guard(cluster_scores_mtx_);
+            cluster_scores_ = scores;
         }
-        else
+
+        if(scores.empty() || scores[0].rejected || scores[0].relative_likelihood < merge_th)
         {
             PRINT_INFO("Creating a new guide.");
             AddNewVm(vm_tmp_ptr,default_name);
+            return;
         }
-        guard.unlock();
+
+        // Train a copy of the closest guide, out of the registry lock as well. If the guide changed
+        // in the meantime the new one is trained, if it is gone the demonstration is inserted instead
+        const ClusterScore& best = scores[0];
+        PRINT_INFO("Update guide: " << best.name << ", relative likelihood " << best.relative_likelihood);
+        boost::shared_ptr<vm_t> selected = guides_copy[best.idx].guide;
+        while(selected)
+        {
+            boost::shared_ptr<vm_t> updated = TrainCopy(selected,data);
+            if(!updated || ReplaceVm(best.name,selected,updated))
+            {
+                delete vm_tmp_ptr;
+                return;
+            }
+        }
+        AddNewVm(vm_tmp_ptr,default_name);
     }
     else
         PRINT_WARNING("Impossible to update guide, data is empty.");
@@ -311,135 +475,136 @@ void MechanismManager::ClusterVm(double* const data, const int n_rows)
     ClusterVm(mat);
 }
 
+void MechanismManager::GetClusterScores(cluster_scores_t& scores)
+{
+    boost::mutex::scoped_lock guard(cluster_scores_mtx_);
+    scores = cluster_scores_;
+}
+
 void MechanismManager::SaveVm(const int idx)
 {
-    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-    guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx<rt_buffer.size())
+    guides_.Read([&](const guides_t& guides)
     {
-        std::string model_complete_path(pkg_path_+"/models/gmm/"+rt_buffer[idx].name);
-        PRINT_INFO("Saving guide "<<rt_buffer[idx].name<<" to " << model_complete_path);
+        if(idx<guides.size())
+        {
+            std::string model_complete_path(GetModelsPath()+guides[idx].name);
+            PRINT_INFO("Saving guide "<<guides[idx].name<<" to " << model_complete_path);
 
-        if(!rt_buffer[idx].guide->SaveModelToFile(model_complete_path))
-            PRINT_ERROR("Impossible to save the file " << model_complete_path);
+            if(!guides[idx].guide->SaveModelToFile(model_complete_path))
+                PRINT_ERROR("Impossible to save the file " << model_complete_path);
+            else
+                 PRINT_INFO("Saving complete");
+        }
         else
-             PRINT_INFO("Saving complete");
-    }
-    else
-        PRINT_WARNING("Guide number#"<<idx<<" not available");
-    guard.unlock();
+            PRINT_WARNING("Guide number#"<<idx<<" not available");
+    });
 }
 
 void MechanismManager::DeleteVm(const int idx)
 {
+   std::string name;
 
-   bool delete_complete = false;
-
-   boost::recursive_mutex::scoped_lock guard(mtx_);
-
-   //guard.lock(); // Lock
-   if(scale_mode_ == HARD)
-   {
-       PRINT_WARNING("Impossible to delete the guide while in HARD mode.");
-       return;
-   }
-   std::vector<GuideStruct>& no_rt_buffer = vm_buffers_[no_rt_idx_];
-   std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-   no_rt_buffer.clear();
-
-   PRINT_INFO("Deleting guide "<<rt_buffer[idx].name);
-
-   // Copy all the guides, except the one to delete
-   // It will be deleted from the no_rt_buffer at the next Delete or Insert
-   // thanks to the clear()
-   for (size_t i = 0; i < rt_buffer.size(); i++)
+   // The guide is removed from the new snapshot, it will be released
+   // once the rt thread does not use the old snapshot anymore
+   bool delete_complete = guides_.Modify([&](guides_t& guides) -> bool
    {
-       if(i != idx)
-            no_rt_buffer.push_back(rt_buffer[i]);
-       else
-           delete_complete = true;
-   }
+       if(scale_mode_ == HARD)
+       {
+           PRINT_WARNING("Impossible to delete the guide while in HARD mode.");
+           return false;
+       }
 
-   // Circular swap
-   rt_idx_ = (rt_idx_ + 1) % 2;
-   no_rt_idx_ = (no_rt_idx_ + 1) % 2;
+       if(idx < 0 || idx >= guides.size())
+           return false;
 
-   guard.unlock();
+       name = guides[idx].name;
+       PRINT_INFO("Deleting guide "<<name);
+       guides.erase(guides.begin()+idx);
+       return true;
+   });
 
    if(delete_complete)
-       PRINT_INFO("Delete of guide "<<rt_buffer[idx].name<<" complete");
+       PRINT_INFO("Delete of guide "<<name<<" complete");
    else
-       PRINT_WARNING("Impossible to remove guide "<<rt_buffer[idx].name);
+       PRINT_WARNING("Impossible to remove guide number#"<<idx);
 }
 
 void MechanismManager::GetVmName(const int idx, std::string& name)
 {
     PRINT_INFO("Get name of guide number#"<<idx);
-    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-    guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx<rt_buffer.size())
+    guides_.Read([&](const guides_t& guides)
     {
-        name = rt_buffer[idx].name;
-    }
-    else
-        PRINT_WARNING("Guide number#"<<idx<<" not available");
-    guard.unlock();
+        if(idx<guides.size())
+        {
+            name = guides[idx].name;
+        }
+        else
+            PRINT_WARNING("Guide number#"<<idx<<" not available");
+    });
 }
 
 void MechanismManager::GetVmNames(std::vector<std::string>& names)
 {
     //PRINT_INFO("Get the guides name");
-    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-    guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    names.resize(rt_buffer.size());
-    for(size_t i=0;i<rt_buffer.size();i++)
+    guides_.Read([&](const guides_t& guides)
     {
-        names[i] = rt_buffer[i].name;
-    }
-    guard.unlock();
+        names.resize(guides.size());
+        for(size_t i=0;i<guides.size();i++)
+        {
+            names[i] = guides[i].name;
+        }
+    });
 }
 
 void MechanismManager::SetVmName(const int idx, std::string& name)
 {
     PRINT_INFO("Set name of guide number#"<<idx);
-    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-    guard.lock();
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    if(idx<rt_buffer.size())
+    guides_.Modify([&](guides_t& guides) -> bool
     {
-        if(!CheckForNamesCollision(name))
+        if(idx<guides.size())
         {
-            rt_buffer[idx].name = name;
+            if(!CheckForNamesCollision(guides,name))
+            {
+                guides[idx].name = name;
 #ifdef USE_ROS_RT_PUBLISHER
-            rt_buffer[idx].guide->InitRtPublishers(name);
+                guides[idx].guide->InitRtPublishers(name);
 #endif
+                return true;
+            }
+            else
+                PRINT_WARNING("Name already used, please change it");
         }
         else
-            PRINT_WARNING("Name already used, please change it");
-    }
-    else
-        PRINT_WARNING("Guide number#"<<idx<<" not available");
-    guard.unlock();
+            PRINT_WARNING("Guide number#"<<idx<<" not available");
+        return false;
+    });
 }
 
 void MechanismManager::SetVmMode(const scale_mode_t mode)
 {
     PRINT_INFO("Set mode for the virtual mechanisms");
-    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-    guard.lock();
 
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    bool has_guides = false;
+    guides_.Read([&](const guides_t& guides)
+    {
+        has_guides = guides.size()>0;
+    });
 
-    if(rt_buffer.size()>0)
+    if(has_guides)
     {
+        bool on_vm = false;
         switch(mode)
         {
           case HARD:
-            while(!OnVm()) // Pass to Hard when on guide
-              boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            while(!on_vm) // Pass to Hard when on guide
+            {
+              guides_.Read([&](const guides_t& guides)
+              {
+                  on_vm = OnVm(guides);
+              });
+              if(!on_vm)
+                  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            }
             scale_mode_ = HARD;
             PRINT_INFO("Set mode to HARD");
             break;
@@ -455,8 +620,6 @@ void MechanismManager::SetVmMode(const scale_mode_t mode)
     }
     else
         PRINT_WARNING("Can not change guide mode, no guide available.");
-
-    guard.unlock();
 }
 scale_mode_t& MechanismManager::GetVmMode()
 {
@@ -467,31 +630,32 @@ scale_mode_t& MechanismManager::GetVmMode()
 void MechanismManager::SetMergeThreshold(double merge_th)
 {
     assert(merge_th >= 0 && merge_th <= 1.0); //0: Merge all , 1.0: Don't merge
-    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-    guard.lock();
+    boost::mutex::scoped_lock guard(config_mtx_);
     merge_th_ = merge_th;
-    guard.unlock();
     PRINT_INFO("Set Merge threshold to: "<< merge_th);
 }
 
 void MechanismManager::GetMergeThreshold(double& merge_th)
 {
-    boost::unique_lock<mutex_t> guard(mtx_, boost::defer_lock);
-    guard.lock();
+    boost::mutex::scoped_lock guard(config_mtx_);
     merge_th = merge_th_;
-    guard.unlock();
     //PRINT_INFO("Get Merge threshold: "<< merge_th);
 }
 
-bool MechanismManager::CheckForNamesCollision(const std::string& name)
+void MechanismManager::SetVmPreferences(const std::string order, const std::string model_type)
+{
+    boost::mutex::scoped_lock guard(config_mtx_);
+    vm_factory_.SetDefaultPreferences(order,model_type);
+    PRINT_INFO("Set guides preferences to: "<< order << " order, " << model_type);
+}
+
+bool MechanismManager::CheckForNamesCollision(const guides_t& guides, const std::string& name)
 {
     bool collision = false;
-    boost::recursive_mutex::scoped_lock guard(mtx_);
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
 
-    for(size_t i = 0; i<rt_buffer.size(); i++)
+    for(size_t i = 0; i<guides.size(); i++)
     {
-        if(std::strcmp(name.c_str(),rt_buffer[i].name.c_str()) == 0)
+        if(std::strcmp(name.c_str(),guides[i].name.c_str()) == 0)
             collision = true;
     }
 
@@ -502,34 +666,71 @@ bool MechanismManager::CheckForNamesCollision(const std::string& name)
 
 void MechanismManager::Update(const VectorXd& robot_position, const VectorXd& robot_velocity, double dt, VectorXd& f_out)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    PROFILE_SCOPE("mm/update");
 
-    double sum = 0.0;
-    for(int i=0; i<rt_buffer.size();i++)
+    guides_t& rt_buffer = guides_.Pin();
+
+    // The guides are independent until the normalization of the scales
+    update_buffer_ = &rt_buffer;
+    update_position_ = &robot_position;
+    update_velocity_ = &robot_velocity;
+    update_dt_ = dt;
     {
-        // Compute the scale for each mechanism
-        rt_buffer[i].scale = rt_buffer[i].guide->getScale(robot_position,escape_factor_);
-        // Update the virtual mechanisms states
-        rt_buffer[i].guide->Update(robot_position,robot_velocity,dt,rt_buffer[i].scale);
-        sum += rt_buffer[i].scale;
+        PROFILE_SCOPE("mm/update_guides");
+        if(update_pool_ && rt_buffer.size() > 1)
+            update_pool_->Run(rt_buffer.size());
+        else
+            for(int i=0; i<rt_buffer.size();i++)
+                UpdateGuide(i);
+    }
+
+    PROFILE_SCOPE("mm/aggregation");
+
+    // Demote the guides far from the robot compared to the closest one, the largest scale is never demoted
+    if(lod_period_ > 0)
+    {
+        lod_max_scale_ = 0.0;
+        for(int i=0; i<rt_buffer.size();i++)
+            lod_max_scale_ = std::max(lod_max_scale_,rt_buffer[i].tick->scale);
+        for(int i=0; i<rt_buffer.size();i++)
+        {
+            GuideStruct& guide = rt_buffer[i];
+            if(guide.tick->dormant)
+                continue;
+            if(guide.tick->scale < lod_sleep_ratio_ * lod_max_scale_)
+                guide.tick->sleep_ticks++;
+            else
+                guide.tick->sleep_ticks = 0;
+            if(guide.tick->sleep_ticks >= lod_period_)
+            {
+                guide.tick->dormant = true;
+                guide.tick->sleep_ticks = 0;
+                guide.tick->scale = 0.0;
+            }
+        }
+        loopCnt++;
     }
 
+    double sum = 0.0;
+    for(int i=0; i<rt_buffer.size();i++)
+        sum += rt_buffer[i].tick->scale;
+
     f_out.fill(0.0); // Reset the force
 
     // Compute the global scales
     for(int i=0; i<rt_buffer.size();i++)
     {
-      rt_buffer[i].scale_hard = rt_buffer[i].scale/sum;
+      rt_buffer[i].tick->scale_hard = rt_buffer[i].tick->scale/sum;
       switch(scale_mode_)
       {
         case HARD:
-            rt_buffer[i].scale =  rt_buffer[i].scale_hard;
+            rt_buffer[i].tick->scale =  rt_buffer[i].tick->scale_hard;
             break;
         case SOFT:
-            rt_buffer[i].scale =  rt_buffer[i].scale * rt_buffer[i].scale_hard;
+            rt_buffer[i].tick->scale =  rt_buffer[i].tick->scale * rt_buffer[i].tick->scale_hard;
             break;
         default:
-          rt_buffer[i].scale =  rt_buffer[i].scale * rt_buffer[i].scale_hard; // Soft
+          rt_buffer[i].tick->scale =  rt_buffer[i].tick->scale * rt_buffer[i].tick->scale_hard; // Soft
           break;
       }
     }
@@ -543,92 +744,155 @@ void MechanismManager::Update(const VectorXd& robot_position, const VectorXd& ro
     int i_active = 0;
     for(int i=0; i<rt_buffer.size();i++)
     {
-        if(rt_buffer[i].scale_hard > max_scale)
+        if(rt_buffer[i].tick->scale_hard > max_scale)
         {
             i_active = i;
-            max_scale = rt_buffer[i].scale_hard;
+            max_scale = rt_buffer[i].tick->scale_hard;
         }
     }
     //2) Activate the filters
     for(int j=0; j<rt_buffer.size();j++)
         if(j==i_active) // active
-            rt_buffer[j].scale_t = rt_buffer[j].fade->IntegrateForward(); // -> 1
+            rt_buffer[j].tick->scale_t = rt_buffer[j].fade->IntegrateForward(); // -> 1
+        else if(rt_buffer[j].tick->dormant && rt_buffer[j].tick->scale_t < LOD_FADE_FLOOR) // Faded out, left out of the projector
+            rt_buffer[j].tick->scale_t = 0.0;
         else // not active
-            rt_buffer[j].scale_t = rt_buffer[j].fade->IntegrateBackward(); // -> 0
+            rt_buffer[j].tick->scale_t = rt_buffer[j].fade->IntegrateBackward(); // -> 0
 
     //3) Compute the force for each mechanism, remove the antagonist force components
+    // f_out = sum_i scale_i * (I - sum_{j!=i} scale_t_j * t_j * t_j') * f_i
+    //       = (I - P) * sum_i scale_i * f_i + sum_i scale_i * scale_t_i * t_i * t_i' * f_i
+    // with P = sum_j scale_t_j * t_j * t_j', so the cost is linear in the number of guides
+    projector_.setZero();
+    for(int j=0; j<rt_buffer.size();j++)
+        if(rt_buffer[j].tick->scale_t > 0.0)
+            projector_.noalias() += rt_buffer[j].tick->scale_t * rt_buffer[j].guide->getJacobianVersor() * rt_buffer[j].guide->getJacobianVersor().transpose();
+
+    f_sum_.fill(0.0);
     for(int i=0; i<rt_buffer.size();i++)
     {
+        if(rt_buffer[i].tick->dormant) // Null scale
+            continue;
         err_pos_ = rt_buffer[i].guide->getState() - robot_position;
-        f_K_ .noalias() = rt_buffer[i].guide->getK() * err_pos_;
+        f_K_.noalias() = rt_buffer[i].guide->getKDiagonal().asDiagonal() * err_pos_;
         err_vel_ = rt_buffer[i].guide->getStateDot() - robot_velocity;
-        f_B_.noalias() = rt_buffer[i].guide->getB() * err_vel_;
+        f_B_.noalias() = rt_buffer[i].guide->getBDiagonal().asDiagonal() * err_vel_;
 
         // Sum spring force + damping force for the current mechanism
         f_vm_ = f_K_ + f_B_;
 
-        f_out += rt_buffer[i].scale * f_vm_;
-        for(int j=0; j<rt_buffer.size();j++)
-        {
-            if(j!=i)
-                f_out -= rt_buffer[i].scale * rt_buffer[j].scale_t * rt_buffer[j].guide->getJacobianVersor() * f_vm_.dot(rt_buffer[j].guide->getJacobianVersor());
-        }
+        f_sum_ += rt_buffer[i].tick->scale * f_vm_;
+        // Add back the own tangent component, removed by P
+        f_out += rt_buffer[i].tick->scale * rt_buffer[i].tick->scale_t * rt_buffer[i].guide->getJacobianVersor() * f_vm_.dot(rt_buffer[i].guide->getJacobianVersor());
     }
+    f_out += f_sum_;
+    f_out.noalias() -= projector_ * f_sum_;
+}
+
+void MechanismManager::UpdateGuide(const int idx)
+{
+    GuideStruct& guide = (*update_buffer_)[idx];
+    if(guide.tick->dormant)
+    {
+        // Wake up check every lod_period_ ticks, spread over the guides
+        if((loopCnt + idx) % lod_period_ != 0)
+            return;
+        // The bounding volumes are built on samples of the guide, and the robot moves until the next check
+        const double reach = lod_wake_margin_ + update_velocity_->norm() * update_dt_ * lod_period_;
+        const double min_dist = std::max(0.0,guide.guide->getDistanceLowerBound(*update_position_) - reach);
+        const double max_scale = std::exp(-escape_factor_*min_dist);
+        if(max_scale < lod_wake_ratio_ * lod_max_scale_)
+            return;
+        guide.tick->dormant = false;
+        // The state is the one of the demotion, start again from the projection of the robot
+        guide.guide->UpdateDiscrete(*update_position_);
+    }
+    // Compute the scale for the mechanism
+    guide.tick->scale = guide.guide->getScale(*update_position_,escape_factor_);
+    // Update the virtual mechanism state
+    guide.guide->Update(*update_position_,*update_velocity_,update_dt_,guide.tick->scale);
 }
 
 void MechanismManager::GetVmPosition(const int idx, Eigen::VectorXd& position)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    guides_t& rt_buffer = guides_.Pin();
     if(idx < rt_buffer.size())
         rt_buffer[idx].guide->getState(position);
 }
 
 void MechanismManager::GetVmVelocity(const int idx, Eigen::VectorXd& velocity)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    guides_t& rt_buffer = guides_.Pin();
     if(idx < rt_buffer.size())
         rt_buffer[idx].guide->getStateDot(velocity);
 }
 
 double MechanismManager::GetPhase(const int idx)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    guides_t& rt_buffer = guides_.Pin();
     if(idx < rt_buffer.size())
         return rt_buffer[idx].guide->getPhase();
     else
         return 0.0;
 }
 
+void MechanismManager::GetTimings(std::string& report)
+{
+    Profiler::Instance().GetReport(report);
+}
+
+bool MechanismManager::DumpTimings(const std::string& file_path)
+{
+    const std::string path = file_path.empty() ? pkg_path_+"/timings.csv" : file_path;
+    if(!Profiler::Instance().Dump(path))
+    {
+        PRINT_WARNING("Can not write the timings to "<<path);
+        return false;
+    }
+    return true;
+}
+
+void MechanismManager::ResetTimings()
+{
+    Profiler::Instance().Reset();
+}
+
+bool MechanismManager::IsVmDormant(const int idx)
+{
+    guides_t& rt_buffer = guides_.Pin();
+    if(idx < rt_buffer.size())
+        return rt_buffer[idx].tick->dormant;
+    else
+        return false;
+}
+
 double MechanismManager::GetScale(const int idx)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    guides_t& rt_buffer = guides_.Pin();
     if(idx < rt_buffer.size())
-        return rt_buffer[idx].scale;
+        return rt_buffer[idx].tick->scale;
     else
         return 0.0;
 }
 
 int MechanismManager::GetNbVms()
 {
-    // NO RT Version
-    //PRINT_INFO("Get number of guides");
-    //boost::recursive_mutex::scoped_lock guard(mtx_);
-    //std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
-    //return rt_buffer.size();
-
-     std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+     guides_t& rt_buffer = guides_.Pin();
      return rt_buffer.size();
 }
 
 bool MechanismManager::OnVm()
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    return OnVm(guides_.Pin());
+}
 
+bool MechanismManager::OnVm(const guides_t& guides)
+{
     bool on_guide = false;
 
-    for(int i=0;i<rt_buffer.size();i++)
+    for(int i=0;i<guides.size();i++)
     {
-        if(rt_buffer[i].scale > 0.9) // We are on a guide if it's scale is ... (so that we are on it)
+        if(guides[i].tick->scale > 0.9) // We are on a guide if it's scale is ... (so that we are on it)
             on_guide = true;
     }
 
@@ -642,14 +906,14 @@ void MechanismManager::SetMode(const scale_mode_t mode)
 
 void MechanismManager::Stop()
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    guides_t& rt_buffer = guides_.Pin();
     for(int i=0;i<rt_buffer.size();i++)
         rt_buffer[i].guide->Stop();
 }
 
 void MechanismManager::SetCollisionDetected(const bool collision)
 {
-    std::vector<GuideStruct>& rt_buffer = vm_buffers_[rt_idx_];
+    guides_t& rt_buffer = guides_.Pin();
     for(int i=0;i<rt_buffer.size();i++)
         rt_buffer[i].guide->setCollisionDetected(collision);
 }
@@ -88,10 +88,13 @@ MechanismManagerInterface::~MechanismManagerInterface()
 
 bool MechanismManagerInterface::ReadConfig()
 {
-    YAML::Node main_node = CreateYamlNodeFromPkgName(ROS_PKG_NAME);
-    if (const YAML::Node& curr_node = main_node["mechanism_manager_interface"])
+    Config::ptr_t cfg = Config::Load(ROS_PKG_NAME);
+    if (cfg->Has("mechanism_manager_interface"))
     {
-        curr_node["position_dim"] >> position_dim_;
+        bool ok = true;
+        ok &= cfg->Get("mechanism_manager_interface/position_dim",position_dim_);
+        if(!ok)
+            return false;
         assert(position_dim_ == 1 || position_dim_ == 2);
 
         return true;
@@ -144,6 +147,17 @@ void MechanismManagerInterface::UpdateVm(Eigen::MatrixXd& data, const int idx, b
         mm_->UpdateVm(data,idx);
 }
 
+void MechanismManagerInterface::StreamVm(Eigen::MatrixXd& data, const int idx, bool threading)
+{
+    if(threading)
+    {
+        async_thread_->AddHandler(boost::bind(&MechanismManager::StreamVm, mm_, data, idx));
+        async_thread_->Trigger();
+    }
+    else
+        mm_->StreamVm(data,idx);
+}
+
 void MechanismManagerInterface::ClusterVm(Eigen::MatrixXd& data, bool threading)
 {
     if(threading)
@@ -227,6 +241,26 @@ void MechanismManagerInterface::GetMergeThreshold(double& merge_th)
     mm_->GetMergeThreshold(merge_th);
 }
 
+void MechanismManagerInterface::GetTimings(std::string& report)
+{
+    mm_->GetTimings(report);
+}
+
+bool MechanismManagerInterface::DumpTimings(const std::string& file_path)
+{
+    return mm_->DumpTimings(file_path);
+}
+
+void MechanismManagerInterface::ResetTimings()
+{
+    mm_->ResetTimings();
+}
+
+void MechanismManagerInterface::GetClusterScores(cluster_scores_t& scores)
+{
+    mm_->GetClusterScores(scores);
+}
+
 void MechanismManagerInterface::GetVmName(const int idx, std::string& name)
 {
     mm_->GetVmName(idx,name);
@@ -311,6 +345,10 @@ double MechanismManagerInterface::GetScale(const int idx)
 {
     return mm_->GetScale(idx);
 }
+bool MechanismManagerInterface::IsVmDormant(const int idx)
+{
+    return mm_->IsVmDormant(idx);
+}
 
 int MechanismManagerInterface::GetNbVms()
 {
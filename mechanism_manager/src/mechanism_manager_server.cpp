@@ -109,6 +109,24 @@ bool MechanismManagerServer::CallBack(MechanismManagerServices::Request &req,
         res.response_command = req.request_command;
     }
 
+    if(std::strcmp(req.request_command.c_str(), "get_timings") == 0)
+    {
+        mm_interface_->GetTimings(res.timings);
+        res.response_command = req.request_command;
+    }
+
+    if(std::strcmp(req.request_command.c_str(), "dump_timings") == 0)
+    {
+        if(mm_interface_->DumpTimings(req.file_path))
+            res.response_command = req.request_command;
+    }
+
+    if(std::strcmp(req.request_command.c_str(), "reset_timings") == 0)
+    {
+        mm_interface_->ResetTimings();
+        res.response_command = req.request_command;
+    }
+
     // Update the names list
     mm_interface_->GetVmNames(res.list_guides);
 
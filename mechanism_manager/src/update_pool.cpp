@@ -0,0 +1,125 @@
+/**
+ * @file   update_pool.cpp
+ * @brief  Pool of pinned spinning threads used to update the guides in parallel.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mechanism_manager/update_pool.h"
+
+////////// Toolbox
+#include <toolbox/debug.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace mechanism_manager
+{
+
+static inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+UpdatePool::UpdatePool(const int n_workers, const int first_cpu, job_t job)
+{
+    assert(n_workers > 0);
+    assert(first_cpu >= 0);
+
+    job_ = job;
+    claim_ = 0;
+    pending_jobs_ = 0;
+    stop_ = false;
+
+    for(int i=0;i<n_workers;i++)
+        workers_.push_back(boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&UpdatePool::Loop,this,first_cpu+i))));
+}
+
+UpdatePool::~UpdatePool()
+{
+    stop_ = true;
+    for(size_t i=0;i<workers_.size();i++)
+        workers_[i]->join();
+}
+
+void UpdatePool::Run(const int n_jobs)
+{
+    if(n_jobs <= 0)
+        return;
+    assert(n_jobs <= MAX_JOBS);
+
+    // The previous round is over (barrier), nobody touches pending_jobs_ until the claim is published
+    const uint32_t round = static_cast<uint32_t>(claim_.load() >> 32) + 1;
+    pending_jobs_ = n_jobs;
+    claim_ = (static_cast<uint64_t>(round) << 32) | (static_cast<uint64_t>(n_jobs) << 16); // Wake up the workers
+
+    RunJobs(round);
+
+    // Barrier
+    while(pending_jobs_ > 0)
+        CpuRelax();
+}
+
+void UpdatePool::RunJobs(const uint32_t round)
+{
+    uint64_t claim = claim_.load();
+    while(static_cast<uint32_t>(claim >> 32) == round)
+    {
+        const int idx = claim & 0xFFFF;
+        const int n_jobs = (claim >> 16) & 0xFFFF;
+        if(idx >= n_jobs)
+            return;
+        if(claim_.compare_exchange_weak(claim,claim + 1))
+        {
+            job_(idx);
+            pending_jobs_--;
+            claim = claim_.load();
+        }
+    }
+}
+
+void UpdatePool::Loop(const int cpu)
+{
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu,&cpu_set);
+    if(pthread_setaffinity_np(pthread_self(),sizeof(cpu_set_t),&cpu_set) != 0)
+        PRINT_WARNING("UpdatePool: Can not pin the worker to cpu " << cpu);
+#endif
+
+    uint32_t seen_round = static_cast<uint32_t>(claim_.load() >> 32);
+    while(!stop_)
+    {
+        const uint32_t curr_round = static_cast<uint32_t>(claim_.load() >> 32);
+        if(curr_round != seen_round)
+        {
+            seen_round = curr_round;
+            RunJobs(curr_round);
+        }
+        else
+            CpuRelax();
+    }
+}
+
+} // namespace
@@ -0,0 +1,464 @@
+/**
+ * @file   benchmark_update.cpp
+ * @brief  Portable benchmark of the mechanism manager and virtual mechanisms update loops (no RTAI needed).
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Usage: benchmark_update [max_guides] [ticks] [output_file]
+// For each order (first, second), model type (gmr, gmr_normalized, spline) and number of guides (1..max_guides)
+// the update of the virtual mechanisms and of the mechanism manager is timed tick by tick.
+// The construction of the guides (load, bake, normalization, recorded references) is timed
+// as well, one build per tick.
+// The mechanism manager is also timed with libraries of guides far from each other, the robot
+// moving close to only one of them (target mechanism_manager_library, n_guides is the library size).
+// Results (percentiles, log2 histogram of the latencies, heap and arena allocations per tick) are
+// printed and written as csv to output_file.
+
+#include <toolbox/debug.h>
+#include "mechanism_manager/mechanism_manager.h"
+
+////////// STD
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace mechanism_manager;
+using namespace virtual_mechanism;
+using namespace Eigen;
+
+////////// Allocations counter
+// On glibc the malloc family is interposed, so that also the Eigen allocations (which do not
+// pass through operator new) are counted. Elsewhere we fall back to the global operator new.
+static std::atomic<long long> alloc_cnt(0);
+
+#ifdef __GLIBC__
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size)
+{
+    alloc_cnt.fetch_add(1,std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    alloc_cnt.fetch_add(1,std::memory_order_relaxed);
+    return __libc_calloc(n,size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    alloc_cnt.fetch_add(1,std::memory_order_relaxed);
+    return __libc_realloc(ptr,size);
+}
+}
+#else
+void* operator new(std::size_t size)
+{
+    alloc_cnt.fetch_add(1,std::memory_order_relaxed);
+    if(void* ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+static const int n_hist_bins = 32; // Bin b counts the ticks in [2^b,2^(b+1)) ns
+static const char* model_files[] = {"test2d_1","test2d_2","test_gmm"};
+static const int n_model_files = 3;
+static const double dt = 0.001;
+
+struct BenchResult
+{
+    std::string target;
+    std::string order;
+    std::string model_type;
+    int n_guides;
+    long n_ticks;
+    double mean;
+    double p50;
+    double p99;
+    double p999;
+    double max;
+    double allocs_per_tick;
+    double arena_allocs_per_tick; // Scratch buffers served by the thread arena, no heap involved
+    long hist[n_hist_bins];
+};
+
+static double Percentile(const std::vector<double>& sorted, const double q)
+{
+    size_t idx = static_cast<size_t>(std::ceil(q * sorted.size()));
+    idx = idx > 0 ? idx - 1 : 0;
+    return sorted[std::min(idx,sorted.size()-1)];
+}
+
+static void ComputeStats(std::vector<double>& samples, const long long allocs, const long long arena_allocs, BenchResult& res)
+{
+    res.n_ticks = samples.size();
+    std::fill(res.hist,res.hist+n_hist_bins,0);
+    double sum = 0.0;
+    for(size_t i=0;i<samples.size();i++)
+    {
+        sum += samples[i];
+        int bin = samples[i] >= 1.0 ? static_cast<int>(std::log2(samples[i])) : 0;
+        res.hist[std::min(bin,n_hist_bins-1)]++;
+    }
+    std::sort(samples.begin(),samples.end());
+    res.mean = sum/samples.size();
+    res.p50 = Percentile(samples,0.5);
+    res.p99 = Percentile(samples,0.99);
+    res.p999 = Percentile(samples,0.999);
+    res.max = samples.back();
+    res.allocs_per_tick = static_cast<double>(allocs)/samples.size();
+    res.arena_allocs_per_tick = static_cast<double>(arena_allocs)/samples.size();
+}
+
+/// Robot moving on a small circle, precomputed to keep the timed loop clean
+static void CreateRobotTrajectory(const int dim, const long n_ticks, MatrixXd& pos, MatrixXd& vel)
+{
+    pos.resize(dim,n_ticks);
+    vel.resize(dim,n_ticks);
+    pos.fill(0.25);
+    vel.fill(0.0);
+    const double w = 2.0 * M_PI * 0.2;
+    for(long i=0;i<n_ticks;i++)
+    {
+        const double t = i * dt;
+        pos(0,i) = 0.5 + 0.2 * std::cos(w*t);
+        pos(1,i) = 0.3 + 0.2 * std::sin(w*t);
+        vel(0,i) = -0.2 * w * std::sin(w*t);
+        vel(1,i) = 0.2 * w * std::cos(w*t);
+    }
+}
+
+static void RunConstruction(const std::string& models_path, const std::string& order, const std::string& model_type,
+                            const long n_builds, const long n_warmup, BenchResult& res)
+{
+    VirtualMechanismFactory factory;
+    factory.SetDefaultPreferences(order,model_type);
+    tool_box::Arena& arena = tool_box::Arena::ThreadLocal();
+
+    std::vector<double> samples(n_builds);
+    long long allocs = 0;
+    long long arena_allocs = 0;
+    for(long k=0;k<n_warmup+n_builds;k++)
+    {
+        const std::string file_name = models_path+model_files[k%n_model_files];
+        const long long allocs_start = alloc_cnt.load(std::memory_order_relaxed);
+        const long long arena_allocs_start = arena.GetNbAllocations();
+        const bench_clock_t::time_point start = bench_clock_t::now();
+        VirtualMechanismInterface* vm = factory.Build(file_name);
+        const bench_clock_t::time_point end = bench_clock_t::now();
+        if(vm == NULL)
+            PRINT_ERROR("Can not build the guide "<<file_name);
+        if(k>=n_warmup)
+        {
+            samples[k-n_warmup] = std::chrono::duration<double,std::nano>(end-start).count();
+            allocs += alloc_cnt.load(std::memory_order_relaxed) - allocs_start;
+            arena_allocs += arena.GetNbAllocations() - arena_allocs_start;
+        }
+        delete vm;
+    }
+
+    res.target = "construction";
+    ComputeStats(samples,allocs,arena_allocs,res);
+}
+
+static void RunVirtualMechanisms(const std::string& models_path, const std::string& order, const std::string& model_type,
+                                 const int n_guides, const long n_ticks, const long n_warmup, BenchResult& res)
+{
+    VirtualMechanismFactory factory;
+    factory.SetDefaultPreferences(order,model_type);
+
+    std::vector<boost::shared_ptr<VirtualMechanismInterface> > vms;
+    for(int i=0;i<n_guides;i++)
+        vms.push_back(boost::shared_ptr<VirtualMechanismInterface>(factory.Build(models_path+model_files[i%n_model_files])));
+
+    const int dim = vms[0]->getStateDim();
+    MatrixXd pos, vel;
+    CreateRobotTrajectory(dim,n_warmup+n_ticks,pos,vel);
+    VectorXd rob_pos(dim), rob_vel(dim);
+
+    std::vector<double> samples(n_ticks);
+    long long allocs = 0;
+    for(long k=0;k<n_warmup+n_ticks;k++)
+    {
+        rob_pos = pos.col(k);
+        rob_vel = vel.col(k);
+        const long long allocs_start = alloc_cnt.load(std::memory_order_relaxed);
+        const bench_clock_t::time_point start = bench_clock_t::now();
+        for(int i=0;i<n_guides;i++)
+            vms[i]->Update(rob_pos,rob_vel,dt);
+        const bench_clock_t::time_point end = bench_clock_t::now();
+        if(k>=n_warmup)
+        {
+            samples[k-n_warmup] = std::chrono::duration<double,std::nano>(end-start).count();
+            allocs += alloc_cnt.load(std::memory_order_relaxed) - allocs_start;
+        }
+    }
+
+    res.target = "virtual_mechanism";
+    ComputeStats(samples,allocs,0,res);
+}
+
+static void RunMechanismManager(const std::string& order, const std::string& model_type,
+                                const int n_guides, const long n_ticks, const long n_warmup, BenchResult& res)
+{
+    MechanismManager mm(2);
+    mm.SetVmPreferences(order,model_type);
+    for(int i=0;i<n_guides;i++)
+    {
+        // Guides are inserted from file and renamed, so the same file can be used more than once
+        std::string file_name(model_files[i%n_model_files]);
+        std::string guide_name = "bench_"+std::to_string(i);
+        mm.InsertVm(file_name);
+        mm.SetVmName(mm.GetNbVms()-1,guide_name);
+    }
+    if(mm.GetNbVms() != n_guides)
+        PRINT_ERROR("Can not insert the guides for the benchmark");
+
+    const int dim = mm.GetPositionDim();
+    MatrixXd pos, vel;
+    CreateRobotTrajectory(dim,n_warmup+n_ticks,pos,vel);
+    VectorXd rob_pos(dim), rob_vel(dim), f_out(dim);
+    f_out.fill(0.0);
+
+    std::vector<double> samples(n_ticks);
+    long long allocs = 0;
+    for(long k=0;k<n_warmup+n_ticks;k++)
+    {
+        rob_pos = pos.col(k);
+        rob_vel = vel.col(k);
+        const long long allocs_start = alloc_cnt.load(std::memory_order_relaxed);
+        const bench_clock_t::time_point start = bench_clock_t::now();
+        mm.Update(rob_pos,rob_vel,dt,f_out);
+        const bench_clock_t::time_point end = bench_clock_t::now();
+        if(k>=n_warmup)
+        {
+            samples[k-n_warmup] = std::chrono::duration<double,std::nano>(end-start).count();
+            allocs += alloc_cnt.load(std::memory_order_relaxed) - allocs_start;
+        }
+    }
+
+    res.target = "mechanism_manager";
+    ComputeStats(samples,allocs,0,res);
+}
+
+/// Copies of an arc of the robot trajectory, on a grid: only the first one is close to the robot
+static void RunMechanismManagerLibrary(const std::string& order, const std::string& model_type,
+                                       const int n_guides, const long n_ticks, const long n_warmup, BenchResult& res)
+{
+    MechanismManager mm(2);
+    mm.SetVmPreferences(order,model_type);
+
+    const int dim = mm.GetPositionDim();
+    MatrixXd pos, vel;
+    CreateRobotTrajectory(dim,n_warmup+n_ticks,pos,vel);
+
+    const int n_points = 100;
+    MatrixXd arc(n_points,dim);
+    for(int j=0;j<n_points;j++)
+        arc.row(j) = pos.col((j*2500L)/n_points).transpose(); // Half a turn
+    for(int i=0;i<n_guides;i++)
+    {
+        MatrixXd data = arc;
+        data.col(0).array() += 2.0 * (i%8);
+        data.col(1).array() += 2.0 * (i/8);
+        mm.InsertVm(data);
+    }
+    if(mm.GetNbVms() != n_guides)
+        PRINT_ERROR("Can not insert the guides for the benchmark");
+
+    VectorXd rob_pos(dim), rob_vel(dim), f_out(dim);
+    f_out.fill(0.0);
+
+    std::vector<double> samples(n_ticks);
+    long long allocs = 0;
+    for(long k=0;k<n_warmup+n_ticks;k++)
+    {
+        rob_pos = pos.col(k);
+        rob_vel = vel.col(k);
+        const long long allocs_start = alloc_cnt.load(std::memory_order_relaxed);
+        const bench_clock_t::time_point start = bench_clock_t::now();
+        mm.Update(rob_pos,rob_vel,dt,f_out);
+        const bench_clock_t::time_point end = bench_clock_t::now();
+        if(k>=n_warmup)
+        {
+            samples[k-n_warmup] = std::chrono::duration<double,std::nano>(end-start).count();
+            allocs += alloc_cnt.load(std::memory_order_relaxed) - allocs_start;
+        }
+    }
+
+    res.target = "mechanism_manager_library";
+    ComputeStats(samples,allocs,0,res);
+}
+
+static void PrintResult(const BenchResult& res)
+{
+    std::cout << std::fixed << std::setprecision(1)
+              << std::setw(18) << res.target << std::setw(8) << res.order << std::setw(16) << res.model_type
+              << std::setw(4) << res.n_guides
+              << "  p50 " << std::setw(9) << res.p50
+              << "  p99 " << std::setw(9) << res.p99
+              << "  p99.9 " << std::setw(9) << res.p999
+              << "  max " << std::setw(10) << res.max
+              << "  allocs/tick " << std::setprecision(2) << res.allocs_per_tick
+              << "  arena allocs/tick " << res.arena_allocs_per_tick << std::endl;
+
+    // Jitter histogram, one row per non empty bin
+    long max_cnt = *std::max_element(res.hist,res.hist+n_hist_bins);
+    for(int b=0;b<n_hist_bins;b++)
+    {
+        if(res.hist[b] == 0)
+            continue;
+        int bar = static_cast<int>(std::ceil(40.0*res.hist[b]/max_cnt));
+        std::cout << "      [" << std::setw(10) << (1L<<b) << ", " << std::setw(10) << (1L<<(b+1)) << ") ns "
+                  << std::setw(8) << res.hist[b] << " " << std::string(bar,'#') << std::endl;
+    }
+}
+
+static void WriteResults(const std::string& file_name, const std::vector<BenchResult>& results)
+{
+    std::ofstream out(file_name.c_str());
+    if(!out.is_open())
+        PRINT_ERROR("Can not open " << file_name);
+
+    out << "target,order,model_type,n_guides,n_ticks,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,allocs_per_tick,arena_allocs_per_tick";
+    for(int b=0;b<n_hist_bins;b++)
+        out << ",hist_" << (1L<<b);
+    out << std::endl;
+
+    out << std::setprecision(10);
+    for(size_t i=0;i<results.size();i++)
+    {
+        const BenchResult& res = results[i];
+        out << res.target << "," << res.order << "," << res.model_type << "," << res.n_guides << "," << res.n_ticks << ","
+            << res.mean << "," << res.p50 << "," << res.p99 << "," << res.p999 << "," << res.max << "," << res.allocs_per_tick << "," << res.arena_allocs_per_tick;
+        for(int b=0;b<n_hist_bins;b++)
+            out << "," << res.hist[b];
+        out << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int max_guides = argc > 1 ? std::atoi(argv[1]) : 4;
+    long n_ticks = argc > 2 ? std::atol(argv[2]) : 10000;
+    std::string output_file = argc > 3 ? argv[3] : "benchmark_update.csv";
+    long n_warmup = n_ticks/10;
+    long n_builds = std::max(10L,n_ticks/500); // A build is much slower than a tick
+
+    if(max_guides < 1 || n_ticks < 1)
+    {
+        std::cerr << "Usage: " << argv[0] << " [max_guides] [ticks] [output_file]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+#ifdef __linux__
+    mlockall(MCL_CURRENT | MCL_FUTURE); // Prevent memory swaps, ignored if not allowed
+#endif
+
+    // The spline models are fitted on the mean of the gmm models with the same name
+    const std::string pkg_path = ros::package::getPath(ROS_PKG_NAME);
+    const char* orders[] = {"first","second"};
+    const char* model_types[] = {"gmr","gmr_normalized","spline"};
+    const char* models_folders[] = {"/models/gmm/","/models/gmm/","/models/spline/"};
+    const int n_model_types = 3;
+
+    std::vector<BenchResult> results;
+    try
+    {
+        for(int o=0;o<2;o++)
+            for(int m=0;m<n_model_types;m++)
+            {
+                BenchResult res;
+                res.order = orders[o];
+                res.model_type = model_types[m];
+                res.n_guides = 1;
+
+                RunConstruction(pkg_path+models_folders[m],res.order,res.model_type,n_builds,n_model_files,res);
+                PrintResult(res);
+                results.push_back(res);
+            }
+
+        for(int o=0;o<2;o++)
+            for(int m=0;m<n_model_types;m++)
+                for(int n=1;n<=max_guides;n++)
+                {
+                    BenchResult res;
+                    res.order = orders[o];
+                    res.model_type = model_types[m];
+                    res.n_guides = n;
+
+                    RunVirtualMechanisms(pkg_path+models_folders[m],res.order,res.model_type,n,n_ticks,n_warmup,res);
+                    PrintResult(res);
+                    results.push_back(res);
+
+                    RunMechanismManager(res.order,res.model_type,n,n_ticks,n_warmup,res);
+                    PrintResult(res);
+                    results.push_back(res);
+                }
+
+        const int library_sizes[] = {4,16,64};
+        for(int o=0;o<2;o++)
+            for(int m=0;m<n_model_types;m++)
+                for(int l=0;l<3;l++)
+                {
+                    BenchResult res;
+                    res.order = orders[o];
+                    res.model_type = model_types[m];
+                    res.n_guides = library_sizes[l];
+
+                    RunMechanismManagerLibrary(res.order,res.model_type,res.n_guides,n_ticks,n_warmup,res);
+                    PrintResult(res);
+                    results.push_back(res);
+                }
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    WriteResults(output_file,results);
+    std::cout << "Results written to " << output_file << std::endl;
+
+    return EXIT_SUCCESS;
+}
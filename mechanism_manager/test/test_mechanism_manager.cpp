@@ -25,6 +25,11 @@
 
 #include <gtest/gtest.h>
 #include "mechanism_manager/mechanism_manager_interface.h"
+#include "mechanism_manager/update_pool.h"
+#include "mechanism_manager/guide_registry.h"
+#include "mechanism_manager/guide_clustering.h"
+#include <toolbox/profiler.h>
+#include <virtual_mechanism/virtual_mechanism_factory.h>
 
 ////////// STD
 #include <iostream>
@@ -323,6 +328,348 @@ TEST(MechanismManagerTest, LoopUpdate)
   //getchar();
 }
 
+TEST(MechanismManagerTest, DormantGuides)
+{
+  MechanismManagerInterface mm;
+
+  int pos_dim = mm.GetPositionDim();
+
+  // Two short guides, far from each other
+  int n_points = 100;
+  MatrixXd data(n_points,pos_dim);
+  for (int i=0; i<pos_dim; i++)
+    data.col(i) = VectorXd::LinSpaced(n_points, 0.0, 0.1);
+  EXPECT_NO_THROW(mm.InsertVm(data));
+  data.array() += 1.0;
+  EXPECT_NO_THROW(mm.InsertVm(data));
+  ASSERT_EQ(mm.GetNbVms(),2);
+
+  Eigen::VectorXd rob_pos(pos_dim), rob_vel(pos_dim), f_out(pos_dim);
+  rob_vel.fill(0.0);
+
+  // On the first guide, the second one is demoted and does not count anymore
+  rob_pos.fill(0.05);
+  for (int i=0;i<100;i++)
+    mm.Update(rob_pos,rob_vel,dt,f_out);
+  EXPECT_FALSE(mm.IsVmDormant(0));
+  EXPECT_TRUE(mm.IsVmDormant(1));
+  EXPECT_EQ(mm.GetScale(1),0.0);
+
+  // On the second guide, it wakes up on the guide and the first one is demoted
+  rob_pos.fill(1.05);
+  for (int i=0;i<100;i++)
+    mm.Update(rob_pos,rob_vel,dt,f_out);
+  EXPECT_TRUE(mm.IsVmDormant(0));
+  EXPECT_FALSE(mm.IsVmDormant(1));
+  Eigen::VectorXd pos(pos_dim);
+  mm.GetVmPosition(1,pos);
+  EXPECT_LT((pos - rob_pos).norm(),1e-2);
+}
+
+void CountJob(std::vector<std::atomic<int> >* cnt, const int idx)
+{
+  (*cnt)[idx]++;
+}
+
+TEST(MechanismManagerTest, StreamVm)
+{
+  MechanismManagerInterface mm;
+  EXPECT_NO_THROW(mm.InsertVm(model_name));
+  int pos_dim = mm.GetPositionDim();
+
+  // Record a demonstration along the guide and off it, streamed in chunks
+  int n_chunks = 4;
+  int chunk_size = 25;
+  MatrixXd chunk(chunk_size,pos_dim);
+  Eigen::VectorXd rob_pos(pos_dim), rob_vel(pos_dim), f_out(pos_dim), pos(pos_dim);
+  rob_vel.fill(0.0);
+  for(int i=0;i<n_chunks;i++)
+  {
+    for(int j=0;j<chunk_size;j++)
+    {
+      mm.GetVmPosition(0,pos);
+      rob_pos = pos.array() + 0.02;
+      chunk.row(j) = rob_pos.transpose();
+      mm.Update(rob_pos,rob_vel,dt,f_out);
+    }
+    EXPECT_NO_THROW(mm.StreamVm(chunk,0));
+  }
+
+  // Scale of the guide for a robot standing still on the demonstration
+  const Eigen::VectorXd probe = chunk.row(chunk_size-1).transpose();
+  auto probe_scale = [&]() -> double
+  {
+    for(int k=0;k<500;k++)
+      mm.Update(probe,rob_vel,dt,f_out);
+    return mm.GetScale(0);
+  };
+  const double scale_before = probe_scale(); // Streaming works on a copy, the guide is the original one
+
+  // The update only costs the last EM iterations, the guide moves towards the demonstration
+  MatrixXd empty;
+  EXPECT_NO_THROW(mm.UpdateVm(empty,0));
+  EXPECT_EQ(mm.GetNbVms(),1);
+  EXPECT_GT(probe_scale(),scale_before);
+
+  // Nothing streamed, empty data
+  EXPECT_NO_THROW(mm.StreamVm(empty,0));
+  EXPECT_NO_THROW(mm.StreamVm(chunk,3)); // No such guide
+  EXPECT_EQ(mm.GetNbVms(),1);
+}
+
+TEST(MechanismManagerTest, UpdatePool)
+{
+  int n_jobs = 50;
+  int n_rounds = 1000;
+  std::vector<std::atomic<int> > cnt(n_jobs);
+  for(int i=0;i<n_jobs;i++)
+    cnt[i] = 0;
+
+  UpdatePool pool(2,0,boost::bind(&CountJob,&cnt,_1));
+  for(int k=0;k<n_rounds;k++)
+    pool.Run(n_jobs);
+
+  // After the barrier every job has been executed exactly once per round
+  for(int i=0;i<n_jobs;i++)
+    EXPECT_EQ(cnt[i],n_rounds);
+
+  // The number of jobs changes from round to round, a late worker must not run a job of the previous round
+  std::vector<int> expected_cnt(n_jobs,0);
+  for(int i=0;i<n_jobs;i++)
+    cnt[i] = 0;
+  for(int k=0;k<n_rounds;k++)
+  {
+    const int n_jobs_round = 1 + (k * 7) % n_jobs;
+    pool.Run(n_jobs_round);
+    for(int i=0;i<n_jobs_round;i++)
+      expected_cnt[i]++;
+    // Right after the barrier, all the jobs of this round are done
+    for(int i=0;i<n_jobs_round;i++)
+      ASSERT_EQ(cnt[i],expected_cnt[i]);
+  }
+  for(int i=0;i<n_jobs;i++)
+    EXPECT_EQ(cnt[i],expected_cnt[i]);
+}
+
+TEST(MechanismManagerTest, GuideRegistry)
+{
+  GuideRegistry registry;
+  std::atomic<bool> stop(false);
+  std::atomic<int> n_errors(0);
+
+  // Rt side: every pinned snapshot has to be consistent, guide_0...guide_n-1
+  boost::thread reader([&]()
+  {
+    while(!stop)
+    {
+      guides_t& guides = registry.Pin();
+      for(size_t i=0;i<guides.size();i++)
+        if(guides[i].name != "guide_"+std::to_string(i))
+          n_errors++;
+    }
+  });
+
+  for(int k=0;k<2000;k++)
+  {
+    registry.Modify([](guides_t& guides) -> bool
+    {
+      if(guides.size() == 10)
+        guides.clear();
+      GuideStruct guide;
+      guide.name = "guide_"+std::to_string(guides.size());
+      guides.push_back(guide);
+      return true;
+    });
+    // Discarded edits are never published
+    EXPECT_FALSE(registry.Modify([](guides_t& guides) -> bool
+    {
+      guides.clear();
+      return false;
+    }));
+  }
+  stop = true;
+  reader.join();
+
+  size_t n_guides = 0;
+  registry.Read([&](const guides_t& guides)
+  {
+    n_guides = guides.size();
+  });
+  EXPECT_EQ(n_guides,10);
+  EXPECT_EQ(n_errors,0);
+}
+
+TEST(MechanismManagerTest, GuideRegistryReclaim)
+{
+  GuideRegistry registry;
+  boost::weak_ptr<tool_box::DynSystemFirstOrder> fade;
+
+  registry.Modify([&](guides_t& guides) -> bool
+  {
+    GuideStruct guide;
+    guide.name = "guide_0";
+    guide.fade = boost::shared_ptr<tool_box::DynSystemFirstOrder>(new tool_box::DynSystemFirstOrder(10.0));
+    fade = guide.fade;
+    guides.push_back(guide);
+    return true;
+  });
+
+  // The rt thread pins the snapshot with the guide, then the guide is removed
+  EXPECT_EQ(registry.Pin().size(),1);
+  registry.Modify([](guides_t& guides) -> bool
+  {
+    guides.clear();
+    return true;
+  });
+
+  // Still pinned, the guide is alive
+  boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+  EXPECT_FALSE(fade.expired());
+
+  // The rt thread moves on, the guide is released by the reclaimer
+  EXPECT_EQ(registry.Pin().size(),0);
+  for(int k=0;k<100 && !fade.expired();k++)
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  EXPECT_TRUE(fade.expired());
+}
+
+TEST(MechanismManagerTest, GuideClustering)
+{
+  virtual_mechanism::VirtualMechanismFactory factory;
+  factory.SetDefaultPreferences("first","spline");
+
+  // Same segment, far segment, reversed segment, detour with the same end points
+  int n_points = 100;
+  MatrixXd demo(n_points,2), far(n_points,2), reversed(n_points,2), detour(n_points,2);
+  for (int i=0; i<2; i++)
+  {
+    demo.col(i) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
+    far.col(i) = VectorXd::LinSpaced(n_points, 5.0, 6.0);
+    reversed.col(i) = VectorXd::LinSpaced(n_points, 1.0, 0.0);
+  }
+  demo.col(1) += 0.01 * VectorXd::Ones(n_points);
+  detour = demo;
+  detour.col(1) += 4.0 * (M_PI * VectorXd::LinSpaced(n_points, 0.0, 1.0)).array().sin().matrix();
+
+  guides_t guides;
+  const MatrixXd* data[] = {&far,&demo,&reversed,&detour};
+  for (int i=0; i<4; i++)
+  {
+    GuideStruct guide;
+    guide.name = "guide_"+std::to_string(i);
+    guide.guide = boost::shared_ptr<vm_t>(factory.Build(*data[i]));
+    guides.push_back(guide);
+  }
+
+  boost::shared_ptr<vm_t> vm_demo(factory.Build(demo));
+  cluster_scores_t scores, scores_serial;
+  GuideClustering(4,0.5).Score(guides,demo,vm_demo->GetResponsability(),scores);
+  GuideClustering(1,0.5).Score(guides,demo,vm_demo->GetResponsability(),scores_serial);
+
+  // Full table, the guides close to the demonstration are scored, the best one ranked first
+  ASSERT_EQ(scores.size(),4);
+  EXPECT_EQ(scores[0].name,"guide_1");
+  EXPECT_EQ(scores[0].idx,1);
+  EXPECT_FALSE(scores[0].rejected);
+  EXPECT_GT(scores[0].relative_likelihood,0.9);
+  EXPECT_EQ(scores[1].name,"guide_3"); // The demonstration stays close to the detour, only the likelihood separates them
+  EXPECT_FALSE(scores[1].rejected);
+  EXPECT_LT(scores[1].relative_likelihood,scores[0].relative_likelihood);
+  EXPECT_TRUE(scores[2].rejected);
+  EXPECT_TRUE(scores[3].rejected);
+  for (int i=0; i<4; i++)
+  {
+    EXPECT_EQ(scores[i].idx,scores_serial[i].idx);
+    EXPECT_EQ(scores[i].likelihood,scores_serial[i].likelihood);
+  }
+
+  // Without rejection every guide is scored, the far one can not be close to the demonstration
+  GuideClustering(4,1e6).Score(guides,demo,vm_demo->GetResponsability(),scores);
+  for (int i=0; i<4; i++)
+    EXPECT_FALSE(scores[i].rejected);
+  EXPECT_EQ(scores[0].name,"guide_1");
+  EXPECT_LT(scores[3].relative_likelihood,1e-6);
+
+  // The other way around the detour goes far from the straight guide, which has the same end points and a box
+  // overlapping its one: only the capsules reject it
+  boost::shared_ptr<vm_t> vm_detour(factory.Build(detour));
+  GuideClustering(4,0.5).Score(guides,detour,vm_detour->GetResponsability(),scores);
+  EXPECT_EQ(scores[0].name,"guide_3");
+  EXPECT_FALSE(scores[0].rejected);
+  for (int i=1; i<4; i++)
+    EXPECT_TRUE(scores[i].rejected);
+}
+
+TEST(MechanismManagerTest, Profiler)
+{
+  tool_box::Profiler& profiler = tool_box::Profiler::Instance();
+  const int stage = profiler.RegisterStage("test/stage");
+  EXPECT_EQ(profiler.RegisterStage("test/stage"),stage);
+  const int scope_stage = profiler.RegisterStage("test/scope");
+  profiler.Reset();
+  const int n_rings = profiler.GetNbRings();
+  profiler.StartExporter(1);
+
+  // Two producers, their rings are drained while they record
+  int n_samples = 20000;
+  std::vector<boost::thread> producers;
+  for(int k=0;k<2;k++)
+    producers.push_back(boost::thread([&,k]()
+    {
+      for(int i=0;i<n_samples;i++)
+      {
+        profiler.Record(stage,k == 0 ? 100 : 10000);
+        if(i % 1000 == 999)
+          boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+      }
+    }));
+  for(size_t k=0;k<producers.size();k++)
+    producers[k].join();
+  {
+    tool_box::ProfilerScope scope(scope_stage);
+  }
+  profiler.StopExporter();
+
+  // The rings of the ended producers are deleted once drained, at most the ring of this thread is new
+  profiler.Collect();
+  EXPECT_LE(profiler.GetNbRings(),n_rings + 1);
+
+  std::vector<tool_box::ProfilerStageStats> stats;
+  profiler.GetStats(stats);
+  ASSERT_GT(stats.size(),scope_stage);
+  const tool_box::ProfilerStageStats& s = stats[stage];
+  EXPECT_EQ(s.name,"test/stage");
+  EXPECT_EQ(s.count + profiler.GetNbDropped(),2*n_samples);
+  EXPECT_EQ(stats[scope_stage].count,1);
+#ifndef PROFILER_TSC
+  EXPECT_DOUBLE_EQ(s.min_ns,100.0);
+  EXPECT_DOUBLE_EQ(s.max_ns,10000.0);
+  // Upper edges of the bins, half of the samples on each value
+  EXPECT_GE(s.GetPercentile(0.25),100.0);
+  EXPECT_LE(s.GetPercentile(0.25),200.0);
+  EXPECT_GE(s.GetPercentile(0.99),10000.0);
+#endif
+
+  std::string report;
+  profiler.GetReport(report);
+  EXPECT_NE(report.find("test/stage"),std::string::npos);
+
+  std::string file_path = "/tmp/test_profiler_timings.csv";
+  ASSERT_TRUE(profiler.Dump(file_path));
+  std::ifstream file(file_path.c_str());
+  std::string header, line;
+  std::getline(file,header);
+  EXPECT_EQ(header.find("stage,count,"),0);
+  bool found = false;
+  while(std::getline(file,line))
+    found = found || line.find("test/stage,") == 0;
+  EXPECT_TRUE(found);
+
+  profiler.Reset();
+  profiler.GetStats(stats);
+  EXPECT_EQ(stats[stage].count,0);
+}
+
 int main(int argc, char** argv)
 {
   //Eigen::initParallel();
@@ -0,0 +1,194 @@
+/**
+ * @file   arena.h
+ * @brief  Per thread monotonic arena for the non rt scratch buffers.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace tool_box
+{
+
+/// Memory is taken from big blocks by moving a pointer, and given back all at once with Rewind() or
+/// Reset(). The blocks are kept, so once the arena is warm a scratch buffer costs no malloc at all.
+/// Not thread safe, each thread uses its own arena through ThreadLocal().
+class Arena
+{
+  public:
+    struct Mark
+    {
+        size_t block;
+        size_t offset;
+    };
+
+    explicit Arena(const size_t block_size = 256 * 1024)
+    {
+        block_size_ = block_size;
+        current_ = 0;
+        offset_ = 0;
+        n_allocations_ = 0;
+        n_blocks_allocated_ = 0;
+    }
+
+    ~Arena()
+    {
+        Release();
+    }
+
+    /// Same arena for all the calls of a thread
+    static Arena& ThreadLocal()
+    {
+        static thread_local Arena arena;
+        return arena;
+    }
+
+    void* Allocate(const size_t size, const size_t alignment = 64)
+    {
+        assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+        n_allocations_++;
+        // Current block first, then the next ones (kept by a previous Rewind), then a new one
+        for(;current_ < blocks_.size();current_++, offset_ = 0)
+        {
+            Block& block = blocks_[current_];
+            const uintptr_t begin = reinterpret_cast<uintptr_t>(block.data) + offset_;
+            const uintptr_t aligned = (begin + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+            if(aligned + size <= reinterpret_cast<uintptr_t>(block.data) + block.size)
+            {
+                offset_ = aligned + size - reinterpret_cast<uintptr_t>(block.data);
+                return reinterpret_cast<void*>(aligned);
+            }
+        }
+        Block block;
+        block.size = std::max(block_size_,size + alignment);
+        block.data = static_cast<char*>(std::malloc(block.size));
+        if(block.data == NULL)
+            throw std::bad_alloc();
+        n_blocks_allocated_++;
+        blocks_.push_back(block);
+        current_ = blocks_.size() - 1;
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(block.data);
+        const uintptr_t aligned = (begin + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+        offset_ = aligned + size - begin;
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    template <typename T>
+    T* Allocate(const size_t n)
+    {
+        return static_cast<T*>(Allocate(n * sizeof(T),std::max<size_t>(alignof(T),64)));
+    }
+
+    /// Uninitialized matrix, valid until the arena is rewound past this point
+    Eigen::Map<Eigen::MatrixXd> NewMatrix(const int rows, const int cols)
+    {
+        return Eigen::Map<Eigen::MatrixXd>(Allocate<double>(rows * cols),rows,cols);
+    }
+
+    inline Mark GetMark() const
+    {
+        Mark mark;
+        mark.block = current_;
+        mark.offset = offset_;
+        return mark;
+    }
+
+    /// Gives back everything allocated after mark
+    inline void Rewind(const Mark& mark)
+    {
+        current_ = mark.block;
+        offset_ = mark.offset;
+    }
+
+    inline void Reset()
+    {
+        current_ = 0;
+        offset_ = 0;
+    }
+
+    /// Frees the blocks
+    void Release()
+    {
+        for(size_t i=0;i<blocks_.size();i++)
+            std::free(blocks_[i].data);
+        blocks_.clear();
+        Reset();
+    }
+
+    /// Counters: allocations served by the arena, and blocks requested to the heap
+    inline long long GetNbAllocations() const {return n_allocations_;}
+    inline long long GetNbBlocksAllocated() const {return n_blocks_allocated_;}
+    inline size_t GetNbBlocks() const {return blocks_.size();}
+
+  private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    struct Block
+    {
+        char* data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    size_t block_size_;
+    size_t current_;
+    size_t offset_;
+    long long n_allocations_;
+    long long n_blocks_allocated_;
+};
+
+/// Rewinds the arena when leaving the scope, everything allocated inside is given back at once
+class ArenaScope
+{
+  public:
+    explicit ArenaScope(Arena& arena = Arena::ThreadLocal()):arena_(arena),mark_(arena.GetMark())
+    {
+    }
+
+    ~ArenaScope()
+    {
+        arena_.Rewind(mark_);
+    }
+
+    inline Arena& GetArena() {return arena_;}
+
+  private:
+    ArenaScope(const ArenaScope&);
+    ArenaScope& operator=(const ArenaScope&);
+
+    Arena& arena_;
+    Arena::Mark mark_;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * @file   config.h
+ * @brief  Process-wide cache of the packages configuration files.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+////////// STD
+#include <map>
+#include <string>
+#include <vector>
+
+////////// BOOST
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+////////// YAML-CPP
+#include <yaml-cpp/yaml.h>
+
+////////// Toolbox
+#include <toolbox/ros.h>
+
+namespace tool_box
+{
+
+/// Immutable configuration of a package (its cfg.yml), parsed once per process and shared
+/// by all the objects of the package. Values are addressed with a path, e.g. "gmr/n_gaussians".
+/// A configuration can be injected (tests, tools) before the objects using it are created.
+/// Not for rt.
+class Config
+{
+    public:
+        typedef boost::shared_ptr<const Config> ptr_t;
+
+        explicit Config(const YAML::Node& node)
+        {
+            root_ = YAML::Clone(node);
+        }
+
+        /// Returns the cached configuration of pkg_name, loading cfg.yml the first time
+        static ptr_t Load(const std::string& pkg_name)
+        {
+            boost::mutex::scoped_lock guard(CacheMutex());
+            ptr_t& cfg = Cache()[pkg_name];
+            if(!cfg)
+                cfg = ptr_t(new Config(CreateYamlNodeFromPkgName(pkg_name)));
+            return cfg;
+        }
+
+        /// Replaces the cached configuration of pkg_name, the objects created before keep the old one
+        static void Inject(const std::string& pkg_name, const YAML::Node& node)
+        {
+            ptr_t cfg(new Config(node));
+            boost::mutex::scoped_lock guard(CacheMutex());
+            Cache()[pkg_name] = cfg;
+        }
+
+        /// Drops the cached configuration of pkg_name, the next Load() reads cfg.yml again
+        static void Reset(const std::string& pkg_name)
+        {
+            boost::mutex::scoped_lock guard(CacheMutex());
+            Cache().erase(pkg_name);
+        }
+
+        bool Has(const std::string& path) const
+        {
+            boost::mutex::scoped_lock guard(mtx_);
+            return Find(path).IsDefined();
+        }
+
+        /// Returns false and leaves value untouched if path does not exist or can not be converted
+        template <typename _T>
+        bool Get(const std::string& path, _T& value) const
+        {
+            boost::mutex::scoped_lock guard(mtx_);
+            const YAML::Node node = Find(path);
+            if(!node.IsDefined())
+                return false;
+            try
+            {
+                value = node.as<_T>();
+            }
+            catch(const YAML::Exception& e)
+            {
+                return false;
+            }
+            return true;
+        }
+
+        /// Deep copy of a sub tree, the caller can use it freely
+        YAML::Node GetNode(const std::string& path) const
+        {
+            boost::mutex::scoped_lock guard(mtx_);
+            return YAML::Clone(Find(path));
+        }
+
+    private:
+
+        /// NOTE yaml-cpp nodes are not safe to read concurrently, the lookups are serialized
+        YAML::Node Find(const std::string& path) const
+        {
+            YAML::Node node(root_); // Shares the tree, reset() below never writes into it
+            size_t begin = 0;
+            while(begin <= path.size())
+            {
+                size_t end = path.find('/',begin);
+                if(end == std::string::npos)
+                    end = path.size();
+                const std::string key = path.substr(begin,end-begin);
+                if(!key.empty())
+                {
+                    if(!node.IsMap())
+                        return YAML::Node(YAML::NodeType::Undefined);
+                    const YAML::Node& const_node = node;
+                    YAML::Node child = const_node[key];
+                    if(!child.IsDefined())
+                        return child;
+                    node.reset(child);
+                }
+                begin = end + 1;
+            }
+            return node;
+        }
+
+        static std::map<std::string,ptr_t>& Cache()
+        {
+            static std::map<std::string,ptr_t> cache;
+            return cache;
+        }
+
+        static boost::mutex& CacheMutex()
+        {
+            static boost::mutex mtx;
+            return mtx;
+        }
+
+        YAML::Node root_;
+        mutable boost::mutex mtx_;
+};
+
+} // namespace
+
+#endif // CONFIG_H
@@ -25,91 +25,363 @@
 #ifndef DTW_H_
 #define DTW_H_
 
+////////// Eigen
 #include <eigen3/Eigen/Core>
 
+////////// STD
+#include <vector>
+#include <deque>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
 namespace{
 
 namespace dtw{
 
-double dist(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int i, int j)
+/// Admissible cells of the cost matrix: the samples j of sig2 in [j_min[i],j_max[i]] can be matched
+/// with the sample i of sig1. The windows are monotone staircases from (0,0) to (l1-1,l2-1).
+struct Window
+{
+    std::vector<int> j_min;
+    std::vector<int> j_max;
+
+    inline int Rows() const {return j_min.size();}
+    inline int Width(const int i) const {return j_max[i] - j_min[i] + 1;}
+};
+
+/// Makes the window monotone and connected, so that a warping path always exists
+inline void RepairWindow(Window& win, const int l2)
+{
+    const int l1 = win.Rows();
+    win.j_min[0] = 0;
+    win.j_max[l1-1] = l2-1;
+    for(int i=0;i<l1;i++)
+    {
+        win.j_min[i] = std::max(0,std::min(win.j_min[i],l2-1));
+        win.j_max[i] = std::max(0,std::min(win.j_max[i],l2-1));
+        if(i > 0)
+        {
+            win.j_min[i] = std::max(win.j_min[i],win.j_min[i-1]);
+            win.j_max[i] = std::max(win.j_max[i],win.j_max[i-1]);
+        }
+        win.j_max[i] = std::max(win.j_max[i],win.j_min[i]);
+    }
+    for(int i=l1-1;i>0;i--) // Each row has to touch the next one
+        win.j_max[i-1] = std::max(win.j_max[i-1],win.j_min[i]-1);
+}
+
+inline Window FullWindow(const int l1, const int l2)
+{
+    Window win;
+    win.j_min.assign(l1,0);
+    win.j_max.assign(l1,l2-1);
+    return win;
+}
+
+/// Sakoe-Chiba band, w samples around the diagonal (scaled if the lengths differ), w < 0 means no band
+inline Window SakoeChibaWindow(const int l1, const int l2, const int w)
+{
+    if(w < 0)
+        return FullWindow(l1,l2);
+    Window win;
+    win.j_min.resize(l1);
+    win.j_max.resize(l1);
+    const double slope = l1 > 1 ? static_cast<double>(l2-1)/(l1-1) : 0.0;
+    for(int i=0;i<l1;i++)
+    {
+        const int j_diag = static_cast<int>(std::floor(i * slope + 0.5));
+        win.j_min[i] = j_diag - w;
+        win.j_max[i] = j_diag + w;
+    }
+    RepairWindow(win,l2);
+    return win;
+}
+
+/// Itakura parallelogram, the local slope of the path is bounded in [1/slope,slope] (on the normalized lengths)
+inline Window ItakuraWindow(const int l1, const int l2, const double slope = 2.0)
+{
+    assert(slope >= 1.0);
+    Window win;
+    win.j_min.resize(l1);
+    win.j_max.resize(l1);
+    for(int i=0;i<l1;i++)
+    {
+        const double x = l1 > 1 ? static_cast<double>(i)/(l1-1) : 0.0;
+        const double y_min = std::max(x/slope,1.0 - slope*(1.0-x));
+        const double y_max = std::min(slope*x,1.0 - (1.0-x)/slope);
+        win.j_min[i] = static_cast<int>(std::ceil(y_min * (l2-1) - 1e-9));
+        win.j_max[i] = static_cast<int>(std::floor(y_max * (l2-1) + 1e-9));
+    }
+    RepairWindow(win,l2);
+    return win;
+}
+
+inline double dist(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, int i, int j)
 {
     return (sig1.row(i) - sig2.row(j)).norm();
 }
 
-double dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::MatrixXd& D, int w = -1)
+/// Cost only, O(l2) memory (two rows).
+/// Early abandoning: returns infinity as soon as a whole row costs more than max_cost.
+inline double dtw(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, const Window& win,
+                  const double max_cost = std::numeric_limits<double>::infinity())
 {
     assert(sig1.cols() == sig2.cols());
-    double d=0;
-    int l1 = sig1.rows();
-    int l2 = sig2.rows();
-    int sizediff = l1 - l2;
-    int i,j;
-    int j1,j2;
-    double cost, temp;
-
-    if(w!=-1 && w<sizediff) w = sizediff; // Adapt the window size, use sizediff
-
-    // Initialize the cost of D
-    D = Eigen::MatrixXd::Constant(l1+1,l2+1,-1);
-    D(0,0) = 0;
+    assert(win.Rows() == sig1.rows());
+    const double inf = std::numeric_limits<double>::infinity();
+    const int l1 = sig1.rows();
+    const int l2 = sig2.rows();
 
-    // Dynamic programming algorithm
-    for(i = 1; i <= l1; i++)
+    // One sample per column, so that the distances read contiguous memory
+    const Eigen::MatrixXd s1 = sig1.transpose();
+    const Eigen::MatrixXd s2 = sig2.transpose();
+
+    // Index j+1 holds the cell j, index 0 is the border
+    std::vector<double> prev(l2+1,inf), curr(l2+1,inf);
+    prev[0] = 0.0;
+    int prev_lo = 0, prev_hi = 0; // Written range of prev
+    int curr_lo = 0, curr_hi = 0; // Written range of curr, from two rows ago
+
+    for(int i=0;i<l1;i++)
     {
-        if(w==-1)
+        std::fill(curr.begin()+curr_lo,curr.begin()+curr_hi+1,inf);
+        const int j1 = win.j_min[i];
+        const int j2 = win.j_max[i];
+        double row_min = inf;
+        for(int j=j1;j<=j2;j++)
         {
-            j1 = 1;
-            j2 = l2;
+            const double cost = (s1.col(i) - s2.col(j)).norm();
+            const double d = cost + std::min(std::min(prev[j+1],prev[j]),curr[j]);
+            curr[j+1] = d;
+            row_min = std::min(row_min,d);
         }
-        else
+        if(row_min > max_cost)
+            return inf;
+        curr_lo = j1+1;
+        curr_hi = j2+1;
+        std::swap(prev,curr);
+        std::swap(prev_lo,curr_lo);
+        std::swap(prev_hi,curr_hi);
+    }
+    return prev[l2];
+}
+
+/// Banded cost matrix and backtracking, O(window) memory.
+/// path holds the matched pairs (i,j), from (0,0) to (l1-1,l2-1).
+inline double dtw_path(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, const Window& win, std::vector<std::pair<int,int> >& path)
+{
+    assert(sig1.cols() == sig2.cols());
+    assert(win.Rows() == sig1.rows());
+    const double inf = std::numeric_limits<double>::infinity();
+    const int l1 = sig1.rows();
+    const int l2 = sig2.rows();
+
+    const Eigen::MatrixXd s1 = sig1.transpose();
+    const Eigen::MatrixXd s2 = sig2.transpose();
+
+    std::vector<int> offset(l1+1,0);
+    for(int i=0;i<l1;i++)
+        offset[i+1] = offset[i] + win.Width(i);
+    std::vector<double> D(offset[l1]);
+
+    // Cumulated cost of the cell (i,j), infinity outside of the window
+    auto cell = [&](const int i, const int j) -> double
+    {
+        if(i < 0 || j < 0)
+            return (i < 0 && j < 0) ? 0.0 : inf;
+        if(j < win.j_min[i] || j > win.j_max[i])
+            return inf;
+        return D[offset[i] + j - win.j_min[i]];
+    };
+
+    for(int i=0;i<l1;i++)
+        for(int j=win.j_min[i];j<=win.j_max[i];j++)
         {
-            j1 = i-w>1 ? i-w : 1;
-            j2 = i+w<l2 ? i+w : l2;
+            const double cost = (s1.col(i) - s2.col(j)).norm();
+            D[offset[i] + j - win.j_min[i]] = cost + std::min(std::min(cell(i-1,j),cell(i-1,j-1)),cell(i,j-1));
         }
-        for(j = j1; j <= j2; j++)
+
+    // Backtracking, diagonal moves first on ties
+    path.clear();
+    int i = l1-1, j = l2-1;
+    path.push_back(std::make_pair(i,j));
+    while(i > 0 || j > 0)
+    {
+        const double d_diag = cell(i-1,j-1);
+        const double d_up = cell(i-1,j);
+        const double d_left = cell(i,j-1);
+        if(d_diag <= d_up && d_diag <= d_left)
         {
-            cost = dist(sig1,sig2,i-1,j-1);
-            temp = D(i-1,j);
-            if(D(i,j-1)!=-1)
-            {
-                if(temp ==-1 || D(i,j-1) < temp) temp = D(i,j-1);
-            }
-            if(D(i-1,j-1) != -1)
-            {
-                if(temp == -1 || D(i-1,j-1) < temp) temp = D(i-1,j-1);
-            }
-            D(i,j) = cost + temp;
+            i--;
+            j--;
         }
+        else if(d_up <= d_left)
+            i--;
+        else
+            j--;
+        path.push_back(std::make_pair(i,j));
     }
+    std::reverse(path.begin(),path.end());
+
+    return D[offset[l1] - 1];
+}
 
-    d = D(l1,l2);
+/// Averages pairs of consecutive samples (the last one is kept alone if the length is odd)
+inline Eigen::MatrixXd downsample(const Eigen::Ref<const Eigen::MatrixXd>& sig)
+{
+    const int l = sig.rows();
+    Eigen::MatrixXd out((l+1)/2,sig.cols());
+    for(int i=0;i<l/2;i++)
+        out.row(i) = 0.5 * (sig.row(2*i) + sig.row(2*i+1));
+    if(l % 2 == 1)
+        out.row(l/2) = sig.row(l-1);
+    return out;
+}
 
-    return d;
+/// FastDTW (Salvador and Chan): the signals are halved until they are short, aligned there with the
+/// exact dtw and the path is projected back level by level, each time widened by radius samples and
+/// refined. The returned window holds the projection on the full resolution signals, dtw_path()
+/// and align_phase() on it give the FastDTW path. O((l1+l2)*radius) time and memory.
+inline Window FastDtwWindow(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, const int radius)
+{
+    assert(radius >= 0);
+    const int l1 = sig1.rows();
+    const int l2 = sig2.rows();
+    const int min_size = radius + 2;
+    if(l1 <= min_size || l2 <= min_size)
+        return FullWindow(l1,l2);
+
+    // Coarse path
+    const Eigen::MatrixXd coarse1 = downsample(sig1);
+    const Eigen::MatrixXd coarse2 = downsample(sig2);
+    std::vector<std::pair<int,int> > path;
+    dtw_path(coarse1,coarse2,FastDtwWindow(coarse1,coarse2,radius),path);
+
+    // Project each coarse cell on its 2x2 block, widened by radius
+    Window win;
+    win.j_min.assign(l1,l2);
+    win.j_max.assign(l1,-1);
+    for(size_t k=0;k<path.size();k++)
+    {
+        const int i_lo = std::max(0,2*path[k].first - radius);
+        const int i_hi = std::min(l1-1,2*path[k].first + 1 + radius);
+        const int j_lo = 2*path[k].second - radius;
+        const int j_hi = 2*path[k].second + 1 + radius;
+        for(int i=i_lo;i<=i_hi;i++)
+        {
+            win.j_min[i] = std::min(win.j_min[i],j_lo);
+            win.j_max[i] = std::max(win.j_max[i],j_hi);
+        }
+    }
+    RepairWindow(win,l2);
+    return win;
 }
 
-double dtw(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1)
+/// Full cost matrix (l1+1)x(l2+1), D(0,0) = 0 and infinity outside of the band. For debugging and plots.
+inline double dtw(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, Eigen::MatrixXd& D, int w = -1)
 {
-    Eigen::MatrixXd D;
-    return dtw(sig1,sig2,D,w);
+    assert(sig1.cols() == sig2.cols());
+    const int l1 = sig1.rows();
+    const int l2 = sig2.rows();
+    const Window win = SakoeChibaWindow(l1,l2,w);
+
+    D = Eigen::MatrixXd::Constant(l1+1,l2+1,std::numeric_limits<double>::infinity());
+    D(0,0) = 0;
+    for(int i = 1; i <= l1; i++)
+        for(int j = win.j_min[i-1]+1; j <= win.j_max[i-1]+1; j++)
+            D(i,j) = dist(sig1,sig2,i-1,j-1) + std::min(std::min(D(i-1,j),D(i,j-1)),D(i-1,j-1));
+
+    return D(l1,l2);
 }
 
-void align_idx(const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, Eigen::VectorXi& idx, int w = -1)
+inline double dtw(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, int w = -1)
 {
-    Eigen::MatrixXd D_tmp;
-    Eigen::MatrixXd::Index first_min_idx;
-    dtw(sig1,sig2,D_tmp,w);
+    return dtw(sig1,sig2,SakoeChibaWindow(sig1.rows(),sig2.rows(),w));
+}
 
-    Eigen::MatrixXd D = D_tmp.block(1,1,D_tmp.rows()-1,D_tmp.cols()-1);
+/// LB_Keogh lower bound of dtw(query,candidate,win): distance of the query from the envelope of the candidate
+/// over the window. O(l1+l2), the envelope is computed with monotone queues.
+inline double lb_keogh(const Eigen::Ref<const Eigen::MatrixXd>& query, const Eigen::Ref<const Eigen::MatrixXd>& candidate, const Window& win,
+                       const double max_cost = std::numeric_limits<double>::infinity())
+{
+    assert(query.cols() == candidate.cols());
+    assert(win.Rows() == query.rows());
+    const int l1 = query.rows();
+    const int dim = query.cols();
 
-    idx.resize(D.rows());
-    for (int i_row = 0; i_row<D.rows(); i_row++)
+    Eigen::MatrixXd excess = Eigen::MatrixXd::Zero(dim,l1);
+    std::deque<int> max_q, min_q;
+    for(int d=0;d<dim;d++)
     {
-        D.row(i_row).minCoeff(&first_min_idx);
-        idx(i_row) = static_cast<int>(first_min_idx);
+        max_q.clear();
+        min_q.clear();
+        int next = 0; // Next candidate sample to enter the window
+        for(int i=0;i<l1;i++)
+        {
+            for(;next<=win.j_max[i];next++)
+            {
+                while(!max_q.empty() && candidate(max_q.back(),d) <= candidate(next,d)) max_q.pop_back();
+                max_q.push_back(next);
+                while(!min_q.empty() && candidate(min_q.back(),d) >= candidate(next,d)) min_q.pop_back();
+                min_q.push_back(next);
+            }
+            while(max_q.front() < win.j_min[i]) max_q.pop_front();
+            while(min_q.front() < win.j_min[i]) min_q.pop_front();
+
+            const double q = query(i,d);
+            const double upper = candidate(max_q.front(),d);
+            const double lower = candidate(min_q.front(),d);
+            excess(d,i) = q > upper ? q - upper : (q < lower ? lower - q : 0.0);
+        }
     }
+
+    // Each sample of the query is matched at least once inside the window
+    double lb = 0.0;
+    for(int i=0;i<l1 && lb<=max_cost;i++)
+        lb += excess.col(i).norm();
+    return lb;
 }
 
-void align_phase(Eigen::VectorXd& phase1, const Eigen::VectorXd& phase2, const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1)
+/// Index of the candidate closest to the query, -1 if none. The candidates are pruned with LB_Keogh
+/// and the dtw is abandoned as soon as it exceeds the best cost found so far.
+/// w is the Sakoe-Chiba half width, in samples.
+inline int nearest(const Eigen::Ref<const Eigen::MatrixXd>& query, const std::vector<Eigen::MatrixXd>& candidates, const int w, double& best_cost)
+{
+    int best_idx = -1;
+    best_cost = std::numeric_limits<double>::infinity();
+    for(size_t k=0;k<candidates.size();k++)
+    {
+        const Window win = SakoeChibaWindow(query.rows(),candidates[k].rows(),w);
+        if(lb_keogh(query,candidates[k],win,best_cost) >= best_cost)
+            continue;
+        const double cost = dtw(query,candidates[k],win,best_cost);
+        if(cost < best_cost)
+        {
+            best_cost = cost;
+            best_idx = k;
+        }
+    }
+    return best_idx;
+}
+
+/// For each sample of sig1, the first sample of sig2 matched by the warping path
+inline void align_idx(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, Eigen::VectorXi& idx, const Window& win)
+{
+    std::vector<std::pair<int,int> > path;
+    dtw_path(sig1,sig2,win,path);
+
+    idx.resize(sig1.rows());
+    for(int k=path.size()-1;k>=0;k--)
+        idx(path[k].first) = path[k].second;
+}
+
+inline void align_idx(const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, Eigen::VectorXi& idx, int w = -1)
+{
+    align_idx(sig1,sig2,idx,SakoeChibaWindow(sig1.rows(),sig2.rows(),w));
+}
+
+inline void align_phase(Eigen::VectorXd& phase1, const Eigen::VectorXd& phase2, const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, int w = -1)
 {
     assert(phase1.size() == sig1.rows());
     assert(phase2.size() == sig2.rows());
@@ -121,7 +393,7 @@ void align_phase(Eigen::VectorXd& phase1, const Eigen::VectorXd& phase2, const E
         phase1(i) = phase2(idx(i));
 }
 
-void align_phase(Eigen::MatrixXd& phase1, const Eigen::MatrixXd& phase2, const Eigen::MatrixXd& sig1, const Eigen::MatrixXd& sig2, int w = -1)
+inline void align_phase(Eigen::MatrixXd& phase1, const Eigen::Ref<const Eigen::MatrixXd>& phase2, const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, const Window& win)
 {
     assert(phase1.rows() == sig1.rows());
     assert(phase2.rows() == sig2.rows());
@@ -129,16 +401,20 @@ void align_phase(Eigen::MatrixXd& phase1, const Eigen::MatrixXd& phase2, const E
     assert(phase2.cols() == 1);
 
     Eigen::VectorXi idx;
-    align_idx(sig1,sig2,idx,w);
+    align_idx(sig1,sig2,idx,win);
 
     for (int i = 0; i<idx.size(); i++)
         phase1(i,0) = phase2(idx(i),0);
 }
 
+inline void align_phase(Eigen::MatrixXd& phase1, const Eigen::Ref<const Eigen::MatrixXd>& phase2, const Eigen::Ref<const Eigen::MatrixXd>& sig1, const Eigen::Ref<const Eigen::MatrixXd>& sig2, int w = -1)
+{
+    align_phase(phase1,phase2,sig1,sig2,SakoeChibaWindow(sig1.rows(),sig2.rows(),w));
+}
+
 } // dtw namespace
 
 } // anonym namespace
 
 
 #endif /* DTW_H_ */
-
@@ -0,0 +1,417 @@
+/**
+ * @file   profiler.h
+ * @brief  Per stage timers of the rt loops, lock-free on the rt side.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+////////// BOOST
+#include <boost/thread.hpp>
+
+////////// STD
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#if defined(PROFILER_USE_TSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PROFILER_TSC
+#endif
+
+/// PROFILE_SCOPE("stage") times the rest of the enclosing scope. It is compiled only with -DUSE_PROFILER, otherwise
+/// it expands to nothing. The first pass registers the stage (not rt), then a pass costs two clock reads and a push
+/// in the ring of the thread. The clock is clock_gettime(CLOCK_MONOTONIC), or the TSC with -DPROFILER_USE_TSC.
+#define PROFILER_CONCAT_(a,b) a##b
+#define PROFILER_CONCAT(a,b) PROFILER_CONCAT_(a,b)
+#ifdef USE_PROFILER
+#define PROFILE_SCOPE(name) \
+    static const int PROFILER_CONCAT(profiler_stage_,__LINE__) = tool_box::Profiler::Instance().RegisterStage(name); \
+    tool_box::ProfilerScope PROFILER_CONCAT(profiler_scope_,__LINE__)(PROFILER_CONCAT(profiler_stage_,__LINE__))
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+namespace tool_box
+{
+
+static const int PROFILER_MAX_STAGES = 64;
+static const int PROFILER_RING_SIZE = 16384; // Samples per thread, power of 2
+static const int PROFILER_HIST_BINS = 32; // Bin b counts the samples in [2^b,2^(b+1)) ns
+
+/// Single producer (the thread owning it), single consumer (the exporter). A full ring drops the new samples.
+class ProfilerRing
+{
+  public:
+    struct Sample
+    {
+        uint32_t stage;
+        uint64_t ticks;
+    };
+
+    ProfilerRing():head_(0),tail_(0),n_dropped_(0),released_(false)
+    {
+    }
+
+    /// Called by the owner at its end, the consumer deletes the ring once drained
+    inline void Release() {released_.store(true,std::memory_order_release);}
+    inline bool IsReleased() const {return released_.load(std::memory_order_acquire);}
+
+    inline void Push(const int stage, const uint64_t ticks)
+    {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        if(head - tail_.load(std::memory_order_acquire) >= PROFILER_RING_SIZE)
+        {
+            n_dropped_.fetch_add(1,std::memory_order_relaxed);
+            return;
+        }
+        Sample& sample = samples_[head & (PROFILER_RING_SIZE - 1)];
+        sample.stage = stage;
+        sample.ticks = ticks;
+        head_.store(head + 1,std::memory_order_release);
+    }
+
+    /// Consumer side, sink(const Sample&) is called for each sample
+    template <typename Sink>
+    void Drain(Sink sink)
+    {
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        const uint64_t head = head_.load(std::memory_order_acquire);
+        for(;tail != head;tail++)
+            sink(samples_[tail & (PROFILER_RING_SIZE - 1)]);
+        tail_.store(tail,std::memory_order_release);
+    }
+
+    inline long long GetNbDropped() const {return n_dropped_.load(std::memory_order_relaxed);}
+
+  private:
+    Sample samples_[PROFILER_RING_SIZE];
+    std::atomic<uint64_t> head_;
+    std::atomic<uint64_t> tail_;
+    std::atomic<long long> n_dropped_;
+    std::atomic<bool> released_;
+};
+
+struct ProfilerStageStats
+{
+    std::string name;
+    long long count;
+    double total_ns;
+    double min_ns;
+    double max_ns;
+    long long hist[PROFILER_HIST_BINS];
+
+    inline double GetMean() const {return count > 0 ? total_ns / count : 0.0;}
+
+    /// Upper edge of the histogram bin of the quantile q
+    double GetPercentile(const double q) const
+    {
+        if(count == 0)
+            return 0.0;
+        const long long rank = std::max(1LL,static_cast<long long>(std::ceil(q * count)));
+        long long cnt = 0;
+        for(int b=0;b<PROFILER_HIST_BINS;b++)
+        {
+            cnt += hist[b];
+            if(cnt >= rank)
+                return std::min(max_ns,std::ldexp(1.0,b+1));
+        }
+        return max_ns;
+    }
+};
+
+/// Process wide, the rt threads record in their own rings, the exporter aggregates them in per stage histograms.
+class Profiler
+{
+  public:
+    static Profiler& Instance()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    ~Profiler()
+    {
+        StopExporter();
+        for(size_t i=0;i<rings_.size();i++)
+            delete rings_[i];
+    }
+
+    /// Not for rt, the same name gives the same stage
+    int RegisterStage(const std::string& name)
+    {
+        boost::mutex::scoped_lock guard(mtx_);
+        for(size_t i=0;i<stats_.size();i++)
+            if(stats_[i].name == name)
+                return i;
+        if(stats_.size() >= PROFILER_MAX_STAGES)
+            return PROFILER_MAX_STAGES - 1; // Last stage shared by the overflowing ones
+        ProfilerStageStats stats;
+        stats.name = name;
+        ResetStats(stats);
+        stats_.push_back(stats);
+        return stats_.size() - 1;
+    }
+
+    static inline uint64_t Now()
+    {
+#ifdef PROFILER_TSC
+        return __rdtsc();
+#else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    /// Rt safe once the thread has recorded its first sample (the ring is created then)
+    inline void Record(const int stage, const uint64_t ticks)
+    {
+        LocalRing().Push(stage,ticks);
+    }
+
+    /// Not for rt, moves the samples of all the rings to the histograms and deletes the rings of the ended threads
+    void Collect()
+    {
+        boost::mutex::scoped_lock guard(mtx_);
+        size_t n_kept = 0;
+        for(size_t r=0;r<rings_.size();r++)
+        {
+            const bool released = rings_[r]->IsReleased(); // Before draining, no sample is pushed after it
+            rings_[r]->Drain([this](const ProfilerRing::Sample& sample)
+            {
+                if(sample.stage >= stats_.size())
+                    return;
+                ProfilerStageStats& stats = stats_[sample.stage];
+                const double ns = sample.ticks * ns_per_tick_;
+                stats.count++;
+                stats.total_ns += ns;
+                stats.min_ns = std::min(stats.min_ns,ns);
+                stats.max_ns = std::max(stats.max_ns,ns);
+                const int bin = ns >= 1.0 ? static_cast<int>(std::log2(ns)) : 0;
+                stats.hist[std::min(bin,PROFILER_HIST_BINS-1)]++;
+            });
+            if(released)
+            {
+                n_dropped_released_ += rings_[r]->GetNbDropped();
+                delete rings_[r];
+            }
+            else
+                rings_[n_kept++] = rings_[r];
+        }
+        rings_.resize(n_kept);
+    }
+
+    /// Not for rt, collects and copies the histograms
+    void GetStats(std::vector<ProfilerStageStats>& stats)
+    {
+        Collect();
+        boost::mutex::scoped_lock guard(mtx_);
+        stats = stats_;
+    }
+
+    /// Samples dropped because a ring was full, the exporter is too slow
+    long long GetNbDropped()
+    {
+        boost::mutex::scoped_lock guard(mtx_);
+        long long n_dropped = n_dropped_released_;
+        for(size_t r=0;r<rings_.size();r++)
+            n_dropped += rings_[r]->GetNbDropped();
+        return n_dropped;
+    }
+
+    /// Rings of the running threads, and of the ended ones not collected yet
+    int GetNbRings()
+    {
+        boost::mutex::scoped_lock guard(mtx_);
+        return rings_.size();
+    }
+
+    /// Not for rt, one line per stage
+    void GetReport(std::string& report)
+    {
+        std::vector<ProfilerStageStats> stats;
+        GetStats(stats);
+        std::ostringstream out;
+        out << std::left << std::setw(28) << "stage" << std::right << std::setw(12) << "count" << std::setw(12) << "mean_ns"
+            << std::setw(12) << "min_ns" << std::setw(12) << "p50_ns" << std::setw(12) << "p99_ns" << std::setw(12) << "max_ns" << std::endl;
+        out << std::fixed << std::setprecision(0);
+        for(size_t i=0;i<stats.size();i++)
+        {
+            const ProfilerStageStats& s = stats[i];
+            out << std::left << std::setw(28) << s.name << std::right << std::setw(12) << s.count << std::setw(12) << s.GetMean()
+                << std::setw(12) << (s.count > 0 ? s.min_ns : 0.0) << std::setw(12) << s.GetPercentile(0.5)
+                << std::setw(12) << s.GetPercentile(0.99) << std::setw(12) << s.max_ns << std::endl;
+        }
+        out << "dropped " << GetNbDropped() << std::endl;
+        report = out.str();
+    }
+
+    /// Not for rt, csv with the histograms
+    bool Dump(const std::string& file_path)
+    {
+        std::vector<ProfilerStageStats> stats;
+        GetStats(stats);
+        std::ofstream out(file_path.c_str());
+        if(!out.is_open())
+            return false;
+        out << "stage,count,mean_ns,min_ns,p50_ns,p99_ns,max_ns";
+        for(int b=0;b<PROFILER_HIST_BINS;b++)
+            out << ",hist_" << (1LL<<b);
+        out << std::endl;
+        out << std::setprecision(10);
+        for(size_t i=0;i<stats.size();i++)
+        {
+            const ProfilerStageStats& s = stats[i];
+            out << s.name << "," << s.count << "," << s.GetMean() << "," << (s.count > 0 ? s.min_ns : 0.0) << ","
+                << s.GetPercentile(0.5) << "," << s.GetPercentile(0.99) << "," << s.max_ns;
+            for(int b=0;b<PROFILER_HIST_BINS;b++)
+                out << "," << s.hist[b];
+            out << std::endl;
+        }
+        return true;
+    }
+
+    /// Not for rt, clears the histograms, the stages are kept
+    void Reset()
+    {
+        Collect();
+        boost::mutex::scoped_lock guard(mtx_);
+        for(size_t i=0;i<stats_.size();i++)
+            ResetStats(stats_[i]);
+    }
+
+    /// Collects every period_ms in a background thread, so that the rings do not fill up
+    void StartExporter(const int period_ms)
+    {
+        assert(period_ms > 0);
+        StopExporter();
+        stop_exporter_ = false;
+        exporter_ = boost::thread([this,period_ms]()
+        {
+            while(!stop_exporter_.load())
+            {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(period_ms));
+                Collect();
+            }
+        });
+    }
+
+    void StopExporter()
+    {
+        stop_exporter_ = true;
+        if(exporter_.joinable())
+            exporter_.join();
+    }
+
+  private:
+    Profiler():n_dropped_released_(0),stop_exporter_(true)
+    {
+        stats_.reserve(PROFILER_MAX_STAGES);
+        ns_per_tick_ = 1.0;
+#ifdef PROFILER_TSC
+        // TSC frequency against the monotonic clock, once
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        const double ns_start = ts.tv_sec * 1e9 + ts.tv_nsec;
+        const uint64_t tsc_start = __rdtsc();
+        boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        const uint64_t tsc_end = __rdtsc();
+        ns_per_tick_ = (ts.tv_sec * 1e9 + ts.tv_nsec - ns_start) / static_cast<double>(tsc_end - tsc_start);
+#endif
+    }
+
+    Profiler(const Profiler&);
+    Profiler& operator=(const Profiler&);
+
+    /// Releases the ring at the end of its thread
+    struct RingOwner
+    {
+        RingOwner():ring(NULL) {}
+        ~RingOwner() {if(ring != NULL) ring->Release();}
+        ProfilerRing* ring;
+    };
+
+    inline ProfilerRing& LocalRing()
+    {
+        static thread_local RingOwner owner;
+        if(owner.ring == NULL)
+        {
+            // Owned by the profiler, the samples of a thread are exported even after its end
+            owner.ring = new ProfilerRing();
+            boost::mutex::scoped_lock guard(mtx_);
+            rings_.push_back(owner.ring);
+        }
+        return *owner.ring;
+    }
+
+    static void ResetStats(ProfilerStageStats& stats)
+    {
+        stats.count = 0;
+        stats.total_ns = 0.0;
+        stats.min_ns = std::numeric_limits<double>::infinity();
+        stats.max_ns = 0.0;
+        std::fill(stats.hist,stats.hist+PROFILER_HIST_BINS,0);
+    }
+
+    boost::mutex mtx_; // Stages, histograms and list of rings, never taken by a rt thread once its ring exists
+    std::vector<ProfilerStageStats> stats_;
+    std::vector<ProfilerRing*> rings_;
+    long long n_dropped_released_; // Samples dropped by the deleted rings
+    double ns_per_tick_;
+    boost::thread exporter_;
+    std::atomic<bool> stop_exporter_;
+};
+
+/// Records the time spent between its construction and its destruction
+class ProfilerScope
+{
+  public:
+    explicit ProfilerScope(const int stage):stage_(stage),start_(Profiler::Now())
+    {
+    }
+
+    ~ProfilerScope()
+    {
+        Profiler::Instance().Record(stage_,Profiler::Now() - start_);
+    }
+
+  private:
+    ProfilerScope(const ProfilerScope&);
+    ProfilerScope& operator=(const ProfilerScope&);
+
+    const int stage_;
+    const uint64_t start_;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,294 @@
+/**
+ * @file   arc_length.h
+ * @brief  Adaptive arc length of a parametric curve, by Gauss-Legendre quadrature.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARC_LENGTH_H
+#define ARC_LENGTH_H
+
+////////// Toolbox
+#include "toolbox/spline/cubic_spline.h"
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+namespace tool_box
+{
+
+/// Floor on the normalized speed ds/dz, so that the inverse map stays finite
+static const double ARC_LENGTH_MIN_SPEED = 1e-9;
+
+/// Not for rt, s(z) and z(s) from the knots of the arc length. The two Hermite splines go through the same knots with
+/// reciprocal derivatives, limited to keep them monotone, so they are the inverse of each other up to the tolerance
+/// used to place the knots.
+inline void CreateArcLengthMaps(const Eigen::Ref<const Eigen::VectorXd>& z, const Eigen::Ref<const Eigen::VectorXd>& s,
+                                const Eigen::Ref<const Eigen::VectorXd>& ds_dz, CubicSpline& s_of_z, CubicSpline& z_of_s)
+{
+    Eigen::VectorXd ds = ds_dz;
+    Eigen::VectorXd dz = ds_dz.cwiseInverse();
+    LimitMonotoneSlopes(z,s,ds);
+    LimitMonotoneSlopes(s,z,dz);
+    s_of_z.SetPoints(z,s,ds);
+    z_of_s.SetPoints(s,z,dz);
+}
+
+/// Arc length s(z) of a curve x(z), z in [z0,z1], given its speed |dx/dz|.
+/// The interval is split until, on each piece:
+///  - the 5 points Gauss-Legendre integral matches the sum of the integrals on the two halves,
+///  - the cubic Hermite interpolation of s(z) (values and speeds at the ends) matches the integral in the middle,
+///  - the cubic Hermite interpolation of z(s) gives back the middle from its abscisse,
+/// so the knots are accurate and both maps built on them (see CreateArcLengthMaps()) are accurate as well.
+/// Where the speed vanishes the inverse map is singular, there the depth is limited by max_depth.
+/// The speed is evaluated in batches, one per level of subdivision:
+///   void speed(const Eigen::Ref<const Eigen::VectorXd>& z, Eigen::Ref<Eigen::VectorXd> v)
+class ArcLength
+{
+  public:
+    /// tolerance is relative to the total length
+    ArcLength(const double tolerance = 1e-6, const int max_depth = 16, const int n_initial = 8)
+    :tolerance_(tolerance),max_depth_(max_depth),n_initial_(n_initial),n_evaluations_(0)
+    {
+        assert(tolerance_ > 0.0);
+        assert(max_depth_ >= 0);
+        assert(n_initial_ > 0);
+    }
+
+    /// Not for rt
+    template <typename Speed>
+    void Compute(Speed speed, const double z0, const double z1)
+    {
+        assert(z1 > z0);
+        n_evaluations_ = 0;
+
+        // Initial uniform pieces, with the speed at the ends
+        Eigen::VectorXd z = Eigen::VectorXd::LinSpaced(n_initial_+1,z0,z1);
+        Eigen::VectorXd v(n_initial_+1);
+        speed(z,v);
+        n_evaluations_ += z.size();
+        std::vector<Piece> pending(n_initial_);
+        for(int i=0;i<n_initial_;i++)
+        {
+            pending[i].a = z(i);
+            pending[i].b = z(i+1);
+            pending[i].speed_a = v(i);
+            pending[i].speed_b = v(i+1);
+            pending[i].depth = 0;
+        }
+
+        // Whole integrals of the initial pieces, they also give the scale of the tolerance
+        Eigen::VectorXd nodes(n_gl_ * n_initial_), values(n_gl_ * n_initial_);
+        for(int i=0;i<n_initial_;i++)
+            Nodes(pending[i].a,pending[i].b,nodes.segment(i*n_gl_,n_gl_));
+        speed(nodes,values);
+        n_evaluations_ += nodes.size();
+        double total = 0.0;
+        for(int i=0;i<n_initial_;i++)
+        {
+            pending[i].length = Integral(pending[i].a,pending[i].b,values.segment(i*n_gl_,n_gl_));
+            total += pending[i].length;
+        }
+        const double abs_tolerance = tolerance_ * std::max(total,1e-12);
+        const double min_speed = ARC_LENGTH_MIN_SPEED * std::max(total,1e-12) / (z1 - z0);
+
+        std::vector<Piece> accepted, next;
+        while(!pending.empty())
+        {
+            // Both halves and the middle speed of every pending piece, one batch
+            const int n = pending.size();
+            const int stride = 2 * n_gl_ + 1;
+            nodes.resize(stride * n);
+            values.resize(stride * n);
+            for(int i=0;i<n;i++)
+            {
+                const Piece& p = pending[i];
+                const double mid = 0.5 * (p.a + p.b);
+                Nodes(p.a,mid,nodes.segment(i*stride,n_gl_));
+                Nodes(mid,p.b,nodes.segment(i*stride+n_gl_,n_gl_));
+                nodes(i*stride+2*n_gl_) = mid;
+            }
+            speed(nodes,values);
+            n_evaluations_ += nodes.size();
+
+            next.clear();
+            for(int i=0;i<n;i++)
+            {
+                const Piece& p = pending[i];
+                const double mid = 0.5 * (p.a + p.b);
+                const double h = p.b - p.a;
+                Piece left, right;
+                left.a = p.a;
+                left.b = right.a = mid;
+                right.b = p.b;
+                left.speed_a = p.speed_a;
+                left.speed_b = right.speed_a = values(i*stride+2*n_gl_);
+                right.speed_b = p.speed_b;
+                left.length = Integral(p.a,mid,values.segment(i*stride,n_gl_));
+                right.length = Integral(mid,p.b,values.segment(i*stride+n_gl_,n_gl_));
+                left.depth = right.depth = p.depth + 1;
+
+                const double quadrature_error = std::abs(left.length + right.length - p.length);
+                const double hermite_mid = 0.5 * p.length + h * (p.speed_a - p.speed_b) / 8.0;
+                const double hermite_error = std::abs(left.length - hermite_mid);
+                const double inverse_error = std::abs(InverseHermite(p,left.length + right.length,left.length,min_speed) - mid);
+                const double local_tolerance = abs_tolerance * h / (z1 - z0);
+                if((quadrature_error <= local_tolerance && hermite_error <= abs_tolerance && inverse_error <= tolerance_ * (z1 - z0))
+                   || p.depth >= max_depth_)
+                {
+                    Piece refined = p;
+                    refined.length = left.length + right.length;
+                    accepted.push_back(refined);
+                }
+                else
+                {
+                    next.push_back(left);
+                    next.push_back(right);
+                }
+            }
+            pending.swap(next);
+        }
+
+        // Knots, cumulative length and speed
+        std::sort(accepted.begin(),accepted.end());
+        const int n_knots = accepted.size() + 1;
+        z_.resize(n_knots);
+        s_.resize(n_knots);
+        speed_.resize(n_knots);
+        z_(0) = accepted[0].a;
+        s_(0) = 0.0;
+        speed_(0) = accepted[0].speed_a;
+        for(int i=0;i<n_knots-1;i++)
+        {
+            z_(i+1) = accepted[i].b;
+            s_(i+1) = s_(i) + accepted[i].length;
+            speed_(i+1) = accepted[i].speed_b;
+        }
+    }
+
+    /// Not for rt, normalized maps s(z) and z(s), s in [0,1], see CreateArcLengthMaps().
+    /// Returns false if the curve has no length.
+    bool CreateMaps(CubicSpline& abscisse_of_phase, CubicSpline& phase_of_abscisse) const
+    {
+        Eigen::VectorXd s, ds_dz;
+        if(!GetNormalized(s,ds_dz))
+            return false;
+        CreateArcLengthMaps(z_,s,ds_dz,abscisse_of_phase,phase_of_abscisse);
+        return true;
+    }
+
+    /// Normalized abscisse s/L and its derivative at the knots, with a floor on the speed so that the inverse is finite
+    bool GetNormalized(Eigen::VectorXd& s, Eigen::VectorXd& ds_dz) const
+    {
+        const double total = GetTotalLength();
+        if(!(total > 0.0))
+            return false;
+        s = s_ / total;
+        s(s.size()-1) = 1.0;
+        ds_dz = (speed_ / total).cwiseMax(ARC_LENGTH_MIN_SPEED);
+        return true;
+    }
+
+    inline const Eigen::VectorXd& GetKnots() const {return z_;}
+    inline const Eigen::VectorXd& GetLength() const {return s_;}
+    inline const Eigen::VectorXd& GetSpeed() const {return speed_;}
+    inline double GetTotalLength() const {return s_.size() > 0 ? s_(s_.size()-1) : 0.0;}
+    inline int GetNbKnots() const {return z_.size();}
+    inline long GetNbEvaluations() const {return n_evaluations_;}
+
+  private:
+    struct Piece
+    {
+        double a;
+        double b;
+        double speed_a;
+        double speed_b;
+        double length; // Integral on [a,b]
+        int depth;
+        bool operator<(const Piece& other) const {return a < other.a;}
+    };
+
+    static const int n_gl_ = 5;
+
+    /// Hermite z(s) on the piece, slopes 1/speed limited as in LimitMonotoneSlopes(), evaluated length after p.a
+    static inline double InverseHermite(const Piece& p, const double length, const double length_in, const double min_speed)
+    {
+        const double h = p.b - p.a;
+        if(!(length > 0.0))
+            return p.a + 0.5 * h;
+        const double slope = h / length;
+        double alpha = 1.0 / (std::max(p.speed_a,min_speed) * slope);
+        double beta = 1.0 / (std::max(p.speed_b,min_speed) * slope);
+        const double r = alpha * alpha + beta * beta;
+        if(r > 9.0)
+        {
+            alpha *= 3.0 / std::sqrt(r);
+            beta *= 3.0 / std::sqrt(r);
+        }
+        const double t = length_in / length;
+        const double t2 = t * t, t3 = t2 * t;
+        return p.a + h * ((-2.0 * t3 + 3.0 * t2) + alpha * (t3 - 2.0 * t2 + t) + beta * (t3 - t2));
+    }
+
+    static inline void Nodes(const double a, const double b, Eigen::Ref<Eigen::VectorXd> nodes)
+    {
+        const double c = 0.5 * (a + b), r = 0.5 * (b - a);
+        for(int i=0;i<n_gl_;i++)
+            nodes(i) = c + r * GlNode(i);
+    }
+
+    static inline double Integral(const double a, const double b, const Eigen::Ref<const Eigen::VectorXd>& values)
+    {
+        double sum = 0.0;
+        for(int i=0;i<n_gl_;i++)
+            sum += GlWeight(i) * values(i);
+        return 0.5 * (b - a) * sum;
+    }
+
+    /// 5 points Gauss-Legendre on [-1,1]
+    static inline double GlNode(const int i)
+    {
+        static const double nodes[n_gl_] = {-0.9061798459386640,-0.5384693101056831,0.0,0.5384693101056831,0.9061798459386640};
+        return nodes[i];
+    }
+
+    static inline double GlWeight(const int i)
+    {
+        static const double weights[n_gl_] = {0.2369268850561891,0.4786286704993665,0.5688888888888889,0.4786286704993665,0.2369268850561891};
+        return weights[i];
+    }
+
+    double tolerance_;
+    int max_depth_;
+    int n_initial_;
+    long n_evaluations_;
+    Eigen::VectorXd z_;
+    Eigen::VectorXd s_;
+    Eigen::VectorXd speed_;
+};
+
+} // namespace
+
+#endif
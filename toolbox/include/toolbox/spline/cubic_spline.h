@@ -0,0 +1,390 @@
+/**
+ * @file   cubic_spline.h
+ * @brief  Natural cubic spline based on Eigen, with O(1) segment lookup.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUBIC_SPLINE_H
+#define CUBIC_SPLINE_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace tool_box
+{
+
+/// Knots of a spline and segment lookup:
+///  - uniform knots: the segment is computed directly from x,
+///  - otherwise the caller keeps a cursor on the last segment, so that close queries (e.g. one per tick)
+///    check the cached segment and its neighbors before falling back to a binary search.
+class SplineKnots
+{
+  public:
+    SplineKnots():uniform_(false),x0_(0.0),inv_step_(0.0)
+    {
+    }
+
+    /// Not for rt, x has to be strictly increasing
+    void Set(const Eigen::Ref<const Eigen::VectorXd>& x)
+    {
+        assert(x.size() >= 2);
+        const int n = x.size();
+        x_ = x;
+        // Uniform knots, up to the rounding of LinSpaced()
+        const double step = (x(n-1) - x(0)) / (n-1);
+        x0_ = x(0);
+        inv_step_ = 1.0 / step;
+        uniform_ = true;
+        for(int i=1;i<n-1 && uniform_;i++)
+            uniform_ = std::abs(x(i) - (x0_ + i * step)) <= 1e-9 * step;
+    }
+
+    inline void Clear() {x_.resize(0);}
+
+    inline int GetNbPoints() const {return x_.size();}
+    inline bool IsUniform() const {return uniform_;}
+    inline const Eigen::VectorXd& Get() const {return x_;}
+    inline double operator()(const int i) const {return x_(i);}
+    inline double Front() const {return x_(0);}
+    inline double Back() const {return x_(x_.size()-1);}
+
+    /// Rt safe, index of the segment [x_i, x_i+1) containing x, x inside the knots
+    inline int FindSegment(const double x, const int cursor) const
+    {
+        const int n_segments = x_.size() - 1;
+        if(uniform_)
+            return std::max(0,std::min(static_cast<int>((x - x0_) * inv_step_),n_segments-1));
+
+        // Cached segment and its neighbors
+        if(cursor >= 0 && cursor < n_segments)
+        {
+            if(x >= x_(cursor))
+            {
+                if(cursor == n_segments-1 || x < x_(cursor+1))
+                    return cursor;
+                if(cursor+1 == n_segments-1 || x < x_(cursor+2))
+                    return cursor+1;
+            }
+            else if(cursor > 0 && x >= x_(cursor-1))
+                return cursor-1;
+        }
+
+        // Jump, binary search
+        const double* begin = x_.data();
+        const int idx = static_cast<int>(std::upper_bound(begin,begin+x_.size(),x) - begin) - 1;
+        return std::max(0,std::min(idx,n_segments-1));
+    }
+
+  private:
+    Eigen::VectorXd x_;
+    bool uniform_;
+    double x0_;
+    double inv_step_;
+};
+
+/// Not for rt, second derivatives of the natural cubic spline through (x,y), one column of y per dimension.
+/// Tridiagonal system with M_0 = M_n-1 = 0, solved with the Thomas algorithm for all the dimensions at once.
+inline void NaturalSplineSecondDerivatives(const Eigen::Ref<const Eigen::VectorXd>& x, const Eigen::Ref<const Eigen::MatrixXd>& y, Eigen::MatrixXd& m)
+{
+    const int n = x.size();
+    assert(y.rows() == n);
+    const Eigen::VectorXd h = x.tail(n-1) - x.head(n-1);
+    assert(h.minCoeff() > 0.0);
+    m.setZero(n,y.cols());
+    if(n <= 2)
+        return;
+    Eigen::VectorXd diag(n-2);
+    Eigen::MatrixXd rhs(n-2,y.cols());
+    for(int i=1;i<n-1;i++)
+    {
+        diag(i-1) = 2.0 * (h(i-1) + h(i));
+        rhs.row(i-1) = 6.0 * ((y.row(i+1) - y.row(i)) / h(i) - (y.row(i) - y.row(i-1)) / h(i-1));
+    }
+    for(int i=1;i<n-2;i++)
+    {
+        const double w = h(i) / diag(i-1);
+        diag(i) -= w * h(i);
+        rhs.row(i) -= w * rhs.row(i-1);
+    }
+    m.row(n-2) = rhs.row(n-3) / diag(n-3);
+    for(int i=n-4;i>=0;i--)
+        m.row(i+1) = (rhs.row(i) - h(i+1) * m.row(i+2)) / diag(i);
+}
+
+/// Not for rt, limits the derivatives dy so that the Hermite spline through (x,y) is monotone where the knots are
+/// (Fritsch-Carlson). Flat segments get flat ends.
+inline void LimitMonotoneSlopes(const Eigen::Ref<const Eigen::VectorXd>& x, const Eigen::Ref<const Eigen::VectorXd>& y, Eigen::Ref<Eigen::VectorXd> dy)
+{
+    for(int i=0;i<x.size()-1;i++)
+    {
+        const double slope = (y(i+1) - y(i)) / (x(i+1) - x(i));
+        if(slope == 0.0)
+        {
+            dy(i) = dy(i+1) = 0.0;
+            continue;
+        }
+        double alpha = std::max(dy(i) / slope,0.0);
+        double beta = std::max(dy(i+1) / slope,0.0);
+        const double r = alpha * alpha + beta * beta;
+        if(r > 9.0)
+        {
+            alpha *= 3.0 / std::sqrt(r);
+            beta *= 3.0 / std::sqrt(r);
+        }
+        dy(i) = alpha * slope;
+        dy(i+1) = beta * slope;
+    }
+}
+
+/// Natural cubic spline, same curve of tk::spline with the default settings (linear extrapolation
+/// outside of the knots). Value, first and second derivative come from a single segment lookup, see SplineKnots.
+/// The coefficients of a segment are contiguous, [a b c d] with y = a + b*h + c*h^2 + d*h^3.
+/// The cursor is not shared between threads: use a copy of the spline, or the overloads with
+/// an explicit cursor.
+class CubicSpline
+{
+  public:
+    typedef Eigen::Matrix<double,4,Eigen::Dynamic> coefficients_t;
+
+    CubicSpline():cursor_(0)
+    {
+    }
+
+    /// Not for rt, x has to be strictly increasing
+    void SetPoints(const Eigen::Ref<const Eigen::VectorXd>& x, const Eigen::Ref<const Eigen::VectorXd>& y)
+    {
+        assert(x.size() == y.size());
+        const int n = x.size();
+        knots_.Set(x);
+        Eigen::MatrixXd m;
+        NaturalSplineSecondDerivatives(x,y,m);
+
+        coef_.resize(4,n-1);
+        for(int i=0;i<n-1;i++)
+        {
+            const double h = x(i+1) - x(i);
+            coef_(0,i) = y(i);
+            coef_(1,i) = (y(i+1) - y(i)) / h - h * (2.0 * m(i,0) + m(i+1,0)) / 6.0;
+            coef_(2,i) = 0.5 * m(i,0);
+            coef_(3,i) = (m(i+1,0) - m(i,0)) / (6.0 * h);
+        }
+        const double h = x(n-1) - x(n-2);
+        y_end_ = y(n-1);
+        dy_end_ = (y(n-1) - y(n-2)) / h + h * (m(n-2,0) + 2.0 * m(n-1,0)) / 6.0;
+        cursor_ = 0;
+    }
+
+    /// Not for rt, cubic Hermite spline with the derivatives dy in the knots, C1 only
+    void SetPoints(const Eigen::Ref<const Eigen::VectorXd>& x, const Eigen::Ref<const Eigen::VectorXd>& y, const Eigen::Ref<const Eigen::VectorXd>& dy)
+    {
+        assert(x.size() == y.size() && x.size() == dy.size());
+        const int n = x.size();
+        knots_.Set(x);
+        coef_.resize(4,n-1);
+        for(int i=0;i<n-1;i++)
+        {
+            const double h = x(i+1) - x(i);
+            const double slope = (y(i+1) - y(i)) / h;
+            coef_(0,i) = y(i);
+            coef_(1,i) = dy(i);
+            coef_(2,i) = (3.0 * slope - 2.0 * dy(i) - dy(i+1)) / h;
+            coef_(3,i) = (dy(i) + dy(i+1) - 2.0 * slope) / (h * h);
+        }
+        y_end_ = y(n-1);
+        dy_end_ = dy(n-1);
+        cursor_ = 0;
+    }
+
+    inline void Clear()
+    {
+        knots_.Clear();
+        coef_.resize(4,0);
+        cursor_ = 0;
+    }
+
+    inline int GetNbPoints() const {return knots_.GetNbPoints();}
+    inline bool IsUniform() const {return knots_.IsUniform();}
+    inline const Eigen::VectorXd& GetKnots() const {return knots_.Get();}
+    inline const coefficients_t& GetCoefficients() const {return coef_;}
+
+    /// Rt safe, value and derivatives in x
+    inline void Evaluate(const double x, double& y, double& dy, double& ddy, int& cursor) const
+    {
+        assert(knots_.GetNbPoints() >= 2);
+        if(x < knots_.Front()) // Linear extrapolation
+        {
+            dy = coef_(1,0);
+            y = coef_(0,0) + dy * (x - knots_.Front());
+            ddy = 0.0;
+            return;
+        }
+        if(x > knots_.Back())
+        {
+            dy = dy_end_;
+            y = y_end_ + dy * (x - knots_.Back());
+            ddy = 0.0;
+            return;
+        }
+        cursor = knots_.FindSegment(x,cursor);
+        const double h = x - knots_(cursor);
+        const double* c = coef_.data() + 4 * cursor;
+        y = c[0] + h * (c[1] + h * (c[2] + h * c[3]));
+        dy = c[1] + h * (2.0 * c[2] + 3.0 * h * c[3]);
+        ddy = 2.0 * c[2] + 6.0 * h * c[3];
+    }
+
+    inline void Evaluate(const double x, double& y, double& dy, double& ddy) const
+    {
+        Evaluate(x,y,dy,ddy,cursor_);
+    }
+
+    inline double operator()(const double x) const
+    {
+        double y, dy, ddy;
+        Evaluate(x,y,dy,ddy,cursor_);
+        return y;
+    }
+
+  private:
+    SplineKnots knots_;
+    coefficients_t coef_;
+    double y_end_;
+    double dy_end_;
+    mutable int cursor_;
+};
+
+/// Natural cubic spline of a Dim dimensional curve, e.g. xyz(phase). All the dimensions share the knots,
+/// so one segment lookup gives the whole position and its derivative. The coefficients of a segment
+/// are stored together, [a(Dim) b(Dim) c(Dim) d(Dim)], instead of one array per dimension.
+template <int Dim>
+class CubicSplineN
+{
+  public:
+    typedef Eigen::Matrix<double,Dim,1> vector_t;
+    typedef Eigen::Matrix<double,4*Dim,Eigen::Dynamic> coefficients_t;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    CubicSplineN():cursor_(0)
+    {
+    }
+
+    /// Not for rt, x has to be strictly increasing, y is n x Dim
+    void SetPoints(const Eigen::Ref<const Eigen::VectorXd>& x, const Eigen::Ref<const Eigen::MatrixXd>& y)
+    {
+        assert(x.size() == y.rows());
+        assert(y.cols() == Dim);
+        const int n = x.size();
+        knots_.Set(x);
+        Eigen::MatrixXd m;
+        NaturalSplineSecondDerivatives(x,y,m);
+
+        coef_.resize(4*Dim,n-1);
+        for(int i=0;i<n-1;i++)
+        {
+            const double h = x(i+1) - x(i);
+            coef_.template block<Dim,1>(0,i) = y.row(i).transpose();
+            coef_.template block<Dim,1>(Dim,i) = ((y.row(i+1) - y.row(i)) / h - h * (2.0 * m.row(i) + m.row(i+1)) / 6.0).transpose();
+            coef_.template block<Dim,1>(2*Dim,i) = 0.5 * m.row(i).transpose();
+            coef_.template block<Dim,1>(3*Dim,i) = ((m.row(i+1) - m.row(i)) / (6.0 * h)).transpose();
+        }
+        const double h = x(n-1) - x(n-2);
+        y_end_ = y.row(n-1).transpose();
+        dy_end_ = ((y.row(n-1) - y.row(n-2)) / h + h * (m.row(n-2) + 2.0 * m.row(n-1)) / 6.0).transpose();
+        cursor_ = 0;
+    }
+
+    /// Not for rt, cubic Hermite spline with the derivatives dy (n x Dim) in the knots, C1 only
+    void SetPoints(const Eigen::Ref<const Eigen::VectorXd>& x, const Eigen::Ref<const Eigen::MatrixXd>& y, const Eigen::Ref<const Eigen::MatrixXd>& dy)
+    {
+        assert(x.size() == y.rows() && x.size() == dy.rows());
+        assert(y.cols() == Dim && dy.cols() == Dim);
+        const int n = x.size();
+        knots_.Set(x);
+        coef_.resize(4*Dim,n-1);
+        for(int i=0;i<n-1;i++)
+        {
+            const double h = x(i+1) - x(i);
+            const vector_t slope = (y.row(i+1) - y.row(i)).transpose() / h;
+            coef_.template block<Dim,1>(0,i) = y.row(i).transpose();
+            coef_.template block<Dim,1>(Dim,i) = dy.row(i).transpose();
+            coef_.template block<Dim,1>(2*Dim,i) = (3.0 * slope - 2.0 * dy.row(i).transpose() - dy.row(i+1).transpose()) / h;
+            coef_.template block<Dim,1>(3*Dim,i) = (dy.row(i).transpose() + dy.row(i+1).transpose() - 2.0 * slope) / (h * h);
+        }
+        y_end_ = y.row(n-1).transpose();
+        dy_end_ = dy.row(n-1).transpose();
+        cursor_ = 0;
+    }
+
+    inline void Clear()
+    {
+        knots_.Clear();
+        coef_.resize(4*Dim,0);
+        cursor_ = 0;
+    }
+
+    inline int GetNbPoints() const {return knots_.GetNbPoints();}
+    inline bool IsUniform() const {return knots_.IsUniform();}
+    inline const Eigen::VectorXd& GetKnots() const {return knots_.Get();}
+
+    /// Rt safe, position and its derivative (the jacobian with respect to x) in x
+    inline void Evaluate(const double x, vector_t& y, vector_t& dy, int& cursor) const
+    {
+        assert(knots_.GetNbPoints() >= 2);
+        if(x < knots_.Front()) // Linear extrapolation
+        {
+            dy = coef_.template block<Dim,1>(Dim,0);
+            y = coef_.template block<Dim,1>(0,0) + dy * (x - knots_.Front());
+            return;
+        }
+        if(x > knots_.Back())
+        {
+            dy = dy_end_;
+            y = y_end_ + dy * (x - knots_.Back());
+            return;
+        }
+        cursor = knots_.FindSegment(x,cursor);
+        const double h = x - knots_(cursor);
+        const Eigen::Map<const Eigen::Matrix<double,Dim,4> > c(coef_.data() + 4 * Dim * cursor);
+        y = c.col(0) + h * (c.col(1) + h * (c.col(2) + h * c.col(3)));
+        dy = c.col(1) + h * (2.0 * c.col(2) + 3.0 * h * c.col(3));
+    }
+
+    inline void Evaluate(const double x, vector_t& y, vector_t& dy) const
+    {
+        Evaluate(x,y,dy,cursor_);
+    }
+
+  private:
+    SplineKnots knots_;
+    coefficients_t coef_;
+    vector_t y_end_;
+    vector_t dy_end_;
+    mutable int cursor_;
+};
+
+} // namespace
+
+#endif
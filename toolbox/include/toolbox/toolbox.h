@@ -25,6 +25,8 @@
 #define TOOLBOX_H
 
 #include <toolbox/ros.h>
+#include <toolbox/config.h>
+#include <toolbox/arena.h>
 #include <toolbox/math.h>
 #include <toolbox/utilities.h>
 #include <toolbox/debug.h>
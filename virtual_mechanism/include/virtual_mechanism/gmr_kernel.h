@@ -0,0 +1,251 @@
+/**
+ * @file   gmr_kernel.h
+ * @brief  Batch GMR prediction, structure of arrays and log-sum-exp responsibilities.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GMR_KERNEL_H
+#define GMR_KERNEL_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// Toolbox
+#include <toolbox/arena.h>
+
+////////// Function Approximator
+#include <vf_gmr/FunctionApproximatorGMR.hpp>
+#include <vf_gmr/ModelParametersGMR.hpp>
+
+////////// STD
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+namespace virtual_mechanism
+{
+
+/// Floor of the variances, input and output, of the gmr
+static const double GMR_MIN_VARIANCE = 1e-12;
+
+/// GMR with a scalar input (the phase), evaluated on blocks of phases at once.
+/// The gaussians are stored as structure of arrays, the responsibilities of a block are computed
+/// as a (gaussians x phases) array with vectorized exp and normalized with the log-sum-exp trick:
+/// far from all the gaussians the densities underflow to zero, the normalized responsibilities do not.
+/// The variances are bounded by min_variance, so a degenerate gaussian can not divide by zero.
+template <int Dim>
+class GmrKernel
+{
+    public:
+      typedef Eigen::Matrix<double,Dim,1> vector_t;
+      typedef Eigen::Array<double,Eigen::Dynamic,1> array_t;
+      typedef Eigen::Matrix<double,Dim,Eigen::Dynamic> matrix_dim_t;
+      typedef Eigen::Array<double,Eigen::Dynamic,Eigen::Dynamic> block_t;
+
+      GmrKernel():n_gaussians_(0)
+      {
+      }
+
+      /// Not for rt. The dmpbbo matrix representation starts with the header, the number of gaussians is in (0,0),
+      /// then for each gaussian a row with the prior, a row with the mean [x y] and the (1+Dim)x(1+Dim) covariance.
+      /// The header is one row, or two for the models saved with an empty second row (e.g. test_gmm).
+      bool Build(const DmpBbo::FunctionApproximatorGMR* const fa, const double min_variance = GMR_MIN_VARIANCE)
+      {
+          assert(fa!=NULL);
+          const DmpBbo::ModelParametersGMR* model_parameters = static_cast<const DmpBbo::ModelParametersGMR*>(fa->getModelParameters());
+          if(model_parameters == NULL)
+              return false;
+          Eigen::MatrixXd gmm;
+          model_parameters->toMatrix(gmm);
+
+          const int n_dims = 1 + Dim;
+          if(gmm.cols() != n_dims || gmm.rows() < 2)
+              return false;
+          const int n_gaussians = static_cast<int>(gmm(0,0));
+          const int n_header_rows = gmm.rows() - n_gaussians * (2 + n_dims);
+          if(n_gaussians < 1 || n_header_rows < 1 || n_header_rows > 2)
+              return false;
+          n_gaussians_ = n_gaussians;
+
+          log_weight_.resize(n_gaussians_);
+          mean_x_.resize(n_gaussians_);
+          var_x_.resize(n_gaussians_);
+          inv_var_x_.resize(n_gaussians_);
+          slope_.resize(Dim,n_gaussians_);
+          intercept_.resize(Dim,n_gaussians_);
+          variance_.resize(Dim,n_gaussians_);
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              const int row = n_header_rows + k * (2 + n_dims);
+              const double prior = gmm(row,0);
+              const double var_x = std::max(gmm(row+2,0),min_variance);
+              mean_x_(k) = gmm(row+1,0);
+              var_x_(k) = var_x;
+              inv_var_x_(k) = 1.0/var_x;
+              log_weight_(k) = std::log(std::max(prior,std::numeric_limits<double>::min())) - 0.5 * std::log(2.0 * M_PI * var_x);
+              for(int j=0;j<Dim;j++)
+              {
+                  // Conditional of y on x: mean intercept + slope * x, variance var_y - cov_yx^2/var_x
+                  const double cov_yx = gmm(row+2+1+j,0);
+                  slope_(j,k) = cov_yx / var_x;
+                  intercept_(j,k) = gmm(row+1,1+j) - slope_(j,k) * mean_x_(k);
+                  variance_(j,k) = std::max(gmm(row+2+1+j,1+j) - slope_(j,k) * cov_yx,min_variance);
+              }
+          }
+
+          // Scratch for the single phase evaluation, so that Evaluate() does not allocate
+          h_.resize(n_gaussians_);
+          g_.resize(n_gaussians_);
+          dh_.resize(n_gaussians_);
+          return true;
+      }
+
+      inline bool IsBuilt() const {return n_gaussians_ > 0;}
+      inline int GetNbGaussians() const {return n_gaussians_;}
+
+      /// Not for rt, input is n x 1, output is n x Dim
+      void predict(const Eigen::Ref<const Eigen::MatrixXd>& input, Eigen::MatrixXd& output)
+      {
+          output.resize(input.rows(),Dim);
+          Predict(input,output,NULL,NULL);
+      }
+
+      /// Not for rt, output already sized, e.g. an arena buffer
+      void predict(const Eigen::Ref<const Eigen::MatrixXd>& input, Eigen::Ref<Eigen::MatrixXd> output)
+      {
+          assert(output.rows() == input.rows() && output.cols() == Dim);
+          Predict(input,output,NULL,NULL);
+      }
+
+      /// Not for rt, same interface of the function approximator
+      void predictDot(const Eigen::Ref<const Eigen::MatrixXd>& input, Eigen::MatrixXd& output, Eigen::MatrixXd& output_dot, Eigen::MatrixXd& variance)
+      {
+          output.resize(input.rows(),Dim);
+          output_dot.resize(input.rows(),Dim);
+          variance.resize(input.rows(),Dim);
+          Eigen::Ref<Eigen::MatrixXd> output_dot_ref(output_dot);
+          Eigen::Ref<Eigen::MatrixXd> variance_ref(variance);
+          Predict(input,output,&output_dot_ref,&variance_ref);
+      }
+
+      /// Not for rt, outputs already sized
+      void predictDot(const Eigen::Ref<const Eigen::MatrixXd>& input, Eigen::Ref<Eigen::MatrixXd> output, Eigen::Ref<Eigen::MatrixXd> output_dot, Eigen::Ref<Eigen::MatrixXd> variance)
+      {
+          assert(output.rows() == input.rows() && output.cols() == Dim);
+          assert(output_dot.rows() == input.rows() && output_dot.cols() == Dim);
+          assert(variance.rows() == input.rows() && variance.cols() == Dim);
+          Predict(input,output,&output_dot,&variance);
+      }
+
+      /// Rt safe, one phase
+      inline void Evaluate(const double phase, vector_t& pos, vector_t& pos_dot, vector_t& variance)
+      {
+          assert(IsBuilt());
+          // Log densities and their derivative on the phase
+          g_ = (mean_x_ - phase) * inv_var_x_;
+          h_ = log_weight_ - 0.5 * g_ * (mean_x_ - phase);
+          h_ = (h_ - h_.maxCoeff()).exp();
+          h_ /= h_.sum();
+          // d(h_k)/dx = h_k * (g_k - sum_j h_j g_j)
+          dh_ = h_ * (g_ - (h_ * g_).sum());
+          pos.noalias() = intercept_ * h_.matrix() + phase * (slope_ * h_.matrix());
+          pos_dot.noalias() = intercept_ * dh_.matrix() + phase * (slope_ * dh_.matrix()) + slope_ * h_.matrix();
+          variance.noalias() = variance_ * h_.matrix();
+      }
+
+    protected:
+
+      /// The scratch buffers are taken from the thread arena
+      void Predict(const Eigen::Ref<const Eigen::MatrixXd>& input, Eigen::Ref<Eigen::MatrixXd> output,
+                   Eigen::Ref<Eigen::MatrixXd>* output_dot, Eigen::Ref<Eigen::MatrixXd>* variance)
+      {
+          assert(IsBuilt());
+          assert(input.cols() == 1);
+          const int n_points = input.rows();
+          const bool compute_dot = output_dot != NULL && variance != NULL;
+
+          // Blocks of phases, so that the (gaussians x phases) arrays stay in cache
+          const int block_size = std::min(256,n_points);
+          tool_box::ArenaScope scope;
+          tool_box::Arena& arena = scope.GetArena();
+          double* h_data = arena.Allocate<double>(n_gaussians_ * block_size);
+          double* g_data = arena.Allocate<double>(n_gaussians_ * block_size);
+          double* norm_data = arena.Allocate<double>(block_size);
+          double* out_data = arena.Allocate<double>(Dim * block_size);
+          double* out_dot_data = arena.Allocate<double>(Dim * block_size);
+          for(int start=0;start<n_points;start+=block_size)
+          {
+              const int n = std::min(block_size,n_points-start);
+              const Eigen::Map<const Eigen::Array<double,1,Eigen::Dynamic> > x(input.data()+start,n);
+              Eigen::Map<block_t> h(h_data,n_gaussians_,n);
+              Eigen::Map<block_t> g(g_data,n_gaussians_,n);
+              Eigen::Map<Eigen::Array<double,1,Eigen::Dynamic> > norm(norm_data,n);
+              Eigen::Map<Eigen::Matrix<double,Dim,Eigen::Dynamic> > out(out_data,Dim,n);
+              Eigen::Map<Eigen::Matrix<double,Dim,Eigen::Dynamic> > out_dot(out_dot_data,Dim,n);
+
+              // Responsibilities, one column per phase
+              g.colwise() = mean_x_; // d(log N_k)/dx = (mu_k - x) / var_k
+              g.rowwise() -= x;
+              g.colwise() *= inv_var_x_;
+              h = ((-0.5 * g.square()).colwise() * var_x_).colwise() + log_weight_; // log(prior_k N_k)
+              norm = h.colwise().maxCoeff();
+              h = (h.rowwise() - norm).exp(); // log-sum-exp
+              norm = h.colwise().sum().inverse();
+              h.rowwise() *= norm;
+
+              // Weighted sum of the conditional means intercept + slope * x
+              out.noalias() = slope_ * h.matrix();
+              out.array().rowwise() *= x;
+              out.noalias() += intercept_ * h.matrix();
+              output.block(start,0,n,Dim) = out.transpose();
+
+              if(compute_dot)
+              {
+                  // d(h_k)/dx = h_k * (g_k - sum_j h_j g_j)
+                  norm = (h * g).colwise().sum();
+                  g = h * (g.rowwise() - norm);
+                  out_dot.noalias() = slope_ * g.matrix();
+                  out_dot.array().rowwise() *= x;
+                  out_dot.noalias() += intercept_ * g.matrix();
+                  out_dot.noalias() += slope_ * h.matrix();
+                  output_dot->block(start,0,n,Dim) = out_dot.transpose();
+                  out.noalias() = variance_ * h.matrix();
+                  variance->block(start,0,n,Dim) = out.transpose();
+              }
+          }
+      }
+
+      int n_gaussians_;
+      array_t log_weight_; // log(prior) + log of the normalization of the input gaussian
+      array_t mean_x_;
+      array_t var_x_;
+      array_t inv_var_x_;
+      matrix_dim_t slope_; // One row per output dimension
+      matrix_dim_t intercept_;
+      matrix_dim_t variance_;
+
+      array_t h_;
+      array_t g_;
+      array_t dh_;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,206 @@
+/**
+ * @file   gmr_model_selection.h
+ * @brief  Parallel multi-start GMR training and selection of the number of gaussians.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GMR_MODEL_SELECTION_H
+#define GMR_MODEL_SELECTION_H
+
+////////// Toolbox
+#include <toolbox/math.h>
+
+////////// VIRTUAL_MECHANISM
+#include <virtual_mechanism/streaming_em.h>
+
+////////// Function Approximator
+#include <vf_gmr/FunctionApproximatorGMR.hpp>
+#include <vf_gmr/ModelParametersGMR.hpp>
+#include <vf_gmr/MetaParametersGMR.hpp>
+
+////////// BOOST
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+////////// STD
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+namespace virtual_mechanism
+{
+
+/// Not for rt. Trains n_restarts models for each number of gaussians in [n_gaussians_min,n_gaussians_max],
+/// the candidates are trained concurrently by n_threads threads (0 uses all the cores):
+///  - restart 0 is the EM of the function approximator
+///  - the other restarts run EM from a random k-means++ seeding, with a repeatable seed
+/// The best candidate by BIC is selected, then the smaller models are compared to it with a likelihood
+/// ratio test (tool_box::lratiotest): the smallest one which is not significantly worse is preferred.
+template <int Dim>
+class GmrModelSelection
+{
+    public:
+      struct Candidate
+      {
+          int n_gaussians;
+          int restart;
+          bool trained;
+          double log_likelihood;
+          int n_parameters;
+          double bic;
+          Eigen::MatrixXd gmm; // dmpbbo representation
+      };
+
+      GmrModelSelection(const int n_gaussians_min, const int n_gaussians_max, const int n_restarts, const int n_threads,
+                        const int n_em_iterations = 100, const double em_tol = 1e-6)
+      {
+          assert(n_gaussians_min > 0 && n_gaussians_max >= n_gaussians_min);
+          assert(n_restarts > 0);
+          assert(n_threads >= 0);
+          n_gaussians_min_ = n_gaussians_min;
+          n_gaussians_max_ = n_gaussians_max;
+          n_restarts_ = n_restarts;
+          n_threads_ = n_threads > 0 ? n_threads : std::max(1u,boost::thread::hardware_concurrency());
+          n_em_iterations_ = n_em_iterations;
+          em_tol_ = em_tol;
+          selected_ = -1;
+      }
+
+      /// Returns the selected model, owned by the caller, or NULL if no candidate could be trained
+      DmpBbo::FunctionApproximatorGMR* Train(const Eigen::MatrixXd& phase, const Eigen::MatrixXd& pos)
+      {
+          assert(phase.cols() == 1 && pos.cols() == Dim);
+          assert(phase.rows() == pos.rows());
+          phase_ = &phase;
+          pos_ = &pos;
+          data_.resize(phase.rows(),1+Dim);
+          data_ << phase, pos;
+
+          candidates_.clear();
+          for(int n_gaussians=n_gaussians_min_;n_gaussians<=n_gaussians_max_;n_gaussians++)
+              for(int restart=0;restart<n_restarts_;restart++)
+              {
+                  Candidate candidate;
+                  candidate.n_gaussians = n_gaussians;
+                  candidate.restart = restart;
+                  candidate.trained = false;
+                  candidates_.push_back(candidate);
+              }
+
+          // Dynamic distribution of the candidates, the bigger models take longer
+          next_candidate_ = 0;
+          boost::thread_group workers;
+          const int n_workers = std::min<int>(n_threads_,candidates_.size());
+          for(int i=1;i<n_workers;i++)
+              workers.create_thread(boost::bind(&GmrModelSelection::TrainCandidates,this));
+          TrainCandidates();
+          workers.join_all();
+
+          selected_ = Select();
+          if(selected_ < 0)
+              return NULL;
+          DmpBbo::ModelParametersGMR* model_parameters_gmr = DmpBbo::ModelParametersGMR::fromMatrix(candidates_[selected_].gmm);
+          if(model_parameters_gmr == NULL)
+              return NULL;
+          return new DmpBbo::FunctionApproximatorGMR(model_parameters_gmr);
+      }
+
+      inline const std::vector<Candidate>& GetCandidates() const {return candidates_;}
+      inline int GetSelected() const {return selected_;}
+
+    protected:
+
+      void TrainCandidates()
+      {
+          int idx;
+          while((idx = next_candidate_.fetch_add(1)) < static_cast<int>(candidates_.size()))
+              TrainCandidate(candidates_[idx]);
+      }
+
+      void TrainCandidate(Candidate& candidate)
+      {
+          StreamingEm<Dim> em;
+          if(candidate.restart == 0)
+          {
+              DmpBbo::MetaParametersGMR* meta_parameters_gmr = new DmpBbo::MetaParametersGMR(1,candidate.n_gaussians);
+              DmpBbo::FunctionApproximatorGMR fa(meta_parameters_gmr);
+              fa.trainIncremental(*phase_,*pos_);
+              static_cast<const DmpBbo::ModelParametersGMR*>(fa.getModelParameters())->toMatrix(candidate.gmm);
+              if(!em.Init(candidate.gmm,0.0))
+                  return;
+          }
+          else
+          {
+              const unsigned int seed = 1000 * candidate.n_gaussians + candidate.restart;
+              if(!em.InitFromData(data_,candidate.n_gaussians,seed))
+                  return;
+              em.Refine(n_em_iterations_,em_tol_);
+              em.ToMatrix(candidate.gmm);
+          }
+
+          candidate.log_likelihood = em.LogLikelihood(data_);
+          candidate.n_parameters = em.GetNbParameters();
+          candidate.bic = -2.0 * candidate.log_likelihood + candidate.n_parameters * std::log(static_cast<double>(data_.rows()));
+          candidate.trained = std::isfinite(candidate.bic);
+      }
+
+      int Select() const
+      {
+          int best = -1;
+          for(int i=0;i<static_cast<int>(candidates_.size());i++)
+              if(candidates_[i].trained && (best < 0 || candidates_[i].bic < candidates_[best].bic))
+                  best = i;
+          if(best < 0)
+              return -1;
+
+          // Nested comparison, from the smallest model: keep it if the best is not significantly better
+          for(int n_gaussians=n_gaussians_min_;n_gaussians<candidates_[best].n_gaussians;n_gaussians++)
+          {
+              int smaller = -1;
+              for(int i=0;i<static_cast<int>(candidates_.size());i++)
+                  if(candidates_[i].trained && candidates_[i].n_gaussians == n_gaussians &&
+                     (smaller < 0 || candidates_[i].log_likelihood > candidates_[smaller].log_likelihood))
+                      smaller = i;
+              if(smaller >= 0 && tool_box::lratiotest(candidates_[best].log_likelihood,candidates_[smaller].log_likelihood,
+                                                      candidates_[best].n_parameters - candidates_[smaller].n_parameters) == 0)
+                  return smaller;
+          }
+          return best;
+      }
+
+      int n_gaussians_min_;
+      int n_gaussians_max_;
+      int n_restarts_;
+      int n_threads_;
+      int n_em_iterations_;
+      double em_tol_;
+
+      const Eigen::MatrixXd* phase_;
+      const Eigen::MatrixXd* pos_;
+      Eigen::MatrixXd data_; // [phase pos]
+
+      std::vector<Candidate> candidates_;
+      std::atomic<int> next_candidate_;
+      int selected_;
+};
+
+} // namespace
+
+#endif
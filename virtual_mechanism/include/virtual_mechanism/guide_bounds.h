@@ -0,0 +1,159 @@
+/**
+ * @file   guide_bounds.h
+ * @brief  Bounding volumes of the sampled guides, used to reject the guides far from a query.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GUIDE_BOUNDS_H
+#define GUIDE_BOUNDS_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/StdVector>
+
+////////// STD
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace virtual_mechanism
+{
+
+/// Axis aligned box and chain of capsules around dense samples of a guide, uniform in its phase.
+/// Each capsule covers a run of consecutive samples: its axis goes from the first to the last one, its radius
+/// contains the samples of the run plus half the longest segment of the run, the margin left for the guide
+/// between two samples. The samples must be dense with respect to the curvature of the guide, SAMPLES_PER_CAPSULE
+/// per capsule: the coarse recorded references of a guide (n_points_discretization) are not enough to contain it.
+/// The build is not rt safe, the queries do not allocate.
+template <int Dim>
+class GuideBounds
+{
+    public:
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+      typedef Eigen::Matrix<double,Dim,1> vector_t;
+
+      static const int SAMPLES_PER_CAPSULE = 32;
+
+      GuideBounds()
+      {
+          min_.setZero();
+          max_.setZero();
+      }
+
+      /// Each row of points is a point, not for rt
+      void Build(const Eigen::MatrixXd& points, const int n_capsules)
+      {
+          assert(points.cols() == Dim);
+          assert(points.rows() > 1);
+          assert(n_capsules > 0);
+          const int n_segments = points.rows() - 1;
+          const int n = std::min(n_capsules,n_segments);
+
+          min_ = points.colwise().minCoeff().transpose();
+          max_ = points.colwise().maxCoeff().transpose();
+
+          capsules_.resize(n);
+          for(int c=0;c<n;c++)
+          {
+              // Runs of segments as even as possible, consecutive runs share their end point
+              const int first = (c * n_segments) / n;
+              const int last = ((c + 1) * n_segments) / n;
+              Capsule& capsule = capsules_[c];
+              capsule.a = points.row(first).transpose();
+              capsule.b = points.row(last).transpose();
+              double radius = 0.0, max_segment = 0.0;
+              for(int i=first;i<=last;i++)
+              {
+                  const vector_t p = points.row(i).transpose();
+                  radius = std::max(radius,std::sqrt(SegmentDistance2(capsule.a,capsule.b,p)));
+                  if(i < last)
+                      max_segment = std::max(max_segment,(points.row(i+1) - points.row(i)).norm());
+              }
+              capsule.radius = radius + 0.5 * max_segment;
+              min_ = min_.cwiseMin(capsule.a.cwiseMin(capsule.b) - vector_t::Constant(capsule.radius));
+              max_ = max_.cwiseMax(capsule.a.cwiseMax(capsule.b) + vector_t::Constant(capsule.radius));
+          }
+      }
+
+      /// True if the box intersects the bounding box, grown by margin
+      inline bool Overlaps(const vector_t& box_min, const vector_t& box_max, const double margin = 0.0) const
+      {
+          return !((box_max.array() < min_.array() - margin).any() || (box_min.array() > max_.array() + margin).any());
+      }
+
+      /// Lower bound of the distance between pos and the guide, 0 inside a capsule
+      double DistanceLowerBound(const vector_t& pos) const
+      {
+          double min_dist = std::numeric_limits<double>::infinity();
+          for(size_t c=0;c<capsules_.size();c++)
+          {
+              const double dist = std::sqrt(SegmentDistance2(capsules_[c].a,capsules_[c].b,pos)) - capsules_[c].radius;
+              if(dist <= 0.0)
+                  return 0.0;
+              min_dist = std::min(min_dist,dist);
+          }
+          return min_dist;
+      }
+
+      /// True if pos is within margin of a capsule, stops at the first one
+      inline bool IsNear(const vector_t& pos, const double margin) const
+      {
+          for(size_t c=0;c<capsules_.size();c++)
+          {
+              const double reach = capsules_[c].radius + margin;
+              if(SegmentDistance2(capsules_[c].a,capsules_[c].b,pos) <= reach * reach)
+                  return true;
+          }
+          return false;
+      }
+
+      inline const vector_t& GetMin() const {return min_;}
+      inline const vector_t& GetMax() const {return max_;}
+      inline int GetNbCapsules() const {return capsules_.size();}
+
+    protected:
+
+      struct Capsule
+      {
+          EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+          vector_t a;
+          vector_t b;
+          double radius;
+      };
+
+      static inline double SegmentDistance2(const vector_t& a, const vector_t& b, const vector_t& p)
+      {
+          const vector_t ab = b - a;
+          const double length2 = ab.squaredNorm();
+          double t = length2 > 0.0 ? ab.dot(p - a) / length2 : 0.0;
+          t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+          return (a + t * ab - p).squaredNorm();
+      }
+
+      vector_t min_;
+      vector_t max_;
+      std::vector<Capsule,Eigen::aligned_allocator<Capsule> > capsules_;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,129 @@
+/**
+ * @file   guide_file.h
+ * @brief  Versioned little endian binary format of the guides, loaded with mmap.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GUIDE_FILE_H
+#define GUIDE_FILE_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+
+////////// STD
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace virtual_mechanism
+{
+
+/// Layout (all the integers and doubles are little endian, all the offsets are multiple of 8):
+///   GuideFileHeader
+///   GuideFileSection x n_sections
+///   payloads, each one is a row major matrix of doubles
+/// A reader must refuse a file with a different major version, and ignore the sections it does not know.
+static const char GUIDE_FILE_MAGIC[8] = {'V','F','G','U','I','D','E','\0'};
+static const uint32_t GUIDE_FILE_VERSION = 1;
+static const char GUIDE_FILE_EXTENSION[] = ".vfg";
+
+enum guide_section_t {GMM = 1,          // Gmm, dmpbbo matrix representation
+                      BAKED_TABLE = 2,  // Phase table nodes, [pos pos_dot pos_ddot variance variance_dot] per row
+                      RECORDED_REFS = 3,// Discretization of the guide, [phase state] per row
+                      SPLINE_KNOTS = 4};// Normalization knots, also the model of the spline guides, [abscisse phase dabscisse/dphase (xyz) (dxyz/dphase)] per row
+
+struct GuideFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size; // sizeof(GuideFileHeader), to skip fields added by future minor versions
+    uint32_t state_dim;
+    uint32_t model_type;  // model_type_t
+    uint32_t n_sections;
+    uint32_t reserved;
+    char name[64];        // Metadata, null terminated
+};
+
+struct GuideFileSection
+{
+    uint32_t id;          // guide_section_t
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t reserved;
+    uint64_t offset;      // From the beginning of the file
+};
+
+typedef Eigen::Matrix<double,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor> row_matrix_t;
+typedef Eigen::Map<const row_matrix_t> section_map_t;
+
+/// Read only view of a guide file, the sections point directly into the mapped file (zero copy).
+/// The views are valid as long as the GuideFile is alive. Not for rt.
+class GuideFile
+{
+    public:
+      GuideFile();
+      ~GuideFile();
+
+      /// Returns false if the file can not be mapped or it is not a valid guide file
+      bool Open(const std::string& file_path);
+      void Close();
+
+      /// Cheap check on the magic, does not map the file
+      static bool IsGuideFile(const std::string& file_path);
+      static bool HasGuideFileExtension(const std::string& file_path);
+
+      bool HasSection(const guide_section_t id) const;
+      /// Returns an empty view if the section does not exist
+      section_map_t GetSection(const guide_section_t id) const;
+
+      inline const GuideFileHeader& GetHeader() const {return *header_;}
+      inline std::string GetName() const {return std::string(header_->name);}
+
+    private:
+      GuideFile(const GuideFile&);
+      GuideFile& operator=(const GuideFile&);
+
+      const GuideFileSection* FindSection(const guide_section_t id) const;
+
+      const char* data_;
+      size_t size_;
+      const GuideFileHeader* header_;
+      const GuideFileSection* sections_;
+};
+
+/// Collects the sections and writes them in one go. Not for rt.
+class GuideFileWriter
+{
+    public:
+      GuideFileWriter(const int state_dim, const int model_type, const std::string& name);
+
+      inline void SetModelType(const int model_type) {header_.model_type = model_type;}
+      void AddSection(const guide_section_t id, const Eigen::MatrixXd& data);
+      bool Save(const std::string& file_path) const;
+
+    private:
+      GuideFileHeader header_;
+      std::vector<GuideFileSection> sections_;
+      std::vector<row_matrix_t> payloads_;
+};
+
+} // namespace
+
+#endif
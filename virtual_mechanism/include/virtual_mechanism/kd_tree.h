@@ -0,0 +1,155 @@
+/**
+ * @file   kd_tree.h
+ * @brief  Static k-d tree used to search the nearest point of the discretized guides.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KD_TREE_H
+#define KD_TREE_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/StdVector>
+
+////////// STD
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace virtual_mechanism
+{
+
+/// Implicit balanced k-d tree: the node of the range [lo,hi) is the median (lo+hi)/2 of the
+/// permutation. The build is not rt safe, the query does not allocate (fixed size stack).
+template <int Dim>
+class KdTree
+{
+    public:
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+      typedef Eigen::Matrix<double,Dim,1> vector_t;
+
+      /// Each row of points is a point, not for rt
+      void Build(const Eigen::MatrixXd& points)
+      {
+          assert(points.cols() == Dim);
+          assert(points.rows() > 0);
+          const int n = points.rows();
+          points_.resize(n);
+          perm_.resize(n);
+          axis_.resize(n);
+          for(int i=0;i<n;i++)
+          {
+              points_[i] = points.row(i).transpose();
+              perm_[i] = i;
+          }
+          Build(0,n);
+      }
+
+      /// Returns the index of the nearest point and its squared distance
+      int FindNearest(const vector_t& query, double& min_dist2) const
+      {
+          assert(points_.size() > 0);
+
+          struct Range {int lo; int hi; double bound;};
+          Range stack[max_depth_];
+          int top = 0;
+          int min_idx = 0;
+          min_dist2 = std::numeric_limits<double>::infinity();
+
+          stack[top].lo = 0;
+          stack[top].hi = points_.size();
+          stack[top].bound = 0.0;
+          top++;
+          while(top > 0)
+          {
+              const Range r = stack[--top];
+              if(r.hi <= r.lo || r.bound >= min_dist2)
+                  continue;
+
+              const int mid = (r.lo + r.hi) / 2;
+              const int idx = perm_[mid];
+              const double d2 = (points_[idx] - query).squaredNorm();
+              if(d2 < min_dist2)
+              {
+                  min_dist2 = d2;
+                  min_idx = idx;
+              }
+
+              const int axis = axis_[mid];
+              const double diff = query(axis) - points_[idx](axis);
+              const double far_bound = std::max(r.bound,diff * diff);
+              // Push the far side first, so the near one is visited first
+              assert(top + 2 <= max_depth_);
+              if(diff < 0.0)
+              {
+                  stack[top].lo = mid + 1; stack[top].hi = r.hi; stack[top].bound = far_bound; top++;
+                  stack[top].lo = r.lo; stack[top].hi = mid; stack[top].bound = r.bound; top++;
+              }
+              else
+              {
+                  stack[top].lo = r.lo; stack[top].hi = mid; stack[top].bound = far_bound; top++;
+                  stack[top].lo = mid + 1; stack[top].hi = r.hi; stack[top].bound = r.bound; top++;
+              }
+          }
+          return min_idx;
+      }
+
+      inline const vector_t& GetPoint(const int idx) const {return points_[idx];}
+      inline int GetNbPoints() const {return points_.size();}
+
+    protected:
+
+      void Build(const int lo, const int hi)
+      {
+          if(hi - lo < 1)
+              return;
+          const int mid = (lo + hi) / 2;
+
+          // Split on the axis with the largest spread
+          vector_t min = points_[perm_[lo]];
+          vector_t max = min;
+          for(int i=lo+1;i<hi;i++)
+          {
+              min = min.cwiseMin(points_[perm_[i]]);
+              max = max.cwiseMax(points_[perm_[i]]);
+          }
+          int axis;
+          (max - min).maxCoeff(&axis);
+
+          const std::vector<vector_t,Eigen::aligned_allocator<vector_t> >& points = points_;
+          std::nth_element(perm_.begin()+lo,perm_.begin()+mid,perm_.begin()+hi,
+                           [&points,axis](const int a, const int b){return points[a](axis) < points[b](axis);});
+          axis_[mid] = axis;
+
+          Build(lo,mid);
+          Build(mid+1,hi);
+      }
+
+      static const int max_depth_ = 128; // Enough for any balanced tree
+
+      std::vector<vector_t,Eigen::aligned_allocator<vector_t> > points_;
+      std::vector<int> perm_;
+      std::vector<int> axis_;
+};
+
+} // namespace
+
+#endif
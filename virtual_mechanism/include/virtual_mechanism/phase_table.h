@@ -0,0 +1,242 @@
+/**
+ * @file   phase_table.h
+ * @brief  Lookup table of a GMR model sampled on the phase, evaluated with cubic Hermite interpolation.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PHASE_TABLE_H
+#define PHASE_TABLE_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/StdVector>
+
+////////// Function Approximator
+#include <vf_gmr/FunctionApproximatorGMR.hpp>
+
+////////// STD
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+namespace virtual_mechanism
+{
+
+/// The GMR output (position, derivative and variance) is sampled on a uniform phase grid in [0,1].
+/// Position uses the exact derivative as Hermite tangent, derivative and variance use finite differences.
+/// The grid is doubled until the errors at the middle of each interval are below their bounds: max_err for the
+/// position, max_err_dot for the derivative (the jacobian of the guide) and max_err_variance for the variance.
+template <int Dim>
+class PhaseTable
+{
+    public:
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+      typedef Eigen::Matrix<double,Dim,1> vector_t;
+      typedef std::vector<vector_t,Eigen::aligned_allocator<vector_t> > samples_t;
+
+      PhaseTable():n_points_(0),step_(1.0),max_err_(0.0),max_err_dot_(0.0),max_err_variance_(0.0)
+      {
+      }
+
+      /// Not for rt, Model is the function approximator or any type with the same predictDot()
+      template <typename Model>
+      bool Bake(Model* const fa, const double max_err, const double max_err_dot, const double max_err_variance,
+                const int min_points, const int max_points)
+      {
+          assert(fa!=NULL);
+          assert(min_points >= 2 && max_points >= min_points);
+
+          int n_points = min_points;
+          bool converged = false;
+          while(!converged)
+          {
+              Sample(fa,n_points);
+              ComputeMaxErrors(fa);
+              converged = max_err_ <= max_err && max_err_dot_ <= max_err_dot && max_err_variance_ <= max_err_variance;
+              if(!converged && 2 * (n_points - 1) + 1 > max_points)
+                  break;
+              if(!converged)
+                  n_points = 2 * (n_points - 1) + 1; // Keep the previous nodes
+          }
+          return converged;
+      }
+
+      /// Rt safe, O(1)
+      inline void Evaluate(const double phase, vector_t& pos, vector_t& pos_dot, vector_t& variance) const
+      {
+          assert(n_points_ >= 2);
+          int i;
+          double t;
+          Locate(phase,i,t);
+
+          const double t2 = t * t;
+          const double t3 = t2 * t;
+          const double h00 = 2.0 * t3 - 3.0 * t2 + 1.0;
+          const double h10 = t3 - 2.0 * t2 + t;
+          const double h01 = -2.0 * t3 + 3.0 * t2;
+          const double h11 = t3 - t2;
+
+          // Position: Hermite on the exact tangents
+          pos = h00 * pos_[i] + h10 * step_ * pos_dot_[i] + h01 * pos_[i+1] + h11 * step_ * pos_dot_[i+1];
+          // Derivative: Hermite on the finite difference tangents, pos_dot_ are the node values
+          pos_dot = h00 * pos_dot_[i] + h10 * step_ * pos_ddot_[i] + h01 * pos_dot_[i+1] + h11 * step_ * pos_ddot_[i+1];
+          variance = h00 * variance_[i] + h10 * step_ * variance_dot_[i] + h01 * variance_[i+1] + h11 * step_ * variance_dot_[i+1];
+      }
+
+      /// Not for rt, one node per row: [phase pos pos_dot pos_ddot variance variance_dot]
+      void Export(Eigen::MatrixXd& nodes) const
+      {
+          nodes.resize(n_points_,1+5*Dim);
+          for(int i=0;i<n_points_;i++)
+          {
+              nodes(i,0) = i * step_;
+              nodes.block(i,1,1,Dim) = pos_[i].transpose();
+              nodes.block(i,1+Dim,1,Dim) = pos_dot_[i].transpose();
+              nodes.block(i,1+2*Dim,1,Dim) = pos_ddot_[i].transpose();
+              nodes.block(i,1+3*Dim,1,Dim) = variance_[i].transpose();
+              nodes.block(i,1+4*Dim,1,Dim) = variance_dot_[i].transpose();
+          }
+      }
+
+      /// Not for rt, inverse of Export(), returns false if the nodes are not a uniform grid on [0,1]
+      template <typename Derived>
+      bool Import(const Eigen::MatrixBase<Derived>& nodes)
+      {
+          const int n_points = nodes.rows();
+          if(n_points < 2 || nodes.cols() != 1+5*Dim)
+              return false;
+          const double step = 1.0/(n_points - 1);
+          for(int i=0;i<n_points;i++)
+              if(std::abs(nodes(i,0) - i * step) > 1e-12)
+                  return false;
+
+          n_points_ = n_points;
+          step_ = step;
+          max_err_ = max_err_dot_ = max_err_variance_ = 0.0; // Not measured, the table was baked offline
+          pos_.resize(n_points_);
+          pos_dot_.resize(n_points_);
+          pos_ddot_.resize(n_points_);
+          variance_.resize(n_points_);
+          variance_dot_.resize(n_points_);
+          for(int i=0;i<n_points_;i++)
+          {
+              pos_[i] = nodes.block(i,1,1,Dim).transpose();
+              pos_dot_[i] = nodes.block(i,1+Dim,1,Dim).transpose();
+              pos_ddot_[i] = nodes.block(i,1+2*Dim,1,Dim).transpose();
+              variance_[i] = nodes.block(i,1+3*Dim,1,Dim).transpose();
+              variance_dot_[i] = nodes.block(i,1+4*Dim,1,Dim).transpose();
+          }
+          return true;
+      }
+
+      inline bool IsBaked() const {return n_points_ >= 2;}
+      inline int GetNbPoints() const {return n_points_;}
+      inline double GetMaxError() const {return max_err_;}
+      inline double GetMaxErrorDot() const {return max_err_dot_;}
+      inline double GetMaxErrorVariance() const {return max_err_variance_;}
+
+    protected:
+
+      inline void Locate(const double phase, int& i, double& t) const
+      {
+          double p = phase < 0.0 ? 0.0 : (phase > 1.0 ? 1.0 : phase);
+          double s = p / step_;
+          i = static_cast<int>(s);
+          if(i > n_points_ - 2)
+              i = n_points_ - 2;
+          t = s - i;
+      }
+
+      template <typename Model>
+      void Sample(Model* const fa, const int n_points)
+      {
+          n_points_ = n_points;
+          step_ = 1.0/(n_points_ - 1);
+
+          Eigen::MatrixXd input(n_points_,1);
+          Eigen::MatrixXd output(n_points_,Dim);
+          Eigen::MatrixXd output_dot(n_points_,Dim);
+          Eigen::MatrixXd variance(n_points_,Dim);
+          input.col(0) = Eigen::VectorXd::LinSpaced(n_points_,0.0,1.0);
+          fa->predictDot(input,output,output_dot,variance);
+
+          pos_.resize(n_points_);
+          pos_dot_.resize(n_points_);
+          pos_ddot_.resize(n_points_);
+          variance_.resize(n_points_);
+          variance_dot_.resize(n_points_);
+          for(int i=0;i<n_points_;i++)
+          {
+              pos_[i] = output.row(i).transpose();
+              pos_dot_[i] = output_dot.row(i).transpose();
+              variance_[i] = variance.row(i).transpose();
+          }
+          FiniteDifferences(pos_dot_,pos_ddot_);
+          FiniteDifferences(variance_,variance_dot_);
+      }
+
+      void FiniteDifferences(const samples_t& in, samples_t& out) const
+      {
+          out[0] = (in[1] - in[0]) / step_;
+          out[n_points_-1] = (in[n_points_-1] - in[n_points_-2]) / step_;
+          for(int i=1;i<n_points_-1;i++)
+              out[i] = (in[i+1] - in[i-1]) / (2.0 * step_);
+      }
+
+      /// Max errors at the middle of the intervals, where the interpolation is worst
+      template <typename Model>
+      void ComputeMaxErrors(Model* const fa)
+      {
+          const int n_mid = n_points_ - 1;
+          Eigen::MatrixXd input(n_mid,1);
+          Eigen::MatrixXd output(n_mid,Dim);
+          Eigen::MatrixXd output_dot(n_mid,Dim);
+          Eigen::MatrixXd output_variance(n_mid,Dim);
+          for(int i=0;i<n_mid;i++)
+              input(i,0) = (i + 0.5) * step_;
+          fa->predictDot(input,output,output_dot,output_variance);
+
+          max_err_ = max_err_dot_ = max_err_variance_ = 0.0;
+          vector_t pos, pos_dot, variance;
+          for(int i=0;i<n_mid;i++)
+          {
+              Evaluate(input(i,0),pos,pos_dot,variance);
+              max_err_ = std::max(max_err_,(pos - output.row(i).transpose()).cwiseAbs().maxCoeff());
+              max_err_dot_ = std::max(max_err_dot_,(pos_dot - output_dot.row(i).transpose()).cwiseAbs().maxCoeff());
+              max_err_variance_ = std::max(max_err_variance_,(variance - output_variance.row(i).transpose()).cwiseAbs().maxCoeff());
+          }
+      }
+
+      int n_points_;
+      double step_;
+      double max_err_;
+      double max_err_dot_;
+      double max_err_variance_;
+      samples_t pos_;
+      samples_t pos_dot_;
+      samples_t pos_ddot_;
+      samples_t variance_;
+      samples_t variance_dot_;
+};
+
+} // namespace
+
+#endif
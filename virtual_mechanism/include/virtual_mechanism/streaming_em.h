@@ -0,0 +1,347 @@
+/**
+ * @file   streaming_em.h
+ * @brief  Streaming EM on the sufficient statistics of a GMM.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMING_EM_H
+#define STREAMING_EM_H
+
+////////// Eigen
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/Cholesky>
+#include <eigen3/Eigen/StdVector>
+
+////////// STD
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <random>
+
+namespace virtual_mechanism
+{
+
+/// GMM on the joint space [phase pos], refined online from chunks of a demonstration.
+///  - The current model is the prior: its statistics count as prior_weight points.
+///  - AddChunk(): E-step on the chunk only, its statistics are added to the ones of the previous chunks
+///    and the parameters are updated (incremental EM). The cost depends on the chunk, not on the demonstration.
+///  - Refine(): full EM iterations on all the streamed points, to be called once at the end of the demonstration.
+/// InitFromData() starts instead from a random k-means++ seeding of a whole demonstration, without prior.
+/// The matrices use the dmpbbo representation, see GmrKernel.
+template <int Dim>
+class StreamingEm
+{
+    public:
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+      static const int n_dims = 1 + Dim;
+      typedef Eigen::Matrix<double,n_dims,1> point_t;
+      typedef Eigen::Matrix<double,n_dims,n_dims> cov_t;
+      typedef std::vector<point_t,Eigen::aligned_allocator<point_t> > points_t;
+      typedef std::vector<cov_t,Eigen::aligned_allocator<cov_t> > covs_t;
+      typedef std::vector<Eigen::LLT<cov_t>,Eigen::aligned_allocator<Eigen::LLT<cov_t> > > llts_t;
+
+      StreamingEm():n_gaussians_(0),n_header_rows_(2),min_variance_(1e-12),log_likelihood_(0.0)
+      {
+      }
+
+      /// Not for rt, returns false if gmm is not a valid model with input dimension 1
+      bool Init(const Eigen::MatrixXd& gmm, const double prior_weight, const double min_variance = 1e-12)
+      {
+          if(gmm.cols() != n_dims || gmm.rows() < 2)
+              return false;
+          const int n_gaussians = static_cast<int>(gmm(0,0));
+          const int n_header_rows = gmm.rows() - n_gaussians * (2 + n_dims); // See GmrKernel::Build()
+          if(n_gaussians < 1 || n_header_rows < 1 || n_header_rows > 2)
+              return false;
+
+          n_gaussians_ = n_gaussians;
+          n_header_rows_ = n_header_rows;
+          min_variance_ = min_variance;
+          priors_.resize(n_gaussians_);
+          means_.resize(n_gaussians_);
+          covs_.resize(n_gaussians_);
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              const int row = n_header_rows_ + k * (2 + n_dims);
+              priors_(k) = gmm(row,0);
+              means_[k] = gmm.row(row+1).transpose();
+              covs_[k] = gmm.block(row+2,0,n_dims,n_dims);
+          }
+          priors_ /= priors_.sum();
+
+          // Prior statistics, as if the current model was fitted on prior_weight points
+          prior_s0_ = prior_weight * priors_;
+          prior_s1_.resize(n_gaussians_);
+          prior_s2_.resize(n_gaussians_);
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              prior_s1_[k] = prior_s0_(k) * means_[k];
+              prior_s2_[k] = prior_s0_(k) * (covs_[k] + means_[k] * means_[k].transpose());
+          }
+
+          points_.clear();
+          ClearStatistics();
+          Factorize();
+          log_likelihood_ = 0.0;
+          return true;
+      }
+
+      /// Not for rt, one point per row [phase pos], seed makes the initialization repeatable
+      bool InitFromData(const Eigen::MatrixXd& data, const int n_gaussians, const unsigned int seed, const double min_variance = 1e-12)
+      {
+          assert(data.cols() == n_dims);
+          const int n_points = data.rows();
+          if(n_gaussians < 1 || n_points < n_gaussians)
+              return false;
+
+          n_gaussians_ = n_gaussians;
+          min_variance_ = min_variance;
+          points_.resize(n_points);
+          for(int i=0;i<n_points;i++)
+              points_[i] = data.row(i).transpose();
+
+          // k-means++ seeding: each center is drawn with probability proportional to the squared distance
+          // from the closest center already drawn
+          std::mt19937 generator(seed);
+          std::vector<int> labels(n_points,0);
+          Eigen::VectorXd dist2 = Eigen::VectorXd::Constant(n_points,std::numeric_limits<double>::infinity());
+          means_.assign(n_gaussians_,points_[std::uniform_int_distribution<int>(0,n_points-1)(generator)]);
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              if(k > 0 && dist2.sum() > 0.0)
+              {
+                  std::discrete_distribution<int> draw(dist2.data(),dist2.data()+n_points);
+                  means_[k] = points_[draw(generator)];
+              }
+              else if(k > 0) // All the points are centers already
+                  means_[k] = points_[std::uniform_int_distribution<int>(0,n_points-1)(generator)];
+              for(int i=0;i<n_points;i++)
+              {
+                  const double d2 = (points_[i] - means_[k]).squaredNorm();
+                  if(d2 < dist2(i))
+                  {
+                      dist2(i) = d2;
+                      labels[i] = k;
+                  }
+              }
+          }
+
+          // Hard assignment to the closest center, the clusters too small take the global covariance
+          point_t mean = point_t::Zero();
+          for(int i=0;i<n_points;i++)
+              mean += points_[i];
+          mean /= n_points;
+          cov_t global_cov = cov_t::Zero();
+          for(int i=0;i<n_points;i++)
+              global_cov += (points_[i] - mean) * (points_[i] - mean).transpose();
+          global_cov /= n_points;
+
+          ClearStatistics();
+          for(int i=0;i<n_points;i++)
+          {
+              s0_(labels[i]) += 1.0;
+              s1_[labels[i]] += points_[i];
+              s2_[labels[i]] += points_[i] * points_[i].transpose();
+          }
+          priors_.resize(n_gaussians_);
+          covs_.resize(n_gaussians_);
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              priors_(k) = std::max(s0_(k),1.0) / n_points;
+              if(s0_(k) > n_dims)
+              {
+                  means_[k] = s1_[k] / s0_(k);
+                  covs_[k] = s2_[k] / s0_(k) - means_[k] * means_[k].transpose();
+              }
+              else
+                  covs_[k] = global_cov / n_gaussians_;
+              covs_[k].diagonal().array() += min_variance_;
+          }
+          priors_ /= priors_.sum();
+
+          prior_s0_.setZero(n_gaussians_);
+          prior_s1_.assign(n_gaussians_,point_t::Zero());
+          prior_s2_.assign(n_gaussians_,cov_t::Zero());
+          ClearStatistics();
+          Factorize();
+          log_likelihood_ = -std::numeric_limits<double>::infinity();
+          return true;
+      }
+
+      /// Not for rt, one point per row [phase pos]
+      void AddChunk(const Eigen::MatrixXd& data)
+      {
+          assert(IsInitialized());
+          assert(data.cols() == n_dims);
+          const size_t first = points_.size();
+          for(int i=0;i<data.rows();i++)
+              points_.push_back(data.row(i).transpose());
+          log_likelihood_ = EStep(first,points_.size());
+          MStep();
+      }
+
+      /// Not for rt, up to n_iter EM iterations on all the streamed points, they stop earlier if the
+      /// mean log-likelihood improves less than tol
+      void Refine(const int n_iter, const double tol = 0.0)
+      {
+          assert(IsInitialized());
+          for(int i=0;i<n_iter && !points_.empty();i++)
+          {
+              const double prev_log_likelihood = log_likelihood_;
+              ClearStatistics();
+              log_likelihood_ = EStep(0,points_.size());
+              MStep();
+              if(i > 0 && log_likelihood_ - prev_log_likelihood < tol)
+                  break;
+          }
+      }
+
+      /// Not for rt, total log-likelihood of the points (one per row [phase pos]) under the current parameters
+      double LogLikelihood(const Eigen::MatrixXd& data) const
+      {
+          assert(IsInitialized());
+          assert(data.cols() == n_dims);
+          Eigen::VectorXd log_resp(n_gaussians_);
+          double log_likelihood = 0.0;
+          for(int i=0;i<data.rows();i++)
+              log_likelihood += LogDensities(data.row(i).transpose(),log_resp);
+          return log_likelihood;
+      }
+
+      /// Free parameters: priors (they sum to one), means and symmetric covariances
+      inline int GetNbParameters() const {return n_gaussians_ * (1 + n_dims + n_dims * (n_dims + 1) / 2) - 1;}
+
+      /// Not for rt
+      void ToMatrix(Eigen::MatrixXd& gmm) const
+      {
+          assert(IsInitialized());
+          gmm.setZero(n_header_rows_ + n_gaussians_ * (2 + n_dims),n_dims);
+          gmm(0,0) = n_gaussians_;
+          gmm(0,1) = Dim;
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              const int row = n_header_rows_ + k * (2 + n_dims);
+              gmm(row,0) = priors_(k);
+              gmm.row(row+1) = means_[k].transpose();
+              gmm.block(row+2,0,n_dims,n_dims) = covs_[k];
+          }
+      }
+
+      inline bool IsInitialized() const {return n_gaussians_ > 0;}
+      inline int GetNbGaussians() const {return n_gaussians_;}
+      inline int GetNbPoints() const {return points_.size();}
+      /// Mean log-likelihood of the points used by the last E-step, before its M-step
+      inline double GetLogLikelihood() const {return log_likelihood_;}
+
+    protected:
+
+      void ClearStatistics()
+      {
+          s0_.setZero(n_gaussians_);
+          s1_.assign(n_gaussians_,point_t::Zero());
+          s2_.assign(n_gaussians_,cov_t::Zero());
+      }
+
+      void Factorize()
+      {
+          llts_.resize(n_gaussians_);
+          log_norm_.resize(n_gaussians_);
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              llts_[k].compute(covs_[k]);
+              const cov_t L = llts_[k].matrixL();
+              log_norm_(k) = std::log(std::max(priors_(k),std::numeric_limits<double>::min()))
+                           - L.diagonal().array().log().sum() - 0.5 * n_dims * std::log(2.0 * M_PI);
+          }
+      }
+
+      /// Log of prior_k * N_k(x) in log_joint, returns the log of their sum
+      double LogDensities(const point_t& x, Eigen::VectorXd& log_joint) const
+      {
+          for(int k=0;k<n_gaussians_;k++)
+              log_joint(k) = log_norm_(k) - 0.5 * llts_[k].matrixL().solve(x - means_[k]).squaredNorm();
+          // Log-sum-exp, no underflow far from the gaussians
+          const double max_log = log_joint.maxCoeff();
+          return max_log + std::log((log_joint.array() - max_log).exp().sum());
+      }
+
+      /// Accumulates the statistics of the points [first,last), returns their mean log-likelihood
+      double EStep(const size_t first, const size_t last)
+      {
+          Eigen::VectorXd log_resp(n_gaussians_);
+          double log_likelihood = 0.0;
+          for(size_t i=first;i<last;i++)
+          {
+              const point_t& x = points_[i];
+              const double log_sum = LogDensities(x,log_resp);
+              log_likelihood += log_sum;
+              for(int k=0;k<n_gaussians_;k++)
+              {
+                  const double r = std::exp(log_resp(k) - log_sum);
+                  s0_(k) += r;
+                  s1_[k] += r * x;
+                  s2_[k] += r * x * x.transpose();
+              }
+          }
+          return last > first ? log_likelihood / (last - first) : 0.0;
+      }
+
+      void MStep()
+      {
+          const Eigen::VectorXd s0 = prior_s0_ + s0_;
+          for(int k=0;k<n_gaussians_;k++)
+          {
+              if(s0(k) <= std::numeric_limits<double>::epsilon()) // Dead gaussian, keep it as it is
+                  continue;
+              means_[k] = (prior_s1_[k] + s1_[k]) / s0(k);
+              covs_[k] = (prior_s2_[k] + s2_[k]) / s0(k) - means_[k] * means_[k].transpose();
+              covs_[k].diagonal().array() += min_variance_;
+          }
+          priors_ = s0 / s0.sum();
+          Factorize();
+      }
+
+      int n_gaussians_;
+      int n_header_rows_; // Same layout of the model used by Init()
+      double min_variance_;
+      double log_likelihood_;
+
+      /// Parameters
+      Eigen::VectorXd priors_;
+      points_t means_;
+      covs_t covs_;
+      llts_t llts_;
+      Eigen::VectorXd log_norm_; // log(prior) - 0.5 * log(det(2 pi cov))
+
+      /// Sufficient statistics: sum of the responsibilities, of r*x and of r*x*x'
+      Eigen::VectorXd prior_s0_;
+      points_t prior_s1_;
+      covs_t prior_s2_;
+      Eigen::VectorXd s0_;
+      points_t s1_;
+      covs_t s2_;
+
+      points_t points_; // Streamed points, used by Refine()
+};
+
+} // namespace
+
+#endif
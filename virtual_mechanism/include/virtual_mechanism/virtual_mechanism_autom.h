@@ -27,22 +27,92 @@
 ////////// Toolbox
 #include <toolbox/toolbox.h>
 
+////////// BOOST
+#include <boost/thread.hpp>
+
+////////// STD
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
 namespace virtual_mechanism
 {
 
+struct AutomEvent
+{
+    const void* autom; // Identifies the automaton, only printed
+    int from;
+    int to;
+    double phase_dot;
+    double phase_dot_ref;
+};
+
+/// Transitions of all the automata of the process. The update threads push them without locks nor allocations,
+/// a background thread drains and prints them every autom/event_log_period ms. A full log drops the new events.
+class AutomEventLog
+{
+public:
+    static AutomEventLog& Instance();
+    ~AutomEventLog();
+
+    /// Rt safe, any number of producers
+    bool Push(const AutomEvent& event);
+
+    /// Not for rt, appends the pending events
+    int Drain(std::vector<AutomEvent>& events);
+
+    inline long long GetNbDropped() const {return n_dropped_.load(std::memory_order_relaxed);}
+
+    /// The drain thread is started at the creation of the log, a period of 0 stops it
+    void Start(const int period_ms);
+    void Stop();
+
+private:
+    AutomEventLog();
+    AutomEventLog(const AutomEventLog&);
+    AutomEventLog& operator=(const AutomEventLog&);
+
+    static const int LOG_SIZE = 1024; // Power of 2
+
+    struct Cell
+    {
+        std::atomic<uint64_t> seq;
+        AutomEvent event;
+    };
+
+    Cell cells_[LOG_SIZE];
+    std::atomic<uint64_t> head_;
+    uint64_t tail_;
+    std::atomic<long long> n_dropped_;
+    boost::mutex drain_mtx_; // Single consumer at a time
+    boost::thread drain_thread_;
+    std::atomic<bool> stop_;
+};
+
+/// Activation of a guide: MANUAL -> PREAUTO when the phase speeds up, PREAUTO -> AUTO when it is back near the
+/// reference speed, AUTO -> MANUAL on a collision. The thresholds are read from autom/ in cfg.yml.
 class VirtualMechanismAutom
 {
 public:
-    VirtualMechanismAutom(){}
+    VirtualMechanismAutom();
     VirtualMechanismAutom(const double phase_dot_preauto_th, const double phase_dot_th);
-    void Step(const double& phase_dot, const double& phase_dot_ref, bool& collision_detected);
-    bool GetState();
+    void Step(const double phase_dot, const double phase_dot_ref, const bool collision_detected);
+    inline bool GetState() const {return active_[state_];}
+    bool ReadConfig();
+
+    enum state_t {MANUAL,PREAUTO,AUTO,N_STATES};
+    static const char* GetStateName(const int state);
+
 private:
-    enum state_t {MANUAL,PREAUTO,AUTO};
+    void CheckThresholds();
+
+    /// Next state, given the state and its guard
+    static const state_t transitions_[N_STATES][2];
+    static const bool active_[N_STATES];
+
     double phase_dot_preauto_th_;
     double phase_dot_th_;
     state_t state_;
-    long long loopCnt;
 };
 
 } // namespace
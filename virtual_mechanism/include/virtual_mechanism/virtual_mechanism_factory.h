@@ -30,7 +30,7 @@ namespace virtual_mechanism
 {
 
 enum order_t {FIRST,SECOND};
-enum model_type_t {GMR,GMR_NORMALIZED}; // SPLINE
+enum model_type_t {GMR,GMR_NORMALIZED,SPLINE};
 
 /*class VirtualMechanismAbstractFactory
 {
@@ -49,11 +49,16 @@ public:
     VirtualMechanismInterface* Build(const std::string model_name); // With default order and model_type
     void SetDefaultPreferences(const order_t order, const model_type_t model_type);
     void SetDefaultPreferences(const std::string order, const std::string model_type);
+    inline order_t GetDefaultOrder() const {return default_order_;}
+    inline model_type_t GetDefaultModelType() const {return default_model_type_;}
 protected:
+    bool ReadConfig();
     VirtualMechanismInterface* CreateEmptyMechanism(const order_t order, const model_type_t model_type);
+    template<int Dim>  VirtualMechanismInterface* SelectOrder(const order_t order, const model_type_t model_type);
     template<typename ORDER>  VirtualMechanismInterface* SelectModel(const model_type_t model_type);
     order_t default_order_;
     model_type_t default_model_type_;
+    int state_dim_; // Selects the fixed size mechanisms to instantiate
 };
 
 } // namespace
@@ -26,6 +26,11 @@
 
 ////////// VirtualMechanismInterface
 #include <virtual_mechanism/virtual_mechanism_interface.h>
+#include <virtual_mechanism/phase_table.h>
+#include <virtual_mechanism/gmr_kernel.h>
+#include <virtual_mechanism/streaming_em.h>
+#include <virtual_mechanism/gmr_model_selection.h>
+#include <virtual_mechanism/guide_file.h>
 
 ////////// Function Approximator
 //#include <functionapproximators/FunctionApproximatorGMR.hpp>
@@ -40,7 +45,8 @@
 #include <boost/make_shared.hpp>
 
 ////////// Toolbox
-#include "toolbox/spline/spline.h"
+#include "toolbox/spline/cubic_spline.h"
+#include "toolbox/spline/arc_length.h"
 #include "toolbox/dtw/dtw.h"
 
 namespace virtual_mechanism
@@ -52,6 +58,8 @@ template <class VM_t>
 class VirtualMechanismGmr: public VM_t
 {
 	public:
+      typedef typename VM_t::vector_t vector_t;
+      typedef Eigen::Matrix<double,VM_t::dim,VM_t::dim> matrix_t;
 
       VirtualMechanismGmr();
       VirtualMechanismGmr(const std::string file_path);
@@ -67,7 +75,11 @@ class VirtualMechanismGmr: public VM_t
       virtual bool CreateModelFromFile(const std::string file_path);
       virtual bool SaveModelToFile(const std::string file_path);
 
-      void ComputeStateGivenPhase(const double abscisse_in, Eigen::VectorXd& state_out);
+      /// Streaming, the chunks refine a copy of the model, CreateModelFromStream() replaces the model with it
+      virtual bool AddDataChunk(const Eigen::MatrixXd& data);
+      virtual bool CreateModelFromStream();
+
+      void ComputeStateGivenPhase(const double abscisse_in, Eigen::Ref<Eigen::VectorXd> state_out);
       double ComputeResponsability(const Eigen::MatrixXd& pos);
       double GetResponsability();
 	  
@@ -81,28 +93,61 @@ class VirtualMechanismGmr: public VM_t
       virtual void ComputeFinalState();
       virtual void CreateRecordedRefs();
       void AlignUpdateModel(const Eigen::MatrixXd& data);
+      bool TrainModelFromStream();
+      void BakeModel();
+      void PredictDot(const double phase);
+
+      /// Binary guide format, see guide_file.h
+      virtual bool LoadModelFromGuideFile(const GuideFile& file);
+      virtual void SaveModelToGuideFile(GuideFileWriter& writer);
 
       void UpdateInvCov();
       double ComputeProbability(const Eigen::VectorXd& pos);
 
-      fa_t* fa_; // Function Approximator
+      fa_t* fa_; // Function Approximator, used for the training
+      GmrKernel<VM_t::dim> kernel_; // Same model, used for the predictions
 
-	  Eigen::MatrixXd fa_input_;
 	  Eigen::MatrixXd fa_output_;
 	  Eigen::MatrixXd fa_output_dot_;
-	  Eigen::MatrixXd variance_;
-	  Eigen::MatrixXd covariance_;
-      Eigen::MatrixXd covariance_inv_;
-	  Eigen::VectorXd err_;
+	  matrix_t covariance_;
+      matrix_t covariance_inv_;
+	  vector_t err_;
 
       int n_gaussians_;
+      int n_gaussians_max_;
+      int training_restarts_;
+      int training_threads_;
       bool use_align_;
+      std::string dtw_band_;
+      double dtw_band_width_;
+      double dtw_itakura_slope_;
+      int dtw_fast_radius_;
+
+      /// Streaming EM, see AddDataChunk()
+      StreamingEm<VM_t::dim> stream_em_;
+      int streaming_em_iterations_;
+      double streaming_prior_weight_;
+      double stream_phase_; // Phase of the last streamed point
+
+      /// Baked mode, the gmr is replaced by a lookup table on the phase
+      PhaseTable<VM_t::dim> phase_table_;
+      bool use_baked_table_;
+      double baked_table_max_error_;
+      double baked_table_max_error_dot_;
+      double baked_table_max_error_variance_;
+      int baked_table_max_points_;
+      vector_t baked_pos_;
+      vector_t baked_pos_dot_;
+      vector_t baked_variance_;
+
+      bool recorded_refs_from_file_;
 };
 
 template <typename VM_t>
 class VirtualMechanismGmrNormalized: public VirtualMechanismGmr<VM_t>
 {
     public:
+      typedef typename VM_t::vector_t vector_t;
 
       VirtualMechanismGmrNormalized();
       VirtualMechanismGmrNormalized(const std::string file_path);
@@ -115,29 +160,33 @@ class VirtualMechanismGmrNormalized: public VirtualMechanismGmr<VM_t>
 
       virtual bool CreateModelFromData(const Eigen::MatrixXd& data);
       virtual bool CreateModelFromFile(const std::string file_path);
+      virtual bool CreateModelFromStream();
 
     protected:
 
       bool ReadConfig();
-      void TrainModel(const Eigen::MatrixXd& data);
       virtual void UpdateJacobian();
       virtual void UpdateState();
       virtual void UpdateStateDot();
-      void Normalize();
-      void AlignUpdateModel(const Eigen::MatrixXd& data);
+      void Normalize(); // After BakeModel(), it uses the kernel of the current model
+      void SetSplines();
+
+      virtual bool LoadModelFromGuideFile(const GuideFile& file);
+      virtual void SaveModelToGuideFile(GuideFileWriter& writer);
 
-      tk::spline spline_phase_;
-      tk::spline spline_phase_inv_;
-      std::vector<tk::spline > splines_xyz_;
+      Eigen::MatrixXd spline_knots_; // [abscisse phase dabscisse/dphase (xyz) (dxyz/dphase)]
+      tool_box::CubicSpline spline_phase_;
+      tool_box::CubicSpline spline_phase_inv_;
+      tool_box::CubicSplineN<vector_t::RowsAtCompileTime> spline_xyz_; // xyz(z), all the axes in one lookup
       bool use_spline_xyz_;
-      int n_points_splines_;
+      double arc_length_tolerance_; // Relative to the length of the guide
       double exec_time_;
 
       double z_;
       double z_dot_;
       double z_dot_ref_;
 
-      Eigen::MatrixXd Jz_;
+      vector_t Jz_;
 
       long long loopCnt;
 };
@@ -38,10 +38,15 @@
 
 ////////// Toolbox
 #include <toolbox/toolbox.h>
+#include <toolbox/profiler.h>
 
 ////////// Autom
 #include "virtual_mechanism/virtual_mechanism_autom.h"
 
+////////// Spatial index
+#include "virtual_mechanism/kd_tree.h"
+#include "virtual_mechanism/guide_bounds.h"
+
 #define LINE_CLAMP(x,y,x1,x2,y1,y2) do { y = (y2-y1)/(x2-x1) * (x-x1) + y1; } while (0)
 
 namespace virtual_mechanism
@@ -55,7 +60,7 @@ class VirtualMechanismInterface
           phase_prev_(0.0),phase_dot_(0.0),phase_dot_ref_(0.0),
           phase_ddot_ref_(0.0),phase_ref_(0.0),phase_dot_prev_(0.0),
           phase_ddot_(0.0),scale_(1.0),
-          fade_(0.0),active_(false),check_activation_(false),dt_(0.001)
+          fade_(0.0),active_(false),check_activation_(false),collision_detected_(false),dt_(0.001)
 	  {
 
           if(!ReadConfig())
@@ -63,23 +68,6 @@ class VirtualMechanismInterface
             PRINT_ERROR("VirtualMechanismInterface: Can not read config file");
           }
 
-	      // Initialize/resize the attributes
-          // NOTE We assume that the phase has dim 1x1
-          state_.resize(state_dim_);
-          state_dot_.resize(state_dim_);
-          displacement_.resize(state_dim_);
-	      torque_.resize(1);
-          force_.resize(state_dim_);
-          force_pos_.resize(state_dim_);
-          force_vel_.resize(state_dim_);
-          final_state_.resize(state_dim_);
-          initial_state_.resize(state_dim_);
-          t_versor_.resize(state_dim_);
-          J_.resize(state_dim_,1);
-          J_transp_.resize(1,state_dim_);
-          BxJ_.resize(state_dim_,1);
-          JtxBxJ_.resize(1,1); // NOTE It is used to store the multiplication J * J_transp
-
           fade_sys_.SetRef(1.0);
 
           // Default quaternions
@@ -97,44 +85,29 @@ class VirtualMechanismInterface
 	  
       inline bool ReadConfig()
       {
-          YAML::Node main_node = tool_box::CreateYamlNodeFromPkgName(ROS_PKG_NAME);
-          if (const YAML::Node& curr_node = main_node["virtual_mechanism_interface"])
+          tool_box::Config::ptr_t cfg = tool_box::Config::Load(ROS_PKG_NAME);
+          if (cfg->Has("virtual_mechanism_interface"))
           {
-              std::vector<double> K,B;
-              curr_node["K"] >> K;
-              curr_node["B"] >> B;
-              curr_node["n_points_discretization"] >> n_points_discretization_;
+              if(!cfg->Get("virtual_mechanism_interface/n_points_discretization",n_points_discretization_))
+                  return false;
 
               assert(n_points_discretization_ > 1);
 
-              state_dim_ = K.size();
-              assert(state_dim_ == 2 || state_dim_ == 3);
-              //assert(K.size() == static_cast<unsigned int>(state_dim_));
-              assert(B.size() == K.size());
-              for(unsigned int i=0; i<K.size(); i++)
-              {
-                assert(K[i] > 0.0);
-                assert(B[i] > 0.0);
-              }
-
-              // Create a diagonal gain matrix
-              if(K.size() == 2)
-              {
-                K_ = Eigen::DiagonalMatrix<double,2>(K[0],K[1]);
-                B_ = Eigen::DiagonalMatrix<double,2>(B[0],B[1]);
-              }
-              else if(K.size() == 3)
-              {
-                K_ = Eigen::DiagonalMatrix<double,3>(K[0],K[1],K[2]);
-                B_ = Eigen::DiagonalMatrix<double,3>(B[0],B[1],B[2]);
-              }
+              if (cfg->Has("virtual_mechanism_interface/n_bounding_capsules"))
+                  cfg->Get("virtual_mechanism_interface/n_bounding_capsules",n_bounding_capsules_);
+              else
+                  n_bounding_capsules_ = 16;
+              assert(n_bounding_capsules_ > 0);
 
-              if (const YAML::Node& active_guide_node = curr_node["active_guide"])
+              if (cfg->Has("virtual_mechanism_interface/active_guide"))
               {
+                  bool ok = true;
                   double fade_sys_gain;
-                  active_guide_node["Kf"] >> Kf_;
-                  active_guide_node["Bf"] >> Bf_;
-                  active_guide_node["fade_sys_gain"] >> fade_sys_gain;
+                  ok &= cfg->Get("virtual_mechanism_interface/active_guide/Kf",Kf_);
+                  ok &= cfg->Get("virtual_mechanism_interface/active_guide/Bf",Bf_);
+                  ok &= cfg->Get("virtual_mechanism_interface/active_guide/fade_sys_gain",fade_sys_gain);
+                  if(!ok)
+                      return false;
                   assert(Kf_ >= 0.0);
                   assert(Bf_ >= 0.0);
                   fade_sys_.SetGain(fade_sys_gain);
@@ -154,135 +127,23 @@ class VirtualMechanismInterface
 
       inline void CheckForActivation();
 
-      virtual void Update(Eigen::VectorXd& force, const double dt)
-	  {
-        assert(dt > 0.0);
-
-        dt_ = dt;
-
-	    // Save the previous phase
-	    phase_prev_ = phase_;
-
-        // Save the previous phase_dot
-        phase_dot_prev_ = phase_dot_;
-
-        // Check for guide activation
-        if(check_activation_)
-            CheckActivation();
-  
-	    // Update the Jacobian and its transpose
-	    UpdateJacobian();
-	    
-	    // Update the phase
-	    UpdatePhase(force,dt);
-	    
-	    // Saturate the phase if exceeds 1 or 0
-	    ApplySaturation();
-	    
-	    // Compute the new state
-	    UpdateState();
-	    
-	    // Compute the new state dot
-	    UpdateStateDot();
-            
-        // Compute the new quaternion reference
-        if (update_quaternion_)
-            UpdateQuaternion();
-
-        // Compute the jacobian versor (used to avoid the lock in the manager)
-        ComputeJacobianVersor();
-	  }
-
-      void UpdateDiscrete(const Eigen::VectorXd& pos)
-      {
-
-        phase_dot_ = 0.0;
-        phase_ddot_ = 0.0;
-
-        // Update the Jacobian and its transpose
-        UpdateJacobian();
-
-        // Compute the phase based on the min distance
-        FindMinDist(pos);
-
-        // Compute the new state
-        UpdateState();
-
-        // Compute the new state dot
-        UpdateStateDot();
-      }
-	  
-      void FindMinDist(const Eigen::VectorXd& pos)
-      {
-          assert(state_recorded_.rows() > 0);
-          assert(pos.size() ==  state_recorded_.cols());
-          assert(tmp_dists_.size() == state_recorded_.rows());
-          assert(phase_recorded_.rows() ==  state_recorded_.rows());
-          assert(phase_recorded_.cols() ==  1);
-
-          int min_idx = 0;
-          double curr_d;
-          double min = std::numeric_limits<double>::infinity();
-          for(unsigned int i_row = 0; i_row < state_recorded_.rows(); i_row++)
-          {
-              curr_d = (state_recorded_.row(i_row).transpose() - pos).norm();
-              if(curr_d < min)
-              {
-                  min = curr_d;
-                  min_idx = i_row;
-              }
-
-
-          }
-
-          /*std::cout << "***" << std::endl;
-
-          std::cout << pos << std::endl;
-
-          std::cout << "***" << std::endl;
-          std::cout << state_recorded_.row(0).transpose() - pos << std::endl;*/
-
-          phase_ = phase_recorded_(min_idx,0);
-      }
+      /// Loop update, implemented with fixed size storage by VirtualMechanismBase
+      virtual void Update(Eigen::VectorXd& force, const double dt)=0;
+      virtual void Update(const Eigen::VectorXd& pos, const Eigen::VectorXd& vel, const double dt, const double scale = 1.0)=0;
+      virtual void UpdateDiscrete(const Eigen::VectorXd& pos)=0;
+      virtual void FindMinDist(const Eigen::VectorXd& pos)=0;
 
       virtual void Stop()
       {
           phase_dot_ = 0.0;
           phase_ddot_ = 0.0;
       }
-
-      inline void Update(const Eigen::VectorXd& pos, const Eigen::VectorXd& vel , const double dt, const double scale = 1.0)
-	  {
-	      assert(pos.size() == state_dim_);
-	      assert(vel.size() == state_dim_);
-	    
-          scale_ = scale;
-
-          if(scale_ > 0.01) // Compute the movement of the mechanism
-          {
-              //K_ = adaptive_gain_ptr_->ComputeGain((state_ - pos).norm());
-              displacement_.noalias() = state_ - pos;
-              force_pos_.noalias() = K_ * displacement_;
-              force_vel_.noalias() = B_ * vel;
-              force_ = force_pos_ - force_vel_;
-              //force_ = force_;
-              //force_ = scale * (K_ * (state_ - pos) - B_ * (vel));
-              Update(force_,dt);
-          }
-          else // Find the min distance point
-          {
-              UpdateDiscrete(pos);
-          }
-
-          // Publish stuff
-#ifdef USE_ROS_RT_PUBLISHER
-          rt_publishers_.PublishAll();
-#endif
-	  }
 	  
       // Here to no break the polymorphism
       virtual double ComputeResponsability(const Eigen::MatrixXd& pos){PRINT_ERROR("ComputeResponsability has not been defined.");}
       virtual double GetResponsability(){PRINT_ERROR("GetResponsability has not been defined.");}
+      virtual bool AddDataChunk(const Eigen::MatrixXd& data){PRINT_ERROR("AddDataChunk has not been defined.");}
+      virtual bool CreateModelFromStream(){PRINT_ERROR("CreateModelFromStream has not been defined.");}
 
       virtual bool CreateModelFromData(const Eigen::MatrixXd& data)=0;
       virtual bool CreateModelFromFile(const std::string file_path)=0;
@@ -291,7 +152,7 @@ class VirtualMechanismInterface
       virtual double getDistance(const Eigen::VectorXd& pos)=0;
       virtual double getScale(const Eigen::VectorXd& pos, const double convergence_factor = 1.0)=0;
 
-      inline double getTorque() const {return torque_(0,0);}
+      inline int getStateDim() const {return state_dim_;}
       inline double getFade() const {return fade_;}
       inline double getPhaseDotDot() const {return phase_ddot_;}
       inline double getPhaseDot() const {return phase_dot_;}
@@ -303,14 +164,31 @@ class VirtualMechanismInterface
       inline double getKf() const {return Kf_;}
       inline double getBf() const {return Bf_;}
 
-      inline void getJacobianVersor(Eigen::VectorXd& t_versor) const {assert(t_versor.size() == state_dim_); t_versor = t_versor_;}
-      inline void getInitialPos(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = initial_state_;}
-      inline void getFinalPos(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = final_state_;}
-      inline void getState(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = state_;}
-	  inline void getStateDot(Eigen::VectorXd& state_dot) const {assert(state_dot.size() == state_dim_); state_dot = state_dot_;}
-      inline void getJacobian(Eigen::MatrixXd& jacobian) const {jacobian = J_;}
-      inline void getK(Eigen::MatrixXd& K) const {K = K_;}
-      inline void getB(Eigen::MatrixXd& B) const {B = B_;}
+      /// Zero-copy views on the fixed size storage of the mechanism
+      virtual double getTorque() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getJacobianVersor() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getInitialPos() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getFinalPos() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getState() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getStateDot() const=0;
+      virtual Eigen::Ref<const Eigen::MatrixXd> getJacobian() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getKDiagonal() const=0; // NOTE K and B are diagonal matrices
+      virtual Eigen::Ref<const Eigen::VectorXd> getBDiagonal() const=0;
+
+      /// Bounding volumes of the recorded references, to reject the guides far from a demonstration or a position
+      virtual Eigen::Ref<const Eigen::VectorXd> getBoundingBoxMin() const=0;
+      virtual Eigen::Ref<const Eigen::VectorXd> getBoundingBoxMax() const=0;
+      virtual double getDistanceLowerBound(const Eigen::VectorXd& pos) const=0;
+      virtual bool IsNear(const Eigen::VectorXd& pos, const double margin) const=0;
+
+      inline void getJacobianVersor(Eigen::VectorXd& t_versor) const {assert(t_versor.size() == state_dim_); t_versor = getJacobianVersor();}
+      inline void getInitialPos(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = getInitialPos();}
+      inline void getFinalPos(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = getFinalPos();}
+      inline void getState(Eigen::VectorXd& state) const {assert(state.size() == state_dim_); state = getState();}
+	  inline void getStateDot(Eigen::VectorXd& state_dot) const {assert(state_dot.size() == state_dim_); state_dot = getStateDot();}
+      inline void getJacobian(Eigen::MatrixXd& jacobian) const {jacobian = getJacobian();}
+      inline void getK(Eigen::MatrixXd& K) const {K = getKDiagonal().asDiagonal();}
+      inline void getB(Eigen::MatrixXd& B) const {B = getBDiagonal().asDiagonal();}
       inline void getQuaternion(Eigen::VectorXd& q) const
       {
               assert(q.size() == 4);
@@ -320,15 +198,6 @@ class VirtualMechanismInterface
               q(3) = quaternion_->z();
       }
 
-      inline Eigen::VectorXd& getJacobianVersor() {return t_versor_;}
-      inline Eigen::VectorXd& getInitialPos() {return initial_state_;}
-      inline Eigen::VectorXd& getFinalPos() {return final_state_;}
-      inline Eigen::VectorXd& getState() {return state_;}
-      inline Eigen::VectorXd& getStateDot() {return state_dot_;}
-      inline Eigen::MatrixXd& getJacobian() {return J_;}
-      inline Eigen::MatrixXd& getK() {return K_;}
-      inline Eigen::MatrixXd& getB() {return B_;}
-
       //inline void setExecutionTime(const double time) {assert(time > 0.0); exec_time_ = time;}
       inline void setCollisionDetected(const bool collision) {collision_detected_ = collision;}
 
@@ -391,24 +260,16 @@ class VirtualMechanismInterface
 
 	  virtual void UpdateJacobian()=0;
 	  virtual void UpdateState()=0;
-	  virtual void UpdatePhase(const Eigen::VectorXd& force, const double dt)=0;
+      virtual void UpdateStateDot()=0;
 	  virtual void ComputeInitialState()=0;
 	  virtual void ComputeFinalState()=0;
+      virtual void ComputeJacobianVersor()=0;
       virtual void CreateRecordedRefs()=0;
 
-      inline void ComputeJacobianVersor()
-      {
-          // Jacobian versor
-          t_versor_ = J_/J_.norm();
-      }
-
       inline void CheckActivation()
       {
           autom_.Step(phase_dot_,phase_dot_ref_,collision_detected_);
-          if(autom_.GetState())
-              active_ = true;
-          else
-              active_ = false;
+          active_ = autom_.GetState();
       }
 
       virtual void ApplySaturation()
@@ -429,11 +290,6 @@ class VirtualMechanismInterface
             phase_ddot_ = 0.0;
           }
       }
-
-      virtual inline void UpdateStateDot()
-	  {
-          state_dot_.noalias() = J_ * phase_dot_;
-	  }
 	  
 	  inline void UpdateQuaternion()
       {
@@ -451,31 +307,10 @@ class VirtualMechanismInterface
       double phase_ddot_;
       double scale_;
       int state_dim_;
-      Eigen::VectorXd displacement_;
-      Eigen::VectorXd state_;
-      Eigen::VectorXd state_dot_;
-	  Eigen::VectorXd torque_;
-      Eigen::VectorXd force_;
-      Eigen::VectorXd force_out_;
-      Eigen::VectorXd force_pos_;
-      Eigen::VectorXd force_vel_;
-	  Eigen::VectorXd initial_state_;
-	  Eigen::VectorXd final_state_;
-      Eigen::VectorXd t_versor_;
-      Eigen::ArrayXd tmp_dists_;
-      Eigen::MatrixXd BxJ_;
-      Eigen::MatrixXd JtxBxJ_;
-	  Eigen::MatrixXd J_;
-	  Eigen::MatrixXd J_transp_;
 
       // Discretization
       int n_points_discretization_;
-      Eigen::MatrixXd state_recorded_;
-      Eigen::MatrixXd phase_recorded_;
-
-	  // Gains
-      Eigen::MatrixXd B_;
-      Eigen::MatrixXd K_;
+      int n_bounding_capsules_;
 
       /// Fade system
       tool_box::DynSystemFirstOrder fade_sys_;
@@ -503,12 +338,323 @@ class VirtualMechanismInterface
 #endif
 
 };
+
+/// Fixed size implementation of the mechanism, Dim is the state dimension (2 or 3).
+/// All the quantities used in the loop update live on the stack/object, no heap indirection.
+template <int Dim>
+class VirtualMechanismBase : public VirtualMechanismInterface
+{
+    public:
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+      static const int dim = Dim;
+      typedef Eigen::Matrix<double,Dim,1> vector_t;
+      typedef Eigen::Matrix<double,1,Dim> row_vector_t;
+      typedef Eigen::DiagonalMatrix<double,Dim> diagonal_t;
+
+      VirtualMechanismBase():
+      VirtualMechanismInterface()
+      {
+          if(!ReadConfig())
+          {
+            PRINT_ERROR("VirtualMechanismBase: Can not read config file");
+          }
+
+          state_dim_ = Dim;
+
+          // Initialize the attributes
+          // NOTE We assume that the phase has dim 1x1
+          state_.setZero();
+          state_dot_.setZero();
+          displacement_.setZero();
+          torque_.setZero();
+          force_.setZero();
+          force_pos_.setZero();
+          force_vel_.setZero();
+          final_state_.setZero();
+          initial_state_.setZero();
+          t_versor_.setZero();
+          J_.setZero();
+          J_transp_.setZero();
+          query_.setZero();
+          BxJ_.setZero();
+          JtxBxJ_.setZero(); // NOTE It is used to store the multiplication J * J_transp
+      }
+
+      inline bool ReadConfig()
+      {
+          tool_box::Config::ptr_t cfg = tool_box::Config::Load(ROS_PKG_NAME);
+          if (cfg->Has("virtual_mechanism_interface"))
+          {
+              bool ok = true;
+              std::vector<double> K,B;
+              ok &= cfg->Get("virtual_mechanism_interface/K",K);
+              ok &= cfg->Get("virtual_mechanism_interface/B",B);
+              if(!ok)
+                  return false;
+
+              assert(K.size() == Dim);
+              assert(B.size() == K.size());
+              for(unsigned int i=0; i<K.size(); i++)
+              {
+                assert(K[i] > 0.0);
+                assert(B[i] > 0.0);
+              }
+
+              // Create a diagonal gain matrix
+              K_.diagonal() = vector_t::Map(&K[0]);
+              B_.diagonal() = vector_t::Map(&B[0]);
+
+              return true;
+          }
+          else
+              return false;
+      }
+
+      virtual void Update(Eigen::VectorXd& force, const double dt)
+      {
+          assert(force.size() == Dim);
+          force_ = force;
+          UpdateMechanism(force_,dt);
+      }
+
+      virtual void Update(const Eigen::VectorXd& pos, const Eigen::VectorXd& vel, const double dt, const double scale = 1.0)
+	  {
+	      assert(pos.size() == Dim);
+	      assert(vel.size() == Dim);
+	    
+          scale_ = scale;
+
+          if(scale_ > 0.01) // Compute the movement of the mechanism
+          {
+              //K_ = adaptive_gain_ptr_->ComputeGain((state_ - pos).norm());
+              displacement_.noalias() = state_ - pos;
+              force_pos_.noalias() = K_ * displacement_;
+              force_vel_.noalias() = B_ * vel;
+              force_ = force_pos_ - force_vel_;
+              //force_ = force_;
+              //force_ = scale * (K_ * (state_ - pos) - B_ * (vel));
+              UpdateMechanism(force_,dt);
+          }
+          else // Find the min distance point
+          {
+              UpdateDiscrete(pos);
+          }
+
+          // Publish stuff
+#ifdef USE_ROS_RT_PUBLISHER
+          rt_publishers_.PublishAll();
+#endif
+	  }
+
+      virtual void UpdateDiscrete(const Eigen::VectorXd& pos)
+      {
+
+        phase_dot_ = 0.0;
+        phase_ddot_ = 0.0;
+
+        // Update the Jacobian and its transpose
+        {
+            PROFILE_SCOPE("vm/update_jacobian");
+            UpdateJacobian();
+        }
+
+        // Compute the phase based on the min distance
+        {
+            PROFILE_SCOPE("vm/find_min_dist");
+            FindMinDist(pos);
+        }
+
+        // Compute the new state
+        {
+            PROFILE_SCOPE("vm/update_state");
+            UpdateState();
+
+            // Compute the new state dot
+            UpdateStateDot();
+        }
+      }
+	  
+      virtual void FindMinDist(const Eigen::VectorXd& pos)
+      {
+          assert(recorded_tree_.GetNbPoints() > 1);
+          assert(pos.size() == Dim);
+          assert(phase_recorded_.rows() ==  recorded_tree_.GetNbPoints());
+          assert(phase_recorded_.cols() ==  1);
+
+          query_ = pos;
+          phase_ = ProjectPhase(query_);
+      }
+
+      virtual double getTorque() const {return torque_(0,0);}
+      virtual Eigen::Ref<const Eigen::VectorXd> getJacobianVersor() const {return t_versor_;}
+      virtual Eigen::Ref<const Eigen::VectorXd> getInitialPos() const {return initial_state_;}
+      virtual Eigen::Ref<const Eigen::VectorXd> getFinalPos() const {return final_state_;}
+      virtual Eigen::Ref<const Eigen::VectorXd> getState() const {return state_;}
+      virtual Eigen::Ref<const Eigen::VectorXd> getStateDot() const {return state_dot_;}
+      virtual Eigen::Ref<const Eigen::MatrixXd> getJacobian() const {return J_;}
+      virtual Eigen::Ref<const Eigen::VectorXd> getKDiagonal() const {return K_.diagonal();}
+      virtual Eigen::Ref<const Eigen::VectorXd> getBDiagonal() const {return B_.diagonal();}
+      virtual Eigen::Ref<const Eigen::VectorXd> getBoundingBoxMin() const {return recorded_bounds_.GetMin();}
+      virtual Eigen::Ref<const Eigen::VectorXd> getBoundingBoxMax() const {return recorded_bounds_.GetMax();}
+      virtual double getDistanceLowerBound(const Eigen::VectorXd& pos) const {assert(pos.size() == Dim); return recorded_bounds_.DistanceLowerBound(pos);}
+      virtual bool IsNear(const Eigen::VectorXd& pos, const double margin) const {assert(pos.size() == Dim); return recorded_bounds_.IsNear(pos,margin);}
+
+      // Bring back the non virtual getters hidden by the overrides
+      using VirtualMechanismInterface::getJacobianVersor;
+      using VirtualMechanismInterface::getInitialPos;
+      using VirtualMechanismInterface::getFinalPos;
+      using VirtualMechanismInterface::getState;
+      using VirtualMechanismInterface::getStateDot;
+      using VirtualMechanismInterface::getJacobian;
+
+   protected:
+
+	  virtual void UpdatePhase(const vector_t& force, const double dt)=0;
+
+      inline void UpdateMechanism(const vector_t& force, const double dt)
+	  {
+        assert(dt > 0.0);
+
+        dt_ = dt;
+
+	    // Save the previous phase
+	    phase_prev_ = phase_;
+
+        // Save the previous phase_dot
+        phase_dot_prev_ = phase_dot_;
+
+        // Check for guide activation
+        if(check_activation_)
+            CheckActivation();
+  
+	    // Update the Jacobian and its transpose
+        {
+            PROFILE_SCOPE("vm/update_jacobian");
+            UpdateJacobian();
+        }
+	    
+	    // Update the phase
+        {
+            PROFILE_SCOPE("vm/update_phase");
+            UpdatePhase(force,dt);
+
+            // Saturate the phase if exceeds 1 or 0
+            ApplySaturation();
+        }
+	    
+	    // Compute the new state
+        {
+            PROFILE_SCOPE("vm/update_state");
+            UpdateState();
+
+            // Compute the new state dot
+            UpdateStateDot();
+        }
+            
+        // Compute the new quaternion reference
+        if (update_quaternion_)
+            UpdateQuaternion();
+
+        // Compute the jacobian versor (used to avoid the lock in the manager)
+        ComputeJacobianVersor();
+	  }
+
+      virtual void ComputeJacobianVersor()
+      {
+          // Jacobian versor
+          t_versor_ = J_/J_.norm();
+      }
+
+      virtual inline void UpdateStateDot()
+	  {
+          state_dot_.noalias() = J_ * phase_dot_;
+	  }
+
+      /// To be called at the end of CreateRecordedRefs, once state_recorded_ and phase_recorded_ are filled.
+      /// The bounds are built on samples, GetNbBoundsSamples() states of the guide uniform in the phase
+      inline void IndexRecordedRefs(const Eigen::MatrixXd& samples)
+      {
+          assert(state_recorded_.cols() == Dim);
+          assert(state_recorded_.rows() > 1);
+          assert(samples.rows() == GetNbBoundsSamples());
+          recorded_tree_.Build(state_recorded_);
+          recorded_bounds_.Build(samples,n_bounding_capsules_);
+      }
+
+      inline int GetNbBoundsSamples() const {return GuideBounds<Dim>::SAMPLES_PER_CAPSULE * n_bounding_capsules_ + 1;}
+
+      /// Phase of the projection of query on the recorded references, the state of the mechanism is not changed
+      inline double ProjectPhase(const vector_t& query) const
+      {
+          // Nearest discretization point
+          double min_dist2;
+          const int min_idx = recorded_tree_.FindNearest(query,min_dist2);
+
+          // Refine projecting on the segments before and after it
+          const int last_idx = recorded_tree_.GetNbPoints() - 1;
+          double phase = phase_recorded_(min_idx,0);
+          if(min_idx > 0)
+              ProjectOnSegment(query,min_idx-1,min_dist2,phase);
+          if(min_idx < last_idx)
+              ProjectOnSegment(query,min_idx,min_dist2,phase);
+          return phase;
+      }
+
+      /// Project query on the segment [idx,idx+1] and update the phase if it is closer than min_dist2
+      inline void ProjectOnSegment(const vector_t& query, const int idx, double& min_dist2, double& phase) const
+      {
+          const vector_t& a = recorded_tree_.GetPoint(idx);
+          const vector_t& b = recorded_tree_.GetPoint(idx+1);
+          const vector_t segment = b - a;
+          const double length2 = segment.squaredNorm();
+          if(length2 <= 0.0)
+              return;
+          double t = segment.dot(query - a) / length2;
+          t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+          const double dist2 = (a + t * segment - query).squaredNorm();
+          if(dist2 < min_dist2)
+          {
+              min_dist2 = dist2;
+              phase = phase_recorded_(idx,0) + t * (phase_recorded_(idx+1,0) - phase_recorded_(idx,0));
+          }
+      }
+
+      vector_t displacement_;
+      vector_t state_;
+      vector_t state_dot_;
+	  Eigen::Matrix<double,1,1> torque_;
+      vector_t force_;
+      vector_t force_pos_;
+      vector_t force_vel_;
+	  vector_t initial_state_;
+	  vector_t final_state_;
+      vector_t t_versor_;
+      vector_t BxJ_;
+      Eigen::Matrix<double,1,1> JtxBxJ_;
+	  vector_t J_;
+	  row_vector_t J_transp_;
+
+      // Discretization
+      Eigen::MatrixXd state_recorded_;
+      Eigen::MatrixXd phase_recorded_;
+      KdTree<Dim> recorded_tree_;
+      GuideBounds<Dim> recorded_bounds_;
+      vector_t query_;
+
+	  // Gains
+      diagonal_t B_;
+      diagonal_t K_;
+};
   
-class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterface
+template <int Dim>
+class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismBase<Dim>
 {
 	public:
+      typedef typename VirtualMechanismBase<Dim>::vector_t vector_t;
+
       VirtualMechanismInterfaceFirstOrder():
-      VirtualMechanismInterface()
+      VirtualMechanismBase<Dim>()
 	  {
 
         if(!ReadConfig())
@@ -522,14 +668,15 @@ class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterface
 
       inline bool ReadConfig()
       {
-          YAML::Node main_node = tool_box::CreateYamlNodeFromPkgName(ROS_PKG_NAME);
-          if (const YAML::Node& curr_node = main_node["first_order"])
+          tool_box::Config::ptr_t cfg = tool_box::Config::Load(ROS_PKG_NAME);
+          if (cfg->Has("first_order"))
           {
-              //main_node["Bd_max"] >> Bd_max_;
-              //main_node["epsilon"] >> epsilon_;
+              bool ok = true;
+              //cfg->Get("first_order/Bd_max",Bd_max_);
+              //cfg->Get("first_order/epsilon",epsilon_);
               //assert(epsilon > 0.1);
-              curr_node["Bd"] >> Bd_;
-              return true;
+              ok &= cfg->Get("first_order/Bd",Bd_);
+              return ok;
           }
           else
               return false;
@@ -542,41 +689,41 @@ class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterface
 	  virtual void ComputeInitialState()=0;
 	  virtual void ComputeFinalState()=0;
 	  
-	  virtual void UpdatePhase(const Eigen::VectorXd& force, const double dt)
+	  virtual void UpdatePhase(const vector_t& force, const double dt)
 	  {
-          BxJ_.noalias() = B_ * J_;
-          JtxBxJ_.noalias() = J_transp_ * BxJ_;
+          this->BxJ_.noalias() = this->B_ * this->J_;
+          this->JtxBxJ_.noalias() = this->J_transp_ * this->BxJ_;
 
 	      // Adapt Bf
           /*Bd_ = std::exp(-4/epsilon_*JxJt_(0,0)) * Bd_max_; // NOTE: Since JxJt_ has dim 1x1 the determinant is the only value in it
 	      //Bf_ = std::exp(-4/epsilon_*JxJt_.determinant()) * Bf_max_; // NOTE JxJt_.determinant() is always positive! so it's ok
           det_ = B_ * JxJt_(0,0) + Bd_ * Bd_;*/
 
-          det_ = JtxBxJ_(0,0) + Bd_;
+          det_ = this->JtxBxJ_(0,0) + Bd_;
 
-	      torque_.noalias() = J_transp_ * force;
+	      this->torque_.noalias() = this->J_transp_ * force;
 	      
-          if(active_)
-              fade_sys_.IntegrateForward(dt);
+          if(this->active_)
+              this->fade_sys_.IntegrateForward(dt);
              //fade_ = fade_gain_ * (1 - fade_) * dt + fade_;
           else
-             fade_sys_.IntegrateBackward(dt);
+             this->fade_sys_.IntegrateBackward(dt);
              //fade_ = fade_gain_ * (-fade_) * dt + fade_;
 
-          fade_ = fade_sys_.GetState();
+          this->fade_ = this->fade_sys_.GetState();
 
           // Always keep the external torque
           //phase_dot_ = num_/det_ * torque_(0,0) + fade_ * (Kf_ * (phase_ref_ - phase_) + Bf_ * phase_dot_ref_);
 
           // Switch between open and closed loop with the external torque
-          phase_dot_ = num_/det_ * torque_(0,0);
-          phase_dot_ = fade_ *  phase_dot_ref_ + (1-fade_) * phase_dot_;
+          this->phase_dot_ = num_/det_ * this->torque_(0,0);
+          this->phase_dot_ = this->fade_ *  this->phase_dot_ref_ + (1-this->fade_) * this->phase_dot_;
 
 	      // Compute the new phase
-          phase_ = phase_dot_ * dt + phase_prev_;
+          this->phase_ = this->phase_dot_ * dt + this->phase_prev_;
 
            // Compute phase_ddot
-          phase_ddot_ = (phase_dot_ - phase_dot_prev_)/dt;
+          this->phase_ddot_ = (this->phase_dot_ - this->phase_dot_prev_)/dt;
 	  }
 
 	  double det_;
@@ -586,31 +733,25 @@ class VirtualMechanismInterfaceFirstOrder : public VirtualMechanismInterface
       //double epsilon_;
 };
 
-class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
+template <int Dim>
+class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismBase<Dim>
 {
 	public:
+      typedef typename VirtualMechanismBase<Dim>::vector_t vector_t;
+
       VirtualMechanismInterfaceSecondOrder():
-      VirtualMechanismInterface()
+      VirtualMechanismBase<Dim>()
       {
           if(!ReadConfig())
           {
             PRINT_ERROR("VirtualMechanismInterfaceSecondOrder: Can not read config file");
           }
 
-	      // Resize the attributes
-	      phase_state_.resize(2); //phase_ and phase_dot
-          phase_state_dot_.resize(2); //phase_dot and phase_ddot
-          phase_state_integrated_.resize(2);
-
-          phase_state_.fill(0.0);
-          phase_state_dot_.fill(0.0);
+	      // Initialize the attributes
+          phase_state_.fill(0.0); //phase_ and phase_dot
+          phase_state_dot_.fill(0.0); //phase_dot and phase_ddot
           phase_state_integrated_.fill(0.0);
 
-	      k1_.resize(2);
-	      k2_.resize(2);
-	      k3_.resize(2);
-	      k4_.resize(2);
-	      
 	      k1_.fill(0.0);
           k2_.fill(0.0);
 	      k3_.fill(0.0);
@@ -621,10 +762,13 @@ class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
 
       inline bool ReadConfig()
       {
-          YAML::Node main_node = tool_box::CreateYamlNodeFromPkgName(ROS_PKG_NAME);
-          if (const YAML::Node& curr_node = main_node["second_order"])
+          tool_box::Config::ptr_t cfg = tool_box::Config::Load(ROS_PKG_NAME);
+          if (cfg->Has("second_order"))
           {
-              curr_node["inertia"] >> inertia_;
+              bool ok = true;
+              ok &= cfg->Get("second_order/inertia",inertia_);
+              if(!ok)
+                  return false;
               assert(inertia_ > 0.0);
               return true;
           }
@@ -639,7 +783,7 @@ class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
 	  virtual void ComputeInitialState()=0;
 	  virtual void ComputeFinalState()=0;
 
-      void IntegrateStepRungeKutta(const double& dt, const double& input1, const double& input2, const Eigen::VectorXd& phase_state, Eigen::VectorXd& phase_state_integrated)
+      void IntegrateStepRungeKutta(const double& dt, const double& input1, const double& input2, const Eigen::Vector2d& phase_state, Eigen::Vector2d& phase_state_integrated)
 	  {
 	 
 	    phase_state_integrated = phase_state;
@@ -663,9 +807,9 @@ class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
 	  
 	  }
 	  
-      inline void DynSystem(const double& dt, const double& input1, const double& input2, const Eigen::VectorXd& phase_state)
+      inline void DynSystem(const double& dt, const double& input1, const double& input2, const Eigen::Vector2d& phase_state)
 	  {
-         phase_state_dot_(1) = (1/inertia_)*(- JtxBxJ_(0,0) * phase_state(1) - input1 + input2); // Old version with damping
+         phase_state_dot_(1) = (1/inertia_)*(- this->JtxBxJ_(0,0) * phase_state(1) - input1 + input2); // Old version with damping
          phase_state_dot_(0) = phase_state(1);
 
          //phase_state_dot_(1) = (1/inertia_)*(- JtxBxJ_(0,0) * phase_state(1) - input1); // Old version with damping
@@ -680,40 +824,40 @@ class VirtualMechanismInterfaceSecondOrder : public VirtualMechanismInterface
          //phase_state_dot_(0) = fade_ *  phase_dot_ref_  + (1-fade_) * phase_state(1);
 	  }
 	  
-	  virtual void UpdatePhase(const Eigen::VectorXd& force, const double dt)
+	  virtual void UpdatePhase(const vector_t& force, const double dt)
 	  {
-          BxJ_.noalias() = B_ * J_;
-          JtxBxJ_.noalias() = J_transp_ * BxJ_;
+          this->BxJ_.noalias() = this->B_ * this->J_;
+          this->JtxBxJ_.noalias() = this->J_transp_ * this->BxJ_;
 
-	      torque_.noalias() = J_transp_ * force;
+	      this->torque_.noalias() = this->J_transp_ * force;
 
-          phase_state_(0) = phase_;
-          phase_state_(1) = phase_dot_;
+          phase_state_(0) = this->phase_;
+          phase_state_(1) = this->phase_dot_;
 	        
-          if(active_)
-              fade_sys_.IntegrateForward(dt);
+          if(this->active_)
+              this->fade_sys_.IntegrateForward(dt);
              //fade_ = fade_gain_ * (1 - fade_) * dt + fade_;
           else
-             fade_sys_.IntegrateBackward(dt);
+             this->fade_sys_.IntegrateBackward(dt);
              //fade_ = fade_gain_ * (-fade_) * dt + fade_;
 
-          fade_ = fade_sys_.GetState();
+          this->fade_ = this->fade_sys_.GetState();
 
-          control_ = fade_ * (Bf_ * (phase_dot_ref_ - phase_dot_) + Kf_ * (phase_ref_ - phase_));
+          control_ = this->fade_ * (this->Bf_ * (this->phase_dot_ref_ - this->phase_dot_) + this->Kf_ * (this->phase_ref_ - this->phase_));
 	      
-          IntegrateStepRungeKutta(dt,torque_(0),control_,phase_state_,phase_state_integrated_);
+          IntegrateStepRungeKutta(dt,this->torque_(0),control_,phase_state_,phase_state_integrated_);
 
-          DynSystem(dt,torque_(0),control_,phase_state_); // to compute the dots
+          DynSystem(dt,this->torque_(0),control_,phase_state_); // to compute the dots
 
-          phase_ = phase_state_integrated_(0);
-	      phase_dot_ = phase_state_integrated_(1);
-          phase_ddot_ = phase_state_dot_(1);
+          this->phase_ = phase_state_integrated_(0);
+	      this->phase_dot_ = phase_state_integrated_(1);
+          this->phase_ddot_ = phase_state_dot_(1);
 	  }
 	  
-	  Eigen::VectorXd phase_state_;
-	  Eigen::VectorXd phase_state_dot_;
-	  Eigen::VectorXd phase_state_integrated_;
-	  Eigen::VectorXd k1_, k2_, k3_, k4_;
+	  Eigen::Vector2d phase_state_;
+	  Eigen::Vector2d phase_state_dot_;
+	  Eigen::Vector2d phase_state_integrated_;
+	  Eigen::Vector2d k1_, k2_, k3_, k4_;
       double inertia_;
       double control_;
 };
@@ -26,47 +26,80 @@
 
 ////////// VirtualMechanismInterface
 #include <virtual_mechanism/virtual_mechanism_interface.h>
+#include <virtual_mechanism/guide_file.h>
 
 ////////// Toolbox
-#include "toolbox/spline/spline.h"
+#include "toolbox/spline/cubic_spline.h"
+#include "toolbox/spline/arc_length.h"
 
 namespace virtual_mechanism
 { 
 
+/// Guide described by a cubic spline xyz(z), normalized with its arc length as the gmr normalized guides.
+/// The model is only the knots matrix, so an update costs two spline lookups.
 template <class VM_t>  
 class VirtualMechanismSpline: public VM_t
 {
 	public:
+      typedef typename VM_t::vector_t vector_t;
+      typedef tool_box::CubicSplineN<vector_t::RowsAtCompileTime> spline_t;
 
       VirtualMechanismSpline();
       VirtualMechanismSpline(const std::string file_path);
       VirtualMechanismSpline(const Eigen::MatrixXd& data);
-	  
+
+      virtual VirtualMechanismInterface* Clone();
+
       virtual double getDistance(const Eigen::VectorXd& pos);
       virtual double getScale(const Eigen::VectorXd& pos, const double convergence_factor = 1.0);
+
+      /// data is [phase pos] or only pos (the abscisse is used as phase), a smoothing spline is fitted on it
+      virtual bool CreateModelFromData(const Eigen::MatrixXd& data);
+      /// Guide file, knots saved by SaveModelToFile() or demonstration in a text file
+      virtual bool CreateModelFromFile(const std::string file_path);
       virtual bool SaveModelToFile(const std::string file_path);
-      void ComputeStateGivenPhase(const double phase_in, Eigen::VectorXd& state_out);
+
+      /// Gaussian likelihood of the distances of pos from the guide, see responsability_std in cfg.yml
+      virtual double ComputeResponsability(const Eigen::MatrixXd& pos);
+      virtual double GetResponsability();
+
+      void ComputeStateGivenPhase(const double abscisse_in, Eigen::Ref<Eigen::VectorXd> state_out); // Not for rt
 	  
 	protected:
 
-      bool LoadModelFromFile(const std::string file_path);
+      bool ReadConfig();
+      bool FitSpline(const Eigen::MatrixXd& data, spline_t& spline_fit);
+      bool Normalize(const spline_t& spline_fit);
+      void SetSplines();
+
+      bool LoadModelFromGuideFile(const GuideFile& file);
+      void SaveModelToGuideFile(GuideFileWriter& writer);
 	  
       virtual void UpdateJacobian();
       virtual void UpdateState();
       virtual void UpdateStateDot();
       virtual void ComputeInitialState();
       virtual void ComputeFinalState();
+      virtual void CreateRecordedRefs();
+
+      Eigen::MatrixXd spline_knots_; // [abscisse phase dabscisse/dphase (xyz) (dxyz/dphase)], as the gmr normalized
+      tool_box::CubicSpline spline_phase_;
+      tool_box::CubicSpline spline_phase_inv_;
+      spline_t spline_xyz_;
 
-      std::vector<tk::spline > splines_xyz_;
-      tk::spline spline_phase_;
-      tk::spline spline_phase_inv_;
+      int n_knots_; // Of the fitted spline, the normalized one has more knots
+      double arc_length_tolerance_;
+      double exec_time_;
+      double responsability_std_;
+      double responsability_;
 
       double z_;
       double z_dot_;
       double z_dot_ref_;
 
-      Eigen::MatrixXd Jz_;
-      Eigen::VectorXd err_;
+      vector_t xyz_;
+      vector_t Jz_;
+      vector_t err_;
 };
 
 }
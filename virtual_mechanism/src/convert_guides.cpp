@@ -0,0 +1,120 @@
+/**
+ * @file   convert_guides.cpp
+ * @brief  Converts text guide models to the binary guide format and checks the round trip.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "virtual_mechanism/virtual_mechanism_factory.h"
+#include "virtual_mechanism/guide_file.h"
+
+////////// Toolbox
+#include <toolbox/debug.h>
+
+////////// BOOST
+#include <boost/shared_ptr.hpp>
+
+////////// STD
+#include <chrono>
+#include <iostream>
+#include <string>
+
+using namespace virtual_mechanism;
+using namespace Eigen;
+
+typedef std::chrono::steady_clock convert_clock_t;
+
+static double ElapsedMs(const convert_clock_t::time_point& start)
+{
+    return std::chrono::duration<double,std::milli>(convert_clock_t::now() - start).count();
+}
+
+/// Runs the same force profile on both guides, returns the max distance between the states
+static double CompareGuides(VirtualMechanismInterface* const vm_a, VirtualMechanismInterface* const vm_b)
+{
+    const int n_steps = 500;
+    const double dt = 0.001;
+    VectorXd force = VectorXd::Constant(vm_a->getStateDim(),10.0);
+    VectorXd force_b = force;
+    double err = (vm_a->getState() - vm_b->getState()).cwiseAbs().maxCoeff();
+    for(int i=0;i<n_steps;i++)
+    {
+        vm_a->Update(force,dt);
+        vm_b->Update(force_b,dt);
+        err = std::max(err,(vm_a->getState() - vm_b->getState()).cwiseAbs().maxCoeff());
+    }
+    return err;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 4)
+    {
+        std::cout << "Usage: convert_guides <first|second> <gmr|gmr_normalized|spline> <model> [model ...]" << std::endl;
+        std::cout << "Writes <model>" << GUIDE_FILE_EXTENSION << " next to each text model." << std::endl;
+        return 1;
+    }
+
+    VirtualMechanismFactory vm_factory;
+    try
+    {
+        vm_factory.SetDefaultPreferences(argv[1],argv[2]);
+    }
+    catch(...)
+    {
+        return 1;
+    }
+
+    int n_errors = 0;
+    for(int i=3;i<argc;i++)
+    {
+        const std::string text_path(argv[i]);
+        const std::string binary_path(text_path + GUIDE_FILE_EXTENSION);
+        try
+        {
+            convert_clock_t::time_point start = convert_clock_t::now();
+            boost::shared_ptr<VirtualMechanismInterface> vm_text(vm_factory.Build(text_path));
+            const double text_ms = ElapsedMs(start);
+
+            if(!vm_text->SaveModelToFile(binary_path))
+            {
+                PRINT_WARNING("Can not write "<< binary_path);
+                n_errors++;
+                continue;
+            }
+
+            start = convert_clock_t::now();
+            boost::shared_ptr<VirtualMechanismInterface> vm_binary(vm_factory.Build(binary_path));
+            const double binary_ms = ElapsedMs(start);
+
+            const double err = CompareGuides(vm_text.get(),vm_binary.get());
+            std::cout << binary_path << ": text load " << text_ms << " ms, binary load " << binary_ms
+                      << " ms, max state difference " << err << std::endl;
+            if(err > 1e-9)
+                n_errors++;
+        }
+        catch(...)
+        {
+            PRINT_WARNING("Can not convert "<< text_path);
+            n_errors++;
+        }
+    }
+
+    return n_errors == 0 ? 0 : 1;
+}
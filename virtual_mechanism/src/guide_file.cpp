@@ -0,0 +1,220 @@
+/**
+ * @file   guide_file.cpp
+ * @brief  Versioned little endian binary format of the guides, loaded with mmap.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "virtual_mechanism/guide_file.h"
+
+////////// Toolbox
+#include <toolbox/debug.h>
+
+////////// STD
+#include <cstring>
+#include <fstream>
+
+////////// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace virtual_mechanism
+{
+
+static inline bool IsLittleEndian()
+{
+    const uint16_t one = 1;
+    return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+
+GuideFile::GuideFile():data_(NULL),size_(0),header_(NULL),sections_(NULL)
+{
+}
+
+GuideFile::~GuideFile()
+{
+    Close();
+}
+
+void GuideFile::Close()
+{
+    if(data_!=NULL)
+        munmap(const_cast<char*>(data_),size_);
+    data_ = NULL;
+    size_ = 0;
+    header_ = NULL;
+    sections_ = NULL;
+}
+
+bool GuideFile::IsGuideFile(const std::string& file_path)
+{
+    char magic[sizeof(GUIDE_FILE_MAGIC)];
+    std::ifstream file(file_path.c_str(),std::ios::binary);
+    if(!file.read(magic,sizeof(magic)))
+        return false;
+    return std::memcmp(magic,GUIDE_FILE_MAGIC,sizeof(magic)) == 0;
+}
+
+bool GuideFile::HasGuideFileExtension(const std::string& file_path)
+{
+    const size_t n = std::strlen(GUIDE_FILE_EXTENSION);
+    return file_path.size() > n && file_path.compare(file_path.size()-n,n,GUIDE_FILE_EXTENSION) == 0;
+}
+
+bool GuideFile::Open(const std::string& file_path)
+{
+    Close();
+
+    if(!IsLittleEndian())
+    {
+        PRINT_WARNING("GuideFile: big endian hosts are not supported");
+        return false;
+    }
+
+    const int fd = open(file_path.c_str(),O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat file_stat;
+    if(fstat(fd,&file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(GuideFileHeader)))
+    {
+        close(fd);
+        return false;
+    }
+    size_ = file_stat.st_size;
+    void* data = mmap(NULL,size_,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd); // The mapping stays valid
+    if(data == MAP_FAILED)
+    {
+        size_ = 0;
+        return false;
+    }
+    data_ = static_cast<const char*>(data);
+    header_ = reinterpret_cast<const GuideFileHeader*>(data_);
+
+    // Validate everything once, so that the accessors do not have to
+    bool valid = std::memcmp(header_->magic,GUIDE_FILE_MAGIC,sizeof(GUIDE_FILE_MAGIC)) == 0
+            && header_->version == GUIDE_FILE_VERSION
+            && header_->header_size >= sizeof(GuideFileHeader)
+            && header_->header_size % 8 == 0
+            && std::memchr(header_->name,'\0',sizeof(header_->name)) != NULL
+            && header_->header_size + static_cast<uint64_t>(header_->n_sections) * sizeof(GuideFileSection) <= size_;
+    if(valid)
+    {
+        sections_ = reinterpret_cast<const GuideFileSection*>(data_ + header_->header_size);
+        for(uint32_t i=0;i<header_->n_sections && valid;i++)
+        {
+            const GuideFileSection& section = sections_[i];
+            valid = section.offset % 8 == 0 && section.offset <= size_;
+            if(valid)
+            {
+                // rows and cols are 32 bits, their product can not wrap, but it can not be scaled by sizeof(double) either
+                const uint64_t max_values = (size_ - section.offset) / sizeof(double);
+                valid = section.rows <= max_values && section.cols <= max_values
+                        && static_cast<uint64_t>(section.rows) * section.cols <= max_values;
+            }
+        }
+    }
+    if(!valid)
+    {
+        PRINT_WARNING("GuideFile: "<< file_path <<" is not a valid guide file (version "<< GUIDE_FILE_VERSION <<")");
+        Close();
+        return false;
+    }
+    return true;
+}
+
+const GuideFileSection* GuideFile::FindSection(const guide_section_t id) const
+{
+    if(header_==NULL)
+        return NULL;
+    for(uint32_t i=0;i<header_->n_sections;i++)
+        if(sections_[i].id == static_cast<uint32_t>(id))
+            return &sections_[i];
+    return NULL;
+}
+
+bool GuideFile::HasSection(const guide_section_t id) const
+{
+    return FindSection(id) != NULL;
+}
+
+section_map_t GuideFile::GetSection(const guide_section_t id) const
+{
+    const GuideFileSection* section = FindSection(id);
+    if(section == NULL)
+        return section_map_t(NULL,0,0);
+    return section_map_t(reinterpret_cast<const double*>(data_ + section->offset),section->rows,section->cols);
+}
+
+GuideFileWriter::GuideFileWriter(const int state_dim, const int model_type, const std::string& name)
+{
+    std::memset(&header_,0,sizeof(header_));
+    std::memcpy(header_.magic,GUIDE_FILE_MAGIC,sizeof(GUIDE_FILE_MAGIC));
+    header_.version = GUIDE_FILE_VERSION;
+    header_.header_size = sizeof(GuideFileHeader);
+    header_.state_dim = state_dim;
+    header_.model_type = model_type;
+    std::strncpy(header_.name,name.c_str(),sizeof(header_.name)-1);
+}
+
+void GuideFileWriter::AddSection(const guide_section_t id, const Eigen::MatrixXd& data)
+{
+    GuideFileSection section;
+    std::memset(&section,0,sizeof(section));
+    section.id = id;
+    section.rows = data.rows();
+    section.cols = data.cols();
+    sections_.push_back(section);
+    payloads_.push_back(data);
+}
+
+bool GuideFileWriter::Save(const std::string& file_path) const
+{
+    if(!IsLittleEndian())
+    {
+        PRINT_WARNING("GuideFileWriter: big endian hosts are not supported");
+        return false;
+    }
+
+    GuideFileHeader header = header_;
+    header.n_sections = sections_.size();
+
+    // Compute the offsets, the payloads follow the section table
+    std::vector<GuideFileSection> sections = sections_;
+    uint64_t offset = sizeof(GuideFileHeader) + sections.size() * sizeof(GuideFileSection);
+    for(size_t i=0;i<sections.size();i++)
+    {
+        sections[i].offset = offset;
+        offset += static_cast<uint64_t>(sections[i].rows) * sections[i].cols * sizeof(double);
+    }
+
+    std::ofstream file(file_path.c_str(),std::ios::binary | std::ios::trunc);
+    if(!file)
+        return false;
+    file.write(reinterpret_cast<const char*>(&header),sizeof(header));
+    if(!sections.empty())
+        file.write(reinterpret_cast<const char*>(&sections[0]),sections.size() * sizeof(GuideFileSection));
+    for(size_t i=0;i<payloads_.size();i++)
+        file.write(reinterpret_cast<const char*>(payloads_[i].data()),payloads_[i].size() * sizeof(double));
+    return static_cast<bool>(file);
+}
+
+} // namespace
@@ -25,82 +25,168 @@
 
 using namespace virtual_mechanism;
 
-VirtualMechanismAutom::VirtualMechanismAutom(const double phase_dot_preauto_th, const double phase_dot_th)
+AutomEventLog& AutomEventLog::Instance()
 {
-    assert(phase_dot_th > 0.0);
-    assert(phase_dot_preauto_th > phase_dot_th);
-    phase_dot_preauto_th_ = phase_dot_preauto_th;
-    phase_dot_th_ = phase_dot_th;
-    state_ = MANUAL;
-    loopCnt = 0;
+    static AutomEventLog log;
+    return log;
+}
+
+AutomEventLog::AutomEventLog():head_(0),tail_(0),n_dropped_(0),stop_(true)
+{
+    for(int i=0;i<LOG_SIZE;i++)
+        cells_[i].seq.store(i,std::memory_order_relaxed);
+
+    int period_ms = 100;
+    tool_box::Config::Load(ROS_PKG_NAME)->Get("autom/event_log_period",period_ms);
+    assert(period_ms >= 0);
+    Start(period_ms);
 }
 
-void VirtualMechanismAutom::Step(const double& phase_dot, const double& phase_dot_ref, bool& collision_detected)
+AutomEventLog::~AutomEventLog()
 {
-    if(true)
+    Stop();
+}
+
+bool AutomEventLog::Push(const AutomEvent& event)
+{
+    // Bounded queue with sequence numbers, a producer claims a cell and publishes it with its sequence
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for(;;)
     {
-        switch(state_)
+        cell = &cells_[pos & (LOG_SIZE - 1)];
+        const int64_t diff = static_cast<int64_t>(cell->seq.load(std::memory_order_acquire)) - static_cast<int64_t>(pos);
+        if(diff == 0)
         {
-            case MANUAL:
-                if(phase_dot >= phase_dot_preauto_th_)
-                    state_ = PREAUTO;
-                break;
-            case PREAUTO:
-                if(phase_dot <= (phase_dot_ref + phase_dot_th_))
-                    state_ = AUTO;
-                break;
-            case AUTO:
-                //if((phase_dot < (phase_dot_ref - phase_dot_th_)))
-                //if((std::abs(r) > (r_th_)))
-                if(collision_detected)
-                    state_ = MANUAL;
+            if(head_.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed))
                 break;
         }
+        else if(diff < 0) // Full
+        {
+            n_dropped_.fetch_add(1,std::memory_order_relaxed);
+            return false;
+        }
+        else
+            pos = head_.load(std::memory_order_relaxed);
     }
-    else // Two states version
-    {
-            if((phase_dot <= (phase_dot_ref + phase_dot_th_)) && (phase_dot >= (phase_dot_ref - phase_dot_th_)))
-                state_ = AUTO;
-            else
-                state_ = MANUAL;
-    }
+    cell->event = event;
+    cell->seq.store(pos + 1,std::memory_order_release);
+    return true;
 }
 
-bool VirtualMechanismAutom::GetState()
+int AutomEventLog::Drain(std::vector<AutomEvent>& events)
 {
-    bool activate_vm;
-    switch(state_)
+    boost::mutex::scoped_lock guard(drain_mtx_);
+    int n_events = 0;
+    for(;;)
     {
-        case MANUAL:
-            activate_vm = false;
-            break;
-        case PREAUTO:
-            activate_vm = false;
-            break;
-        case AUTO:
-            activate_vm = true;
+        Cell& cell = cells_[tail_ & (LOG_SIZE - 1)];
+        if(cell.seq.load(std::memory_order_acquire) != tail_ + 1)
             break;
+        events.push_back(cell.event);
+        cell.seq.store(tail_ + LOG_SIZE,std::memory_order_release);
+        tail_++;
+        n_events++;
     }
+    return n_events;
+}
 
-    if(loopCnt%1000==0)
+void AutomEventLog::Start(const int period_ms)
+{
+    Stop();
+    if(period_ms <= 0)
+        return;
+    stop_ = false;
+    drain_thread_ = boost::thread([this,period_ms]()
     {
-        switch(state_)
+        std::vector<AutomEvent> events;
+        while(!stop_.load())
         {
-            case MANUAL:
-                std::cout << "****" <<std::endl;
-                std::cout << "MANUAL" <<std::endl;
-                break;
-            case PREAUTO:
-                std::cout << "****" <<std::endl;
-                std::cout << "PREAUTO" <<std::endl;
-                break;
-            case AUTO:
-                std::cout << "****" <<std::endl;
-                std::cout << "AUTO" <<std::endl;
-                break;
+            boost::this_thread::sleep(boost::posix_time::milliseconds(period_ms));
+            events.clear();
+            Drain(events);
+            for(size_t i=0;i<events.size();i++)
+                PRINT_INFO("VirtualMechanismAutom "<<events[i].autom<<": "<<VirtualMechanismAutom::GetStateName(events[i].from)
+                           <<" -> "<<VirtualMechanismAutom::GetStateName(events[i].to)
+                           <<" (phase_dot "<<events[i].phase_dot<<", phase_dot_ref "<<events[i].phase_dot_ref<<")");
         }
+    });
+}
+
+void AutomEventLog::Stop()
+{
+    stop_ = true;
+    if(drain_thread_.joinable())
+        drain_thread_.join();
+}
+
+const VirtualMechanismAutom::state_t VirtualMechanismAutom::transitions_[N_STATES][2] =
+{
+    {MANUAL,PREAUTO}, // MANUAL, guard: phase_dot >= phase_dot_preauto_th
+    {PREAUTO,AUTO},   // PREAUTO, guard: phase_dot <= phase_dot_ref + phase_dot_th
+    {AUTO,MANUAL}     // AUTO, guard: collision detected
+};
+
+const bool VirtualMechanismAutom::active_[N_STATES] = {false,false,true};
+
+VirtualMechanismAutom::VirtualMechanismAutom()
+{
+    state_ = MANUAL;
+    if(!ReadConfig())
+    {
+        PRINT_ERROR("VirtualMechanismAutom: Can not read config file");
+    }
+    AutomEventLog::Instance(); // Created out of the rt loop
+}
+
+VirtualMechanismAutom::VirtualMechanismAutom(const double phase_dot_preauto_th, const double phase_dot_th)
+{
+    phase_dot_preauto_th_ = phase_dot_preauto_th;
+    phase_dot_th_ = phase_dot_th;
+    CheckThresholds();
+    state_ = MANUAL;
+    AutomEventLog::Instance();
+}
+
+bool VirtualMechanismAutom::ReadConfig()
+{
+    tool_box::Config::ptr_t cfg = tool_box::Config::Load(ROS_PKG_NAME);
+    if (cfg->Has("autom"))
+    {
+        bool ok = true;
+        ok &= cfg->Get("autom/phase_dot_preauto_th",phase_dot_preauto_th_);
+        ok &= cfg->Get("autom/phase_dot_th",phase_dot_th_);
+        if(!ok)
+            return false;
+        CheckThresholds();
+        return true;
+    }
+    else
+        return false;
+}
+
+void VirtualMechanismAutom::CheckThresholds()
+{
+    assert(phase_dot_th_ > 0.0);
+    assert(phase_dot_preauto_th_ > phase_dot_th_); // Hysteresis
+}
+
+void VirtualMechanismAutom::Step(const double phase_dot, const double phase_dot_ref, const bool collision_detected)
+{
+    const bool guards[N_STATES] = {phase_dot >= phase_dot_preauto_th_,
+                                   phase_dot <= (phase_dot_ref + phase_dot_th_),
+                                   collision_detected};
+    const state_t next_state = transitions_[state_][guards[state_]];
+    if(next_state != state_)
+    {
+        const AutomEvent event = {this,state_,next_state,phase_dot,phase_dot_ref};
+        AutomEventLog::Instance().Push(event);
+        state_ = next_state;
     }
-    loopCnt++;
+}
 
-    return activate_vm;
+const char* VirtualMechanismAutom::GetStateName(const int state)
+{
+    static const char* names[N_STATES] = {"MANUAL","PREAUTO","AUTO"};
+    return state >= 0 && state < N_STATES ? names[state] : "UNKNOWN";
 }
@@ -34,15 +34,35 @@ using namespace std;
 namespace virtual_mechanism
 {
 
-typedef VirtualMechanismInterfaceFirstOrder VMP_1ord_t;
-typedef VirtualMechanismInterfaceSecondOrder VMP_2ord_t;
-
 VirtualMechanismFactory::VirtualMechanismFactory()
 {
+    if(!ReadConfig())
+    {
+      PRINT_ERROR("VirtualMechanismFactory: Can not read config file");
+    }
+
     default_order_ = FIRST;
     default_model_type_ = GMR;
 }
 
+bool VirtualMechanismFactory::ReadConfig()
+{
+    tool_box::Config::ptr_t cfg = tool_box::Config::Load(ROS_PKG_NAME);
+    if (cfg->Has("virtual_mechanism_interface"))
+    {
+        bool ok = true;
+        std::vector<double> K;
+        ok &= cfg->Get("virtual_mechanism_interface/K",K);
+        if(!ok)
+            return false;
+        state_dim_ = K.size();
+        assert(state_dim_ == 2 || state_dim_ == 3);
+        return true;
+    }
+    else
+        return false;
+}
+
 VirtualMechanismInterface* VirtualMechanismFactory::Build(const MatrixXd& data, const order_t order, const model_type_t model_type)
 {
     VirtualMechanismInterface* vm_ptr = NULL;
@@ -90,6 +110,14 @@ VirtualMechanismInterface* VirtualMechanismFactory::Build(const MatrixXd& data)
 
 VirtualMechanismInterface* VirtualMechanismFactory::Build(const string model_name)
 {
+    // A binary guide file knows its model type
+    GuideFile file;
+    if(GuideFile::IsGuideFile(model_name) && file.Open(model_name))
+    {
+        const uint32_t model_type = file.GetHeader().model_type;
+        if(model_type == GMR || model_type == GMR_NORMALIZED || model_type == SPLINE)
+            return Build(model_name,default_order_,static_cast<model_type_t>(model_type));
+    }
     return Build(model_name,default_order_,default_model_type_);
 }
 
@@ -112,6 +140,8 @@ void VirtualMechanismFactory::SetDefaultPreferences(const string order, const st
         default_model_type_ = GMR;
     else if (model_type == "gmr_normalized")
         default_model_type_ = GMR_NORMALIZED;
+    else if (model_type == "spline")
+        default_model_type_ = SPLINE;
     else
         PRINT_ERROR("VirtualMechanismFactory: Wrong model_type.");
 }
@@ -120,13 +150,31 @@ VirtualMechanismInterface* VirtualMechanismFactory::CreateEmptyMechanism(const o
 {
      VirtualMechanismInterface* vm_ptr = NULL;
 
+     switch(state_dim_)
+     {
+       case 2:
+         vm_ptr = SelectOrder<2>(order,model_type);
+         break;
+       case 3:
+         vm_ptr = SelectOrder<3>(order,model_type);
+         break;
+       default:
+         throw std::runtime_error("VirtualMechanismFactory: Wrong state dimension.");
+     }
+     return vm_ptr;
+}
+
+template<int Dim>  VirtualMechanismInterface* VirtualMechanismFactory::SelectOrder(const order_t order, const model_type_t model_type)
+{
+     VirtualMechanismInterface* vm_ptr = NULL;
+
      switch(order)
      {
        case FIRST:
-         vm_ptr = SelectModel<VMP_1ord_t>(model_type);
+         vm_ptr = SelectModel<VirtualMechanismInterfaceFirstOrder<Dim> >(model_type);
          break;
        case SECOND:
-         vm_ptr = SelectModel<VMP_2ord_t>(model_type);
+         vm_ptr = SelectModel<VirtualMechanismInterfaceSecondOrder<Dim> >(model_type);
          break;
      }
      return vm_ptr;
@@ -143,6 +191,9 @@ template<typename ORDER>  VirtualMechanismInterface* VirtualMechanismFactory::Se
        case GMR_NORMALIZED:
         vm_ptr = new VirtualMechanismGmrNormalized<ORDER>();
         break;
+       case SPLINE:
+        vm_ptr = new VirtualMechanismSpline<ORDER>();
+        break;
     }
     return vm_ptr;
 }
@@ -22,12 +22,15 @@
  */
 
 #include "virtual_mechanism/virtual_mechanism_gmr.h"
+#include "virtual_mechanism/virtual_mechanism_factory.h" // model_type_t
+
+////////// STD
+#include <cstring>
 
 using namespace std;
 using namespace Eigen;
 using namespace tool_box;
 using namespace DmpBbo;
-using namespace tk;
 using namespace dtw;
 
 namespace virtual_mechanism
@@ -36,13 +39,28 @@ namespace virtual_mechanism
 template<class VM_t>
 bool VirtualMechanismGmrNormalized<VM_t>::CreateModelFromData(const MatrixXd& data)
 {
+    // Normalize() predicts with the kernel, it runs once the new model is baked
     VirtualMechanismGmr<VM_t>::CreateModelFromData(data);
     Normalize();
+    return true;
+}
+
+template<class VM_t>
+bool VirtualMechanismGmrNormalized<VM_t>::CreateModelFromStream()
+{
+    if(!this->TrainModelFromStream())
+        return false;
+    Normalize();
+    VM_t::Init();
+    return true;
 }
 
 template<class VM_t>
 bool VirtualMechanismGmrNormalized<VM_t>::CreateModelFromFile(const std::string file_path)
 {
+    if(GuideFile::IsGuideFile(file_path)) // Normalized by LoadModelFromGuideFile()
+        return VirtualMechanismGmr<VM_t>::CreateModelFromFile(file_path);
+
     if(VirtualMechanismGmr<VM_t>::CreateModelFromFile(file_path))
     {
         Normalize();
@@ -79,7 +97,7 @@ VirtualMechanismGmrNormalized<VM_t>::VirtualMechanismGmrNormalized():
       PRINT_ERROR("VirtualMechanismGmrNormalized: Can not read config file");
     }
 
-    Jz_.resize(VM_t::state_dim_,1);
+    Jz_.setZero();
     loopCnt = 0;
     z_ = 0.0;
     z_dot_ = 0.0;
@@ -92,6 +110,7 @@ VirtualMechanismGmrNormalized<VM_t>::VirtualMechanismGmrNormalized(const fa_t* c
     assert(fa!=NULL);
     assert(fa->isTrained());
     this->fa_ = dynamic_cast<fa_t*>(fa->clone());
+    this->BakeModel();
     Normalize();
     VM_t::Init();
 }
@@ -105,75 +124,90 @@ VirtualMechanismInterface* VirtualMechanismGmrNormalized<VM_t>::Clone()
 template <class VM_t>
 void VirtualMechanismGmrNormalized<VM_t>::Normalize()
 {
-    spline_phase_.clear(); // spline::clear()
-    spline_phase_inv_.clear(); // spline::clear()
-    splines_xyz_.clear(); // std::vector::clear()
+    const int dim = VM_t::state_dim_;
 
-    std::vector<double> phase_for_spline(n_points_splines_);
-    std::vector<double> abscisse_for_spline(n_points_splines_);
+    // Arc length of the GMR mean, adaptive Gauss-Legendre on the speed |dxyz/dz|
+    ArcLength arc_length(arc_length_tolerance_);
+    arc_length.Compute([&](const Ref<const VectorXd>& phase, Ref<VectorXd> speed)
+    {
+        ArenaScope scope;
+        Map<MatrixXd> pos = scope.GetArena().NewMatrix(phase.size(),dim);
+        Map<MatrixXd> pos_dot = scope.GetArena().NewMatrix(phase.size(),dim);
+        Map<MatrixXd> variance = scope.GetArena().NewMatrix(phase.size(),dim);
+        this->kernel_.predictDot(phase,pos,pos_dot,variance);
+        speed = pos_dot.rowwise().norm();
+    },0.0,1.0);
+
+    VectorXd abscisse, dabscisse;
+    if(!arc_length.GetNormalized(abscisse,dabscisse))
+        PRINT_ERROR("VirtualMechanismGmrNormalized: The guide has no length");
+
+    const int n_knots = arc_length.GetNbKnots();
+    spline_knots_.resize(n_knots,3 + (use_spline_xyz_ ? 2 * dim : 0));
+    spline_knots_.col(0) = abscisse;
+    spline_knots_.col(1) = arc_length.GetKnots();
+    spline_knots_.col(2) = dabscisse;
+    if(use_spline_xyz_) // xyz and its derivative at the same knots
+    {
+        ArenaScope scope;
+        Map<MatrixXd> variance = scope.GetArena().NewMatrix(n_knots,dim);
+        this->kernel_.predictDot(spline_knots_.col(1),spline_knots_.middleCols(3,dim),spline_knots_.rightCols(dim),variance);
+    }
 
-    Eigen::MatrixXd input_phase(n_points_splines_,1);
-    Eigen::MatrixXd output_position(n_points_splines_,VM_t::state_dim_);
-    //Eigen::MatrixXd output_position_dot(n_points,VM_t::state_dim_);
-    Eigen::MatrixXd position_diff(n_points_splines_-1,VM_t::state_dim_);
-    input_phase.col(0) = VectorXd::LinSpaced(n_points_splines_, 0.0, 1.0);
+    SetSplines();
+}
 
-    // Get xyz from GMR using a linspaced phase [0,1], preserve the rhythme
-    this->fa_->predict(input_phase,output_position);
-    //fa_->predictDot(input_phase,output_position,output_position_dot);
+template <class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::SetSplines()
+{
+    // abscisse (s) -> phase (z) and phase (z) -> abscisse (s), inverse of each other
+    CreateArcLengthMaps(spline_knots_.col(1),spline_knots_.col(0),spline_knots_.col(2),spline_phase_inv_,spline_phase_);
 
     if(use_spline_xyz_)
-    {
-        vector<vector<double> > xyz(VM_t::state_dim_, vector<double>(n_points_splines_));
-        splines_xyz_.resize(VM_t::state_dim_);
-        // Copy to std vectors
-        for(int i=0;i<n_points_splines_;i++)
-        {
-            phase_for_spline[i] = input_phase(i,0);
-            for(int j=0;j<VM_t::state_dim_;j++)
-                xyz[j][i] = output_position(i,j);
-        }
-        for(int i=0;i<VM_t::state_dim_;i++)
-        {
-            splines_xyz_[i].set_points(phase_for_spline,xyz[i]);
-        }
-    }
+        spline_xyz_.SetPoints(spline_knots_.col(1),spline_knots_.middleCols(3,VM_t::state_dim_),spline_knots_.rightCols(VM_t::state_dim_));
     else
-    {
-        for(int i=0;i<n_points_splines_;i++)
-            phase_for_spline[i] = input_phase(i,0);
-    }
+        spline_xyz_.Clear();
+}
 
-    // Compute the abscisse curviligne
-    abscisse_for_spline[0] = 0.0;
-    //position_diff.row(0) = output_position.row(0);
-    for(int i=0;i<position_diff.rows();i++)
-    {
-        position_diff.row(i) = output_position.row(i+1) - output_position.row(i);
-        abscisse_for_spline[i+1] = position_diff.row(i).norm() + abscisse_for_spline[i];
-    }
-    // Normalize
-    for(int i=0;i<abscisse_for_spline.size();i++)
+template <class VM_t>
+bool VirtualMechanismGmrNormalized<VM_t>::LoadModelFromGuideFile(const GuideFile& file)
+{
+    if(!VirtualMechanismGmr<VM_t>::LoadModelFromGuideFile(file))
+        return false;
+
+    // Reuse the knots if they match the configuration, otherwise normalize again
+    section_map_t knots = file.GetSection(SPLINE_KNOTS);
+    if(knots.rows() >= 2 && knots.cols() == 3 + (use_spline_xyz_ ? 2 * VM_t::state_dim_ : 0))
     {
-        abscisse_for_spline[i] = abscisse_for_spline[i]/abscisse_for_spline[n_points_splines_-1];
+        spline_knots_ = knots;
+        SetSplines();
     }
+    else
+        Normalize();
+    return true;
+}
 
-    //tool_box::WriteTxtFile("abscisse.txt",abscisse_for_spline);
-
-    spline_phase_.set_points(abscisse_for_spline,phase_for_spline); // set_points(x,y) ----> z = f(s)
-    spline_phase_inv_.set_points(phase_for_spline,abscisse_for_spline); // set_points(x,y) ----> s = g(z)
+template <class VM_t>
+void VirtualMechanismGmrNormalized<VM_t>::SaveModelToGuideFile(GuideFileWriter& writer)
+{
+    VirtualMechanismGmr<VM_t>::SaveModelToGuideFile(writer);
+    writer.SetModelType(GMR_NORMALIZED);
+    writer.AddSection(SPLINE_KNOTS,spline_knots_);
 }
 
 template<class VM_t>
 bool VirtualMechanismGmrNormalized<VM_t>::ReadConfig()
 {
-    YAML::Node main_node = CreateYamlNodeFromPkgName(ROS_PKG_NAME);
-    if (const YAML::Node& curr_node = main_node["gmr_normalized"])
+    Config::ptr_t cfg = Config::Load(ROS_PKG_NAME);
+    if (cfg->Has("gmr_normalized"))
     {
-        curr_node["use_spline_xyz"] >> use_spline_xyz_;
-        curr_node["n_points_splines"] >> n_points_splines_;
-        curr_node["execution_time"] >> exec_time_;
-        assert(n_points_splines_ > 2);
+        bool ok = true;
+        ok &= cfg->Get("gmr_normalized/use_spline_xyz",use_spline_xyz_);
+        ok &= cfg->Get("gmr_normalized/arc_length_tolerance",arc_length_tolerance_);
+        ok &= cfg->Get("gmr_normalized/execution_time",exec_time_);
+        if(!ok)
+            return false;
+        assert(arc_length_tolerance_ > 0);
         assert(exec_time_ > 0);
         return true;
     }
@@ -181,27 +215,17 @@ bool VirtualMechanismGmrNormalized<VM_t>::ReadConfig()
         return false;
 }
 
-template<class VM_t>
-void VirtualMechanismGmrNormalized<VM_t>::TrainModel(const MatrixXd& data)
-{
-    VirtualMechanismGmr<VM_t>::TrainModel(data);
-    Normalize();
-}
-
-template<class VM_t>
-void VirtualMechanismGmrNormalized<VM_t>::AlignUpdateModel(const MatrixXd& data)
-{
-    VirtualMechanismGmr<VM_t>::AlignUpdateModel(data);
-    Normalize();
-}
-
 template <class VM_t>
 void VirtualMechanismGmrNormalized<VM_t>::UpdateJacobian()
 {
 
   z_dot_ref_ = 1.0/exec_time_;
 
-  z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * spline_phase_.compute_derivate(VM_t::phase_) * VM_t::phase_dot_; // FIXME constant value arbitrary
+  // abscisse (s) -> phase (z) and its derivatives, one lookup
+  double z_s, dz_s, ddz_s;
+  spline_phase_.Evaluate(VM_t::phase_,z_s,dz_s,ddz_s);
+
+  z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * dz_s * VM_t::phase_dot_; // FIXME constant value arbitrary
 
   if(VM_t::active_)
   {
@@ -212,17 +236,18 @@ void VirtualMechanismGmrNormalized<VM_t>::UpdateJacobian()
   }
   else
   {
-      //z_dot_ = spline_phase_.compute_derivate(VM_t::phase_) * VM_t::phase_dot_;
-      z_ = spline_phase_(VM_t::phase_); // abscisse (s) -> phase (z)
+      //z_dot_ = dz_s * VM_t::phase_dot_;
+      z_ = z_s; // abscisse (s) -> phase (z)
   }
 
   // HACKY THING
   // Compute the phase_dot_ref starting by the constant reference in z_dot
   // Ignore all the structure
   // Just out some stuff
-  VM_t::phase_dot_ref_ = spline_phase_inv_.compute_derivate(z_) * z_dot_ref_;
-  VM_t::phase_ddot_ref_ = spline_phase_inv_.compute_second_derivate(z_) * z_dot_ref_;
-  VM_t::phase_ref_ = spline_phase_inv_(z_);
+  double ds_z, dds_z;
+  spline_phase_inv_.Evaluate(z_,VM_t::phase_ref_,ds_z,dds_z);
+  VM_t::phase_dot_ref_ = ds_z * z_dot_ref_;
+  VM_t::phase_ddot_ref_ = dds_z * z_dot_ref_;
 
   // Saturate z
   if(z_ > 1.0)
@@ -230,23 +255,19 @@ void VirtualMechanismGmrNormalized<VM_t>::UpdateJacobian()
   else if (z_ < 0.0)
     z_ = 0;
 
-  this->fa_input_(0,0) = z_;
-  this->fa_->predictDot(this->fa_input_,this->fa_output_,this->fa_output_dot_,this->variance_); // We need this for the covariance
-  this->covariance_ = this->variance_.row(0).asDiagonal();
+  this->PredictDot(z_); // We need this for the covariance
 
   if(!use_spline_xyz_) // Compute xyz and J(z) using GMR
   {
       Jz_ = this->fa_output_dot_.transpose(); // J(z)
-      VM_t::J_transp_ =  this->fa_output_dot_ * spline_phase_.compute_derivate(VM_t::phase_); // J(z) * d(z)/d(s) = J(s)
+      VM_t::J_transp_ =  this->fa_output_dot_ * dz_s; // J(z) * d(z)/d(s) = J(s)
   }
   else // Compute xyz and J(z) using the spline
   {
-      for(int i=0;i<VM_t::state_dim_;i++)
-      {
-          this->fa_output_(0,i) = splines_xyz_[i](this->fa_input_(0,0));
-          Jz_(i,0) = splines_xyz_[i].compute_derivate(this->fa_input_(0,0));
-          VM_t::J_transp_(0,i) = Jz_(i,0) * spline_phase_.compute_derivate(VM_t::phase_);
-      }
+      vector_t xyz;
+      spline_xyz_.Evaluate(z_,xyz,Jz_);
+      this->fa_output_ = xyz.transpose();
+      VM_t::J_transp_ = Jz_.transpose() * dz_s;
   }
   VM_t::J_ = VM_t::J_transp_.transpose();
 }
@@ -258,26 +279,31 @@ void VirtualMechanismGmrNormalized<VM_t>::ComputeStateGivenPhase(const double ab
   assert(abscisse_in >= 0.0);
   assert(state_out.size() == VM_t::state_dim_);
   assert(state_out_dot.size() == VM_t::state_dim_);
-  MatrixXd fa_input, fa_output, fa_output_dot;
-  fa_input.resize(1,1);
-  fa_output.resize(1,VM_t::state_dim_);
-  fa_output_dot.resize(1,VM_t::state_dim_);
+  ArenaScope scope;
+  Map<MatrixXd> fa_input = scope.GetArena().NewMatrix(1,1);
+  Map<MatrixXd> fa_output = scope.GetArena().NewMatrix(1,VM_t::state_dim_);
+  Map<MatrixXd> fa_output_dot = scope.GetArena().NewMatrix(1,VM_t::state_dim_);
+  Map<MatrixXd> fa_variance = scope.GetArena().NewMatrix(1,VM_t::state_dim_);
 
-  fa_input(0,0) = spline_phase_(abscisse_in);
-  phase_out_dot = spline_phase_.compute_derivate(abscisse_in);
+  // Own cursors, the rt thread may use the ones of the splines
+  int cursor = 0;
+  double dd;
+  spline_phase_.Evaluate(abscisse_in,fa_input(0,0),phase_out_dot,dd,cursor);
 
   if(!use_spline_xyz_)
   {
-      this->fa_->predictDot(fa_input,fa_output,fa_output_dot);
+      this->kernel_.predictDot(fa_input,fa_output,fa_output_dot,fa_variance);
       state_out = fa_output.transpose();
       state_out_dot = fa_output_dot.transpose() * phase_out_dot;
   }
   else
-      for(int i=0;i<VM_t::state_dim_;i++)
-      {
-        state_out(i) =  splines_xyz_[i](fa_input(0,0));
-        state_out_dot(i) = splines_xyz_[i].compute_derivate(fa_input(0,0)) * phase_out_dot;
-      }
+  {
+      vector_t xyz, xyz_dot;
+      cursor = 0;
+      spline_xyz_.Evaluate(fa_input(0,0),xyz,xyz_dot,cursor);
+      state_out = xyz;
+      state_out_dot = xyz_dot * phase_out_dot;
+  }
 
   phase_out = fa_input(0,0);
 
@@ -298,6 +324,16 @@ void VirtualMechanismGmrNormalized<VM_t>::UpdateStateDot()
 template <class VM_t>
 bool VirtualMechanismGmr<VM_t>::SaveModelToFile(const string file_path)
 {
+    if(GuideFile::HasGuideFileExtension(file_path))
+    {
+        // Use the file name as guide name
+        const size_t begin = file_path.find_last_of('/') + 1;
+        const std::string name = file_path.substr(begin,file_path.size()-begin-std::strlen(GUIDE_FILE_EXTENSION));
+        GuideFileWriter writer(VM_t::state_dim_,GMR,name);
+        SaveModelToGuideFile(writer);
+        return writer.Save(file_path);
+    }
+
     const ModelParametersGMR* model_parameters_gmr = static_cast<const ModelParametersGMR*>(fa_->getModelParameters());
     if(model_parameters_gmr->saveGMMToMatrix(file_path, true)) // overwrite = true
         return true;
@@ -313,17 +349,15 @@ VirtualMechanismGmr<VM_t>::VirtualMechanismGmr(): VM_t()
       PRINT_ERROR("VirtualMechanismGmr: Can not read config file");
     }
 
-    fa_input_.resize(1,1);
     fa_output_.resize(1,VM_t::state_dim_);
     fa_output_dot_.resize(1,VM_t::state_dim_);
-    variance_.resize(1,VM_t::state_dim_);
-    covariance_.resize(VM_t::state_dim_,VM_t::state_dim_);
-    covariance_inv_.resize(VM_t::state_dim_,VM_t::state_dim_);
-    err_.resize(VM_t::state_dim_);
-    variance_.fill(1.0);
-    covariance_ = variance_.row(0).asDiagonal();
     covariance_inv_.fill(0.0);
     err_.fill(0.0);
+    baked_pos_.fill(0.0);
+    baked_pos_dot_.fill(0.0);
+    baked_variance_.fill(1.0);
+    covariance_ = baked_variance_.asDiagonal();
+    recorded_refs_from_file_ = false;
     fa_ = NULL;
 }
 
@@ -350,6 +384,7 @@ VirtualMechanismGmr<VM_t>::VirtualMechanismGmr(const fa_t* const fa) : VirtualMe
     assert(fa!=NULL);
     assert(fa->isTrained());
     fa_ = dynamic_cast<fa_t*>(fa->clone());
+    BakeModel();
     VM_t::Init();
 }
 
@@ -362,12 +397,41 @@ VirtualMechanismInterface* VirtualMechanismGmr<VM_t>::Clone()
 template<class VM_t>
 bool VirtualMechanismGmr<VM_t>::ReadConfig()
 {
-    YAML::Node main_node = CreateYamlNodeFromPkgName(ROS_PKG_NAME);
-    if (const YAML::Node& curr_node = main_node["gmr"])
+    Config::ptr_t cfg = Config::Load(ROS_PKG_NAME);
+    if (cfg->Has("gmr"))
     {
-        curr_node["n_gaussians"] >> n_gaussians_;
-        curr_node["use_align"] >> use_align_;
+        bool ok = true;
+        ok &= cfg->Get("gmr/n_gaussians",n_gaussians_);
+        ok &= cfg->Get("gmr/use_align",use_align_);
+        ok &= cfg->Get("gmr/dtw_band",dtw_band_);
+        ok &= cfg->Get("gmr/dtw_band_width",dtw_band_width_);
+        ok &= cfg->Get("gmr/dtw_itakura_slope",dtw_itakura_slope_);
+        ok &= cfg->Get("gmr/dtw_fast_radius",dtw_fast_radius_);
+        ok &= cfg->Get("gmr/training_restarts",training_restarts_);
+        ok &= cfg->Get("gmr/n_gaussians_max",n_gaussians_max_);
+        ok &= cfg->Get("gmr/training_threads",training_threads_);
+        ok &= cfg->Get("gmr/streaming_em_iterations",streaming_em_iterations_);
+        ok &= cfg->Get("gmr/streaming_prior_weight",streaming_prior_weight_);
+        ok &= cfg->Get("gmr/use_baked_table",use_baked_table_);
+        ok &= cfg->Get("gmr/baked_table_max_error",baked_table_max_error_);
+        ok &= cfg->Get("gmr/baked_table_max_error_dot",baked_table_max_error_dot_);
+        ok &= cfg->Get("gmr/baked_table_max_error_variance",baked_table_max_error_variance_);
+        ok &= cfg->Get("gmr/baked_table_max_points",baked_table_max_points_);
+        if(!ok)
+            return false;
         assert(n_gaussians_ > 0);
+        assert(dtw_band_ == "none" || dtw_band_ == "sakoe_chiba" || dtw_band_ == "itakura" || dtw_band_ == "fast");
+        assert(dtw_band_width_ > 0.0 && dtw_band_width_ <= 1.0);
+        assert(dtw_itakura_slope_ >= 1.0);
+        assert(dtw_fast_radius_ >= 0);
+        assert(training_restarts_ > 0);
+        assert(training_threads_ >= 0);
+        assert(streaming_em_iterations_ >= 0);
+        assert(streaming_prior_weight_ >= 0.0);
+        assert(baked_table_max_error_ > 0.0);
+        assert(baked_table_max_error_dot_ > 0.0);
+        assert(baked_table_max_error_variance_ > 0.0);
+        assert(baked_table_max_points_ > 2);
         return true;
     }
     else
@@ -384,6 +448,8 @@ bool VirtualMechanismGmr<VM_t>::CreateModelFromData(const MatrixXd& data)
         fa_ = new fa_t(meta_parameters_gmr);
     }
 
+    recorded_refs_from_file_ = false;
+
     if(use_align_ && fa_->isTrained()) // Update only if the model has been already trained!
         AlignUpdateModel(data);
     else
@@ -393,24 +459,172 @@ bool VirtualMechanismGmr<VM_t>::CreateModelFromData(const MatrixXd& data)
     assert(fa_->getExpectedInputDim() == 1);
     assert(fa_->getExpectedOutputDim() == VM_t::state_dim_);
 
+    BakeModel();
+
+    return true;
+}
+
+template<class VM_t>
+bool VirtualMechanismGmr<VM_t>::AddDataChunk(const MatrixXd& data)
+{
+    if(fa_ == NULL || !fa_->isTrained() || data.rows() == 0)
+        return false;
+
+    if(!stream_em_.IsInitialized()) // First chunk, start from the current model
+    {
+        const ModelParametersGMR* model_parameters_gmr = static_cast<const ModelParametersGMR*>(fa_->getModelParameters());
+        MatrixXd gmm;
+        model_parameters_gmr->toMatrix(gmm);
+        if(!stream_em_.Init(gmm,streaming_prior_weight_,GMR_MIN_VARIANCE))
+            return false;
+        stream_phase_ = 0.0;
+    }
+
+    MatrixXd chunk(data.rows(),1 + VM_t::state_dim_);
+    if(data.cols() == VM_t::state_dim_ + 1) // phase + pos
+        chunk = data;
+    else // only pos
+    {
+        // The abscisse needs the whole demonstration, the phase is the projection on the
+        // current guide instead, forced to be monotonic. The state of the guide is not changed.
+        for(int i=0;i<data.rows();i++)
+        {
+            const vector_t query = data.row(i).transpose();
+            stream_phase_ = std::max(stream_phase_,VM_t::ProjectPhase(query));
+            chunk(i,0) = stream_phase_;
+        }
+        chunk.rightCols(VM_t::state_dim_) = data;
+    }
+
+    stream_em_.AddChunk(chunk);
+    return true;
+}
+
+template<class VM_t>
+bool VirtualMechanismGmr<VM_t>::CreateModelFromStream()
+{
+    if(!TrainModelFromStream())
+        return false;
+    VM_t::Init();
+    return true;
+}
+
+template<class VM_t>
+bool VirtualMechanismGmr<VM_t>::TrainModelFromStream()
+{
+    if(!stream_em_.IsInitialized())
+        return false;
+
+    stream_em_.Refine(streaming_em_iterations_);
+    MatrixXd gmm;
+    stream_em_.ToMatrix(gmm);
+    stream_em_ = StreamingEm<VM_t::dim>(); // Ready for the next demonstration
+
+    ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::fromMatrix(gmm);
+    if(model_parameters_gmr==NULL)
+        return false;
+    delete fa_;
+    fa_ = new fa_t(model_parameters_gmr);
+    assert(fa_->getExpectedInputDim() == 1);
+    assert(fa_->getExpectedOutputDim() == VM_t::state_dim_);
+
+    recorded_refs_from_file_ = false;
+    BakeModel();
     return true;
 }
 
 template<class VM_t>
 bool VirtualMechanismGmr<VM_t>::CreateModelFromFile(const std::string file_path)
 {
+    if(GuideFile::IsGuideFile(file_path))
+    {
+        GuideFile file;
+        if(!file.Open(file_path))
+            return false;
+        if(file.GetHeader().state_dim != VM_t::state_dim_)
+        {
+            PRINT_WARNING("Guide file "<< file_path <<" has dimension "<< file.GetHeader().state_dim);
+            return false;
+        }
+        return LoadModelFromGuideFile(file);
+    }
+
     ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
     if(model_parameters_gmr!=NULL)
     {
-        fa_ = new fa_t(model_parameters_gmr);
+        fa_t* fa = new fa_t(model_parameters_gmr);
+        delete fa_; // Previous model, if any
+        fa_ = fa;
         assert(fa_->getExpectedInputDim() == 1);
         assert(fa_->getExpectedOutputDim() == VM_t::state_dim_);
+        BakeModel();
         return true;
     }
     else
         return false;
 }
 
+template<class VM_t>
+bool VirtualMechanismGmr<VM_t>::LoadModelFromGuideFile(const GuideFile& file)
+{
+    section_map_t gmm = file.GetSection(GMM);
+    if(gmm.size() == 0)
+        return false;
+
+    ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::fromMatrix(gmm);
+    if(model_parameters_gmr==NULL)
+        return false;
+    fa_t* fa = new fa_t(model_parameters_gmr);
+    delete fa_; // Previous model, if any
+    fa_ = fa;
+    assert(fa_->getExpectedInputDim() == 1);
+    assert(fa_->getExpectedOutputDim() == VM_t::state_dim_);
+
+    // Baked table, baked again if missing or not valid
+    kernel_.Build(fa_);
+    if(use_baked_table_)
+    {
+        if(phase_table_.Import(file.GetSection(BAKED_TABLE)))
+            PRINT_INFO("Gmr baked table loaded with "<<phase_table_.GetNbPoints()<<" points");
+        else
+            BakeModel();
+    }
+
+    // Discretization, used by CreateRecordedRefs() if it matches the configuration
+    section_map_t refs = file.GetSection(RECORDED_REFS);
+    if(refs.rows() == VM_t::n_points_discretization_ && refs.cols() == 1 + VM_t::state_dim_)
+    {
+        VM_t::phase_recorded_ = refs.leftCols(1);
+        VM_t::state_recorded_ = refs.rightCols(VM_t::state_dim_);
+        recorded_refs_from_file_ = true;
+    }
+
+    return true;
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::SaveModelToGuideFile(GuideFileWriter& writer)
+{
+    const ModelParametersGMR* model_parameters_gmr = static_cast<const ModelParametersGMR*>(fa_->getModelParameters());
+    MatrixXd gmm;
+    model_parameters_gmr->toMatrix(gmm);
+    writer.AddSection(GMM,gmm);
+
+    if(phase_table_.IsBaked())
+    {
+        MatrixXd nodes;
+        phase_table_.Export(nodes);
+        writer.AddSection(BAKED_TABLE,nodes);
+    }
+
+    if(VM_t::state_recorded_.rows() > 1)
+    {
+        MatrixXd refs(VM_t::state_recorded_.rows(),1 + VM_t::state_dim_);
+        refs << VM_t::phase_recorded_, VM_t::state_recorded_;
+        writer.AddSection(RECORDED_REFS,refs);
+    }
+}
+
 template <class VM_t>
 VirtualMechanismGmr<VM_t>::~VirtualMechanismGmr()
 {
@@ -418,16 +632,16 @@ VirtualMechanismGmr<VM_t>::~VirtualMechanismGmr()
 }
 
 template<class VM_t>
-void VirtualMechanismGmr<VM_t>::ComputeStateGivenPhase(const double phase_in, VectorXd& state_out) // Not for rt
+void VirtualMechanismGmr<VM_t>::ComputeStateGivenPhase(const double phase_in, Ref<VectorXd> state_out) // Not for rt
 {
   assert(phase_in <= 1.0);
   assert(phase_in >= 0.0);
   assert(state_out.size() == VM_t::state_dim_);
-  MatrixXd fa_input, fa_output;
-  fa_input.resize(1,1);
-  fa_output.resize(1,VM_t::state_dim_);
+  ArenaScope scope;
+  Map<MatrixXd> fa_input = scope.GetArena().NewMatrix(1,1);
+  Map<MatrixXd> fa_output = scope.GetArena().NewMatrix(1,VM_t::state_dim_);
   fa_input(0,0) = phase_in;
-  fa_->predict(fa_input,fa_output);
+  kernel_.predict(fa_input,fa_output);
   state_out = fa_output.transpose();
 }
 
@@ -444,16 +658,48 @@ void VirtualMechanismGmr<VM_t>::ComputeFinalState()
 }
 
 template<class VM_t>
-void VirtualMechanismGmr<VM_t>::UpdateJacobian()
+void VirtualMechanismGmr<VM_t>::BakeModel() // Not for rt, every time the model changes
 {
-  fa_input_(0,0) = VM_t::phase_; // Convert to Eigen Matrix
+  if(!kernel_.Build(fa_))
+      PRINT_ERROR("Can not build the gmr kernel, unexpected model parameters");
 
-  fa_->predictDot(fa_input_,fa_output_,fa_output_dot_,variance_);
+  if(!use_baked_table_)
+      return;
 
-  covariance_ = variance_.row(0).asDiagonal();
+  if(phase_table_.Bake(&kernel_,baked_table_max_error_,baked_table_max_error_dot_,baked_table_max_error_variance_,17,baked_table_max_points_))
+      PRINT_INFO("Gmr baked with "<<phase_table_.GetNbPoints()<<" points, max errors "<<phase_table_.GetMaxError()
+                 <<" (pos) "<<phase_table_.GetMaxErrorDot()<<" (pos_dot) "<<phase_table_.GetMaxErrorVariance()<<" (variance)");
+  else
+      PRINT_WARNING("Gmr baked with "<<phase_table_.GetNbPoints()<<" points, max errors "<<phase_table_.GetMaxError()
+                    <<" (pos) "<<phase_table_.GetMaxErrorDot()<<" (pos_dot) "<<phase_table_.GetMaxErrorVariance()<<" (variance) above the bounds "
+                    <<baked_table_max_error_<<" "<<baked_table_max_error_dot_<<" "<<baked_table_max_error_variance_);
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::PredictDot(const double phase)
+{
+  if(use_baked_table_)
+  {
+      // O(1), independent from the number of gaussians
+      phase_table_.Evaluate(phase,baked_pos_,baked_pos_dot_,baked_variance_);
+      fa_output_ = baked_pos_.transpose();
+      fa_output_dot_ = baked_pos_dot_.transpose();
+      covariance_ = baked_variance_.asDiagonal();
+  }
+  else
+  {
+      kernel_.Evaluate(phase,baked_pos_,baked_pos_dot_,baked_variance_);
+      fa_output_ = baked_pos_.transpose();
+      fa_output_dot_ = baked_pos_dot_.transpose();
+      covariance_ = baked_variance_.asDiagonal();
+  }
+}
+
+template<class VM_t>
+void VirtualMechanismGmr<VM_t>::UpdateJacobian()
+{
+  PredictDot(VM_t::phase_);
 
-  //covariance_ = variance_;
-  
   VM_t::J_transp_ = fa_output_dot_; // NOTE The output is transposed!
   VM_t::J_ = VM_t::J_transp_.transpose();
 }
@@ -480,7 +726,7 @@ template<class VM_t>
 void VirtualMechanismGmr<VM_t>::UpdateInvCov()
 {
   for (int i = 0; i<VM_t::state_dim_; i++) // NOTE We assume that is a diagonal matrix
-        covariance_inv_(i,i) = 1/(covariance_(i,i));
+        covariance_inv_(i,i) = 1.0/std::max(covariance_(i,i),GMR_MIN_VARIANCE);
         //covariance_inv_(i,i) = 1.0;
 
   //covariance_inv_ = covariance_.inverse();
@@ -496,16 +742,16 @@ double VirtualMechanismGmr<VM_t>::ComputeProbability(const VectorXd& pos)
   // NOTE Since the covariance matrix is a diagonal matrix:
   // output = exp(-0.5*err_.transpose()*covariance_inv_*err_);
   // becomes:
+  // NOTE Computed as a log, the product of small variances underflows and the
+  // inverse of a null variance is bounded by UpdateInvCov()
   double prob = 0.0;
-  double determinant_cov = 1.0;
+  double log_determinant_cov = 0.0;
   for (int i = 0; i<VM_t::state_dim_; i++)
   {
     prob += err_(i)*err_(i)*covariance_inv_(i,i);
-    determinant_cov *= covariance_(i,i);
+    log_determinant_cov -= std::log(covariance_inv_(i,i));
   }
 
-  prob = exp(-0.5*prob);
-
   //prob_ = exp(-0.5*err_.transpose()*covariance_inv_*err_);
   //determinant_cov = covariance_inv_.determinant();
 
@@ -513,7 +759,7 @@ double VirtualMechanismGmr<VM_t>::ComputeProbability(const VectorXd& pos)
   // Hence the 1.0/covariance_inv_.determinant() below
   //  ( (2\pi)^N*|\Sigma| )^(-1/2)
 
-  prob *= pow(pow(2*M_PI,VM_t::state_.size()) * determinant_cov,-0.5);
+  prob = exp(-0.5*(prob + VM_t::state_.size() * std::log(2*M_PI) + log_determinant_cov));
 
   return prob;
 }
@@ -550,6 +796,23 @@ void VirtualMechanismGmr<VM_t>::TrainModel(const MatrixXd& data)
     //phase.col(0) = VectorXd::LinSpaced(pos.rows(), 0.0, 1.0); // Time
     ComputeAbscisse(pos,phase); // Abscisse
   }
+
+  // A trained model keeps what it learned from the previous demonstrations, only a new one is selected
+  if(!fa_->isTrained() && (training_restarts_ > 1 || n_gaussians_max_ > n_gaussians_))
+  {
+      // Multi-start EM and sweep on the number of gaussians, in parallel
+      GmrModelSelection<VM_t::dim> selection(n_gaussians_,std::max(n_gaussians_,n_gaussians_max_),training_restarts_,training_threads_);
+      fa_t* fa = selection.Train(phase,pos);
+      if(fa != NULL)
+      {
+          const typename GmrModelSelection<VM_t::dim>::Candidate& selected = selection.GetCandidates()[selection.GetSelected()];
+          PRINT_INFO("Gmr selected "<<selected.n_gaussians<<" gaussians (restart "<<selected.restart<<"), BIC "<<selected.bic);
+          delete fa_;
+          fa_ = fa;
+          return;
+      }
+      PRINT_WARNING("Gmr model selection failed, single training with "<<n_gaussians_<<" gaussians");
+  }
   fa_->trainIncremental(phase,pos);
 }
 
@@ -558,12 +821,15 @@ void VirtualMechanismGmr<VM_t>::AlignUpdateModel(const MatrixXd& data)
 {
     int n_points = data.rows();
 
+    // The references only live during the alignment, they are taken from the thread arena.
+    // pos and phase stay on the heap, they are given to the function approximator.
+    ArenaScope scope;
     MatrixXd pos, phase;
-    MatrixXd pos_ref(n_points,VM_t::state_dim_);
-    MatrixXd phase_ref(n_points,1);
+    Map<MatrixXd> pos_ref = scope.GetArena().NewMatrix(n_points,VM_t::state_dim_);
+    Map<MatrixXd> phase_ref = scope.GetArena().NewMatrix(n_points,1);
     phase_ref.col(0) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
 
-    this->fa_->predict(phase_ref,pos_ref);
+    kernel_.predict(phase_ref,pos_ref);
 
     // Extract the phase and the pos
     if(data.cols() == VM_t::state_dim_ + 1) // phase + pos
@@ -582,7 +848,17 @@ void VirtualMechanismGmr<VM_t>::AlignUpdateModel(const MatrixXd& data)
     //std::string file_name = "/home/sybot/gennaro_output/phase_before.txt";
     //WriteTxtFile(file_name.c_str(),phase);
 
-    align_phase(phase,phase_ref,pos,pos_ref);
+    // Banded dtw, the memory and the time grow with the band instead of n_points^2
+    Window win;
+    if(dtw_band_ == "sakoe_chiba")
+        win = SakoeChibaWindow(n_points,n_points,std::ceil(dtw_band_width_ * n_points));
+    else if(dtw_band_ == "itakura")
+        win = ItakuraWindow(n_points,n_points,dtw_itakura_slope_);
+    else if(dtw_band_ == "fast") // Coarse to fine, for the long demonstrations
+        win = FastDtwWindow(pos,pos_ref,dtw_fast_radius_);
+    else
+        win = FullWindow(n_points,n_points);
+    align_phase(phase,phase_ref,pos,pos_ref,win);
 
     //file_name = "/home/sybot/gennaro_output/phase_after.txt";
     //WriteTxtFile(file_name.c_str(),phase);
@@ -609,17 +885,31 @@ void VirtualMechanismGmr<VM_t>::CreateRecordedRefs()
     //VM_t::state_recorded_.resize(n_points,VM_t::state_dim_);
     //VM_t::phase_recorded_ = VectorXd::LinSpaced(n_points, 0.0, 1.0);
 
-    VM_t::state_recorded_.resize(VM_t::n_points_discretization_,VM_t::state_dim_);
-    VM_t::phase_recorded_.resize(VM_t::n_points_discretization_,1);
-    VM_t::tmp_dists_.resize(VM_t::n_points_discretization_);
-    VM_t::phase_recorded_.col(0) = VectorXd::LinSpaced(VM_t::n_points_discretization_, 0.0, 1.0);
+    if(recorded_refs_from_file_) // Already filled by LoadModelFromGuideFile()
+        recorded_refs_from_file_ = false;
+    else
+    {
+        VM_t::state_recorded_.resize(VM_t::n_points_discretization_,VM_t::state_dim_);
+        VM_t::phase_recorded_.resize(VM_t::n_points_discretization_,1);
+        VM_t::phase_recorded_.col(0) = VectorXd::LinSpaced(VM_t::n_points_discretization_, 0.0, 1.0);
+
+        kernel_.predict(VM_t::phase_recorded_,VM_t::state_recorded_);
+    }
+
+    MatrixXd phase_samples(VM_t::GetNbBoundsSamples(),1), samples;
+    phase_samples.col(0) = VectorXd::LinSpaced(phase_samples.rows(), 0.0, 1.0);
+    kernel_.predict(phase_samples,samples);
 
-    fa_->predict(VM_t::phase_recorded_,VM_t::state_recorded_);
+    VM_t::IndexRecordedRefs(samples);
 }
 
 // Explicitly instantiate the templates, and its member definitions
-template class VirtualMechanismGmr<VirtualMechanismInterfaceFirstOrder>;
-template class VirtualMechanismGmr<VirtualMechanismInterfaceSecondOrder>;
-template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceFirstOrder>;
-template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceSecondOrder>;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceFirstOrder<2> >;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceSecondOrder<2> >;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceFirstOrder<3> >;
+template class VirtualMechanismGmr<VirtualMechanismInterfaceSecondOrder<3> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceFirstOrder<2> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceSecondOrder<2> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceFirstOrder<3> >;
+template class VirtualMechanismGmrNormalized<VirtualMechanismInterfaceSecondOrder<3> >;
 }
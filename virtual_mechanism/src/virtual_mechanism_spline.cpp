@@ -22,76 +22,337 @@
  */
 
 #include "virtual_mechanism/virtual_mechanism_spline.h"
+#include "virtual_mechanism/virtual_mechanism_factory.h" // model_type_t
+
+////////// STD
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
 
 using namespace std;
 using namespace Eigen;
 using namespace tool_box;
-using namespace tk;
 
 namespace virtual_mechanism
 {
 
-template <typename VM_t>
-bool VirtualMechanismSpline<VM_t>::LoadModelFromFile(const string file_path)
+template <class VM_t>
+VirtualMechanismSpline<VM_t>::VirtualMechanismSpline():
+    VM_t()
 {
-    vector<vector<double> > data; // abscissa phase x y z
-    ReadTxtFile(file_path.c_str(),data);
+    if(!ReadConfig())
+    {
+      PRINT_ERROR("VirtualMechanismSpline: Can not read config file");
+    }
 
-    int n_points = data.size();
+    xyz_.setZero();
+    Jz_.setZero();
+    err_.setZero();
+    responsability_ = 1.0;
+    z_ = 0.0;
+    z_dot_ = 0.0;
+    z_dot_ref_ = 0.1;
+}
 
-    vector<double> abscissa(n_points,0.0);
-    vector<double> phase(n_points,0.0);
-    vector<vector<double> > xyz(VM_t::state_dim_, std::vector<double>(n_points));
+template <class VM_t>
+VirtualMechanismSpline<VM_t>::VirtualMechanismSpline(const string file_path):
+    VirtualMechanismSpline()
+{
+    if(CreateModelFromFile(file_path))
+        VM_t::Init();
+    else
+        PRINT_ERROR("Can not create model from file "<< file_path);
+}
 
-    for(int i=0;i<n_points;i++)
+template <class VM_t>
+VirtualMechanismSpline<VM_t>::VirtualMechanismSpline(const MatrixXd& data):
+    VirtualMechanismSpline()
+{
+    if(CreateModelFromData(data))
+        VM_t::Init();
+    else
+        PRINT_ERROR("Can not create model from data");
+}
+
+template<class VM_t>
+VirtualMechanismInterface* VirtualMechanismSpline<VM_t>::Clone()
+{
+    VirtualMechanismSpline<VM_t>* vm = new VirtualMechanismSpline<VM_t>();
+    vm->spline_knots_ = spline_knots_;
+    vm->responsability_ = responsability_;
+    vm->SetSplines();
+    vm->Init();
+    return vm;
+}
+
+template<class VM_t>
+bool VirtualMechanismSpline<VM_t>::ReadConfig()
+{
+    Config::ptr_t cfg = Config::Load(ROS_PKG_NAME);
+    if (cfg->Has("spline"))
     {
-        abscissa[i] = data[i][0];
-        phase[i] =  data[i][1];
-        for(int j=0;j<VM_t::state_dim_;j++)
-            xyz[j][i] = data[i][j+2];
+        bool ok = true;
+        ok &= cfg->Get("spline/n_knots",n_knots_);
+        ok &= cfg->Get("spline/arc_length_tolerance",arc_length_tolerance_);
+        ok &= cfg->Get("spline/execution_time",exec_time_);
+        ok &= cfg->Get("spline/responsability_std",responsability_std_);
+        if(!ok)
+            return false;
+        assert(n_knots_ >= 2);
+        assert(arc_length_tolerance_ > 0);
+        assert(exec_time_ > 0);
+        assert(responsability_std_ > 0);
+        return true;
     }
+    else
+        return false;
+}
 
-    splines_xyz_.resize(VM_t::state_dim_);
+template<class VM_t>
+bool VirtualMechanismSpline<VM_t>::CreateModelFromData(const MatrixXd& data)
+{
+    spline_t spline_fit;
+    if(!FitSpline(data,spline_fit) || !Normalize(spline_fit))
+        return false;
+
+    // Likelihood of the demonstration itself, the reference for ClusterVm()
+    if(data.cols() == VM_t::state_dim_ + 1)
+        responsability_ = ComputeResponsability(data.rightCols(VM_t::state_dim_));
+    else
+        responsability_ = ComputeResponsability(data);
+    return true;
+}
 
-    for(int i=0;i<VM_t::state_dim_;i++)
-        splines_xyz_[i].set_points(phase,xyz[i]);
+template<class VM_t>
+bool VirtualMechanismSpline<VM_t>::FitSpline(const MatrixXd& data, spline_t& spline_fit) // Not for rt
+{
+    const int n_points = data.rows();
+    if(n_points < 2 || (data.cols() != VM_t::state_dim_ && data.cols() != VM_t::state_dim_ + 1))
+        return false;
 
-    spline_phase_.set_points(abscissa,phase); // set_points(x,y) ----> z = f(s)
-    spline_phase_inv_.set_points(phase,abscissa); // set_points(x,y) ----> s = g(z)
+    // Extract the phase and the pos
+    MatrixXd pos, phase;
+    if(data.cols() == VM_t::state_dim_ + 1) // phase + pos
+    {
+        phase = data.col(0);
+        pos = data.rightCols(VM_t::state_dim_);
+    }
+    else // only pos
+    {
+        pos = data;
+        ComputeAbscisse(pos,phase); // Abscisse
+    }
+    const double phase_min = phase.minCoeff();
+    const double phase_max = phase.maxCoeff();
+    if(!(phase_max > phase_min))
+        return false;
+    const VectorXd z = (phase.col(0).array() - phase_min) / (phase_max - phase_min);
+
+    // Knots uniform in z, each one is the local quadratic regression of the data around it,
+    // with a gaussian window as wide as the knots spacing (no bias on the curvature)
+    const int n_knots = std::min(n_knots_,n_points);
+    const VectorXd knots = VectorXd::LinSpaced(n_knots,0.0,1.0);
+    const double h = 1.0 / (n_knots - 1);
+    MatrixXd knots_xyz(n_knots,VM_t::state_dim_);
+    for(int k=0;k<n_knots;k++)
+    {
+        Matrix3d A = Matrix3d::Zero();
+        Matrix<double,3,VM_t::dim> B = Matrix<double,3,VM_t::dim>::Zero();
+        int closest = 0;
+        for(int i=0;i<n_points;i++)
+        {
+            const double d = (z(i) - knots(k)) / h;
+            const double w = std::exp(-0.5 * d * d);
+            const Vector3d basis(1.0,d,d*d);
+            A += w * basis * basis.transpose();
+            B += w * basis * pos.row(i);
+            if(std::abs(z(i) - knots(k)) < std::abs(z(closest) - knots(k)))
+                closest = i;
+        }
+        FullPivLU<Matrix3d> lu(A);
+        lu.setThreshold(1e-9);
+        if(lu.rank() == 3)
+            knots_xyz.row(k) = lu.solve(B).row(0);
+        else if(A(0,0) > 0.0) // Not enough distinct phases around the knot
+            knots_xyz.row(k) = B.row(0) / A(0,0);
+        else // Gap in the demonstration
+            knots_xyz.row(k) = pos.row(closest);
+    }
 
+    spline_fit.SetPoints(knots,knots_xyz);
     return true;
 }
 
-template <typename VM_t>
-VirtualMechanismSpline<VM_t>::VirtualMechanismSpline(const string file_path):
-    VM_t()
+template <class VM_t>
+bool VirtualMechanismSpline<VM_t>::Normalize(const spline_t& spline_fit) // Not for rt
 {
-    LoadModelFromFile(file_path);
+    const int dim = VM_t::state_dim_;
 
-    Jz_.resize(VM_t::state_dim_,1);
-    err_.resize(VM_t::state_dim_);
-    err_.fill(0.0);
+    // Arc length of the fitted spline. The initial pieces are its segments, so the Hermite spline
+    // on the knots of the arc length reproduces it exactly.
+    ArcLength arc_length(arc_length_tolerance_,16,spline_fit.GetNbPoints()-1);
+    arc_length.Compute([&](const Ref<const VectorXd>& phase, Ref<VectorXd> speed)
+    {
+        vector_t xyz, xyz_dot;
+        int cursor = 0;
+        for(int i=0;i<phase.size();i++)
+        {
+            spline_fit.Evaluate(phase(i),xyz,xyz_dot,cursor);
+            speed(i) = xyz_dot.norm();
+        }
+    },0.0,1.0);
+
+    VectorXd abscisse, dabscisse;
+    if(!arc_length.GetNormalized(abscisse,dabscisse))
+    {
+        PRINT_WARNING("VirtualMechanismSpline: The guide has no length");
+        return false;
+    }
 
-    z_ = 0.0;
-    z_dot_ = 0.0;
-    z_dot_ref_ = 0.1;
+    const int n_knots = arc_length.GetNbKnots();
+    spline_knots_.resize(n_knots,3 + 2 * dim);
+    spline_knots_.col(0) = abscisse;
+    spline_knots_.col(1) = arc_length.GetKnots();
+    spline_knots_.col(2) = dabscisse;
+    vector_t xyz, xyz_dot;
+    int cursor = 0;
+    for(int i=0;i<n_knots;i++)
+    {
+        spline_fit.Evaluate(spline_knots_(i,1),xyz,xyz_dot,cursor);
+        spline_knots_.block(i,3,1,dim) = xyz.transpose();
+        spline_knots_.block(i,3+dim,1,dim) = xyz_dot.transpose();
+    }
+
+    SetSplines();
+    return true;
+}
+
+template <class VM_t>
+void VirtualMechanismSpline<VM_t>::SetSplines()
+{
+    // abscisse (s) -> phase (z) and phase (z) -> abscisse (s), inverse of each other
+    CreateArcLengthMaps(spline_knots_.col(1),spline_knots_.col(0),spline_knots_.col(2),spline_phase_inv_,spline_phase_);
+    spline_xyz_.SetPoints(spline_knots_.col(1),spline_knots_.middleCols(3,VM_t::state_dim_),spline_knots_.rightCols(VM_t::state_dim_));
+}
+
+template<class VM_t>
+bool VirtualMechanismSpline<VM_t>::CreateModelFromFile(const string file_path)
+{
+    if(GuideFile::IsGuideFile(file_path))
+    {
+        GuideFile file;
+        if(!file.Open(file_path))
+            return false;
+        if(file.GetHeader().state_dim != VM_t::state_dim_)
+        {
+            PRINT_WARNING("Guide file "<< file_path <<" has dimension "<< file.GetHeader().state_dim);
+            return false;
+        }
+        return LoadModelFromGuideFile(file);
+    }
+
+    // Text file, one point per row
+    if(!std::ifstream(file_path.c_str()).good())
+        return false;
+    vector<vector<double> > values;
+    ReadTxtFile(file_path,values);
+    int n_cols = 0;
+    for(size_t i=0;i<values.size() && n_cols == 0;i++)
+        n_cols = values[i].size();
+    MatrixXd data(values.size(),n_cols);
+    int n_rows = 0;
+    for(size_t i=0;i<values.size();i++)
+    {
+        if(values[i].empty())
+            continue;
+        if(static_cast<int>(values[i].size()) != n_cols)
+            return false;
+        for(int j=0;j<n_cols;j++)
+            data(n_rows,j) = values[i][j];
+        n_rows++;
+    }
+    data.conservativeResize(n_rows,n_cols);
+
+    if(n_cols == 3 + 2 * VM_t::state_dim_) // Knots, see SaveModelToFile()
+    {
+        if(n_rows < 2)
+            return false;
+        spline_knots_ = data;
+        responsability_ = 1.0;
+        SetSplines();
+        return true;
+    }
+    else // Demonstration
+        return CreateModelFromData(data);
 }
 
-template <typename VM_t>
+template <class VM_t>
+bool VirtualMechanismSpline<VM_t>::SaveModelToFile(const string file_path)
+{
+    if(GuideFile::HasGuideFileExtension(file_path))
+    {
+        // Use the file name as guide name
+        const size_t begin = file_path.find_last_of('/') + 1;
+        const std::string name = file_path.substr(begin,file_path.size()-begin-std::strlen(GUIDE_FILE_EXTENSION));
+        GuideFileWriter writer(VM_t::state_dim_,SPLINE,name);
+        SaveModelToGuideFile(writer);
+        return writer.Save(file_path);
+    }
+
+    // Text file with the knots, full precision so that the guide is the same once loaded
+    std::ofstream out(file_path.c_str());
+    if(!out.is_open())
+        return false;
+    out << std::setprecision(std::numeric_limits<double>::digits10 + 2);
+    for(int i=0;i<spline_knots_.rows();i++)
+    {
+        for(int j=0;j<spline_knots_.cols();j++)
+            out << (j > 0 ? " " : "") << spline_knots_(i,j);
+        out << "\n";
+    }
+    return out.good();
+}
+
+template <class VM_t>
+bool VirtualMechanismSpline<VM_t>::LoadModelFromGuideFile(const GuideFile& file)
+{
+    section_map_t knots = file.GetSection(SPLINE_KNOTS);
+    if(knots.rows() < 2 || knots.cols() != 3 + 2 * VM_t::state_dim_)
+        return false;
+    spline_knots_ = knots;
+    responsability_ = 1.0;
+    SetSplines();
+    return true;
+}
+
+template <class VM_t>
+void VirtualMechanismSpline<VM_t>::SaveModelToGuideFile(GuideFileWriter& writer)
+{
+    writer.AddSection(SPLINE_KNOTS,spline_knots_);
+}
+
+template <class VM_t>
 void VirtualMechanismSpline<VM_t>::UpdateJacobian()
 {
-    z_dot_ref_ = 1.0/VM_t::exec_time_;
+    z_dot_ref_ = 1.0/exec_time_;
 
-    z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * spline_phase_.compute_derivate(VM_t::phase_) * VM_t::phase_dot_; // FIXME constant value arbitrary
+    // abscisse (s) -> phase (z) and its derivatives, one lookup
+    double z_s, dz_s, ddz_s;
+    spline_phase_.Evaluate(VM_t::phase_,z_s,dz_s,ddz_s);
+
+    z_dot_ = VM_t::fade_ *  z_dot_ref_ + (VM_t::fade_sys_.GetRef()-VM_t::fade_) * dz_s * VM_t::phase_dot_; // FIXME constant value arbitrary
 
     if(VM_t::active_)
         z_ = z_dot_ * VM_t::dt_ + z_;
     else
-        z_ = spline_phase_(VM_t::phase_); // abscisse (s) -> phase (z)
+        z_ = z_s; // abscisse (s) -> phase (z)
 
-    VM_t::phase_dot_ref_ = spline_phase_inv_.compute_derivate(z_) * z_dot_ref_;
-    VM_t::phase_ddot_ref_ = spline_phase_inv_.compute_second_derivate(z_) * z_dot_ref_;
-    VM_t::phase_ref_ = spline_phase_inv_(z_);
+    // Phase references from the constant reference in z_dot
+    double ds_z, dds_z;
+    spline_phase_inv_.Evaluate(z_,VM_t::phase_ref_,ds_z,dds_z);
+    VM_t::phase_dot_ref_ = ds_z * z_dot_ref_;
+    VM_t::phase_ddot_ref_ = dds_z * z_dot_ref_;
 
     // Saturate z
     if(z_ > 1.0)
@@ -99,90 +360,146 @@ void VirtualMechanismSpline<VM_t>::UpdateJacobian()
     else if (z_ < 0.0)
       z_ = 0;
 
-    for(int i=0;i<VM_t::state_dim_;i++)
-    {
-        //this->fa_output_(0,i) = splines_xyz_[i](z_);
-        Jz_(i,0) = splines_xyz_[i].compute_derivate(z_);
-        VM_t::J_transp_(0,i) = Jz_(i,0) * spline_phase_.compute_derivate(VM_t::phase_);
-    }
-
+    spline_xyz_.Evaluate(z_,xyz_,Jz_); // xyz(z) and J(z)
+    VM_t::J_transp_ = Jz_.transpose() * dz_s; // J(z) * d(z)/d(s) = J(s)
     VM_t::J_ = VM_t::J_transp_.transpose();
 }
 
-template<typename VM_t>
+template<class VM_t>
 void VirtualMechanismSpline<VM_t>::UpdateState()
 {
-    for(int i=0;i<VM_t::state_dim_;i++)
-        VM_t::state_(i) = splines_xyz_[i](z_);
+    VM_t::state_ = xyz_;
 }
 
-template<typename VM_t>
+template<class VM_t>
 void VirtualMechanismSpline<VM_t>::UpdateStateDot()
 {
-    VM_t::state_dot_ = this->Jz_ * this->z_dot_; // Keep the velocities of the demonstrations
+    VM_t::state_dot_ = Jz_ * z_dot_; // Keep the velocities of the demonstrations
 }
 
 template<class VM_t>
-void VirtualMechanismSpline<VM_t>::ComputeStateGivenPhase(const double phase_in, VectorXd& state_out)
+void VirtualMechanismSpline<VM_t>::ComputeStateGivenPhase(const double abscisse_in, Ref<VectorXd> state_out) // Not for rt
 {
-   assert(phase_in <= 1.0);
-   assert(phase_in >= 0.0);
-   assert(state_out.size() == VM_t::state_dim_);
-
-   for(int i=0;i<VM_t::state_dim_;i++)
-       state_out(i) = splines_xyz_[i](phase_in);
+    assert(abscisse_in <= 1.0);
+    assert(abscisse_in >= 0.0);
+    assert(state_out.size() == VM_t::state_dim_);
+
+    // Own cursors, the rt thread may use the ones of the splines
+    int cursor = 0;
+    double z, dz, ddz;
+    spline_phase_.Evaluate(abscisse_in,z,dz,ddz,cursor);
+
+    vector_t xyz, xyz_dot;
+    cursor = 0;
+    spline_xyz_.Evaluate(z,xyz,xyz_dot,cursor);
+    state_out = xyz;
 }
 
-/*template<class VM_t>
-void VirtualMechanismGmr<VM_t>::ComputeStateGivenPhase(const double abscisse_in, VectorXd& state_out, VectorXd& state_out_dot, double& phase_out, double& phase_out_dot)
+template<class VM_t>
+void VirtualMechanismSpline<VM_t>::ComputeInitialState()
 {
-  assert(phase_in <= 1.0);
-  assert(phase_in >= 0.0);
-  assert(state_out.size() == VM_t::state_dim_);
-  assert(state_out_dot.size() == VM_t::state_dim_);
-
-  phase_out = spline_phase_(abscisse_in);
-  phase_out_dot = spline_phase_.compute_derivate(abscisse_in);
+    ComputeStateGivenPhase(0.0,VM_t::initial_state_);
+}
 
-  for(int i=0;i<VM_t::state_dim_;i++)
-  {
-      VM_t::state_out_dot(i) = splines_xyz_[i].compute_derivate(phase_out) * phase_out_dot;
-      VM_t::state_(i) = splines_xyz_[i](phase_out);
-  }
-}*/
+template<class VM_t>
+void VirtualMechanismSpline<VM_t>::ComputeFinalState()
+{
+    ComputeStateGivenPhase(1.0,VM_t::final_state_);
+}
 
 template<class VM_t>
-void VirtualMechanismSpline<VM_t>::ComputeInitialState()
+void VirtualMechanismSpline<VM_t>::CreateRecordedRefs()
 {
-  ComputeStateGivenPhase(0.0,VM_t::initial_state_);
+    VM_t::state_recorded_.resize(VM_t::n_points_discretization_,VM_t::state_dim_);
+    VM_t::phase_recorded_.resize(VM_t::n_points_discretization_,1);
+    VM_t::phase_recorded_.col(0) = VectorXd::LinSpaced(VM_t::n_points_discretization_, 0.0, 1.0);
+
+    vector_t state;
+    for(int i=0;i<VM_t::n_points_discretization_;i++)
+    {
+        ComputeStateGivenPhase(VM_t::phase_recorded_(i,0),state);
+        VM_t::state_recorded_.row(i) = state.transpose();
+    }
+
+    MatrixXd samples(VM_t::GetNbBoundsSamples(),VM_t::state_dim_);
+    for(int i=0;i<samples.rows();i++)
+    {
+        ComputeStateGivenPhase(static_cast<double>(i)/(samples.rows()-1),state);
+        samples.row(i) = state.transpose();
+    }
+
+    VM_t::IndexRecordedRefs(samples);
 }
 
 template<class VM_t>
-void VirtualMechanismSpline<VM_t>::ComputeFinalState()
+double VirtualMechanismSpline<VM_t>::ComputeResponsability(const MatrixXd& pos) // Not for rt
 {
-  ComputeStateGivenPhase(1.0,VM_t::final_state_);
+    assert(pos.cols() == VM_t::state_dim_);
+    if(pos.rows() == 0)
+        return 0.0;
+
+    // Closest point on the guide: the closest sample in z, refined by Gauss-Newton steps
+    const VectorXd& knots = spline_xyz_.GetKnots();
+    const int n_samples = 8 * (knots.size() - 1) + 1;
+    VectorXd z_samples(n_samples);
+    MatrixXd xyz_samples(VM_t::state_dim_,n_samples);
+    vector_t xyz, xyz_dot;
+    int cursor = 0;
+    for(int i=0;i<n_samples;i++)
+    {
+        const int k = std::min(i/8,static_cast<int>(knots.size())-2);
+        z_samples(i) = knots(k) + (knots(k+1) - knots(k)) * (i - 8 * k) / 8.0;
+        spline_xyz_.Evaluate(z_samples(i),xyz,xyz_dot,cursor);
+        xyz_samples.col(i) = xyz;
+    }
+
+    double sum_dist2 = 0.0;
+    for(int j=0;j<pos.rows();j++)
+    {
+        const vector_t p = pos.row(j).transpose();
+        int closest;
+        (xyz_samples.colwise() - p).colwise().squaredNorm().minCoeff(&closest);
+        double z = z_samples(closest);
+        for(int it=0;it<3;it++)
+        {
+            cursor = 0;
+            spline_xyz_.Evaluate(z,xyz,xyz_dot,cursor);
+            const double speed2 = xyz_dot.squaredNorm();
+            if(!(speed2 > 0.0))
+                break;
+            z = std::min(std::max(z + (p - xyz).dot(xyz_dot) / speed2,knots(0)),knots(knots.size()-1));
+        }
+        cursor = 0;
+        spline_xyz_.Evaluate(z,xyz,xyz_dot,cursor);
+        sum_dist2 += std::min((p - xyz).squaredNorm(),(xyz_samples.col(closest) - p).squaredNorm());
+    }
+
+    return std::exp(-0.5 * sum_dist2 / (pos.rows() * responsability_std_ * responsability_std_));
 }
 
-template <class VM_t>
-bool VirtualMechanismSpline<VM_t>::SaveModelToFile(const string file_path)
+template<class VM_t>
+double VirtualMechanismSpline<VM_t>::GetResponsability()
 {
-     return true;
+    return responsability_;
 }
 
 template<class VM_t>
 double VirtualMechanismSpline<VM_t>::getDistance(const VectorXd& pos)
 {
-  err_ = pos - VM_t::state_;
-  return err_.norm();
+    err_ = pos - VM_t::state_;
+    return err_.norm();
 }
 
 template<class VM_t>
 double VirtualMechanismSpline<VM_t>::getScale(const VectorXd& pos, const double convergence_factor)
 {
-  return  std::exp(-convergence_factor*getDistance(pos));
+    return  std::exp(-convergence_factor*getDistance(pos));
 }
 
 // Explicitly instantiate the templates, and its member definitions
-template class VirtualMechanismSpline<VirtualMechanismInterfaceFirstOrder>;
-template class VirtualMechanismSpline<VirtualMechanismInterfaceSecondOrder>;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceFirstOrder<2> >;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceSecondOrder<2> >;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceFirstOrder<3> >;
+template class VirtualMechanismSpline<VirtualMechanismInterfaceSecondOrder<3> >;
+
 }
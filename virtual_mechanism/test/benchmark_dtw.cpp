@@ -0,0 +1,151 @@
+/**
+ * @file   benchmark_dtw.cpp
+ * @brief  Accuracy and speed of the banded and FastDTW alignments against the exact dtw.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Usage: benchmark_dtw [max_points] [radius] [output_file]
+// A demonstration is generated by time warping and perturbing a reference trajectory, then aligned
+// on the reference with the exact dtw (full window), the Sakoe-Chiba band (10%) and FastDTW (radius).
+// For each length (250, 500, ... max_points) the time, the number of cells, the cost error and the
+// phase error of the alignment with respect to the exact path are printed and written as csv.
+
+#include <toolbox/dtw/dtw.h>
+
+////////// STD
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+using namespace Eigen;
+
+typedef std::chrono::steady_clock bench_clock_t;
+
+struct Result
+{
+    std::string method;
+    int n_points;
+    long long n_cells;
+    double time_ms;
+    double cost;
+    double cost_err; // Relative to the exact cost, in %
+    double mean_phase_err;
+    double max_phase_err;
+};
+
+static void CreateSignals(const int n_points, MatrixXd& demo, MatrixXd& ref)
+{
+    demo.resize(n_points,3);
+    ref.resize(n_points,3);
+    for(int i=0;i<n_points;i++)
+    {
+        const double t = static_cast<double>(i)/(n_points-1);
+        const double t_warped = t + 0.15 * std::sin(2.0 * M_PI * t); // Slower, then faster
+        ref.row(i) << std::cos(4.0 * t), std::sin(6.0 * t), t;
+        demo.row(i) << std::cos(4.0 * t_warped), std::sin(6.0 * t_warped), t_warped;
+    }
+    demo += 0.005 * MatrixXd::Random(n_points,3);
+}
+
+static long long CountCells(const dtw::Window& win)
+{
+    long long n_cells = 0;
+    for(int i=0;i<win.Rows();i++)
+        n_cells += win.Width(i);
+    return n_cells;
+}
+
+static Result Align(const std::string& method, const MatrixXd& demo, const MatrixXd& ref, const int radius, VectorXi& idx)
+{
+    const int n_points = demo.rows();
+    Result result;
+    result.method = method;
+    result.n_points = n_points;
+
+    bench_clock_t::time_point start = bench_clock_t::now();
+    dtw::Window win;
+    if(method == "exact")
+        win = dtw::FullWindow(n_points,n_points);
+    else if(method == "sakoe_chiba")
+        win = dtw::SakoeChibaWindow(n_points,n_points,n_points/10);
+    else
+        win = dtw::FastDtwWindow(demo,ref,radius);
+    std::vector<std::pair<int,int> > path;
+    result.cost = dtw::dtw_path(demo,ref,win,path);
+    idx.resize(n_points);
+    for(int k=path.size()-1;k>=0;k--)
+        idx(path[k].first) = path[k].second;
+    result.time_ms = std::chrono::duration<double,std::milli>(bench_clock_t::now() - start).count();
+    result.n_cells = CountCells(win);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    const int max_points = argc > 1 ? std::atoi(argv[1]) : 4000;
+    const int radius = argc > 2 ? std::atoi(argv[2]) : 10;
+    const std::string output_file = argc > 3 ? argv[3] : "benchmark_dtw.csv";
+
+    std::vector<Result> results;
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << std::setw(12) << "method" << std::setw(8) << "points" << std::setw(12) << "cells"
+              << std::setw(12) << "time[ms]" << std::setw(12) << "cost err[%]"
+              << std::setw(16) << "mean phase err" << std::setw(16) << "max phase err" << std::endl;
+
+    for(int n_points=250;n_points<=max_points;n_points*=2)
+    {
+        MatrixXd demo, ref;
+        CreateSignals(n_points,demo,ref);
+
+        VectorXi exact_idx, idx;
+        Result exact = Align("exact",demo,ref,radius,exact_idx);
+
+        const char* methods[] = {"exact","sakoe_chiba","fast"};
+        for(int m=0;m<3;m++)
+        {
+            Result result = m == 0 ? exact : Align(methods[m],demo,ref,radius,idx);
+            if(m == 0)
+                idx = exact_idx;
+            // Phase error: distance between the matched reference phases, in [0,1]
+            const VectorXd phase_err = (idx - exact_idx).cast<double>().cwiseAbs() / (n_points-1);
+            result.cost_err = 100.0 * (result.cost - exact.cost) / exact.cost;
+            result.mean_phase_err = phase_err.mean();
+            result.max_phase_err = phase_err.maxCoeff();
+            results.push_back(result);
+
+            std::cout << std::setw(12) << result.method << std::setw(8) << result.n_points << std::setw(12) << result.n_cells
+                      << std::setw(12) << result.time_ms << std::setw(12) << result.cost_err
+                      << std::setw(16) << result.mean_phase_err << std::setw(16) << result.max_phase_err << std::endl;
+        }
+    }
+
+    std::ofstream file(output_file.c_str());
+    file << "method,n_points,n_cells,time_ms,cost,cost_err_percent,mean_phase_err,max_phase_err" << std::endl;
+    for(size_t i=0;i<results.size();i++)
+        file << results[i].method << "," << results[i].n_points << "," << results[i].n_cells << "," << results[i].time_ms << ","
+             << results[i].cost << "," << results[i].cost_err << "," << results[i].mean_phase_err << "," << results[i].max_phase_err << std::endl;
+    std::cout << "Results written to " << output_file << std::endl;
+
+    return 0;
+}
@@ -145,6 +145,113 @@ TEST(VirtualMechanismFactory, Clone)
     delete vm_ptr;
 }
 
+TEST(VirtualMechanismFactory, Config)
+{
+    // Loaded once and shared
+    tool_box::Config::ptr_t cfg = tool_box::Config::Load(ROS_PKG_NAME);
+    EXPECT_EQ(cfg,tool_box::Config::Load(ROS_PKG_NAME));
+
+    std::vector<double> K;
+    EXPECT_TRUE(cfg->Get("virtual_mechanism_interface/K",K));
+    EXPECT_TRUE(K.size() == 2 || K.size() == 3);
+    int n_gaussians = -1;
+    EXPECT_FALSE(cfg->Get("gmr/not_a_key",n_gaussians));
+    EXPECT_FALSE(cfg->Get("virtual_mechanism_interface/K",n_gaussians)); // Wrong type
+    EXPECT_EQ(n_gaussians,-1);
+
+    // Injected config, the guides created before keep their parameters
+    YAML::Node node = YAML::Clone(cfg->GetNode(""));
+    node["gmr"]["n_gaussians"] = 7;
+    tool_box::Config::Inject("config_test",node);
+    EXPECT_TRUE(tool_box::Config::Load("config_test")->Get("gmr/n_gaussians",n_gaussians));
+    EXPECT_EQ(n_gaussians,7);
+    cfg->Get("gmr/n_gaussians",n_gaussians);
+    EXPECT_NE(n_gaussians,7);
+    tool_box::Config::Reset("config_test");
+}
+
+TEST(VirtualMechanismFactory, Arena)
+{
+    tool_box::Arena arena(1024);
+    {
+        tool_box::ArenaScope scope(arena);
+        double* a = arena.Allocate<double>(10);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % 64,0u);
+        Eigen::Map<Eigen::MatrixXd> m = arena.NewMatrix(20,20); // Bigger than a block
+        m.setOnes();
+        EXPECT_DOUBLE_EQ(m.sum(),400.0);
+    }
+    const long long n_blocks = arena.GetNbBlocksAllocated();
+    EXPECT_EQ(n_blocks,2);
+
+    // Warm arena, the same requests do not touch the heap anymore
+    for(int i=0;i<10;i++)
+    {
+        tool_box::ArenaScope scope(arena);
+        arena.Allocate<double>(10);
+        arena.NewMatrix(20,20);
+    }
+    EXPECT_EQ(arena.GetNbBlocksAllocated(),n_blocks);
+    EXPECT_EQ(arena.GetNbAllocations(),22);
+}
+
+TEST(VirtualMechanismAutom, Transitions)
+{
+    AutomEventLog& log = AutomEventLog::Instance();
+    log.Stop(); // Drained here
+    std::vector<AutomEvent> events;
+    log.Drain(events);
+    events.clear();
+
+    VirtualMechanismAutom autom(0.2,0.05);
+    const double phase_dot_ref = 0.1;
+    EXPECT_FALSE(autom.GetState());
+    autom.Step(0.1,phase_dot_ref,false); // Too slow to leave MANUAL
+    autom.Step(0.3,phase_dot_ref,false); // PREAUTO
+    EXPECT_FALSE(autom.GetState());
+    autom.Step(0.2,phase_dot_ref,false); // Still above the reference
+    autom.Step(0.12,phase_dot_ref,false); // AUTO
+    EXPECT_TRUE(autom.GetState());
+    autom.Step(0.0,phase_dot_ref,false);
+    EXPECT_TRUE(autom.GetState());
+    autom.Step(0.0,phase_dot_ref,true); // MANUAL
+    EXPECT_FALSE(autom.GetState());
+
+    // Only the transitions are logged
+    EXPECT_EQ(log.Drain(events),3);
+    ASSERT_EQ(events.size(),3u);
+    EXPECT_EQ(events[0].from,VirtualMechanismAutom::MANUAL);
+    EXPECT_EQ(events[0].to,VirtualMechanismAutom::PREAUTO);
+    EXPECT_DOUBLE_EQ(events[0].phase_dot,0.3);
+    EXPECT_EQ(events[1].to,VirtualMechanismAutom::AUTO);
+    EXPECT_EQ(events[2].to,VirtualMechanismAutom::MANUAL);
+    EXPECT_EQ(events[2].autom,&autom);
+
+    // Concurrent producers, a full log drops the new events
+    const long long n_dropped = log.GetNbDropped();
+    const int n_events = 1000;
+    std::vector<boost::thread> producers;
+    for(int k=0;k<4;k++)
+        producers.push_back(boost::thread([&]()
+        {
+            for(int i=0;i<n_events;i++)
+            {
+                const AutomEvent event = {NULL,VirtualMechanismAutom::MANUAL,VirtualMechanismAutom::PREAUTO,0.0,0.0};
+                log.Push(event);
+            }
+        }));
+    for(size_t k=0;k<producers.size();k++)
+        producers[k].join();
+    events.clear();
+    log.Drain(events);
+    EXPECT_EQ(events.size() + log.GetNbDropped() - n_dropped,4*n_events);
+
+    // Thresholds from the config
+    VirtualMechanismAutom autom_cfg;
+    EXPECT_FALSE(autom_cfg.GetState());
+    log.Start(100);
+}
+
 /*TEST(VirtualMechanismGmrTest, LoopUpdateMethod)
 {
   boost::shared_ptr<fa_t> fa_ptr(generateDemoFa());
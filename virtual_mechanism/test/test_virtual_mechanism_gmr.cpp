@@ -40,6 +40,7 @@
 #include <iostream>
 #include <fstream> 
 #include <iterator>
+#include <cstddef>
 #include <boost/concept_check.hpp>
 
 ////////// ROS
@@ -51,8 +52,8 @@ using namespace Eigen;
 using namespace boost;
 using namespace DmpBbo;
 
-typedef VirtualMechanismInterfaceFirstOrder VMP_1ord_t;
-typedef VirtualMechanismInterfaceSecondOrder VMP_2ord_t;
+typedef VirtualMechanismInterfaceFirstOrder<2> VMP_1ord_t;
+typedef VirtualMechanismInterfaceSecondOrder<2> VMP_2ord_t;
 
 std::string pkg_path = ros::package::getPath("virtual_mechanism");
 std::string file_path(pkg_path+"/test/test_gmm");
@@ -176,6 +177,530 @@ TEST(VirtualMechanismGmrNormalizedTest, UpdateMethod)
 
 }
 
+// Fraction of the length of the gmr mean travelled at phase_in, measured on a dense polyline
+double LengthFraction(VirtualMechanismGmr<VMP_1ord_t>& vm, const double phase_in)
+{
+  int n_points = 2001;
+  VectorXd length(n_points);
+  VectorXd state(test_dim), prev_state(test_dim);
+  vm.ComputeStateGivenPhase(0.0,prev_state);
+  length(0) = 0.0;
+  for(int i=1;i<n_points;i++)
+  {
+    vm.ComputeStateGivenPhase(static_cast<double>(i)/(n_points-1),state);
+    length(i) = length(i-1) + (state - prev_state).norm();
+    prev_state = state;
+  }
+  const double x = phase_in * (n_points-1);
+  const int i = std::min(static_cast<int>(x),n_points-2);
+  return (length(i) + (x - i) * (length(i+1) - length(i))) / length(n_points-1);
+}
+
+TEST(VirtualMechanismGmrNormalizedTest, ArcLengthFollowsTheModel)
+{
+  // Phase + pos, the speed along the curve is not constant in the phase
+  int n_points = 100;
+  MatrixXd data(n_points,test_dim+1);
+  data.col(0) = VectorXd::LinSpaced(n_points,0.0,1.0);
+  data.col(1) = data.col(0).array().square();
+  data.col(2).setZero();
+
+  VirtualMechanismGmrNormalized<VMP_1ord_t> vm(data);
+
+  VectorXd state(test_dim), state_dot(test_dim);
+  double phase, phase_dot;
+  for(int i=1;i<4;i++)
+  {
+    vm.ComputeStateGivenPhase(0.25*i,state,state_dot,phase,phase_dot);
+    EXPECT_NEAR(LengthFraction(vm,phase),0.25*i,1e-2);
+  }
+
+  // Retrained on a longer curve with another speed profile, the abscisse follows the new model
+  data.col(1) = 2.0 * data.col(0);
+  data.col(2) = 2.0 * data.col(0).array().cube();
+  vm.CreateModelFromData(data);
+
+  for(int i=1;i<4;i++)
+  {
+    vm.ComputeStateGivenPhase(0.25*i,state,state_dot,phase,phase_dot);
+    EXPECT_NEAR(LengthFraction(vm,phase),0.25*i,1e-2);
+  }
+}
+
+TEST(VirtualMechanismGmrTest, PhaseTable)
+{
+  double max_err = 1e-4, max_err_dot = 1e-3, max_err_variance = 1e-6;
+  ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+  fa_t fa(model_parameters_gmr);
+  GmrKernel<2> kernel;
+  ASSERT_TRUE(kernel.Build(&fa));
+
+  PhaseTable<2> table;
+  EXPECT_TRUE(table.Bake(&kernel,max_err,max_err_dot,max_err_variance,17,4097));
+  EXPECT_LE(table.GetMaxError(),max_err);
+  EXPECT_LE(table.GetMaxErrorDot(),max_err_dot);
+  EXPECT_LE(table.GetMaxErrorVariance(),max_err_variance);
+
+  // Position, derivative and variance at the middle of the intervals, where the interpolation is worst
+  int n_mid = table.GetNbPoints() - 1;
+  MatrixXd mid(n_mid,1), output, output_dot, output_variance;
+  for(int i=0;i<n_mid;i++)
+    mid(i,0) = (i + 0.5) / n_mid;
+  kernel.predictDot(mid,output,output_dot,output_variance);
+
+  PhaseTable<2>::vector_t pos, pos_dot, variance;
+  for(int i=0;i<n_mid;i++)
+  {
+    table.Evaluate(mid(i,0),pos,pos_dot,variance);
+    EXPECT_LE((pos - output.row(i).transpose()).cwiseAbs().maxCoeff(),max_err);
+    EXPECT_LE((pos_dot - output_dot.row(i).transpose()).cwiseAbs().maxCoeff(),max_err_dot);
+    EXPECT_LE((variance - output_variance.row(i).transpose()).cwiseAbs().maxCoeff(),max_err_variance);
+  }
+
+  // Position anywhere else
+  int n_points = 1000;
+  MatrixXd input(n_points,1);
+  input.col(0) = VectorXd::LinSpaced(n_points,0.0,1.0);
+  output.resize(n_points,test_dim);
+  fa.predict(input,output);
+  for(int i=0;i<n_points;i++)
+  {
+    table.Evaluate(input(i,0),pos,pos_dot,variance);
+    EXPECT_LE((pos - output.row(i).transpose()).cwiseAbs().maxCoeff(),2*max_err);
+  }
+}
+
+TEST(VirtualMechanismGmrTest, GmrKernel)
+{
+  ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+  fa_t fa(model_parameters_gmr);
+
+  GmrKernel<2> kernel;
+  EXPECT_TRUE(kernel.Build(&fa));
+
+  // More points than a block
+  int n_points = 1000;
+  MatrixXd input(n_points,1), output(n_points,test_dim), output_dot(n_points,test_dim), variance(n_points,test_dim);
+  MatrixXd k_output, k_output_dot, k_variance;
+  input.col(0) = VectorXd::LinSpaced(n_points,0.0,1.0);
+  fa.predictDot(input,output,output_dot,variance);
+  kernel.predictDot(input,k_output,k_output_dot,k_variance);
+  EXPECT_LE((k_output - output).cwiseAbs().maxCoeff(),1e-9);
+  EXPECT_LE((k_output_dot - output_dot).cwiseAbs().maxCoeff(),1e-6);
+  EXPECT_LE((k_variance - variance).cwiseAbs().maxCoeff(),1e-9);
+
+  GmrKernel<2>::vector_t pos, pos_dot, var;
+  for(int i=0;i<n_points;i+=37)
+  {
+    kernel.Evaluate(input(i,0),pos,pos_dot,var);
+    EXPECT_LE((pos - k_output.row(i).transpose()).cwiseAbs().maxCoeff(),1e-12);
+    EXPECT_LE((pos_dot - k_output_dot.row(i).transpose()).cwiseAbs().maxCoeff(),1e-9);
+    EXPECT_LE((var - k_variance.row(i).transpose()).cwiseAbs().maxCoeff(),1e-12);
+  }
+
+  // Far from all the gaussians the densities underflow, the responsibilities do not
+  MatrixXd far(2,1);
+  far << -1e3, 1e3;
+  kernel.predictDot(far,k_output,k_output_dot,k_variance);
+  EXPECT_TRUE(k_output.allFinite());
+  EXPECT_TRUE(k_output_dot.allFinite());
+  EXPECT_TRUE(k_variance.allFinite());
+}
+
+TEST(CubicSpline, Evaluate)
+{
+  // Uniform and non uniform knots on the same curve
+  int n_points = 200;
+  VectorXd x_uniform = VectorXd::LinSpaced(n_points,0.0,1.0);
+  VectorXd x_warped = x_uniform.array().square();
+  tool_box::CubicSpline spline_uniform, spline_warped;
+  spline_uniform.SetPoints(x_uniform,x_uniform.array().sin());
+  spline_warped.SetPoints(x_warped,x_warped.array().sin());
+  EXPECT_TRUE(spline_uniform.IsUniform());
+  EXPECT_FALSE(spline_warped.IsUniform());
+
+  // Interpolation of the knots
+  for(int i=0;i<n_points;i+=17)
+    EXPECT_NEAR(spline_warped(x_warped(i)),std::sin(x_warped(i)),1e-12);
+
+  // Forward, backward and random queries give the same result of the binary search
+  VectorXd queries(3*n_points);
+  queries.head(n_points) = VectorXd::LinSpaced(n_points,0.05,0.95);
+  queries.segment(n_points,n_points) = VectorXd::LinSpaced(n_points,0.95,0.05);
+  queries.tail(n_points) = (VectorXd::Random(n_points).array() + 1.0) * 0.45 + 0.05;
+  double y, dy, ddy;
+  int cursor = 0;
+  for(int i=0;i<queries.size();i++)
+  {
+    const double q = queries(i);
+    spline_warped.Evaluate(q,y,dy,ddy,cursor);
+    const double* begin = spline_warped.GetKnots().data();
+    EXPECT_EQ(cursor,static_cast<int>(std::upper_bound(begin,begin+n_points,q) - begin) - 1);
+    EXPECT_NEAR(y,std::sin(q),1e-7);
+    EXPECT_NEAR(dy,std::cos(q),1e-4);
+    spline_uniform.Evaluate(q,y,dy,ddy);
+    EXPECT_NEAR(y,std::sin(q),1e-7);
+    EXPECT_NEAR(dy,std::cos(q),1e-4);
+    EXPECT_NEAR(ddy,-std::sin(q),1e-2);
+  }
+
+  // Natural spline, linear extrapolation
+  spline_uniform.Evaluate(1.0,y,dy,ddy);
+  EXPECT_NEAR(ddy,0.0,1e-9);
+  double y_out, dy_out;
+  spline_uniform.Evaluate(1.5,y_out,dy_out,ddy);
+  EXPECT_NEAR(y_out,y + 0.5 * dy,1e-12);
+  EXPECT_NEAR(dy_out,dy,1e-12);
+
+  // Fused xyz spline, same curves of one spline per axis
+  MatrixXd xyz(n_points,3);
+  xyz << x_warped.array().sin(), x_warped.array().cos(), x_warped.array().square();
+  tool_box::CubicSplineN<3> spline_xyz;
+  spline_xyz.SetPoints(x_warped,xyz);
+  std::vector<tool_box::CubicSpline> splines(3);
+  for(int j=0;j<3;j++)
+    splines[j].SetPoints(x_warped,xyz.col(j));
+  tool_box::CubicSplineN<3>::vector_t pos, pos_dot;
+  for(int i=0;i<queries.size();i++)
+  {
+    const double q = i < 3 ? -0.5 + i : queries(i); // Also outside of the knots
+    spline_xyz.Evaluate(q,pos,pos_dot);
+    for(int j=0;j<3;j++)
+    {
+      splines[j].Evaluate(q,y,dy,ddy);
+      EXPECT_NEAR(pos(j),y,1e-12);
+      EXPECT_NEAR(pos_dot(j),dy,1e-9);
+    }
+  }
+}
+
+TEST(ArcLength, Maps)
+{
+  // x(z) = [cos(2 pi z^2) sin(2 pi z^2)], the speed grows with z, s(z) = z^2 once normalized
+  tool_box::ArcLength arc_length(1e-8);
+  arc_length.Compute([](const Ref<const VectorXd>& z, Ref<VectorXd> speed)
+  {
+    speed = 4.0 * M_PI * z;
+  },0.0,1.0);
+  EXPECT_NEAR(arc_length.GetTotalLength(),2.0 * M_PI,1e-8 * 2.0 * M_PI);
+
+  // Adaptive knots, denser where the curvature of s(z) is not captured by the Hermite splines
+  EXPECT_GT(arc_length.GetNbKnots(),9);
+
+  tool_box::CubicSpline s_of_z, z_of_s;
+  EXPECT_TRUE(arc_length.CreateMaps(s_of_z,z_of_s));
+  double s, ds, dds, z, dz, ddz;
+  for(int i=0;i<=100;i++)
+  {
+    const double z_in = i / 100.0;
+    s_of_z.Evaluate(z_in,s,ds,dds);
+    EXPECT_NEAR(s,z_in * z_in,1e-6);
+    z_of_s.Evaluate(s,z,dz,ddz);
+    EXPECT_NEAR(z,z_in,1e-5); // Inverse of each other
+    if(i > 0)
+    {
+      EXPECT_GT(ds,0.0); // Monotone
+      EXPECT_NEAR(ds * dz,1.0,1e-2);
+    }
+  }
+}
+
+TEST(VirtualMechanismGmrTest, StreamingEm)
+{
+  ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+  fa_t fa(model_parameters_gmr);
+  MatrixXd gmm;
+  model_parameters_gmr->toMatrix(gmm);
+
+  // New demonstration: the guide shifted by offset
+  int n_points = 300;
+  double offset = 0.01;
+  MatrixXd phase(n_points,1), pos(n_points,test_dim), data(n_points,1+test_dim);
+  phase.col(0) = VectorXd::LinSpaced(n_points,0.0,1.0);
+  fa.predict(phase,pos);
+  data << phase, pos.array() + offset;
+
+  StreamingEm<2> em;
+  EXPECT_TRUE(em.Init(gmm,0.1*n_points)); // The data counts ten times the current model
+  int chunk = 50;
+  for(int i=0;i<n_points;i+=chunk)
+    em.AddChunk(data.middleRows(i,chunk));
+  EXPECT_EQ(em.GetNbPoints(),n_points);
+  double log_lik_streamed = em.GetLogLikelihood();
+  em.Refine(5);
+  EXPECT_TRUE(std::isfinite(em.GetLogLikelihood()));
+  EXPECT_GE(em.GetLogLikelihood(),log_lik_streamed);
+
+  // The refined model moves towards the new demonstration
+  MatrixXd refined;
+  em.ToMatrix(refined);
+  EXPECT_EQ(refined.rows(),gmm.rows());
+  fa_t fa_refined(ModelParametersGMR::fromMatrix(refined));
+  MatrixXd pos_refined;
+  fa_refined.predict(phase,pos_refined);
+  double err = (pos.array() + offset - pos_refined.array()).abs().mean();
+  EXPECT_LT(err,0.2*offset);
+
+  // Streaming on a guide
+  VirtualMechanismGmr<VMP_1ord_t> vm(file_path);
+  EXPECT_FALSE(vm.CreateModelFromStream()); // Nothing streamed
+  for(int i=0;i<n_points;i+=chunk)
+    EXPECT_TRUE(vm.AddDataChunk(data.middleRows(i,chunk).rightCols(test_dim))); // Only pos
+  EXPECT_TRUE(vm.CreateModelFromStream());
+  EXPECT_FALSE(vm.CreateModelFromStream());
+}
+
+TEST(VirtualMechanismGmrTest, GmrModelSelection)
+{
+  ModelParametersGMR* model_parameters_gmr = ModelParametersGMR::loadGMMFromMatrix(file_path);
+  fa_t fa(model_parameters_gmr);
+
+  int n_points = 300;
+  MatrixXd phase(n_points,1), pos;
+  phase.col(0) = VectorXd::LinSpaced(n_points,0.0,1.0);
+  fa.predict(phase,pos);
+  pos += 0.001 * MatrixXd::Random(n_points,test_dim);
+
+  int n_gaussians_min = 2, n_gaussians_max = 5, n_restarts = 3;
+  GmrModelSelection<2> selection(n_gaussians_min,n_gaussians_max,n_restarts,2);
+  fa_t* selected_fa = selection.Train(phase,pos);
+  ASSERT_TRUE(selected_fa != NULL);
+  EXPECT_EQ(selection.GetCandidates().size(),(n_gaussians_max-n_gaussians_min+1)*n_restarts);
+  for(int i=0;i<selection.GetCandidates().size();i++)
+    EXPECT_TRUE(selection.GetCandidates()[i].trained);
+  ASSERT_GE(selection.GetSelected(),0);
+
+  // The selected model predicts the data
+  MatrixXd pos_selected;
+  selected_fa->predict(phase,pos_selected);
+  EXPECT_LT((pos_selected - pos).cwiseAbs().mean(),0.01);
+  delete selected_fa;
+
+  // The random restarts are repeatable
+  GmrModelSelection<2> selection_again(n_gaussians_min,n_gaussians_max,n_restarts,1);
+  delete selection_again.Train(phase,pos);
+  for(int i=0;i<selection.GetCandidates().size();i++)
+    EXPECT_DOUBLE_EQ(selection.GetCandidates()[i].log_likelihood,selection_again.GetCandidates()[i].log_likelihood);
+}
+
+TEST(KdTree, FindNearest)
+{
+  int n_points = 1000;
+  MatrixXd points = MatrixXd::Random(n_points,test_dim);
+
+  KdTree<2> tree;
+  tree.Build(points);
+
+  KdTree<2>::vector_t query;
+  double dist2;
+  for(int k=0;k<100;k++)
+  {
+    query = 2.0 * KdTree<2>::vector_t::Random(); // Inside and outside the points bounds
+    int idx = tree.FindNearest(query,dist2);
+
+    int min_idx;
+    double min_dist2 = (points.rowwise() - query.transpose()).rowwise().squaredNorm().minCoeff(&min_idx);
+    EXPECT_EQ(idx,min_idx);
+    EXPECT_DOUBLE_EQ(dist2,min_dist2);
+  }
+}
+
+TEST(VirtualMechanismGmrTest, GuideBounds)
+{
+  VirtualMechanismGmr<VMP_1ord_t> vm(file_path);
+
+  // Dense samples of the guide, denser than the ones used to build the bounds, all inside them
+  int n_samples = 2000, n_outside = 0;
+  MatrixXd samples(n_samples,test_dim);
+  VectorXd state(test_dim);
+  for(int i=0;i<n_samples;i++)
+  {
+    vm.ComputeStateGivenPhase(static_cast<double>(i)/(n_samples-1),state);
+    samples.row(i) = state.transpose();
+    if(vm.getDistanceLowerBound(state) > 0.0 || !vm.IsNear(state,0.0))
+      n_outside++;
+  }
+  EXPECT_EQ(n_outside,0);
+  for(int i=0;i<test_dim;i++)
+  {
+    EXPECT_LE(vm.getBoundingBoxMin()(i),samples.col(i).minCoeff());
+    EXPECT_GE(vm.getBoundingBoxMax()(i),samples.col(i).maxCoeff());
+  }
+
+  // The lower bound never exceeds the distance to the guide, and it is tight enough to reject the far points
+  VectorXd query(test_dim);
+  const VectorXd size = vm.getBoundingBoxMax() - vm.getBoundingBoxMin();
+  int n_far = 0, n_rejected = 0;
+  for(int k=0;k<200;k++)
+  {
+    query = vm.getBoundingBoxMin() + (VectorXd::Random(test_dim).array() + 1.0).matrix().cwiseProduct(size);
+    const double dist = (samples.rowwise() - query.transpose()).rowwise().norm().minCoeff();
+    const double lower_bound = vm.getDistanceLowerBound(query);
+    EXPECT_LE(lower_bound,dist + 1e-12);
+    EXPECT_EQ(vm.IsNear(query,0.0),lower_bound <= 0.0);
+    if(dist > 0.5 * size.norm())
+    {
+      n_far++;
+      if(!vm.IsNear(query,0.25 * size.norm()))
+        n_rejected++;
+    }
+  }
+  EXPECT_GT(n_far,0);
+  EXPECT_EQ(n_rejected,n_far);
+}
+
+template <typename VM_t>
+double GuideFileRoundTrip(const std::string& binary_path)
+{
+  VM_t vm_text(file_path);
+  EXPECT_TRUE(vm_text.SaveModelToFile(binary_path));
+  EXPECT_TRUE(GuideFile::IsGuideFile(binary_path));
+  VM_t vm_binary(binary_path);
+
+  Eigen::VectorXd force(test_dim);
+  force.fill(10.0);
+  double err = 0.0;
+  for (int i = 0; i < 500; i++)
+  {
+    vm_text.Update(force,dt);
+    vm_binary.Update(force,dt);
+    err = std::max(err,(vm_text.getState() - vm_binary.getState()).cwiseAbs().maxCoeff());
+  }
+  return err;
+}
+
+TEST(VirtualMechanismGmrTest, GuideFile)
+{
+  std::string binary_path(file_path+GUIDE_FILE_EXTENSION);
+
+  // Same guide from the text and the binary files
+  EXPECT_EQ(GuideFileRoundTrip<VirtualMechanismGmr<VMP_1ord_t> >(binary_path),0.0);
+  EXPECT_EQ(GuideFileRoundTrip<VirtualMechanismGmr<VMP_2ord_t> >(binary_path),0.0);
+  EXPECT_EQ(GuideFileRoundTrip<VirtualMechanismGmrNormalized<VMP_1ord_t> >(binary_path),0.0);
+
+  GuideFile file;
+  ASSERT_TRUE(file.Open(binary_path));
+  EXPECT_EQ(file.GetHeader().version,GUIDE_FILE_VERSION);
+  EXPECT_EQ(file.GetHeader().state_dim,test_dim);
+  EXPECT_EQ(file.GetName(),"test_gmm");
+  EXPECT_TRUE(file.HasSection(GMM));
+  EXPECT_TRUE(file.HasSection(SPLINE_KNOTS));
+  EXPECT_EQ(file.GetSection(RECORDED_REFS).cols(),1+test_dim);
+  file.Close();
+
+  // A file from another version is refused
+  std::fstream raw(binary_path.c_str(),std::ios::in | std::ios::out | std::ios::binary);
+  uint32_t version = GUIDE_FILE_VERSION + 1;
+  raw.seekp(sizeof(GUIDE_FILE_MAGIC));
+  raw.write(reinterpret_cast<const char*>(&version),sizeof(version));
+  raw.close();
+  EXPECT_FALSE(file.Open(binary_path));
+  VirtualMechanismGmr<VMP_1ord_t> vm;
+  EXPECT_FALSE(vm.CreateModelFromFile(binary_path));
+
+  // A section whose size in bytes wraps around is refused
+  raw.open(binary_path.c_str(),std::ios::in | std::ios::out | std::ios::binary);
+  version = GUIDE_FILE_VERSION;
+  raw.seekp(sizeof(GUIDE_FILE_MAGIC));
+  raw.write(reinterpret_cast<const char*>(&version),sizeof(version));
+  raw.close();
+  ASSERT_TRUE(file.Open(binary_path));
+  const uint64_t first_section = file.GetHeader().header_size;
+  file.Close();
+  const uint32_t dims[2] = {1u << 31, 1u << 30}; // rows x cols x 8 bytes = 2^64
+  raw.open(binary_path.c_str(),std::ios::in | std::ios::out | std::ios::binary);
+  raw.seekp(first_section + offsetof(GuideFileSection,rows));
+  raw.write(reinterpret_cast<const char*>(dims),sizeof(dims));
+  raw.close();
+  EXPECT_FALSE(file.Open(binary_path));
+
+  std::remove(binary_path.c_str());
+}
+
+TEST(Dtw, Windows)
+{
+  int l1 = 120, l2 = 100, w = 15;
+  MatrixXd sig1 = MatrixXd::Random(l1,test_dim);
+  MatrixXd sig2 = MatrixXd::Random(l2,test_dim);
+
+  // Two rows version against the full cost matrix
+  MatrixXd D;
+  double full_cost = dtw::dtw(sig1,sig2,D);
+  EXPECT_NEAR(dtw::dtw(sig1,sig2,dtw::FullWindow(l1,l2)),full_cost,1e-9);
+
+  std::vector<dtw::Window> windows;
+  windows.push_back(dtw::SakoeChibaWindow(l1,l2,w));
+  windows.push_back(dtw::ItakuraWindow(l1,l2,2.0));
+  for(size_t k=0;k<windows.size();k++)
+  {
+    double cost = dtw::dtw(sig1,sig2,windows[k]);
+    EXPECT_GE(cost,full_cost - 1e-9);
+    EXPECT_LE(dtw::lb_keogh(sig1,sig2,windows[k]),cost + 1e-9);
+
+    // The backtracked path is a valid warping path with the same cost
+    std::vector<std::pair<int,int> > path;
+    EXPECT_NEAR(dtw::dtw_path(sig1,sig2,windows[k],path),cost,1e-9);
+    ASSERT_GE(path.size(),l1);
+    EXPECT_EQ(path.front(),std::make_pair(0,0));
+    EXPECT_EQ(path.back(),std::make_pair(l1-1,l2-1));
+    double path_cost = dtw::dist(sig1,sig2,0,0);
+    for(size_t i=1;i<path.size();i++)
+    {
+      int di = path[i].first - path[i-1].first;
+      int dj = path[i].second - path[i-1].second;
+      EXPECT_TRUE(di >= 0 && di <= 1 && dj >= 0 && dj <= 1 && di + dj > 0);
+      path_cost += dtw::dist(sig1,sig2,path[i].first,path[i].second);
+    }
+    EXPECT_NEAR(path_cost,cost,1e-9);
+
+    // Early abandoning
+    EXPECT_TRUE(std::isinf(dtw::dtw(sig1,sig2,windows[k],0.5 * cost)));
+  }
+
+  // FastDTW, exact with a radius covering the signals, an upper bound of the exact cost otherwise
+  std::vector<std::pair<int,int> > fast_path;
+  EXPECT_NEAR(dtw::dtw_path(sig1,sig2,dtw::FastDtwWindow(sig1,sig2,l1),fast_path),full_cost,1e-9);
+  EXPECT_GE(dtw::dtw_path(sig1,sig2,dtw::FastDtwWindow(sig1,sig2,2),fast_path),full_cost - 1e-9);
+  EXPECT_EQ(fast_path.back(),std::make_pair(l1-1,l2-1));
+
+  // Pruned nearest neighbor against the brute force one
+  std::vector<MatrixXd> candidates;
+  for(int k=0;k<20;k++)
+    candidates.push_back(MatrixXd::Random(l2,test_dim));
+  candidates.push_back(sig1.topRows(l2) + 0.01 * MatrixXd::Random(l2,test_dim));
+  double best_cost;
+  int best_idx = dtw::nearest(sig1,candidates,w,best_cost);
+  int brute_idx = -1;
+  double brute_cost = std::numeric_limits<double>::infinity();
+  for(size_t k=0;k<candidates.size();k++)
+  {
+    double cost = dtw::dtw(sig1,candidates[k],dtw::SakoeChibaWindow(l1,l2,w));
+    if(cost < brute_cost)
+    {
+      brute_cost = cost;
+      brute_idx = k;
+    }
+  }
+  EXPECT_EQ(best_idx,brute_idx);
+  EXPECT_NEAR(best_cost,brute_cost,1e-9);
+
+  // A time warped copy is aligned back on the original
+  int n_points = 200;
+  MatrixXd phase_ref(n_points,1), phase(n_points,1);
+  phase_ref.col(0) = VectorXd::LinSpaced(n_points,0.0,1.0);
+  MatrixXd ref(n_points,test_dim), warped(n_points,test_dim);
+  for(int i=0;i<n_points;i++)
+  {
+    double t = phase_ref(i,0);
+    double t_warped = t * t;
+    ref.row(i) << std::cos(3.0 * t), std::sin(3.0 * t);
+    warped.row(i) << std::cos(3.0 * t_warped), std::sin(3.0 * t_warped);
+  }
+  dtw::align_phase(phase,phase_ref,warped,ref,dtw::SakoeChibaWindow(n_points,n_points,n_points/2));
+  for(int i=0;i<n_points;i++)
+    EXPECT_NEAR(phase(i,0),phase_ref(i,0) * phase_ref(i,0),0.02);
+}
+
 /*TEST(VirtualMechanismGmrTest, UpdateGuideNormalized)
 {
   int n_points = 100;
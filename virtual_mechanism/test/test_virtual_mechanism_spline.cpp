@@ -1,9 +1,32 @@
+/**
+ * @file   test_virtual_mechanism_spline.cpp
+ * @brief  GTest for Virtual Mechanism Spline.
+ * @author Gennaro Raiola
+ *
+ * This file is part of virtual-fixtures, a set of libraries and programs to create
+ * and interact with a library of virtual guides.
+ * Copyright (C) 2014-2016 Gennaro Raiola, ENSTA-ParisTech
+ *
+ * virtual-fixtures is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * virtual-fixtures is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with virtual-fixtures.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
 #include <toolbox/debug.h>
 #include <toolbox/toolbox.h>
-#include <toolbox/dtw/dtw.h>
 
 #include <gtest/gtest.h>
 #include "virtual_mechanism/virtual_mechanism_spline.h"
+#include "virtual_mechanism/virtual_mechanism_factory.h"
 
 ////////// STD
 #include <iostream>
@@ -15,27 +38,54 @@
 #include <ros/ros.h>
 #include <ros/package.h>
 
-using namespace virtual_mechanism_interface;
-using namespace virtual_mechanism_spline;
+using namespace virtual_mechanism;
 using namespace Eigen;
 using namespace boost;
 
-typedef VirtualMechanismInterfaceFirstOrder VMP_1ord_t;
-typedef VirtualMechanismInterfaceSecondOrder VMP_2ord_t;
+typedef VirtualMechanismInterfaceFirstOrder<2> VMP_1ord_t;
+typedef VirtualMechanismInterfaceSecondOrder<2> VMP_2ord_t;
 
 std::string pkg_path = ros::package::getPath("virtual_mechanism");
-std::string file_path(pkg_path+"/test/test_spline.txt");
+std::string file_path(pkg_path+"/test/test_spline");
+double dt = 0.001;
+int test_dim = 2;
 
-TEST(VirtualMechanismSplineTest, InitializesCorrectlySpline)
+/// Quarter of circle of radius 1, sampled non uniformly
+MatrixXd CreateArc(const int n_points)
 {
+  MatrixXd data(n_points,test_dim);
+  for (int i=0; i<n_points; i++)
+  {
+      const double t = static_cast<double>(i)/(n_points-1);
+      const double angle = 0.5 * M_PI * t * t;
+      data(i,0) = std::cos(angle);
+      data(i,1) = std::sin(angle);
+  }
+  return data;
+}
 
-  //::testing::FLAGS_gtest_death_test_style = "threadsafe"; // NOTE https://code.google.com/p/googletest/wiki/AdvancedGuide#Death_Test_Styles
+template <typename VM_t>
+double StateDifference(VM_t& vm_a, VM_t& vm_b)
+{
+  Eigen::VectorXd force(test_dim);
+  force.fill(10.0);
+  double err = 0.0;
+  for (int i = 0; i < 500; i++)
+  {
+    vm_a.Update(force,dt);
+    vm_b.Update(force,dt);
+    err = std::max(err,(vm_a.getState() - vm_b.getState()).cwiseAbs().maxCoeff());
+  }
+  return err;
+}
 
+TEST(VirtualMechanismSplineTest, InitializesCorrectlyFromFile)
+{
   EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(file_path));
   EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t> vm2(file_path));
 }
 
-/*TEST(VirtualMechanismSplineTest, InitializesCorrectlyFromData)
+TEST(VirtualMechanismSplineTest, InitializesCorrectlyFromData)
 {
   int n_points = 50;
   MatrixXd data(n_points,test_dim); // No phase
@@ -43,17 +93,141 @@ TEST(VirtualMechanismSplineTest, InitializesCorrectlySpline)
   for (int i=0; i<data.cols(); i++)
       data.col(i) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
 
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t>(data));
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t>(data));
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(data));
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t> vm2(data));
 
   data.resize(n_points,test_dim+1); // With phase
 
   for (int i=0; i<data.cols(); i++)
       data.col(i) = VectorXd::LinSpaced(n_points, 0.0, 1.0);
 
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t>(data));
-  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t>(data));
-}*/
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(data));
+  EXPECT_NO_THROW(VirtualMechanismSpline<VMP_2ord_t> vm2(data));
+
+  data.setZero(); // No length
+  EXPECT_ANY_THROW(VirtualMechanismSpline<VMP_1ord_t> vm1(data));
+}
+
+TEST(VirtualMechanismSplineTest, UpdateMethod)
+{
+  VirtualMechanismSpline<VMP_1ord_t> vm1(file_path);
+  VirtualMechanismSpline<VMP_2ord_t> vm2(file_path);
+
+  Eigen::VectorXd force(test_dim);
+  Eigen::VectorXd pos(test_dim);
+  Eigen::VectorXd vel(test_dim);
+  force.fill(1.0);
+  pos.fill(0.5);
+  vel.fill(0.0);
+
+  START_REAL_TIME_CRITICAL_CODE();
+
+  // Force input interface
+  EXPECT_NO_THROW(vm1.Update(force,dt));
+  EXPECT_NO_THROW(vm2.Update(force,dt));
+
+  // Cart input interface
+  EXPECT_NO_THROW(vm1.Update(pos,vel,dt));
+  EXPECT_NO_THROW(vm2.Update(pos,vel,dt));
+
+  EXPECT_NO_THROW(vm1.getScale(pos));
+  EXPECT_NO_THROW(vm2.getScale(pos));
+
+  END_REAL_TIME_CRITICAL_CODE();
+}
+
+TEST(VirtualMechanismSplineTest, Fit)
+{
+  MatrixXd data = CreateArc(200);
+  VirtualMechanismSpline<VMP_1ord_t> vm(data);
+
+  // End points and guide on the arc, whatever the sampling of the demonstration
+  EXPECT_LT((vm.getInitialPos() - data.row(0).transpose()).norm(),1e-3);
+  EXPECT_LT((vm.getFinalPos() - data.row(data.rows()-1).transpose()).norm(),1e-3);
+  Eigen::VectorXd state(test_dim);
+  for (int i=0; i<=20; i++)
+  {
+      vm.ComputeStateGivenPhase(i/20.0,state);
+      EXPECT_NEAR(state.norm(),1.0,1e-3);
+  }
+
+  // The abscisse is normalized, uniform speed along the arc
+  Eigen::VectorXd state_half(test_dim);
+  vm.ComputeStateGivenPhase(0.5,state_half);
+  EXPECT_NEAR(std::atan2(state_half(1),state_half(0)),0.25*M_PI,1e-3);
+
+  // The demonstration is the most likely one
+  EXPECT_GT(vm.GetResponsability(),0.99);
+  EXPECT_LT(vm.ComputeResponsability(data.array() + 0.1),vm.GetResponsability());
+}
+
+TEST(VirtualMechanismSplineTest, GuideBounds)
+{
+  // Wavy guide, between its coarse recorded references it goes far from the chords joining them
+  int n_points = 400;
+  MatrixXd data(n_points,test_dim);
+  data.col(0) = VectorXd::LinSpaced(n_points,0.0,1.0);
+  data.col(1) = 0.2 * (9.0 * M_PI * data.col(0)).array().sin();
+  VirtualMechanismSpline<VMP_1ord_t> vm(data);
+
+  // Every point of the densely sampled guide is inside the bounds
+  int n_samples = 20000, n_outside = 0;
+  MatrixXd samples(n_samples,test_dim);
+  VectorXd state(test_dim);
+  for (int i=0; i<n_samples; i++)
+  {
+    vm.ComputeStateGivenPhase(static_cast<double>(i)/(n_samples-1),state);
+    samples.row(i) = state.transpose();
+    if(vm.getDistanceLowerBound(state) > 0.0 || !vm.IsNear(state,0.0))
+      n_outside++;
+  }
+  EXPECT_EQ(n_outside,0);
+  for (int i=0; i<test_dim; i++)
+  {
+    EXPECT_LE(vm.getBoundingBoxMin()(i),samples.col(i).minCoeff());
+    EXPECT_GE(vm.getBoundingBoxMax()(i),samples.col(i).maxCoeff());
+  }
+
+  // So the lower bound never exceeds the distance to the guide
+  VectorXd query(test_dim);
+  for (int k=0; k<500; k++)
+  {
+    query = 0.5 * VectorXd::Ones(test_dim) + 0.6 * VectorXd::Random(test_dim);
+    const double dist = (samples.rowwise() - query.transpose()).rowwise().norm().minCoeff();
+    EXPECT_LE(vm.getDistanceLowerBound(query),dist + 1e-12);
+  }
+}
+
+TEST(VirtualMechanismSplineTest, LoadAndSave)
+{
+  VirtualMechanismSpline<VMP_1ord_t> vm(CreateArc(200));
+
+  std::string text_path(file_path+"_knots");
+  std::string binary_path(file_path+GUIDE_FILE_EXTENSION);
+  EXPECT_TRUE(vm.SaveModelToFile(text_path));
+  EXPECT_TRUE(vm.SaveModelToFile(binary_path));
+
+  GuideFile file;
+  ASSERT_TRUE(file.Open(binary_path));
+  EXPECT_EQ(file.GetHeader().model_type,SPLINE);
+
+  // Same guide from the text and the binary files, and from the copy
+  VirtualMechanismSpline<VMP_1ord_t> vm_text(text_path);
+  VirtualMechanismSpline<VMP_1ord_t> vm_binary(binary_path);
+  boost::shared_ptr<VirtualMechanismInterface> vm_clone(vm.Clone());
+  VirtualMechanismSpline<VMP_1ord_t> vm_ref(binary_path);
+  EXPECT_EQ(StateDifference(vm_ref,vm_text),0.0);
+  EXPECT_EQ(StateDifference(vm,vm_binary),0.0);
+  EXPECT_EQ(StateDifference(vm,*static_cast<VirtualMechanismSpline<VMP_1ord_t>*>(vm_clone.get())),0.0);
+
+  // The factory knows the model type from the guide file
+  VirtualMechanismFactory factory;
+  boost::shared_ptr<VirtualMechanismInterface> vm_factory(factory.Build(binary_path));
+  EXPECT_TRUE(dynamic_cast<VirtualMechanismSpline<VMP_1ord_t>*>(vm_factory.get()) != NULL);
+
+  std::remove(text_path.c_str());
+  std::remove(binary_path.c_str());
+}
 
 int main(int argc, char** argv)
 {